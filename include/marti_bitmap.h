@@ -0,0 +1,143 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * marti_bitmap.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#ifndef SERVICES_MARTI_INCLUDE_MARTI_BITMAP_H_
+#define SERVICES_MARTI_INCLUDE_MARTI_BITMAP_H_
+
+#include "marti_service_library.h"
+#include "typedefs.h"
+
+
+/**
+ * A compressed set of 32-bit values in the style of a Roaring bitmap.
+ *
+ * The values are split by their upper 16 bits into containers. A
+ * container holding up to 4096 values stores them as a sorted array
+ * of their lower 16 bits and a fuller one stores them as a 65536-bit
+ * bitmap, so each container takes at most 8KB.
+ */
+typedef struct MartiBitmap MartiBitmap;
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Allocate an empty MartiBitmap.
+ *
+ * @return The new MartiBitmap or <code>NULL</code> upon error.
+ */
+MARTI_SERVICE_LOCAL MartiBitmap *AllocateMartiBitmap (void);
+
+
+/**
+ * Free a MartiBitmap.
+ *
+ * @param bitmap_p The MartiBitmap to free.
+ */
+MARTI_SERVICE_LOCAL void FreeMartiBitmap (MartiBitmap *bitmap_p);
+
+
+/**
+ * Add a value to a MartiBitmap.
+ *
+ * @param bitmap_p The MartiBitmap to update.
+ * @param value The value to add.
+ * @return <code>true</code> if the value is now in the MartiBitmap,
+ * <code>false</code> upon error.
+ */
+MARTI_SERVICE_LOCAL bool AddToMartiBitmap (MartiBitmap *bitmap_p, const uint32 value);
+
+
+/**
+ * Remove a value from a MartiBitmap.
+ *
+ * @param bitmap_p The MartiBitmap to update.
+ * @param value The value to remove.
+ * @return <code>true</code> if the value is no longer in the MartiBitmap,
+ * <code>false</code> upon error.
+ */
+MARTI_SERVICE_LOCAL bool RemoveFromMartiBitmap (MartiBitmap *bitmap_p, const uint32 value);
+
+
+/**
+ * Check whether a value is in a MartiBitmap.
+ *
+ * @param bitmap_p The MartiBitmap to check.
+ * @param value The value to look for.
+ * @return <code>true</code> if the value is in the MartiBitmap,
+ * <code>false</code> otherwise.
+ */
+MARTI_SERVICE_LOCAL bool IsInMartiBitmap (const MartiBitmap *bitmap_p, const uint32 value);
+
+
+/**
+ * Get the number of values in a MartiBitmap.
+ *
+ * @param bitmap_p The MartiBitmap to check.
+ * @return The number of values.
+ */
+MARTI_SERVICE_LOCAL uint64 GetMartiBitmapCardinality (const MartiBitmap *bitmap_p);
+
+
+/**
+ * Get the values that are in both of two MartiBitmaps.
+ *
+ * @param bitmap_0_p The first MartiBitmap.
+ * @param bitmap_1_p The second MartiBitmap.
+ * @return The new MartiBitmap which the caller should free with
+ * FreeMartiBitmap () or <code>NULL</code> upon error.
+ */
+MARTI_SERVICE_LOCAL MartiBitmap *GetMartiBitmapIntersection (const MartiBitmap *bitmap_0_p, const MartiBitmap *bitmap_1_p);
+
+
+/**
+ * Get the values that are in either of two MartiBitmaps.
+ *
+ * @param bitmap_0_p The first MartiBitmap.
+ * @param bitmap_1_p The second MartiBitmap.
+ * @return The new MartiBitmap which the caller should free with
+ * FreeMartiBitmap () or <code>NULL</code> upon error.
+ */
+MARTI_SERVICE_LOCAL MartiBitmap *GetMartiBitmapUnion (const MartiBitmap *bitmap_0_p, const MartiBitmap *bitmap_1_p);
+
+
+/**
+ * Get the values that are in one MartiBitmap but not in another.
+ *
+ * @param bitmap_0_p The MartiBitmap to take the values from.
+ * @param bitmap_1_p The MartiBitmap with the values to leave out.
+ * @return The new MartiBitmap which the caller should free with
+ * FreeMartiBitmap () or <code>NULL</code> upon error.
+ */
+MARTI_SERVICE_LOCAL MartiBitmap *GetMartiBitmapDifference (const MartiBitmap *bitmap_0_p, const MartiBitmap *bitmap_1_p);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif /* SERVICES_MARTI_INCLUDE_MARTI_BITMAP_H_ */
@@ -58,10 +58,20 @@ typedef struct MartiEntry
 
 	char *me_comments_s;
 
-	char **me_taxa_ss;
+	/**
+	 * The NCBI taxonomy ids of the taxa, and their forebears,
+	 * for this sample.
+	 */
+	uint32 *me_taxa_p;
 
 	size_t me_num_taxa;
 
+	/**
+	 * The taxa ids as strings for the user interface. This is
+	 * <code>NULL</code> until GetMartiEntryTaxaAsStrings () is called.
+	 */
+	char **me_taxa_ss;
+
 } MartiEntry;
 
 
@@ -93,6 +103,9 @@ MARTI_ENTRY_PREFIX_LOCAL const char *ME_START_DATE_S MARTI_ENTRY_VAL ("date");
 MARTI_ENTRY_PREFIX_LOCAL const char *ME_SITE_NAME_S MARTI_ENTRY_VAL ("site_name");
 MARTI_ENTRY_PREFIX_LOCAL const char *ME_DESCRIPTION_S MARTI_ENTRY_VAL ("description");
 MARTI_ENTRY_PREFIX_LOCAL const char *ME_TAXA_S MARTI_ENTRY_VAL ("taxa");
+MARTI_ENTRY_PREFIX_LOCAL const char *ME_TAXA_PREORDER_S MARTI_ENTRY_VAL ("taxa_preorder");
+MARTI_ENTRY_PREFIX_LOCAL const char *ME_TAXA_PREORDER_VERSION_S MARTI_ENTRY_VAL ("taxa_preorder_version");
+MARTI_ENTRY_PREFIX_LOCAL const char *ME_INDEXING_TYPE_S MARTI_ENTRY_VAL ("Grassroots:MARTiSample");
 
 
 
@@ -105,7 +118,7 @@ extern "C"
 
 MARTI_SERVICE_LOCAL MartiEntry *AllocateMartiEntry (bson_oid_t *id_p, User *user_p, PermissionsGroup *permissions_group_p, const bool owns_user_flag,
 																const char *sample_name_s, const char *marti_id_s, const char *site_name_s,
-																const char *description_s, double64 latitude, double64 longitude, const struct tm *time_p, const char **taxa_ss,
+																const char *description_s, double64 latitude, double64 longitude, const struct tm *time_p, const uint32 *taxa_p,
 																const size_t num_taxa);
 
 /**
@@ -117,14 +130,167 @@ MARTI_SERVICE_LOCAL MartiEntry *AllocateMartiEntry (bson_oid_t *id_p, User *user
 MARTI_SERVICE_LOCAL void FreeMartiEntry (MartiEntry *marti_p);
 
 
+/**
+ * Make a deep copy of a MartiEntry. The copy shares the original's
+ * User rather than owning it and gets a new, empty PermissionsGroup
+ * since each MartiEntry frees its own.
+ *
+ * @param src_p The MartiEntry to copy.
+ * @return The copy or <code>NULL</code> upon error.
+ * @ingroup MartiEntry
+ */
+MARTI_SERVICE_LOCAL MartiEntry *CopyMartiEntry (const MartiEntry *src_p);
+
+
 
 
 MARTI_SERVICE_LOCAL MartiEntry *GetMartiEntryFromJSON (const json_t *json_p, const MartiServiceData *data_p);
 
 
+MARTI_SERVICE_LOCAL json_t *GetMartiEntryAsJSON (const MartiEntry *me_p, MartiServiceData *data_p);
+
+
 MARTI_SERVICE_LOCAL OperationStatus SaveMartiEntry (MartiEntry *entry_p, ServiceJob *job_p, MartiServiceData *data_p);
 
 
+/**
+ * Save a MartiEntry, replacing the fields of any existing entry with
+ * the same MARTi id rather than using the MartiEntry's id. This is a
+ * single findAndModify on the database so submitting the same entry
+ * again just updates it rather than creating a duplicate.
+ *
+ * @param entry_p The MartiEntry to save. If it has no id, one is created
+ * for use if there is no existing entry. Afterwards, its id will be the
+ * id of the saved entry.
+ * @param job_p The ServiceJob to update.
+ * @param data_p The MartiServiceData for the collection.
+ * @return The OperationStatus of the save.
+ * @ingroup MartiEntry
+ */
+MARTI_SERVICE_LOCAL OperationStatus UpsertMartiEntryByMartiId (MartiEntry *entry_p, ServiceJob *job_p, MartiServiceData *data_p);
+
+
+/**
+ * Get the location of a stored MARTi sample directly from its BSON document.
+ *
+ * @param doc_p The BSON document for the sample.
+ * @param latitude_p If successful, this will be set to the sample's latitude.
+ * @param longitude_p If successful, this will be set to the sample's longitude.
+ * @return <code>true</code> if the location was read successfully,
+ * <code>false</code> otherwise.
+ * @ingroup MartiEntry
+ */
+MARTI_SERVICE_LOCAL bool GetMartiEntryCoordinatesFromBSON (const bson_t *doc_p, double64 *latitude_p, double64 *longitude_p);
+
+
+/**
+ * Get the date of a stored MARTi sample directly from its BSON document.
+ *
+ * @param doc_p The BSON document for the sample.
+ * @param time_p If successful, this will be set to the sample's date as
+ * the number of seconds since the epoch.
+ * @return <code>true</code> if the sample has a valid date,
+ * <code>false</code> otherwise.
+ * @ingroup MartiEntry
+ */
+MARTI_SERVICE_LOCAL bool GetMartiEntryTimeFromBSON (const bson_t *doc_p, int64 *time_p);
+
+
+/**
+ * Get the taxa of a stored MARTi sample directly from its BSON document.
+ * Any taxa that are still stored as strings are converted and any that
+ * aren't valid taxonomy ids are skipped.
+ *
+ * @param doc_p The BSON document for the sample.
+ * @param num_taxa_p If successful, this will be set to the number of taxa.
+ * @return The taxonomy ids which the caller should free with FreeMemory ()
+ * or <code>NULL</code> if the sample has no taxa or upon error.
+ * @ingroup MartiEntry
+ */
+MARTI_SERVICE_LOCAL uint32 *GetMartiEntryTaxaFromBSON (const bson_t *doc_p, size_t *num_taxa_p);
+
+
+/**
+ * Get the taxa ids of a MartiEntry as strings. These are created
+ * the first time that this is called and are then kept with the
+ * MartiEntry until it is freed.
+ *
+ * @param entry_p The MartiEntry to get the taxa for.
+ * @return The array of me_num_taxa strings or <code>NULL</code> if the
+ * MartiEntry has no taxa or upon error.
+ * @ingroup MartiEntry
+ */
+MARTI_SERVICE_LOCAL char **GetMartiEntryTaxaAsStrings (MartiEntry *entry_p);
+
+
+/**
+ * Parse a taxonomy id. This must be a whole number that fits
+ * into the 32-bit integers that the taxa are stored as.
+ *
+ * @param taxon_s The taxonomy id as a string.
+ * @param taxon_p If successful, this will be set to the taxonomy id.
+ * @return <code>true</code> if the taxonomy id was valid,
+ * <code>false</code> otherwise.
+ * @ingroup MartiEntry
+ */
+MARTI_SERVICE_LOCAL bool GetMartiTaxonIdFromString (const char *taxon_s, uint32 *taxon_p);
+
+
+/**
+ * Parse an array of taxonomy ids. Any empty strings are skipped.
+ *
+ * @param taxa_ss The taxonomy ids as strings.
+ * @param num_taxa The number of strings in taxa_ss.
+ * @param num_ids_p If successful, this will be set to the number of
+ * taxonomy ids that were parsed.
+ * @return The taxonomy ids which the caller should free with FreeMemory ()
+ * or <code>NULL</code> if there were none or if any of them were invalid.
+ * @ingroup MartiEntry
+ */
+MARTI_SERVICE_LOCAL uint32 *GetMartiTaxonIdsFromStrings (const char **taxa_ss, const size_t num_taxa, size_t *num_ids_p);
+
+
+/**
+ * Add the taxonomy tree's pre-order numbers for the taxa of a MartiEntry
+ * to its JSON, along with the version of the taxonomy that they came from,
+ * so that they are stored with it. Nothing is added if the taxonomy hasn't
+ * been loaded.
+ *
+ * @param json_p The JSON for the MartiEntry.
+ * @param marti_p The MartiEntry.
+ * @return <code>true</code> if the numbers were added successfully or
+ * weren't needed, <code>false</code> otherwise.
+ * @ingroup MartiEntry
+ */
+MARTI_SERVICE_LOCAL bool AddMartiEntryTaxaPreorderToJSON (json_t *json_p, const MartiEntry *marti_p);
+
+
+/**
+ * Update the in-memory spatial, taxa and similarity indexes and the
+ * list of samples with a MartiEntry that has just been saved. Any
+ * failures are logged.
+ *
+ * @param marti_p The saved MartiEntry.
+ * @ingroup MartiEntry
+ */
+MARTI_SERVICE_LOCAL void UpdateMartiIndexesForEntry (const MartiEntry *marti_p);
+
+
+/**
+ * Adjust the stored JSON of a MartiEntry for adding it to the Lucene
+ * index. The fields that are only needed by the database are removed
+ * and the date as text, the MARTi url and the provider are added.
+ *
+ * @param marti_json_p The JSON for the MartiEntry which will be updated.
+ * @param marti_p The MartiEntry.
+ * @param data_p The MartiServiceData with the url and provider details.
+ * @return <code>true</code> if the JSON was updated successfully,
+ * <code>false</code> otherwise.
+ * @ingroup MartiEntry
+ */
+MARTI_SERVICE_LOCAL bool PrepareMartiEntryJSONForIndexing (json_t *marti_json_p, const MartiEntry *marti_p, const MartiServiceData *data_p);
+
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,139 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * marti_entry_cache.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#ifndef SERVICES_MARTI_INCLUDE_MARTI_ENTRY_CACHE_H_
+#define SERVICES_MARTI_INCLUDE_MARTI_ENTRY_CACHE_H_
+
+#include "bson/bson.h"
+#include "jansson.h"
+
+#include "marti_service_library.h"
+#include "marti_entry.h"
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Set up the in-process cache of MartiEntries. The cache is shared by
+ * all of the MARTi services in this process and lives for as long as
+ * the service library is loaded. Calling this more than once has no effect.
+ *
+ * The cache is configured by the "entry_cache" object in the service
+ * configuration, e.g.
+ *
+ *	"entry_cache": {
+ *		"size": 256,
+ *		"ttl": 60
+ *	}
+ *
+ * where "size" is the maximum number of entries to store and "ttl" is
+ * the number of seconds that an entry remains valid for. When the cache
+ * is full, the least recently used entry is replaced. If there is no
+ * "entry_cache" object, then no cache is used.
+ *
+ * @param service_config_p The service configuration.
+ * @return <code>true</code> if the cache is available, <code>false</code>
+ * otherwise.
+ */
+MARTI_SERVICE_LOCAL bool InitMartiEntryCache (const json_t *service_config_p);
+
+
+/**
+ * Check whether the entry cache is in use.
+ *
+ * @return <code>true</code> if the cache is in use, <code>false</code>
+ * otherwise.
+ */
+MARTI_SERVICE_LOCAL bool IsMartiEntryCacheEnabled (void);
+
+
+/**
+ * Get a copy of a cached MartiEntry by its id.
+ *
+ * @param id_p The id of the MartiEntry.
+ * @return A copy of the MartiEntry which the caller should free with
+ * FreeMartiEntry () or <code>NULL</code> if it is not in the cache.
+ */
+MARTI_SERVICE_LOCAL MartiEntry *GetCachedMartiEntryById (const bson_oid_t *id_p);
+
+
+/**
+ * Get a copy of a cached MartiEntry by its MARTi id. Since the cache
+ * is small, this checks each of the cached entries in turn.
+ *
+ * @param marti_id_s The MARTi id of the MartiEntry.
+ * @return A copy of the MartiEntry which the caller should free with
+ * FreeMartiEntry () or <code>NULL</code> if it is not in the cache.
+ */
+MARTI_SERVICE_LOCAL MartiEntry *GetCachedMartiEntryByMartiId (const char *marti_id_s);
+
+
+/**
+ * Store a copy of a MartiEntry in the cache.
+ *
+ * @param entry_p The MartiEntry to store.
+ * @param generation The value of GetMartiEntryCacheGeneration () from
+ * before the MartiEntry was loaded. If any entries have been saved since
+ * then, it will not be stored.
+ * @return <code>true</code> if the MartiEntry was stored, <code>false</code>
+ * otherwise.
+ */
+MARTI_SERVICE_LOCAL bool SetCachedMartiEntry (const MartiEntry *entry_p, const uint32 generation);
+
+
+/**
+ * Get the current generation of the entry cache. This is
+ * incremented each time that an entry is removed.
+ *
+ * @return The generation.
+ */
+MARTI_SERVICE_LOCAL uint32 GetMartiEntryCacheGeneration (void);
+
+
+/**
+ * Remove a MartiEntry from the cache. This needs to be
+ * called whenever an entry is saved.
+ *
+ * @param id_p The id of the MartiEntry.
+ */
+MARTI_SERVICE_LOCAL void RemoveCachedMartiEntry (const bson_oid_t *id_p);
+
+
+/**
+ * Get the cache's hit and miss counts.
+ *
+ * @return The statistics as a JSON object or <code>NULL</code> if the
+ * cache is not in use or upon error.
+ */
+MARTI_SERVICE_LOCAL json_t *GetMartiEntryCacheStatisticsAsJSON (void);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif /* SERVICES_MARTI_INCLUDE_MARTI_ENTRY_CACHE_H_ */
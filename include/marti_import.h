@@ -0,0 +1,74 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * marti_import.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#ifndef SERVICES_MARTI_INCLUDE_MARTI_IMPORT_H_
+#define SERVICES_MARTI_INCLUDE_MARTI_IMPORT_H_
+
+#include "marti_service_library.h"
+#include "marti_service_data.h"
+
+#include "service_job.h"
+#include "user_details.h"
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Import a set of MARTi samples in one go.
+ *
+ * The data is either JSON lines, where each line is a JSON object for a
+ * sample, or CSV with a header row giving the column names. The format is
+ * worked out from the first non-blank character: if it is a '{' then JSON
+ * lines are used, otherwise CSV. The fields for each sample are
+ *
+ *	name, marti_id, site_name, description, latitude, longitude, date, taxa
+ *
+ * of which site_name, description and taxa are optional. For CSV, any taxa
+ * are separated by semicolons, commas or spaces.
+ *
+ * The rows are checked one at a time as they are read and the valid ones
+ * are written to the database with unordered bulk inserts of the configured
+ * "import_batch_size". Each batch is then added to the Lucene index in a
+ * single call. Any rows that are invalid or that the database rejects are
+ * added to the job's errors, keyed by their line number, and the rest of
+ * the rows are still imported.
+ *
+ * @param data_s The data to import.
+ * @param user_p The User who is importing the samples.
+ * @param job_p The ServiceJob to add the errors and a summary to.
+ * @param data_p The MartiServiceData for the collection.
+ * @return OS_SUCCEEDED if all of the rows were imported, OS_PARTIALLY_SUCCEEDED
+ * if only some of them were or OS_FAILED if none of them were.
+ */
+MARTI_SERVICE_LOCAL OperationStatus ImportMartiEntries (const char *data_s, User *user_p, ServiceJob *job_p, MartiServiceData *data_p);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif /* SERVICES_MARTI_INCLUDE_MARTI_IMPORT_H_ */
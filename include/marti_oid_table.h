@@ -0,0 +1,118 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * marti_oid_table.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#ifndef SERVICES_MARTI_INCLUDE_MARTI_OID_TABLE_H_
+#define SERVICES_MARTI_INCLUDE_MARTI_OID_TABLE_H_
+
+#include "bson/bson.h"
+
+#include "marti_service_library.h"
+
+
+/**
+ * A hash table mapping bson_oid_ts to uint32 values, such as
+ * the position of a sample within an in-memory index.
+ *
+ * This does no locking of its own so it is up to the
+ * owner to serialise access to it.
+ */
+typedef struct MartiOidTable
+{
+	/** The keys */
+	bson_oid_t *mot_ids_p;
+
+	/** The values for each key */
+	uint32 *mot_values_p;
+
+	/** Whether each slot is in use */
+	bool *mot_used_p;
+
+	/** The number of slots. This is always a power of 2. */
+	size_t mot_capacity;
+
+	/** The number of slots in use */
+	size_t mot_size;
+} MartiOidTable;
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Allocate a MartiOidTable.
+ *
+ * @param initial_capacity The number of entries to allocate space for.
+ * @return The new MartiOidTable or <code>NULL</code> upon error.
+ */
+MARTI_SERVICE_LOCAL MartiOidTable *AllocateMartiOidTable (size_t initial_capacity);
+
+
+/**
+ * Free a MartiOidTable.
+ *
+ * @param table_p The MartiOidTable to free.
+ */
+MARTI_SERVICE_LOCAL void FreeMartiOidTable (MartiOidTable *table_p);
+
+
+/**
+ * Get the value for a given id.
+ *
+ * @param table_p The MartiOidTable to search.
+ * @param id_p The id to find.
+ * @param value_p If the id is found, this will be set to its value.
+ * @return <code>true</code> if the id was found, <code>false</code> otherwise.
+ */
+MARTI_SERVICE_LOCAL bool GetMartiOidTableValue (const MartiOidTable *table_p, const bson_oid_t *id_p, uint32 *value_p);
+
+
+/**
+ * Set the value for a given id, replacing any existing value.
+ *
+ * @param table_p The MartiOidTable to update.
+ * @param id_p The id to set the value for.
+ * @param value The value to set.
+ * @return <code>true</code> if the value was set, <code>false</code> upon error.
+ */
+MARTI_SERVICE_LOCAL bool SetMartiOidTableValue (MartiOidTable *table_p, const bson_oid_t *id_p, const uint32 value);
+
+
+/**
+ * Remove an id from a MartiOidTable.
+ *
+ * @param table_p The MartiOidTable to update.
+ * @param id_p The id to remove.
+ * @return <code>true</code> if the id was removed, <code>false</code> if it
+ * was not in the table.
+ */
+MARTI_SERVICE_LOCAL bool RemoveMartiOidTableValue (MartiOidTable *table_p, const bson_oid_t *id_p);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif /* SERVICES_MARTI_INCLUDE_MARTI_OID_TABLE_H_ */
@@ -0,0 +1,95 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * marti_sample_list.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#ifndef SERVICES_MARTI_INCLUDE_MARTI_SAMPLE_LIST_H_
+#define SERVICES_MARTI_INCLUDE_MARTI_SAMPLE_LIST_H_
+
+#include "bson/bson.h"
+#include "jansson.h"
+
+#include "marti_service_library.h"
+#include "marti_service_data.h"
+#include "string_parameter.h"
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Add an option for each sample in the MARTi collection to a parameter,
+ * using the sample's id as the value and its name as the description.
+ * The options are sorted by name.
+ *
+ * Only the id and name of each sample are needed, so these are
+ * kept in memory rather than getting every sample from the database
+ * each time. The list is loaded the first time that it is needed and
+ * updated by UpdateMartiSampleList () whenever a sample is saved by
+ * this process. It is reloaded every few minutes so that samples saved
+ * by other processes are picked up too.
+ *
+ * @param data_p The MartiServiceData to load the list with.
+ * @param param_p The parameter to add the options to.
+ * @param value_s If this is not <code>NULL</code>, the id to look for
+ * on the list.
+ * @param value_found_flag_p If value_s is on the list, this will be
+ * set to <code>true</code>.
+ * @return <code>true</code> if all of the options were added successfully,
+ * <code>false</code> otherwise.
+ */
+MARTI_SERVICE_LOCAL bool AddMartiSampleListOptions (const MartiServiceData *data_p, StringParameter *param_p, const char *value_s, bool *value_found_flag_p);
+
+
+/**
+ * Add a sample to the list or, if it is already there, update its name.
+ * This does nothing if the list hasn't been loaded yet.
+ *
+ * @param id_p The id of the sample.
+ * @param name_s The name of the sample.
+ */
+MARTI_SERVICE_LOCAL void UpdateMartiSampleList (const bson_oid_t *id_p, const char *name_s);
+
+
+/**
+ * Find the samples whose names or MARTi ids start with a given prefix.
+ * Samples matching by name come first, sorted by name, followed by those
+ * matching only by MARTi id, sorted by MARTi id. The comparison is case
+ * sensitive so that it can use the indexes on these fields.
+ *
+ * @param prefix_s The start of the name or MARTi id to look for.
+ * @param max_matches The most samples to return.
+ * @param data_p The MartiServiceData for the collection.
+ * @return An array of objects with the "id", name and MARTi id of each
+ * matching sample, which the caller should free with json_decref (),
+ * or <code>NULL</code> upon error.
+ */
+MARTI_SERVICE_LOCAL json_t *FindMartiSamplesByPrefix (const char *prefix_s, const uint32 max_matches, const MartiServiceData *data_p);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif /* SERVICES_MARTI_INCLUDE_MARTI_SAMPLE_LIST_H_ */
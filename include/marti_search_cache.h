@@ -0,0 +1,134 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * marti_search_cache.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#ifndef SERVICES_MARTI_INCLUDE_MARTI_SEARCH_CACHE_H_
+#define SERVICES_MARTI_INCLUDE_MARTI_SEARCH_CACHE_H_
+
+#include "jansson.h"
+
+#include "marti_service_library.h"
+#include "operation.h"
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Set up the in-process cache of search results. The cache is shared by
+ * all of the MARTi services in this process and lives for as long as
+ * the service library is loaded. Calling this more than once has no effect.
+ *
+ * The cache is configured by the "search_cache" object in the service
+ * configuration, e.g.
+ *
+ *	"search_cache": {
+ *		"size": 128,
+ *		"ttl": 300
+ *	}
+ *
+ * where "size" is the maximum number of queries to store and "ttl" is
+ * the number of seconds that results remain valid for. If there is no
+ * "search_cache" object, then no cache is used.
+ *
+ * @param service_config_p The service configuration.
+ * @return <code>true</code> if the cache is available, <code>false</code>
+ * otherwise.
+ */
+MARTI_SERVICE_LOCAL bool InitMartiSearchCache (const json_t *service_config_p);
+
+
+/**
+ * Get the cached results for a query.
+ *
+ * @param key_s The normalised query.
+ * @param results_pp If the query is cached, this will be set to a copy of the
+ * array of result records which the caller is responsible for freeing.
+ * @param next_token_pp If the query is cached, this will be set to a copy of
+ * the token for the following page of results or <code>NULL</code> if there
+ * is no following page. The caller is responsible for freeing this.
+ * @param status_p If the query is cached, this will be set to the status of
+ * the original search.
+ * @return <code>true</code> if the query was found in the cache, <code>false</code>
+ * otherwise.
+ */
+MARTI_SERVICE_LOCAL bool GetCachedMartiSearchResults (const char *key_s, json_t **results_pp, json_t **next_token_pp, OperationStatus *status_p);
+
+
+/**
+ * Store the results of a query in the cache.
+ *
+ * @param key_s The normalised query.
+ * @param results_p The array of result records. This will be copied.
+ * @param next_token_p The token for the following page of results. This can
+ * be <code>NULL</code> and will be copied.
+ * @param status The status of the search.
+ * @param generation The value of GetMartiSearchCacheGeneration () from
+ * before the search was started. If any entries have been saved since then,
+ * the results will not be stored.
+ * @return <code>true</code> if the results were stored, <code>false</code>
+ * otherwise.
+ */
+MARTI_SERVICE_LOCAL bool SetCachedMartiSearchResults (const char *key_s, const json_t *results_p, const json_t *next_token_p, const OperationStatus status, const uint32 generation);
+
+
+/**
+ * Get the current generation of the MARTi collection. This is
+ * incremented each time that an entry is saved.
+ *
+ * @return The generation.
+ */
+MARTI_SERVICE_LOCAL uint32 GetMartiSearchCacheGeneration (void);
+
+
+/**
+ * Mark all of the cached search results as out of date. This
+ * needs to be called whenever an entry is saved.
+ */
+MARTI_SERVICE_LOCAL void InvalidateMartiSearchCache (void);
+
+
+/**
+ * Check whether the search cache is in use.
+ *
+ * @return <code>true</code> if the cache is in use, <code>false</code>
+ * otherwise.
+ */
+MARTI_SERVICE_LOCAL bool IsMartiSearchCacheEnabled (void);
+
+
+/**
+ * Get the cache's hit and miss counts.
+ *
+ * @return The statistics as a JSON object or <code>NULL</code> upon error.
+ */
+MARTI_SERVICE_LOCAL json_t *GetMartiSearchCacheStatisticsAsJSON (void);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif /* SERVICES_MARTI_INCLUDE_MARTI_SEARCH_CACHE_H_ */
@@ -28,6 +28,68 @@
 #include "marti_service_library.h"
 
 
+/**
+ * The set of fields to return for each matching
+ * MARTi sample when searching.
+ */
+typedef enum MartiProjection
+{
+	/** The id, names, location and date only */
+	MP_MINIMAL,
+
+	/** Every field apart from the taxa */
+	MP_STANDARD,
+
+	/** The complete document */
+	MP_FULL,
+
+	/** The number of different MartiProjections */
+	MP_NUM_PROJECTIONS
+} MartiProjection;
+
+
+/**
+ * How the taxa given to a search are matched
+ * against each MARTi sample's taxa.
+ */
+typedef enum MartiTaxaMatch
+{
+	/** The sample has at least one of the taxa */
+	MTM_ANY,
+
+	/** The sample has every one of the taxa */
+	MTM_ALL,
+
+	/** The number of different MartiTaxaMatches */
+	MTM_NUM_MATCHES
+} MartiTaxaMatch;
+
+
+/**
+ * The different ways of choosing the area to search.
+ */
+typedef enum MartiSearchMode
+{
+	/** Samples within a given distance of a point, sorted by distance */
+	MSM_RADIUS,
+
+	/** Samples within a latitude/longitude bounding box, unsorted */
+	MSM_BOX,
+
+	/** Samples within a GeoJSON Polygon or MultiPolygon, unsorted */
+	MSM_POLYGON,
+
+	/** A given number of the samples nearest to a point, sorted by distance */
+	MSM_NEAREST,
+
+	/** A given number of the samples whose taxa are most similar to a sample's or a list of taxa, most similar first */
+	MSM_SIMILAR,
+
+	/** The number of different MartiSearchModes */
+	MSM_NUM_MODES
+} MartiSearchMode;
+
+
 
 #ifdef __cplusplus
 extern "C"
@@ -41,7 +41,17 @@ MARTI_SERVICE_API ServicesArray *GetServices (User *user_p, GrassrootsServer *gr
 MARTI_SERVICE_API void ReleaseServices (ServicesArray *services_p);
 
 
-
+/**
+ * Add an error for a particular row of a submission to a ServiceJob.
+ *
+ * @param job_p The ServiceJob to add the error to.
+ * @param value_p The row that the error is for. If this has a marti_id,
+ * it is included in the error's key. This can be <code>NULL</code>.
+ * @param error_s The error message.
+ * @param index The row number, which is used as the error's key.
+ * @return <code>true</code> if the error was added successfully, <code>false</code>
+ * otherwise.
+ */
 MARTI_SERVICE_LOCAL bool AddErrorMessage (ServiceJob *job_p, const json_t *value_p, const char *error_s, const int index);
 
 
@@ -51,6 +61,46 @@ MARTI_SERVICE_LOCAL MartiEntry *GetMartiEntryByMartiIdString (const char * const
 MARTI_SERVICE_LOCAL MartiEntry *GetMartiEntryByMongoIdString (const char * const mongo_id_s, const MartiServiceData *data_p);
 
 
+/**
+ * Add a value to the metadata of a ServiceJob.
+ *
+ * @param job_p The ServiceJob to update.
+ * @param key_s The key to store the value under.
+ * @param value_p The value to add. This will be stolen by the ServiceJob
+ * or freed if there is an error.
+ * @return <code>true</code> if the value was added successfully, <code>false</code>
+ * otherwise.
+ */
+MARTI_SERVICE_LOCAL bool AddMartiJobMetadata (ServiceJob *job_p, const char * const key_s, json_t *value_p);
+
+
+/**
+ * Create an index, which may span several fields, on the MARTi collection.
+ * Nothing is changed if an identical index already exists.
+ *
+ * @param data_p The MartiServiceData for the collection.
+ * @param name_s The name of the index.
+ * @param keys_p The fields to index, in order, and their index types.
+ * @param unique_flag <code>true</code> if the index should reject duplicate values.
+ * @return <code>true</code> if the index was created successfully or already
+ * existed, <code>false</code> otherwise.
+ */
+MARTI_SERVICE_LOCAL bool AddMartiCollectionIndex (MartiServiceData *data_p, const char * const name_s, const bson_t *keys_p, const bool unique_flag);
+
+
+/**
+ * Get the distance along the Earth's surface between two points.
+ * This uses the same Earth radius as MongoDB's spherical queries.
+ *
+ * @param latitude_0 The latitude of the first point in degrees.
+ * @param longitude_0 The longitude of the first point in degrees.
+ * @param latitude_1 The latitude of the second point in degrees.
+ * @param longitude_1 The longitude of the second point in degrees.
+ * @return The distance in metres.
+ */
+MARTI_SERVICE_LOCAL double64 GetMartiDistance (const double64 latitude_0, const double64 longitude_0, const double64 latitude_1, const double64 longitude_1);
+
+
 #ifdef __cplusplus
 }
 #endif
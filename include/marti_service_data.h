@@ -78,6 +78,56 @@ typedef struct /*MARTI_SERVICE_LOCAL*/ MartiServiceData
 	 */
 	const char *msd_api_url_s;
 
+	/**
+	 * @private
+	 *
+	 * If this is <code>true</code> then search results are converted
+	 * and added to the ServiceJob as they are read from the database
+	 * rather than after all of them have been loaded.
+	 */
+	bool msd_stream_results_flag;
+
+	/**
+	 * @private
+	 *
+	 * The number of documents to get from the database
+	 * in each batch when streaming search results.
+	 */
+	uint32 msd_search_batch_size;
+
+	/**
+	 * @private
+	 *
+	 * The most samples that a keyword search can match in the
+	 * Lucene index before it is rejected as too broad.
+	 */
+	uint32 msd_max_keyword_matches;
+
+	/**
+	 * @private
+	 *
+	 * The number of samples to write to the database in each bulk
+	 * operation, and to add to the Lucene index in one go, when
+	 * importing samples.
+	 */
+	uint32 msd_import_batch_size;
+
+	/**
+	 * @private
+	 *
+	 * If this is <code>true</code> then the "Load Sample" list only holds
+	 * the current sample and the others are found by looking up the
+	 * start of their names or MARTi ids.
+	 */
+	bool msd_sample_lookup_flag;
+
+	/**
+	 * @private
+	 *
+	 * The most samples that a sample lookup returns.
+	 */
+	uint32 msd_max_lookup_matches;
+
 } MartiServiceData;
 
 
@@ -0,0 +1,165 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * marti_similarity_index.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#ifndef SERVICES_MARTI_INCLUDE_MARTI_SIMILARITY_INDEX_H_
+#define SERVICES_MARTI_INCLUDE_MARTI_SIMILARITY_INDEX_H_
+
+#include <time.h>
+
+#include "bson/bson.h"
+
+#include "marti_service_library.h"
+#include "marti_service_data.h"
+
+
+/**
+ * A sample found by searching the similarity index.
+ */
+typedef struct MartiSimilarMatch
+{
+	/** The id of the matching sample. */
+	bson_oid_t msm_id;
+
+	/**
+	 * The estimated Jaccard similarity, between 0 and 1, of the
+	 * sample's taxa and the taxa that were searched for.
+	 */
+	double64 msm_similarity;
+
+	/** The distance, in metres, of the sample from the search point. */
+	double64 msm_distance;
+} MartiSimilarMatch;
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Load the in-memory similarity index of the MARTi collection. A MinHash
+ * sketch of each sample's taxa is kept, along with the sample's location,
+ * and the sketches are split into bands that are hashed into buckets. Samples
+ * that share a bucket for any band are likely to have similar taxa, so only
+ * these need to be compared to find the most similar samples rather than the
+ * whole collection. The index is shared by all of the MARTi services in this
+ * process and lives for as long as the service library is loaded so calling
+ * this more than once has no effect.
+ *
+ * The index is used if there is a "similarity_index" object in the service
+ * configuration, e.g.
+ *
+ *	"similarity_index": {}
+ *
+ * Saves made through this process go straight into the index and those made
+ * by other processes are picked up by RefreshMartiSimilarityIndex ().
+ *
+ * @param data_p The MartiServiceData to load the samples with.
+ * @return <code>true</code> if the index is available, <code>false</code>
+ * otherwise.
+ */
+MARTI_SERVICE_LOCAL bool InitMartiSimilarityIndex (MartiServiceData *data_p);
+
+
+/**
+ * Add any samples that have been saved, by this or any other process, since
+ * the similarity index was last loaded. This only goes to the database if
+ * the index has not been refreshed for a few minutes and does nothing if
+ * another thread is already refreshing it or if the index is not in use.
+ *
+ * @param data_p The MartiServiceData to load the samples with.
+ */
+MARTI_SERVICE_LOCAL void RefreshMartiSimilarityIndex (MartiServiceData *data_p);
+
+
+/**
+ * Check whether the similarity index is in use.
+ *
+ * @return <code>true</code> if the index is in use, <code>false</code>
+ * otherwise.
+ */
+MARTI_SERVICE_LOCAL bool IsMartiSimilarityIndexEnabled (void);
+
+
+/**
+ * Check whether a sample is in the similarity index. Only samples
+ * with at least one taxon are stored.
+ *
+ * @param id_p The id of the sample.
+ * @return <code>true</code> if the sample is in the index, <code>false</code>
+ * otherwise.
+ */
+MARTI_SERVICE_LOCAL bool IsInMartiSimilarityIndex (const bson_oid_t *id_p);
+
+
+/**
+ * Set the taxa, location and date of a sample in the similarity index, replacing
+ * any that it had before. This does nothing if the index is not in use.
+ *
+ * @param id_p The id of the sample.
+ * @param taxa_p The taxonomy ids of the sample's taxa.
+ * @param num_taxa The number of taxa. If this is 0, the sample is removed
+ * from the index.
+ * @param latitude The latitude of the sample.
+ * @param longitude The longitude of the sample.
+ * @param time_p The date of the sample. This can be <code>NULL</code>.
+ * @return <code>true</code> if the index was updated successfully or is
+ * not in use, <code>false</code> otherwise.
+ */
+MARTI_SERVICE_LOCAL bool UpdateMartiSimilarityIndex (const bson_oid_t *id_p, const uint32 *taxa_p, const size_t num_taxa, const double64 latitude, const double64 longitude, const struct tm *time_p);
+
+
+/**
+ * Find the samples whose taxa are most similar to those of a given sample
+ * or to a given set of taxa.
+ *
+ * The matches are sorted by similarity, most similar first, and then by
+ * distance. Samples that share no LSH bucket with the search are not
+ * considered, so samples with a low similarity may be missed.
+ *
+ * @param id_p If this is not <code>NULL</code>, the taxa of this sample
+ * are used and the sample itself is not included in the matches.
+ * @param taxa_p If id_p is <code>NULL</code>, the taxa to search for.
+ * @param num_taxa The number of taxa.
+ * @param max_matches The maximum number of matches to get.
+ * @param latitude The latitude of the point to search from.
+ * @param longitude The longitude of the point to search from.
+ * @param max_distance If this is greater than 0, only samples within
+ * this distance, in metres, of the point will match.
+ * @param start_p If this is not <code>NULL</code> only samples on or after this date will match.
+ * @param end_p If this is not <code>NULL</code> only samples on or before this date will match.
+ * @param num_matches_p This will be set to the number of matches.
+ * @return The array of matches which the caller should free with FreeMemory ()
+ * or <code>NULL</code> if there were none or upon error.
+ */
+MARTI_SERVICE_LOCAL MartiSimilarMatch *FindMartiSimilarSamples (const bson_oid_t *id_p, const uint32 *taxa_p, const size_t num_taxa, const uint32 max_matches,
+																																const double64 latitude, const double64 longitude, const double64 max_distance,
+																																const struct tm *start_p, const struct tm *end_p, size_t *num_matches_p);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif /* SERVICES_MARTI_INCLUDE_MARTI_SIMILARITY_INDEX_H_ */
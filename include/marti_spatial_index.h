@@ -0,0 +1,166 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * marti_spatial_index.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#ifndef SERVICES_MARTI_INCLUDE_MARTI_SPATIAL_INDEX_H_
+#define SERVICES_MARTI_INCLUDE_MARTI_SPATIAL_INDEX_H_
+
+#include <time.h>
+
+#include "bson/bson.h"
+
+#include "marti_service_library.h"
+#include "marti_service_data.h"
+
+
+/**
+ * A sample found by searching the spatial index.
+ */
+typedef struct MartiSpatialMatch
+{
+	/** The id of the matching sample. */
+	bson_oid_t msm_id;
+
+	/** The distance, in metres, of the sample from the search point. */
+	double64 msm_distance;
+} MartiSpatialMatch;
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Load the in-memory spatial index of the MARTi collection. This holds the
+ * id, location and date of every sample in a grid of latitude/longitude cells
+ * so that the matching ids for a search can be found without going to the
+ * database. The index is shared by all of the MARTi services in this process
+ * and lives for as long as the service library is loaded so calling this more
+ * than once has no effect.
+ *
+ * The index is configured by the "spatial_index" object in the service
+ * configuration, e.g.
+ *
+ *	"spatial_index": {
+ *		"cell_size": 1.0
+ *	}
+ *
+ * where "cell_size" is the width and height, in degrees, of each cell. The
+ * whole grid is allocated when the index is created, so this must be at
+ * least 0.25. If there is no "spatial_index" object, then the index is
+ * not used.
+ *
+ * Saves made through this process go straight into the index and those made
+ * by other processes are picked up by RefreshMartiSpatialIndex ().
+ *
+ * @param data_p The MartiServiceData to load the samples with.
+ * @return <code>true</code> if the index is available, <code>false</code>
+ * otherwise.
+ */
+MARTI_SERVICE_LOCAL bool InitMartiSpatialIndex (MartiServiceData *data_p);
+
+
+/**
+ * Check whether the spatial index is in use.
+ *
+ * @return <code>true</code> if the index is in use, <code>false</code>
+ * otherwise.
+ */
+MARTI_SERVICE_LOCAL bool IsMartiSpatialIndexEnabled (void);
+
+
+/**
+ * Add any samples that have been saved, by this or any other process, since
+ * the spatial index was last loaded. This only goes to the database if
+ * the index has not been refreshed for a few minutes and does nothing if
+ * another thread is already refreshing it or if the index is not in use.
+ *
+ * @param data_p The MartiServiceData to load the samples with.
+ */
+MARTI_SERVICE_LOCAL void RefreshMartiSpatialIndex (MartiServiceData *data_p);
+
+
+/**
+ * Add a sample to the spatial index or update its details if
+ * it is already there. This does nothing if the index is not in use.
+ *
+ * @param id_p The id of the sample.
+ * @param latitude The latitude of the sample.
+ * @param longitude The longitude of the sample.
+ * @param time_p The date of the sample. This can be <code>NULL</code>.
+ * @return <code>true</code> if the index was updated successfully or is
+ * not in use, <code>false</code> otherwise.
+ */
+MARTI_SERVICE_LOCAL bool UpdateMartiSpatialIndex (const bson_oid_t *id_p, const double64 latitude, const double64 longitude, const struct tm *time_p);
+
+
+/**
+ * Find all of the samples within a given distance of a point.
+ *
+ * The matches are sorted by distance and then by id. To get the matches
+ * following a previous one, set min_distance to its distance and after_id_p
+ * to its id.
+ *
+ * @param latitude The latitude of the point to search from.
+ * @param longitude The longitude of the point to search from.
+ * @param min_distance The minimum distance, in metres.
+ * @param after_id_p If this is not <code>NULL</code> then any samples at exactly
+ * min_distance will only be matched if their ids are greater than this.
+ * @param max_distance The maximum distance, in metres. If this is 0, then
+ * there is no maximum distance.
+ * @param start_p If this is not <code>NULL</code> only samples on or after this date will match.
+ * @param end_p If this is not <code>NULL</code> only samples on or before this date will match.
+ * @param num_matches_p This will be set to the number of matches.
+ * @return The array of matches which the caller should free with FreeMemory ()
+ * or <code>NULL</code> if there were none or upon error.
+ */
+MARTI_SERVICE_LOCAL MartiSpatialMatch *FindMartiSpatialIndexMatches (const double64 latitude, const double64 longitude, const double64 min_distance, const bson_oid_t *after_id_p,
+																																	 const double64 max_distance, const struct tm *start_p, const struct tm *end_p, size_t *num_matches_p);
+
+
+/**
+ * Find all of the samples within a bounding box.
+ *
+ * The matches are sorted by id and their distances are set to 0.
+ *
+ * @param min_latitude The southern edge of the box.
+ * @param min_longitude The western edge of the box. If this is greater than
+ * max_longitude, the box crosses the antimeridian.
+ * @param max_latitude The northern edge of the box.
+ * @param max_longitude The eastern edge of the box.
+ * @param start_p If this is not <code>NULL</code> only samples on or after this date will match.
+ * @param end_p If this is not <code>NULL</code> only samples on or before this date will match.
+ * @param num_matches_p This will be set to the number of matches.
+ * @return The array of matches which the caller should free with FreeMemory ()
+ * or <code>NULL</code> if there were none or upon error.
+ */
+MARTI_SERVICE_LOCAL MartiSpatialMatch *FindMartiSpatialIndexMatchesInBox (const double64 min_latitude, const double64 min_longitude, const double64 max_latitude, const double64 max_longitude,
+																																				const struct tm *start_p, const struct tm *end_p, size_t *num_matches_p);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif /* SERVICES_MARTI_INCLUDE_MARTI_SPATIAL_INDEX_H_ */
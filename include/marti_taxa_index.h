@@ -0,0 +1,125 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * marti_taxa_index.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#ifndef SERVICES_MARTI_INCLUDE_MARTI_TAXA_INDEX_H_
+#define SERVICES_MARTI_INCLUDE_MARTI_TAXA_INDEX_H_
+
+#include "bson/bson.h"
+
+#include "marti_service_library.h"
+#include "marti_service_data.h"
+#include "marti_spatial_index.h"
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Load the in-memory taxa index of the MARTi collection. Each sample is
+ * given a number and, for each taxon, the numbers of the samples with that
+ * taxon are stored in a compressed bitmap. Any combination of taxa that a
+ * sample must have or must not have can then be worked out with bitmap
+ * operations rather than by the database. The index is shared by all of
+ * the MARTi services in this process and lives for as long as the service
+ * library is loaded so calling this more than once has no effect.
+ *
+ * The index is used if there is a "taxa_index" object in the service
+ * configuration, e.g.
+ *
+ *	"taxa_index": {}
+ *
+ * It is only used to filter the matches from the spatial index so it
+ * has no effect unless the spatial index is enabled too. Saves made through
+ * this process go straight into the index and those made by other processes
+ * are picked up by RefreshMartiTaxaIndex ().
+ *
+ * @param data_p The MartiServiceData to load the samples with.
+ * @return <code>true</code> if the index is available, <code>false</code>
+ * otherwise.
+ */
+MARTI_SERVICE_LOCAL bool InitMartiTaxaIndex (MartiServiceData *data_p);
+
+
+/**
+ * Check whether the taxa index is in use.
+ *
+ * @return <code>true</code> if the index is in use, <code>false</code>
+ * otherwise.
+ */
+MARTI_SERVICE_LOCAL bool IsMartiTaxaIndexEnabled (void);
+
+
+/**
+ * Add any samples that have been saved, by this or any other process, since
+ * the taxa index was last loaded. This only goes to the database if the
+ * index has not been refreshed for a few minutes and does nothing if
+ * another thread is already refreshing it or if the index is not in use.
+ *
+ * @param data_p The MartiServiceData to load the samples with.
+ */
+MARTI_SERVICE_LOCAL void RefreshMartiTaxaIndex (MartiServiceData *data_p);
+
+
+/**
+ * Set the taxa of a sample in the taxa index, replacing any that it had
+ * before. This does nothing if the index is not in use.
+ *
+ * @param id_p The id of the sample.
+ * @param taxa_p The taxonomy ids of the sample's taxa.
+ * @param num_taxa The number of taxa.
+ * @return <code>true</code> if the index was updated successfully or is
+ * not in use, <code>false</code> otherwise.
+ */
+MARTI_SERVICE_LOCAL bool UpdateMartiTaxaIndex (const bson_oid_t *id_p, const uint32 *taxa_p, const size_t num_taxa);
+
+
+/**
+ * Remove any spatial index matches whose taxa don't match a taxa expression.
+ * A sample matches if it has any, or all, of the given taxa and none of the
+ * excluded ones. The order of the remaining matches is kept.
+ *
+ * @param matches_p The matches to filter.
+ * @param num_matches_p The number of matches. This will be updated to the
+ * number of matches that are left.
+ * @param taxa_p The taxa that the samples must have. If there are none, then
+ * only the excluded taxa are used.
+ * @param num_taxa The number of taxa.
+ * @param all_flag If this is <code>true</code> the samples must have all of
+ * the taxa, otherwise they must have at least one.
+ * @param excluded_p The taxa that the samples must not have.
+ * @param num_excluded The number of excluded taxa.
+ * @return <code>true</code> if the matches were filtered successfully,
+ * <code>false</code> if the index is not in use or upon error.
+ */
+MARTI_SERVICE_LOCAL bool FilterMartiSpatialMatchesByTaxa (MartiSpatialMatch *matches_p, size_t *num_matches_p, const uint32 *taxa_p, const size_t num_taxa, const bool all_flag,
+																													const uint32 *excluded_p, const size_t num_excluded);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif /* SERVICES_MARTI_INCLUDE_MARTI_TAXA_INDEX_H_ */
@@ -0,0 +1,108 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * marti_taxonomy.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#ifndef SERVICES_MARTI_INCLUDE_MARTI_TAXONOMY_H_
+#define SERVICES_MARTI_INCLUDE_MARTI_TAXONOMY_H_
+
+#include "jansson.h"
+
+#include "marti_service_library.h"
+#include "typedefs.h"
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Load the NCBI taxonomy tree used for subtree searches. The tree is shared
+ * by all of the MARTi services in this process and lives for as long as the
+ * service library is loaded so calling this more than once has no effect.
+ *
+ * Each taxon is numbered in a pre-order walk of the tree so that all of
+ * its descendants have the consecutive numbers that follow its own. A
+ * subtree is then just the interval from the taxon's number to that of
+ * its last descendant.
+ *
+ * The tree is configured by the "taxonomy" object in the service
+ * configuration, e.g.
+ *
+ *	"taxonomy": {
+ *		"nodes_file": "/opt/ncbi/taxdump/nodes.dmp"
+ *	}
+ *
+ * where "nodes_file" is the nodes.dmp file from the NCBI taxdump. If there
+ * is no "taxonomy" object, then subtree searches are not available.
+ *
+ * The numbers are stored with each sample when it is saved, along with
+ * the version of the taxonomy that they came from. If the nodes.dmp file
+ * is updated, or samples were saved before the taxonomy was configured,
+ * setting "migrate_taxa_preorder" to true in the service configuration
+ * renumbers every sample that doesn't have the current version when the
+ * services are loaded.
+ *
+ * @param service_config_p The service configuration.
+ * @return <code>true</code> if the tree is available, <code>false</code>
+ * otherwise.
+ */
+MARTI_SERVICE_LOCAL bool InitMartiTaxonomy (const json_t *service_config_p);
+
+
+/**
+ * Check whether the taxonomy tree has been loaded.
+ *
+ * @return <code>true</code> if the tree is available, <code>false</code>
+ * otherwise.
+ */
+MARTI_SERVICE_LOCAL bool IsMartiTaxonomyLoaded (void);
+
+
+/**
+ * Get the version of the loaded taxonomy. This is a hash of the
+ * pre-order numbers so it only changes when they do.
+ *
+ * @return The version or <code>NULL</code> if the tree isn't loaded.
+ */
+MARTI_SERVICE_LOCAL const char *GetMartiTaxonomyVersion (void);
+
+
+/**
+ * Get the interval of pre-order numbers for a taxon and all of its descendants.
+ *
+ * @param taxon The NCBI taxonomy id.
+ * @param first_p If successful, this will be set to the taxon's own number.
+ * @param last_p If successful, this will be set to the number of the taxon's
+ * last descendant, or its own number if it has none.
+ * @return <code>true</code> if the taxon is in the tree, <code>false</code>
+ * otherwise.
+ */
+MARTI_SERVICE_LOCAL bool GetMartiTaxonInterval (const uint32 taxon, uint32 *first_p, uint32 *last_p);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif /* SERVICES_MARTI_INCLUDE_MARTI_TAXONOMY_H_ */
@@ -0,0 +1,873 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * marti_bitmap.c
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#include <string.h>
+
+#include "marti_bitmap.h"
+
+#include "memory_allocations.h"
+#include "streams.h"
+
+
+/* The most values that a container stores as an array */
+#define S_MAX_ARRAY_SIZE (4096)
+
+/* The number of 64-bit words needed for all 65536 lower values */
+#define S_NUM_WORDS (1024)
+
+
+typedef struct BitmapContainer
+{
+	/* The upper 16 bits of all of the values in this container */
+	uint16 bc_key;
+
+	uint32 bc_cardinality;
+
+	/*
+	 * If bc_words_p is NULL, the lower 16 bits
+	 * of the values as a sorted array.
+	 */
+	uint16 *bc_values_p;
+
+	uint32 bc_capacity;
+
+	/* Otherwise, the lower 16 bits of the values as a bitmap */
+	uint64 *bc_words_p;
+} BitmapContainer;
+
+
+struct MartiBitmap
+{
+	/* The containers sorted by key */
+	BitmapContainer *mb_containers_p;
+
+	uint32 mb_num_containers;
+
+	uint32 mb_capacity;
+};
+
+
+typedef enum BitmapOperation
+{
+	BO_AND,
+
+	BO_OR,
+
+	BO_AND_NOT
+} BitmapOperation;
+
+
+static bool FindContainer (const MartiBitmap *bitmap_p, const uint16 key, uint32 *index_p);
+
+static BitmapContainer *InsertContainer (MartiBitmap *bitmap_p, const uint32 index, const uint16 key);
+
+static void RemoveContainer (MartiBitmap *bitmap_p, const uint32 index);
+
+static bool AppendContainer (MartiBitmap *bitmap_p, BitmapContainer *container_p);
+
+static void ClearContainer (BitmapContainer *container_p);
+
+static bool CopyContainer (const BitmapContainer *src_p, BitmapContainer *dest_p);
+
+static bool FindValue (const BitmapContainer *container_p, const uint16 value, uint32 *index_p);
+
+static bool AddToContainer (BitmapContainer *container_p, const uint16 value);
+
+static void RemoveFromContainer (BitmapContainer *container_p, const uint16 value);
+
+static bool ConvertToWords (BitmapContainer *container_p);
+
+static bool ConvertToArray (BitmapContainer *container_p);
+
+static void GetContainerWords (const BitmapContainer *container_p, uint64 *words_p);
+
+static bool SetContainerFromWords (BitmapContainer *container_p, const uint16 key, uint64 *words_p);
+
+static bool CombineContainers (const BitmapContainer *container_0_p, const BitmapContainer *container_1_p, const BitmapOperation op, BitmapContainer *result_p);
+
+static bool CombineArrays (const BitmapContainer *container_0_p, const BitmapContainer *container_1_p, const BitmapOperation op, BitmapContainer *result_p);
+
+static MartiBitmap *CombineBitmaps (const MartiBitmap *bitmap_0_p, const MartiBitmap *bitmap_1_p, const BitmapOperation op);
+
+static uint32 CountBits (uint64 word);
+
+
+
+MartiBitmap *AllocateMartiBitmap (void)
+{
+	MartiBitmap *bitmap_p = (MartiBitmap *) AllocMemory (sizeof (MartiBitmap));
+
+	if (bitmap_p)
+		{
+			bitmap_p -> mb_containers_p = NULL;
+			bitmap_p -> mb_num_containers = 0;
+			bitmap_p -> mb_capacity = 0;
+		}
+
+	return bitmap_p;
+}
+
+
+void FreeMartiBitmap (MartiBitmap *bitmap_p)
+{
+	uint32 i;
+
+	for (i = 0; i < bitmap_p -> mb_num_containers; ++ i)
+		{
+			ClearContainer ((bitmap_p -> mb_containers_p) + i);
+		}
+
+	if (bitmap_p -> mb_containers_p)
+		{
+			FreeMemory (bitmap_p -> mb_containers_p);
+		}
+
+	FreeMemory (bitmap_p);
+}
+
+
+bool AddToMartiBitmap (MartiBitmap *bitmap_p, const uint32 value)
+{
+	const uint16 key = (uint16) (value >> 16);
+	BitmapContainer *container_p = NULL;
+	uint32 index;
+
+	if (FindContainer (bitmap_p, key, &index))
+		{
+			container_p = (bitmap_p -> mb_containers_p) + index;
+		}
+	else
+		{
+			container_p = InsertContainer (bitmap_p, index, key);
+		}
+
+	if (container_p)
+		{
+			if (AddToContainer (container_p, (uint16) (value & 0xFFFF)))
+				{
+					return true;
+				}
+
+			if (container_p -> bc_cardinality == 0)
+				{
+					RemoveContainer (bitmap_p, index);
+				}
+		}
+
+	PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add " UINT32_FMT " to bitmap", value);
+
+	return false;
+}
+
+
+bool RemoveFromMartiBitmap (MartiBitmap *bitmap_p, const uint32 value)
+{
+	uint32 index;
+
+	if (FindContainer (bitmap_p, (uint16) (value >> 16), &index))
+		{
+			BitmapContainer *container_p = (bitmap_p -> mb_containers_p) + index;
+
+			RemoveFromContainer (container_p, (uint16) (value & 0xFFFF));
+
+			if (container_p -> bc_cardinality == 0)
+				{
+					RemoveContainer (bitmap_p, index);
+				}
+		}
+
+	return true;
+}
+
+
+bool IsInMartiBitmap (const MartiBitmap *bitmap_p, const uint32 value)
+{
+	uint32 index;
+
+	if (FindContainer (bitmap_p, (uint16) (value >> 16), &index))
+		{
+			const BitmapContainer *container_p = (bitmap_p -> mb_containers_p) + index;
+			const uint16 low = (uint16) (value & 0xFFFF);
+
+			if (container_p -> bc_words_p)
+				{
+					return ((* ((container_p -> bc_words_p) + (low >> 6))) & (((uint64) 1) << (low & 63))) != 0;
+				}
+			else
+				{
+					return FindValue (container_p, low, &index);
+				}
+		}
+
+	return false;
+}
+
+
+uint64 GetMartiBitmapCardinality (const MartiBitmap *bitmap_p)
+{
+	uint64 cardinality = 0;
+	uint32 i;
+
+	for (i = 0; i < bitmap_p -> mb_num_containers; ++ i)
+		{
+			cardinality += ((bitmap_p -> mb_containers_p) + i) -> bc_cardinality;
+		}
+
+	return cardinality;
+}
+
+
+MartiBitmap *GetMartiBitmapIntersection (const MartiBitmap *bitmap_0_p, const MartiBitmap *bitmap_1_p)
+{
+	return CombineBitmaps (bitmap_0_p, bitmap_1_p, BO_AND);
+}
+
+
+MartiBitmap *GetMartiBitmapUnion (const MartiBitmap *bitmap_0_p, const MartiBitmap *bitmap_1_p)
+{
+	return CombineBitmaps (bitmap_0_p, bitmap_1_p, BO_OR);
+}
+
+
+MartiBitmap *GetMartiBitmapDifference (const MartiBitmap *bitmap_0_p, const MartiBitmap *bitmap_1_p)
+{
+	return CombineBitmaps (bitmap_0_p, bitmap_1_p, BO_AND_NOT);
+}
+
+
+/*
+ * Walk both sets of containers in key order, so only the containers
+ * with the same key ever need to be combined value by value.
+ */
+static MartiBitmap *CombineBitmaps (const MartiBitmap *bitmap_0_p, const MartiBitmap *bitmap_1_p, const BitmapOperation op)
+{
+	MartiBitmap *result_p = AllocateMartiBitmap ();
+
+	if (result_p)
+		{
+			uint32 i = 0;
+			uint32 j = 0;
+			bool success_flag = true;
+
+			while (success_flag && (i < bitmap_0_p -> mb_num_containers) && (j < bitmap_1_p -> mb_num_containers))
+				{
+					const BitmapContainer *container_0_p = (bitmap_0_p -> mb_containers_p) + i;
+					const BitmapContainer *container_1_p = (bitmap_1_p -> mb_containers_p) + j;
+					BitmapContainer result;
+
+					memset (&result, 0, sizeof (BitmapContainer));
+
+					if (container_0_p -> bc_key < container_1_p -> bc_key)
+						{
+							if (op != BO_AND)
+								{
+									success_flag = CopyContainer (container_0_p, &result);
+								}
+
+							++ i;
+						}
+					else if (container_0_p -> bc_key > container_1_p -> bc_key)
+						{
+							if (op == BO_OR)
+								{
+									success_flag = CopyContainer (container_1_p, &result);
+								}
+
+							++ j;
+						}
+					else
+						{
+							success_flag = CombineContainers (container_0_p, container_1_p, op, &result);
+							++ i;
+							++ j;
+						}
+
+					if (success_flag && (result.bc_cardinality > 0))
+						{
+							success_flag = AppendContainer (result_p, &result);
+						}
+				}
+
+			/* Any remaining containers are only in one of the bitmaps */
+			if (op != BO_AND)
+				{
+					while (success_flag && (i < bitmap_0_p -> mb_num_containers))
+						{
+							BitmapContainer result;
+
+							success_flag = CopyContainer ((bitmap_0_p -> mb_containers_p) + i, &result) && AppendContainer (result_p, &result);
+							++ i;
+						}
+				}
+
+			if (op == BO_OR)
+				{
+					while (success_flag && (j < bitmap_1_p -> mb_num_containers))
+						{
+							BitmapContainer result;
+
+							success_flag = CopyContainer ((bitmap_1_p -> mb_containers_p) + j, &result) && AppendContainer (result_p, &result);
+							++ j;
+						}
+				}
+
+			if (success_flag)
+				{
+					return result_p;
+				}
+
+			FreeMartiBitmap (result_p);
+		}
+
+	PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to combine bitmaps");
+
+	return NULL;
+}
+
+
+/*
+ * Two arrays are merged directly. Otherwise, both containers are
+ * expanded to bitmaps so that they can be combined a word at a time.
+ */
+static bool CombineContainers (const BitmapContainer *container_0_p, const BitmapContainer *container_1_p, const BitmapOperation op, BitmapContainer *result_p)
+{
+	if ((! (container_0_p -> bc_words_p)) && (! (container_1_p -> bc_words_p)))
+		{
+			return CombineArrays (container_0_p, container_1_p, op, result_p);
+		}
+	else
+		{
+			uint64 *words_p = (uint64 *) AllocMemoryArray (S_NUM_WORDS, sizeof (uint64));
+
+			if (words_p)
+				{
+					uint64 other_words [S_NUM_WORDS];
+					uint32 i;
+
+					GetContainerWords (container_0_p, words_p);
+					GetContainerWords (container_1_p, other_words);
+
+					switch (op)
+						{
+							case BO_AND:
+								for (i = 0; i < S_NUM_WORDS; ++ i)
+									{
+										* (words_p + i) &= other_words [i];
+									}
+								break;
+
+							case BO_OR:
+								for (i = 0; i < S_NUM_WORDS; ++ i)
+									{
+										* (words_p + i) |= other_words [i];
+									}
+								break;
+
+							case BO_AND_NOT:
+								for (i = 0; i < S_NUM_WORDS; ++ i)
+									{
+										* (words_p + i) &= ~ (other_words [i]);
+									}
+								break;
+						}
+
+					return SetContainerFromWords (result_p, container_0_p -> bc_key, words_p);
+				}
+		}
+
+	return false;
+}
+
+
+static bool CombineArrays (const BitmapContainer *container_0_p, const BitmapContainer *container_1_p, const BitmapOperation op, BitmapContainer *result_p)
+{
+	const uint32 capacity = (op == BO_OR) ? (container_0_p -> bc_cardinality) + (container_1_p -> bc_cardinality) : container_0_p -> bc_cardinality;
+	uint16 *values_p = (uint16 *) AllocMemoryArray (capacity, sizeof (uint16));
+
+	if (values_p)
+		{
+			const uint16 *values_0_p = container_0_p -> bc_values_p;
+			const uint16 *values_1_p = container_1_p -> bc_values_p;
+			const uint32 size_0 = container_0_p -> bc_cardinality;
+			const uint32 size_1 = container_1_p -> bc_cardinality;
+			uint32 i = 0;
+			uint32 j = 0;
+			uint32 k = 0;
+
+			while ((i < size_0) && (j < size_1))
+				{
+					const uint16 value_0 = * (values_0_p + i);
+					const uint16 value_1 = * (values_1_p + j);
+
+					if (value_0 < value_1)
+						{
+							if (op != BO_AND)
+								{
+									* (values_p + (k ++)) = value_0;
+								}
+
+							++ i;
+						}
+					else if (value_0 > value_1)
+						{
+							if (op == BO_OR)
+								{
+									* (values_p + (k ++)) = value_1;
+								}
+
+							++ j;
+						}
+					else
+						{
+							if (op != BO_AND_NOT)
+								{
+									* (values_p + (k ++)) = value_0;
+								}
+
+							++ i;
+							++ j;
+						}
+				}
+
+			if (op != BO_AND)
+				{
+					while (i < size_0)
+						{
+							* (values_p + (k ++)) = * (values_0_p + (i ++));
+						}
+				}
+
+			if (op == BO_OR)
+				{
+					while (j < size_1)
+						{
+							* (values_p + (k ++)) = * (values_1_p + (j ++));
+						}
+				}
+
+			result_p -> bc_key = container_0_p -> bc_key;
+			result_p -> bc_cardinality = k;
+			result_p -> bc_values_p = values_p;
+			result_p -> bc_capacity = capacity;
+			result_p -> bc_words_p = NULL;
+
+			if (k == 0)
+				{
+					ClearContainer (result_p);
+				}
+			else if (k > S_MAX_ARRAY_SIZE)
+				{
+					if (!ConvertToWords (result_p))
+						{
+							ClearContainer (result_p);
+							return false;
+						}
+				}
+
+			return true;
+		}
+
+	return (capacity == 0);
+}
+
+
+static bool FindContainer (const MartiBitmap *bitmap_p, const uint16 key, uint32 *index_p)
+{
+	uint32 low = 0;
+	uint32 high = bitmap_p -> mb_num_containers;
+
+	while (low < high)
+		{
+			const uint32 mid = (low + high) >> 1;
+			const uint16 mid_key = ((bitmap_p -> mb_containers_p) + mid) -> bc_key;
+
+			if (mid_key < key)
+				{
+					low = mid + 1;
+				}
+			else if (mid_key > key)
+				{
+					high = mid;
+				}
+			else
+				{
+					*index_p = mid;
+					return true;
+				}
+		}
+
+	*index_p = low;
+
+	return false;
+}
+
+
+static BitmapContainer *InsertContainer (MartiBitmap *bitmap_p, const uint32 index, const uint16 key)
+{
+	BitmapContainer *container_p = NULL;
+
+	if (bitmap_p -> mb_num_containers == bitmap_p -> mb_capacity)
+		{
+			const uint32 new_capacity = (bitmap_p -> mb_capacity) ? ((bitmap_p -> mb_capacity) << 1) : 4;
+			BitmapContainer *containers_p = (BitmapContainer *) ReallocMemory (bitmap_p -> mb_containers_p, new_capacity * sizeof (BitmapContainer), (bitmap_p -> mb_capacity) * sizeof (BitmapContainer));
+
+			if (!containers_p)
+				{
+					return NULL;
+				}
+
+			bitmap_p -> mb_containers_p = containers_p;
+			bitmap_p -> mb_capacity = new_capacity;
+		}
+
+	container_p = (bitmap_p -> mb_containers_p) + index;
+
+	memmove (container_p + 1, container_p, ((bitmap_p -> mb_num_containers) - index) * sizeof (BitmapContainer));
+	memset (container_p, 0, sizeof (BitmapContainer));
+	container_p -> bc_key = key;
+	++ (bitmap_p -> mb_num_containers);
+
+	return container_p;
+}
+
+
+static void RemoveContainer (MartiBitmap *bitmap_p, const uint32 index)
+{
+	BitmapContainer *container_p = (bitmap_p -> mb_containers_p) + index;
+
+	ClearContainer (container_p);
+	-- (bitmap_p -> mb_num_containers);
+	memmove (container_p, container_p + 1, ((bitmap_p -> mb_num_containers) - index) * sizeof (BitmapContainer));
+}
+
+
+/*
+ * Containers are always appended in key order, so just add
+ * it to the end and take ownership of its values.
+ */
+static bool AppendContainer (MartiBitmap *bitmap_p, BitmapContainer *container_p)
+{
+	BitmapContainer *dest_p = InsertContainer (bitmap_p, bitmap_p -> mb_num_containers, container_p -> bc_key);
+
+	if (dest_p)
+		{
+			*dest_p = *container_p;
+			return true;
+		}
+
+	ClearContainer (container_p);
+
+	return false;
+}
+
+
+static void ClearContainer (BitmapContainer *container_p)
+{
+	if (container_p -> bc_values_p)
+		{
+			FreeMemory (container_p -> bc_values_p);
+			container_p -> bc_values_p = NULL;
+		}
+
+	if (container_p -> bc_words_p)
+		{
+			FreeMemory (container_p -> bc_words_p);
+			container_p -> bc_words_p = NULL;
+		}
+
+	container_p -> bc_cardinality = 0;
+	container_p -> bc_capacity = 0;
+}
+
+
+static bool CopyContainer (const BitmapContainer *src_p, BitmapContainer *dest_p)
+{
+	*dest_p = *src_p;
+
+	if (src_p -> bc_words_p)
+		{
+			dest_p -> bc_words_p = (uint64 *) AllocMemoryArray (S_NUM_WORDS, sizeof (uint64));
+
+			if (dest_p -> bc_words_p)
+				{
+					memcpy (dest_p -> bc_words_p, src_p -> bc_words_p, S_NUM_WORDS * sizeof (uint64));
+					return true;
+				}
+		}
+	else
+		{
+			dest_p -> bc_capacity = src_p -> bc_cardinality;
+			dest_p -> bc_values_p = (uint16 *) AllocMemoryArray (src_p -> bc_cardinality, sizeof (uint16));
+
+			if (dest_p -> bc_values_p)
+				{
+					memcpy (dest_p -> bc_values_p, src_p -> bc_values_p, (src_p -> bc_cardinality) * sizeof (uint16));
+					return true;
+				}
+		}
+
+	memset (dest_p, 0, sizeof (BitmapContainer));
+
+	return false;
+}
+
+
+static bool FindValue (const BitmapContainer *container_p, const uint16 value, uint32 *index_p)
+{
+	uint32 low = 0;
+	uint32 high = container_p -> bc_cardinality;
+
+	while (low < high)
+		{
+			const uint32 mid = (low + high) >> 1;
+			const uint16 mid_value = * ((container_p -> bc_values_p) + mid);
+
+			if (mid_value < value)
+				{
+					low = mid + 1;
+				}
+			else if (mid_value > value)
+				{
+					high = mid;
+				}
+			else
+				{
+					*index_p = mid;
+					return true;
+				}
+		}
+
+	*index_p = low;
+
+	return false;
+}
+
+
+static bool AddToContainer (BitmapContainer *container_p, const uint16 value)
+{
+	uint32 index;
+
+	if (! (container_p -> bc_words_p))
+		{
+			if (FindValue (container_p, value, &index))
+				{
+					return true;
+				}
+
+			if (container_p -> bc_cardinality < S_MAX_ARRAY_SIZE)
+				{
+					uint16 *value_p = NULL;
+
+					if (container_p -> bc_cardinality == container_p -> bc_capacity)
+						{
+							const uint32 new_capacity = (container_p -> bc_capacity) ? ((container_p -> bc_capacity) << 1) : 4;
+							uint16 *values_p = (uint16 *) ReallocMemory (container_p -> bc_values_p, new_capacity * sizeof (uint16), (container_p -> bc_capacity) * sizeof (uint16));
+
+							if (!values_p)
+								{
+									return false;
+								}
+
+							container_p -> bc_values_p = values_p;
+							container_p -> bc_capacity = new_capacity;
+						}
+
+					value_p = (container_p -> bc_values_p) + index;
+					memmove (value_p + 1, value_p, ((container_p -> bc_cardinality) - index) * sizeof (uint16));
+					*value_p = value;
+					++ (container_p -> bc_cardinality);
+
+					return true;
+				}
+
+			if (!ConvertToWords (container_p))
+				{
+					return false;
+				}
+		}
+
+	index = value >> 6;
+
+	if (! ((* ((container_p -> bc_words_p) + index)) & (((uint64) 1) << (value & 63))))
+		{
+			* ((container_p -> bc_words_p) + index) |= ((uint64) 1) << (value & 63);
+			++ (container_p -> bc_cardinality);
+		}
+
+	return true;
+}
+
+
+static void RemoveFromContainer (BitmapContainer *container_p, const uint16 value)
+{
+	uint32 index;
+
+	if (container_p -> bc_words_p)
+		{
+			index = value >> 6;
+
+			if ((* ((container_p -> bc_words_p) + index)) & (((uint64) 1) << (value & 63)))
+				{
+					* ((container_p -> bc_words_p) + index) &= ~ (((uint64) 1) << (value & 63));
+					-- (container_p -> bc_cardinality);
+
+					/* If this fails, it can stay as a bitmap */
+					if (container_p -> bc_cardinality <= S_MAX_ARRAY_SIZE)
+						{
+							ConvertToArray (container_p);
+						}
+				}
+		}
+	else if (FindValue (container_p, value, &index))
+		{
+			uint16 *value_p = (container_p -> bc_values_p) + index;
+
+			-- (container_p -> bc_cardinality);
+			memmove (value_p, value_p + 1, ((container_p -> bc_cardinality) - index) * sizeof (uint16));
+		}
+}
+
+
+static bool ConvertToWords (BitmapContainer *container_p)
+{
+	uint64 *words_p = (uint64 *) AllocMemoryArray (S_NUM_WORDS, sizeof (uint64));
+
+	if (words_p)
+		{
+			GetContainerWords (container_p, words_p);
+
+			if (container_p -> bc_values_p)
+				{
+					FreeMemory (container_p -> bc_values_p);
+					container_p -> bc_values_p = NULL;
+				}
+
+			container_p -> bc_capacity = 0;
+			container_p -> bc_words_p = words_p;
+
+			return true;
+		}
+
+	return false;
+}
+
+
+static bool ConvertToArray (BitmapContainer *container_p)
+{
+	uint16 *values_p = (uint16 *) AllocMemoryArray (container_p -> bc_cardinality, sizeof (uint16));
+
+	if (values_p)
+		{
+			uint32 i;
+			uint32 k = 0;
+
+			for (i = 0; i < S_NUM_WORDS; ++ i)
+				{
+					uint64 word = * ((container_p -> bc_words_p) + i);
+
+					while (word)
+						{
+							const uint64 lowest = word & (~ word + 1);
+
+							* (values_p + (k ++)) = (uint16) ((i << 6) + CountBits (lowest - 1));
+							word ^= lowest;
+						}
+				}
+
+			FreeMemory (container_p -> bc_words_p);
+			container_p -> bc_words_p = NULL;
+			container_p -> bc_values_p = values_p;
+			container_p -> bc_capacity = container_p -> bc_cardinality;
+
+			return true;
+		}
+
+	return false;
+}
+
+
+static void GetContainerWords (const BitmapContainer *container_p, uint64 *words_p)
+{
+	if (container_p -> bc_words_p)
+		{
+			memcpy (words_p, container_p -> bc_words_p, S_NUM_WORDS * sizeof (uint64));
+		}
+	else
+		{
+			const uint16 *value_p = container_p -> bc_values_p;
+			uint32 i;
+
+			memset (words_p, 0, S_NUM_WORDS * sizeof (uint64));
+
+			for (i = container_p -> bc_cardinality; i > 0; -- i, ++ value_p)
+				{
+					* (words_p + ((*value_p) >> 6)) |= ((uint64) 1) << ((*value_p) & 63);
+				}
+		}
+}
+
+
+/*
+ * Take ownership of the words and store them in whichever
+ * form is the more compact for the number of values.
+ */
+static bool SetContainerFromWords (BitmapContainer *container_p, const uint16 key, uint64 *words_p)
+{
+	uint32 cardinality = 0;
+	uint32 i;
+
+	for (i = 0; i < S_NUM_WORDS; ++ i)
+		{
+			cardinality += CountBits (* (words_p + i));
+		}
+
+	container_p -> bc_key = key;
+	container_p -> bc_cardinality = cardinality;
+	container_p -> bc_values_p = NULL;
+	container_p -> bc_capacity = 0;
+	container_p -> bc_words_p = words_p;
+
+	if (cardinality == 0)
+		{
+			ClearContainer (container_p);
+		}
+	else if (cardinality <= S_MAX_ARRAY_SIZE)
+		{
+			if (!ConvertToArray (container_p))
+				{
+					ClearContainer (container_p);
+					return false;
+				}
+		}
+
+	return true;
+}
+
+
+static uint32 CountBits (uint64 word)
+{
+	word = word - ((word >> 1) & 0x5555555555555555ULL);
+	word = (word & 0x3333333333333333ULL) + ((word >> 2) & 0x3333333333333333ULL);
+	word = (word + (word >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+
+	return (uint32) ((word * 0x0101010101010101ULL) >> 56);
+}
@@ -5,8 +5,22 @@
  *      Author: billy
  */
 
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
 #define ALLOCATE_MARTI_ENTRY_TAGS (1)
 #include "marti_entry.h"
+#include "marti_search_cache.h"
+#include "marti_spatial_index.h"
+#include "marti_taxa_index.h"
+#include "marti_similarity_index.h"
+#include "marti_sample_list.h"
+#include "marti_entry_cache.h"
+#include "marti_taxonomy.h"
 #include "memory_allocations.h"
 #include "json_util.h"
 #include "mongodb_util.h"
@@ -21,12 +35,26 @@ static bool AddRealToJSONArray (json_t *array_p, const double64 value);
 
 static bool AddNonTrivialDateToJSON (json_t *json_p, const char * const key_s, const struct tm *date_p);
 
-static bool GetNonTrivialDateFromJSON (json_t *json_p, const char * const key_s, struct tm **time_pp);
+static bool AddNonTrivialDateStringToJSON (json_t *json_p, const char * const key_s, const struct tm *date_p);
+
+static bool GetNonTrivialDateFromJSON (const json_t *json_p, const char * const key_s, struct tm **time_pp);
+
+static struct tm *GetTimeFromMillis (const int64 millis);
+
+static uint32 *CopyTaxa (const uint32 *taxa_p, const size_t num_taxa);
+
+static bool AddNonTrivialTaxaToJSON (json_t *json_p, const char * const key_s, const uint32 *taxa_p, const size_t num_taxa);
+
+static uint32 *GetTaxaFromJSON (const json_t *taxa_json_p, size_t *num_taxa_p);
+
+static OperationStatus IndexSavedMartiEntry (MartiEntry *marti_p, json_t *marti_json_p, ServiceJob *job_p, MartiServiceData *data_p);
+
+static bool RunMartiEntryUpsert (MartiEntry *marti_p, const bson_t *doc_p, MartiServiceData *data_p);
 
 
 MartiEntry *AllocateMartiEntry (bson_oid_t *id_p, User *user_p, PermissionsGroup *permissions_group_p, const bool owns_user_flag,
 																const char *sample_name_s, const char *marti_id_s, const char *site_name_s,
-																const char *description_s, double64 latitude, double64 longitude, const struct tm *time_p, const char **taxa_ss,
+																const char *description_s, double64 latitude, double64 longitude, const struct tm *time_p, const uint32 *taxa_p,
 																const size_t num_taxa)
 {
 	if (marti_id_s)
@@ -53,9 +81,9 @@ MartiEntry *AllocateMartiEntry (bson_oid_t *id_p, User *user_p, PermissionsGroup
 
 													if ((description_s == NULL) || (copied_description_s = EasyCopyToNewString (description_s)))
 														{
-															char **copied_taxa_ss = NULL;
+															uint32 *copied_taxa_p = NULL;
 
-															if ((taxa_ss == NULL)|| (copied_taxa_ss = CopyStringArray (taxa_ss, num_taxa)))
+															if ((taxa_p == NULL) || (num_taxa == 0) || (copied_taxa_p = CopyTaxa (taxa_p, num_taxa)))
 																{
 																	bool alloc_perms_flag = false;
 
@@ -87,8 +115,9 @@ MartiEntry *AllocateMartiEntry (bson_oid_t *id_p, User *user_p, PermissionsGroup
 																					entry_p -> me_time_p = copied_start_p;
 																					entry_p -> me_site_name_s = copied_site_name_s;
 																					entry_p -> me_comments_s = copied_description_s;
-																					entry_p -> me_taxa_ss = copied_taxa_ss;
-																					entry_p -> me_num_taxa = num_taxa;
+																					entry_p -> me_taxa_p = copied_taxa_p;
+																					entry_p -> me_num_taxa = copied_taxa_p ? num_taxa : 0;
+																					entry_p -> me_taxa_ss = NULL;
 
 																					return entry_p;
 																				}
@@ -101,9 +130,9 @@ MartiEntry *AllocateMartiEntry (bson_oid_t *id_p, User *user_p, PermissionsGroup
 
 																		}
 
-																	if (copied_taxa_ss)
+																	if (copied_taxa_p)
 																		{
-																			FreeStringArray (copied_taxa_ss, num_taxa);
+																			FreeMemory (copied_taxa_p);
 																		}
 																}
 
@@ -187,6 +216,11 @@ void FreeMartiEntry (MartiEntry *marti_p)
 			FreeTime (marti_p -> me_time_p);
 		}
 
+	if (marti_p -> me_taxa_p)
+		{
+			FreeMemory (marti_p -> me_taxa_p);
+		}
+
 	if (marti_p -> me_taxa_ss)
 		{
 			FreeStringArray (marti_p -> me_taxa_ss, marti_p -> me_num_taxa);
@@ -196,6 +230,30 @@ void FreeMartiEntry (MartiEntry *marti_p)
 }
 
 
+MartiEntry *CopyMartiEntry (const MartiEntry *src_p)
+{
+	MartiEntry *dest_p = NULL;
+	bson_oid_t *id_p = GetNewUnitialisedBSONOid ();
+
+	if (id_p)
+		{
+			bson_oid_copy (src_p -> me_id_p, id_p);
+
+			dest_p = AllocateMartiEntry (id_p, src_p -> me_user_p, NULL, false, src_p -> me_sample_name_s, src_p -> me_marti_id_s,
+																	 src_p -> me_site_name_s, src_p -> me_comments_s, src_p -> me_latitude, src_p -> me_longitude, src_p -> me_time_p,
+																	 src_p -> me_taxa_p, src_p -> me_num_taxa);
+
+			if (!dest_p)
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to copy MARTi Entry \"%s\"", src_p -> me_marti_id_s);
+					FreeBSONOid (id_p);
+				}
+		}
+
+	return dest_p;
+}
+
+
 json_t *GetMartiEntryAsJSON (const MartiEntry *me_p, MartiServiceData *data_p)
 {
 	json_t *marti_json_p = json_object ();
@@ -212,7 +270,7 @@ json_t *GetMartiEntryAsJSON (const MartiEntry *me_p, MartiServiceData *data_p)
 										{
 											if (SetNonTrivialString (marti_json_p, ME_DESCRIPTION_S, me_p -> me_comments_s, true))
 												{
-													if (SetNonTrivialArrayOfStrings (marti_json_p, ME_TAXA_S, me_p -> me_taxa_ss, me_p -> me_num_taxa, true))
+													if (AddNonTrivialTaxaToJSON (marti_json_p, ME_TAXA_S, me_p -> me_taxa_p, me_p -> me_num_taxa))
 														{
 															/*
 															 * We're storing the location as a GeoJSON Point to allow for
@@ -242,7 +300,7 @@ json_t *GetMartiEntryAsJSON (const MartiEntry *me_p, MartiServiceData *data_p)
 																												{
 																													if (AddNonTrivialDateToJSON (marti_json_p, ME_START_DATE_S, me_p -> me_time_p))
 																														{
-																															if (SetJSONString (marti_json_p, INDEXING_TYPE_S, "Grassroots:MARTiSample"))
+																															if (SetJSONString (marti_json_p, INDEXING_TYPE_S, ME_INDEXING_TYPE_S))
 																																{
 																																	if (SetJSONString (marti_json_p, INDEXING_TYPE_DESCRIPTION_S, "MARTi Sample"))
 																																		{
@@ -267,7 +325,7 @@ json_t *GetMartiEntryAsJSON (const MartiEntry *me_p, MartiServiceData *data_p)
 																		}
 
 																}
-														}		/* if (SetNonTrivialArray (marti_json_p, ME_TAXA_S, me_p -> me_comments_s, true)) */
+														}		/* if (AddNonTrivialTaxaToJSON (marti_json_p, ME_TAXA_S, me_p -> me_taxa_p, me_p -> me_num_taxa)) */
 
 
 												}
@@ -331,63 +389,30 @@ MartiEntry *GetMartiEntryFromJSON (const json_t *json_p, const MartiServiceData
 																				{
 																					const char *site_name_s = GetJSONString (json_p, ME_SITE_NAME_S);
 																					const char *description_s = GetJSONString (json_p, ME_DESCRIPTION_S);
-																					const json_t *taxa_p = json_object_get (json_p, ME_TAXA_S);
+																					const json_t *taxa_json_p = json_object_get (json_p, ME_TAXA_S);
 
 																					User *user_p = NULL;
 																					PermissionsGroup *permissions_group_p = NULL;
 																					size_t num_taxa = 0;
-																					const char **taxa_ss = NULL;
+																					uint32 *taxa_p = NULL;
 
 
-																					if (taxa_p)
+																					if (json_is_array (taxa_json_p))
 																						{
-																							if (json_is_array (taxa_p))
-																								{
-																									num_taxa = json_array_size (taxa_p);
-
-																									taxa_ss = (const char **) AllocMemoryArray (num_taxa, sizeof (const char *));
-
-																									if (taxa_ss)
-																										{
-																											size_t i;
-																											const char **value_ss = taxa_ss;
-
-																											for (i = 0; i < num_taxa; ++ i, ++ value_ss)
-																												{
-																													entry_p = json_array_get (taxa_p, i);
-
-																													if (json_is_string (entry_p))
-																														{
-																															*value_ss = json_string_value (entry_p);
-																														}
-																													else if (json_is_null (entry_p))
-																														{
-																															*value_ss = NULL;
-																														}
-
-																												}
-
-																										}
-																									else
-																										{
-
-																										}
-
-
-																								}
+																							taxa_p = GetTaxaFromJSON (taxa_json_p, &num_taxa);
 																						}
 
 																					marti_p = AllocateMartiEntry (id_p, user_p, permissions_group_p, true, name_s, marti_id_s, site_name_s,
-																																				description_s, latitude, longitude, start_p, taxa_ss, num_taxa);
+																																				description_s, latitude, longitude, start_p, taxa_p, num_taxa);
 
 																					if (start_p)
 																						{
 																							FreeTime (start_p);
 																						}
 
-																					if (taxa_ss)
+																					if (taxa_p)
 																						{
-																							FreeMemory (taxa_ss);
+																							FreeMemory (taxa_p);
 																						}
 																				}
 																		}
@@ -429,36 +454,115 @@ static bool AddRealToJSONArray (json_t *array_p, const double64 value)
 }
 
 
+/*
+ * Store the date as an extended JSON date, i.e.
+ *
+ *	{ "$date": { "$numberLong": "<milliseconds since the epoch>" } }
+ *
+ * so that when it is converted to BSON it becomes a native Date rather
+ * than a string. This means that date ranges are compared numerically
+ * and can be used in the compound location and date index.
+ */
 static bool AddNonTrivialDateToJSON (json_t *json_p, const char * const key_s, const struct tm *date_p)
 {
 	if (date_p)
 		{
-			char *time_s = GetTimeAsString (date_p, true, NULL);
+			struct tm t = *date_p;
+			const int64 millis = ((int64) timegm (&t)) * 1000;
+			char millis_s [32];
+			json_t *date_json_p;
 
-			if (time_s)
+			snprintf (millis_s, sizeof (millis_s), "%" PRId64, millis);
+
+			date_json_p = json_pack ("{s:{s:s}}", "$date", "$numberLong", millis_s);
+
+			if (date_json_p)
 				{
-					if (SetJSONString (json_p, key_s, time_s))
+					if (json_object_set_new (json_p, key_s, date_json_p) == 0)
 						{
 							return true;
 						}
 
+					json_decref (date_json_p);
+				}
+		}
+
+	return false;
+}
+
+
+/*
+ * The search index and clients want the date as
+ * plain text rather than as an extended JSON date.
+ */
+static bool AddNonTrivialDateStringToJSON (json_t *json_p, const char * const key_s, const struct tm *date_p)
+{
+	bool success_flag = false;
+
+	if (date_p)
+		{
+			char *time_s = GetTimeAsString (date_p, true, NULL);
+
+			if (time_s)
+				{
+					success_flag = SetJSONString (json_p, key_s, time_s);
+
 					FreeTimeString (time_s);
 				}
 
 		}
 
-	return false;
+	return success_flag;
 }
 
 
-static bool GetNonTrivialDateFromJSON (json_t *json_p, const char * const key_s, struct tm **time_pp)
+/*
+ * Get a date which can either be a string, from before the dates were
+ * stored as BSON Dates, or an extended JSON date in any of the forms
+ * that the mongo driver produces:
+ *
+ *	{ "$date": <milliseconds> }
+ *	{ "$date": "<ISO-8601 date>" }
+ *	{ "$date": { "$numberLong": "<milliseconds>" } }
+ */
+static bool GetNonTrivialDateFromJSON (const json_t *json_p, const char * const key_s, struct tm **time_pp)
 {
 	bool success_flag = false;
-	const char *time_s = GetJSONString (json_p, key_s);
+	const json_t *value_p = json_object_get (json_p, key_s);
+
+	if (json_is_object (value_p))
+		{
+			value_p = json_object_get (value_p, "$date");
+
+			if (json_is_object (value_p))
+				{
+					value_p = json_object_get (value_p, "$numberLong");
+
+					if (json_is_string (value_p))
+						{
+							*time_pp = GetTimeFromMillis ((int64) strtoll (json_string_value (value_p), NULL, 10));
+						}
+				}
+			else if (json_is_integer (value_p))
+				{
+					*time_pp = GetTimeFromMillis ((int64) json_integer_value (value_p));
+				}
+			else if (json_is_string (value_p))
+				{
+					/* Drop any fractional seconds and time zone, "YYYY-MM-DDTHH:MM:SS" */
+					char time_s [20];
 
-	if (time_s)
+					strncpy (time_s, json_string_value (value_p), sizeof (time_s) - 1);
+					time_s [sizeof (time_s) - 1] = '\0';
+
+					*time_pp = GetTimeFromString (time_s);
+				}
+
+			success_flag = (*time_pp != NULL);
+		}
+	else if (json_is_string (value_p))
 		{
-			struct tm *time_p = GetTimeFromString (time_s);
+			struct tm *time_p = GetTimeFromString (json_string_value (value_p));
 
 			if (time_p)
 				{
@@ -476,6 +580,20 @@ static bool GetNonTrivialDateFromJSON (json_t *json_p, const char * const key_s,
 }
 
 
+static struct tm *GetTimeFromMillis (const int64 millis)
+{
+	const time_t secs = (time_t) (millis / 1000);
+	struct tm t;
+
+	if (gmtime_r (&secs, &t))
+		{
+			return DuplicateTime (&t);
+		}
+
+	return NULL;
+}
+
+
 
 OperationStatus SaveMartiEntry (MartiEntry *marti_p, ServiceJob *job_p, MartiServiceData *data_p)
 {
@@ -489,69 +607,738 @@ OperationStatus SaveMartiEntry (MartiEntry *marti_p, ServiceJob *job_p, MartiSer
 
 			if (marti_json_p)
 				{
+					if (!AddMartiEntryTaxaPreorderToJSON (marti_json_p, marti_p))
+						{
+							PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to add taxonomy numbers for MARTi Entry \"%s\"", marti_p -> me_marti_id_s);
+						}
+
 					if (SaveMongoDataWithTimestamp (data_p -> msd_mongo_p, marti_json_p, data_p -> msd_collection_s,
 																					selector_p, MONGO_TIMESTAMP_S))
 						{
-							if (data_p -> msd_api_url_s)
+							status = IndexSavedMartiEntry (marti_p, marti_json_p, job_p, data_p);
+						}
+
+					json_decref (marti_json_p);
+				}		/* if (marti_json_p) */
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to get MARTi Entry \"%s\" as JSON", marti_p -> me_sample_name_s);
+					success_flag = false;
+				}
+
+		}		/* if (location_p -> lo_id_p) */
+
+	SetServiceJobStatus (job_p, status);
+
+	return status;
+}
+
+
+OperationStatus UpsertMartiEntryByMartiId (MartiEntry *marti_p, ServiceJob *job_p, MartiServiceData *data_p)
+{
+	OperationStatus status = OS_FAILED;
+
+	/* This is the id that will be used if there is no existing entry */
+	if (! (marti_p -> me_id_p))
+		{
+			marti_p -> me_id_p = GetNewBSONOid ();
+		}
+
+	if (marti_p -> me_id_p)
+		{
+			json_t *marti_json_p = GetMartiEntryAsJSON (marti_p, data_p);
+
+			if (marti_json_p)
+				{
+					bson_t *doc_p = NULL;
+
+					if (!AddMartiEntryTaxaPreorderToJSON (marti_json_p, marti_p))
+						{
+							PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to add taxonomy numbers for MARTi Entry \"%s\"", marti_p -> me_marti_id_s);
+						}
+
+					if ((doc_p = ConvertJSONToBSON (marti_json_p)) != NULL)
+						{
+							if (RunMartiEntryUpsert (marti_p, doc_p, data_p))
+								{
+									/*
+									 * If the entry already existed, marti_p now has its
+									 * id so get the JSON again for the search index.
+									 */
+									json_decref (marti_json_p);
+
+									if ((marti_json_p = GetMartiEntryAsJSON (marti_p, data_p)) != NULL)
+										{
+											status = IndexSavedMartiEntry (marti_p, marti_json_p, job_p, data_p);
+										}
+									else
+										{
+											PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to get MARTi Entry \"%s\" as JSON for indexing", marti_p -> me_marti_id_s);
+											status = OS_PARTIALLY_SUCCEEDED;
+										}
+								}
+
+							bson_destroy (doc_p);
+						}
+					else
+						{
+							PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, marti_json_p, "Failed to convert MARTi Entry \"%s\" to BSON", marti_p -> me_marti_id_s);
+						}
+
+					if (marti_json_p)
+						{
+							json_decref (marti_json_p);
+						}
+				}		/* if (marti_json_p) */
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to get MARTi Entry \"%s\" as JSON", marti_p -> me_marti_id_s);
+				}
+
+		}		/* if (marti_p -> me_id_p) */
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate id for MARTi Entry \"%s\"", marti_p -> me_marti_id_s);
+		}
+
+	SetServiceJobStatus (job_p, status);
+
+	return status;
+}
+
+
+void UpdateMartiIndexesForEntry (const MartiEntry *marti_p)
+{
+	if (!UpdateMartiSpatialIndex (marti_p -> me_id_p, marti_p -> me_latitude, marti_p -> me_longitude, marti_p -> me_time_p))
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to add MARTi Entry \"%s\" to the spatial index", marti_p -> me_marti_id_s);
+		}
+
+	if (!UpdateMartiTaxaIndex (marti_p -> me_id_p, marti_p -> me_taxa_p, marti_p -> me_num_taxa))
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to add MARTi Entry \"%s\" to the taxa index", marti_p -> me_marti_id_s);
+		}
+
+	if (!UpdateMartiSimilarityIndex (marti_p -> me_id_p, marti_p -> me_taxa_p, marti_p -> me_num_taxa, marti_p -> me_latitude, marti_p -> me_longitude, marti_p -> me_time_p))
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to add MARTi Entry \"%s\" to the similarity index", marti_p -> me_marti_id_s);
+		}
+
+	/* Keep the "Load Sample" list up to date in case this is a new sample or its name has changed */
+	UpdateMartiSampleList (marti_p -> me_id_p, marti_p -> me_sample_name_s);
+}
+
+
+bool PrepareMartiEntryJSONForIndexing (json_t *marti_json_p, const MartiEntry *marti_p, const MartiServiceData *data_p)
+{
+	bool success_flag = true;
+
+	/* The search index doesn't need the taxonomy numbers */
+	json_object_del (marti_json_p, ME_TAXA_PREORDER_S);
+	json_object_del (marti_json_p, ME_TAXA_PREORDER_VERSION_S);
+
+	if (!AddNonTrivialDateStringToJSON (marti_json_p, ME_START_DATE_S, marti_p -> me_time_p))
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to set date as text for indexing MARTi Entry \"%s\"", marti_p -> me_marti_id_s);
+		}
+
+	if (data_p -> msd_api_url_s)
+		{
+			char *url_s = ConcatenateStrings (data_p -> msd_api_url_s, marti_p -> me_marti_id_s);
+
+			success_flag = false;
+
+			if (url_s)
+				{
+					if (SetJSONString (marti_json_p, CONTEXT_PREFIX_SCHEMA_ORG_S "url", url_s))
+						{
+							json_t *provider_p = json_object_get (data_p -> msd_base_data.sd_config_p, SERVER_PROVIDER_S);
+
+							success_flag = true;
+
+							if (provider_p)
+								{
+									if (json_object_set (marti_json_p, SERVER_PROVIDER_S, provider_p) != 0)
+										{
+											PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, marti_json_p, "Failed to add provider");
+											success_flag = false;
+										}
+								}
+						}
+
+					FreeCopiedString (url_s);
+				}
+		}
+
+	return success_flag;
+}
+
+
+
+bool GetMartiEntryCoordinatesFromBSON (const bson_t *doc_p, double64 *latitude_p, double64 *longitude_p)
+{
+	bson_iter_t iter;
+
+	if (bson_iter_init (&iter, doc_p))
+		{
+			char *key_s = ConcatenateVarargsStrings (ME_LOCATION_S, ".", ME_COORDINATES_S, NULL);
+
+			if (key_s)
+				{
+					bool success_flag = false;
+					bson_iter_t coords_iter;
+
+					if (bson_iter_find_descendant (&iter, key_s, &coords_iter) && BSON_ITER_HOLDS_ARRAY (&coords_iter))
+						{
+							bson_iter_t value_iter;
+
+							/*
+							 * For GeoJSON objects, the longitude comes first
+							 */
+							if (bson_iter_recurse (&coords_iter, &value_iter))
+								{
+									if (bson_iter_next (&value_iter) && BSON_ITER_HOLDS_NUMBER (&value_iter))
+										{
+											const double64 longitude = bson_iter_as_double (&value_iter);
+
+											if (bson_iter_next (&value_iter) && BSON_ITER_HOLDS_NUMBER (&value_iter))
+												{
+													*latitude_p = bson_iter_as_double (&value_iter);
+													*longitude_p = longitude;
+													success_flag = true;
+												}
+										}
+								}
+						}
+
+					FreeCopiedString (key_s);
+
+					return success_flag;
+				}
+		}
+
+	return false;
+}
+
+
+bool GetMartiEntryTimeFromBSON (const bson_t *doc_p, int64 *time_p)
+{
+	bool success_flag = false;
+	bson_iter_t iter;
+
+	if (bson_iter_init_find (&iter, doc_p, ME_START_DATE_S))
+		{
+			if (BSON_ITER_HOLDS_DATE_TIME (&iter))
+				{
+					*time_p = bson_iter_date_time (&iter) / 1000;
+					success_flag = true;
+				}
+			else if (BSON_ITER_HOLDS_UTF8 (&iter))
+				{
+					/* from before the dates were stored as BSON Dates */
+					struct tm *tm_p = GetTimeFromString (bson_iter_utf8 (&iter, NULL));
+
+					if (tm_p)
+						{
+							*time_p = (int64) timegm (tm_p);
+							success_flag = true;
+
+							FreeTime (tm_p);
+						}
+				}
+		}
+
+	return success_flag;
+}
+
+
+uint32 *GetMartiEntryTaxaFromBSON (const bson_t *doc_p, size_t *num_taxa_p)
+{
+	uint32 *taxa_p = NULL;
+	bson_iter_t iter;
+
+	*num_taxa_p = 0;
+
+	if (bson_iter_init_find (&iter, doc_p, ME_TAXA_S) && BSON_ITER_HOLDS_ARRAY (&iter))
+		{
+			bson_iter_t value_iter;
+
+			if (bson_iter_recurse (&iter, &value_iter))
+				{
+					size_t num_taxa = 0;
+					size_t capacity = 0;
+
+					while (bson_iter_next (&value_iter))
+						{
+							uint32 taxon;
+							bool valid_flag = false;
+
+							if (BSON_ITER_HOLDS_INT32 (&value_iter) || BSON_ITER_HOLDS_INT64 (&value_iter))
+								{
+									const int64 value = bson_iter_as_int64 (&value_iter);
+
+									if ((value >= 0) && (value <= INT32_MAX))
+										{
+											taxon = (uint32) value;
+											valid_flag = true;
+										}
+								}
+							else if (BSON_ITER_HOLDS_UTF8 (&value_iter))
 								{
-									char *url_s = ConcatenateStrings (data_p -> msd_api_url_s, marti_p -> me_marti_id_s);
+									valid_flag = GetMartiTaxonIdFromString (bson_iter_utf8 (&value_iter, NULL), &taxon);
+								}
 
-									if (url_s)
+							if (valid_flag)
+								{
+									if (num_taxa == capacity)
 										{
-											if (SetJSONString (marti_json_p, CONTEXT_PREFIX_SCHEMA_ORG_S "url", url_s))
+											const size_t new_capacity = capacity ? (capacity << 1) : 16;
+											uint32 *new_taxa_p = (uint32 *) ReallocMemory (taxa_p, new_capacity * sizeof (uint32), capacity * sizeof (uint32));
+
+											if (!new_taxa_p)
 												{
-													json_t *provider_p = json_object_get (data_p -> msd_base_data.sd_config_p, SERVER_PROVIDER_S);
+													PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, doc_p, "Failed to allocate space for " SIZET_FMT " taxa", new_capacity);
 
-													if (provider_p)
+													if (taxa_p)
 														{
-															if (json_object_set (marti_json_p, SERVER_PROVIDER_S, provider_p) != 0)
-																{
-																	PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, marti_json_p, "Failed to add provider");
-																	success_flag = false;
-																}
+															FreeMemory (taxa_p);
 														}
-												}
-											else
-												{
 
-													success_flag = false;
+													return NULL;
 												}
+
+											taxa_p = new_taxa_p;
+											capacity = new_capacity;
+										}
+
+									* (taxa_p + num_taxa) = taxon;
+									++ num_taxa;
+								}
+						}
+
+					*num_taxa_p = num_taxa;
+				}
+		}
+
+	return taxa_p;
+}
+
+char **GetMartiEntryTaxaAsStrings (MartiEntry *entry_p)
+{
+	if ((! (entry_p -> me_taxa_ss)) && (entry_p -> me_num_taxa > 0))
+		{
+			char **taxa_ss = (char **) AllocMemoryArray (entry_p -> me_num_taxa, sizeof (char *));
+
+			if (taxa_ss)
+				{
+					size_t i;
+					bool success_flag = true;
+
+					for (i = 0; (i < entry_p -> me_num_taxa) && success_flag; ++ i)
+						{
+							char *taxon_s = ConvertUnsignedIntegerToString (* ((entry_p -> me_taxa_p) + i));
+
+							if (taxon_s)
+								{
+									* (taxa_ss + i) = taxon_s;
+								}
+							else
+								{
+									success_flag = false;
+								}
+						}
+
+					if (success_flag)
+						{
+							entry_p -> me_taxa_ss = taxa_ss;
+						}
+					else
+						{
+							FreeStringArray (taxa_ss, i - 1);
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to convert " SIZET_FMT " taxa to strings for \"%s\"", entry_p -> me_num_taxa, entry_p -> me_marti_id_s);
+						}
+				}
+		}
+
+	return entry_p -> me_taxa_ss;
+}
+
+
+bool GetMartiTaxonIdFromString (const char *taxon_s, uint32 *taxon_p)
+{
+	if (!IsStringEmpty (taxon_s))
+		{
+			char *end_s = NULL;
+			unsigned long value;
+
+			errno = 0;
+			value = strtoul (taxon_s, &end_s, 10);
+
+			/* The taxa are stored as 32-bit signed integers */
+			if ((errno == 0) && (end_s != taxon_s) && (*end_s == '\0') && (*taxon_s != '-') && (value <= INT32_MAX))
+				{
+					*taxon_p = (uint32) value;
+					return true;
+				}
+		}
+
+	return false;
+}
+
+
+uint32 *GetMartiTaxonIdsFromStrings (const char **taxa_ss, const size_t num_taxa, size_t *num_ids_p)
+{
+	uint32 *taxa_p = NULL;
+
+	*num_ids_p = 0;
+
+	if (num_taxa > 0)
+		{
+			taxa_p = (uint32 *) AllocMemoryArray (num_taxa, sizeof (uint32));
+
+			if (taxa_p)
+				{
+					size_t i;
+					size_t j = 0;
+
+					for (i = 0; i < num_taxa; ++ i, ++ taxa_ss)
+						{
+							if (!IsStringEmpty (*taxa_ss))
+								{
+									if (GetMartiTaxonIdFromString (*taxa_ss, taxa_p + j))
+										{
+											++ j;
 										}
 									else
 										{
-											success_flag = false;
+											PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Invalid taxonomy id \"%s\"", *taxa_ss);
+											FreeMemory (taxa_p);
+											return NULL;
 										}
 								}
+						}
+
+					if (j > 0)
+						{
+							*num_ids_p = j;
+						}
+					else
+						{
+							FreeMemory (taxa_p);
+							taxa_p = NULL;
+						}
+				}
+		}
+
+	return taxa_p;
+}
 
-							if (success_flag)
+
+static uint32 *CopyTaxa (const uint32 *taxa_p, const size_t num_taxa)
+{
+	uint32 *copied_taxa_p = (uint32 *) AllocMemoryArray (num_taxa, sizeof (uint32));
+
+	if (copied_taxa_p)
+		{
+			memcpy (copied_taxa_p, taxa_p, num_taxa * sizeof (uint32));
+		}
+
+	return copied_taxa_p;
+}
+
+
+/*
+ * The taxa are stored as integers, which the mongo driver
+ * converts to 32-bit BSON integers, rather than strings.
+ */
+static bool AddNonTrivialTaxaToJSON (json_t *json_p, const char * const key_s, const uint32 *taxa_p, const size_t num_taxa)
+{
+	bool success_flag = true;
+
+	if (num_taxa > 0)
+		{
+			json_t *taxa_json_p = json_array ();
+
+			success_flag = false;
+
+			if (taxa_json_p)
+				{
+					size_t i;
+
+					success_flag = true;
+
+					for (i = 0; (i < num_taxa) && success_flag; ++ i, ++ taxa_p)
+						{
+							success_flag = (json_array_append_new (taxa_json_p, json_integer ((json_int_t) *taxa_p)) == 0);
+						}
+
+					if (success_flag)
+						{
+							success_flag = (json_object_set_new (json_p, key_s, taxa_json_p) == 0);
+						}
+					else
+						{
+							json_decref (taxa_json_p);
+						}
+				}
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * The taxa can either be integers or, for samples that were saved
+ * before the taxa were stored as integers, strings. Any values that
+ * aren't valid taxonomy ids are skipped.
+ */
+static uint32 *GetTaxaFromJSON (const json_t *taxa_json_p, size_t *num_taxa_p)
+{
+	const size_t size = json_array_size (taxa_json_p);
+	uint32 *taxa_p = NULL;
+
+	*num_taxa_p = 0;
+
+	if (size > 0)
+		{
+			taxa_p = (uint32 *) AllocMemoryArray (size, sizeof (uint32));
+
+			if (taxa_p)
+				{
+					size_t i;
+					size_t j = 0;
+
+					for (i = 0; i < size; ++ i)
+						{
+							const json_t *value_p = json_array_get (taxa_json_p, i);
+
+							if (json_is_integer (value_p))
 								{
-									if (IndexData (job_p, marti_json_p, NULL))
+									const json_int_t value = json_integer_value (value_p);
+
+									if ((value >= 0) && (value <= INT32_MAX))
 										{
-											status = OS_SUCCEEDED;
+											* (taxa_p + j) = (uint32) value;
+											++ j;
 										}
-									else
+								}
+							else if (json_is_string (value_p))
+								{
+									if (GetMartiTaxonIdFromString (json_string_value (value_p), taxa_p + j))
 										{
-											status = OS_PARTIALLY_SUCCEEDED;
+											++ j;
 										}
 								}
-							else
+						}
+
+					if (j > 0)
+						{
+							*num_taxa_p = j;
+						}
+					else
+						{
+							FreeMemory (taxa_p);
+							taxa_p = NULL;
+						}
+				}
+		}
+
+	return taxa_p;
+}
+
+
+/*
+ * Store the pre-order number of each of the sample's taxa from the
+ * taxonomy tree so that a search for everything under a taxon can
+ * be a range query on these numbers. Any taxa that aren't in the
+ * tree are skipped and nothing is added if the tree isn't loaded.
+ * A sample without any taxa still gets an empty array so that an
+ * update replaces the numbers of any taxa that it used to have.
+ */
+bool AddMartiEntryTaxaPreorderToJSON (json_t *json_p, const MartiEntry *marti_p)
+{
+	bool success_flag = true;
+	const char *version_s = GetMartiTaxonomyVersion ();
+
+	if (version_s)
+		{
+			json_t *numbers_p = json_array ();
+
+			success_flag = false;
+
+			if (numbers_p)
+				{
+					const uint32 *taxon_p = marti_p -> me_taxa_p;
+					size_t i;
+
+					success_flag = true;
+
+					for (i = marti_p -> me_num_taxa; (i > 0) && success_flag; -- i, ++ taxon_p)
+						{
+							uint32 first;
+							uint32 last;
+
+							if (GetMartiTaxonInterval (*taxon_p, &first, &last))
 								{
-									status = OS_PARTIALLY_SUCCEEDED;
+									success_flag = (json_array_append_new (numbers_p, json_integer ((json_int_t) first)) == 0);
 								}
 						}
 
-					json_decref (marti_json_p);
-				}		/* if (marti_json_p) */
-			else
-				{
-					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to get MARTi Entry \"%s\" as JSON", marti_p -> me_sample_name_s);
-					success_flag = false;
+					if (success_flag)
+						{
+							if (json_object_set_new (json_p, ME_TAXA_PREORDER_S, numbers_p) == 0)
+								{
+									success_flag = SetJSONString (json_p, ME_TAXA_PREORDER_VERSION_S, version_s);
+								}
+							else
+								{
+									success_flag = false;
+								}
+						}
+					else
+						{
+							json_decref (numbers_p);
+						}
 				}
+		}
 
-		}		/* if (location_p -> lo_id_p) */
+	return success_flag;
+}
 
-	SetServiceJobStatus (job_p, status);
+
+/*
+ * Once an entry has been written to the database, update everything
+ * else that depends upon it and add it to the search index.
+ */
+static OperationStatus IndexSavedMartiEntry (MartiEntry *marti_p, json_t *marti_json_p, ServiceJob *job_p, MartiServiceData *data_p)
+{
+	OperationStatus status = OS_PARTIALLY_SUCCEEDED;
+
+	/*
+	 * Any cached search results, and any cached
+	 * copy of this entry, might now be out of date
+	 */
+	InvalidateMartiSearchCache ();
+	RemoveCachedMartiEntry (marti_p -> me_id_p);
+
+	UpdateMartiIndexesForEntry (marti_p);
+
+	if (PrepareMartiEntryJSONForIndexing (marti_json_p, marti_p, data_p))
+		{
+			if (IndexData (job_p, marti_json_p, NULL))
+				{
+					status = OS_SUCCEEDED;
+				}
+		}
 
 	return status;
 }
 
+
+/*
+ * Insert or update the entry with the given MARTi id in a single
+ * findAndModify. The document's _id is only set when it is inserted
+ * and the id of the stored document is copied back into marti_p.
+ */
+static bool RunMartiEntryUpsert (MartiEntry *marti_p, const bson_t *doc_p, MartiServiceData *data_p)
+{
+	bool success_flag = false;
+	bson_t *set_p = bson_new ();
+
+	if (set_p)
+		{
+			bson_copy_to_excluding_noinit (doc_p, set_p, MONGO_ID_S, NULL);
+
+			if (BSON_APPEND_DATE_TIME (set_p, MONGO_TIMESTAMP_S, ((int64) time (NULL)) * 1000))
+				{
+					bson_t *update_p = BCON_NEW ("$set", BCON_DOCUMENT (set_p),
+																			 "$setOnInsert", "{", MONGO_ID_S, BCON_OID (marti_p -> me_id_p), "}");
+
+					if (update_p)
+						{
+							bson_t *query_p = BCON_NEW (ME_MARTI_ID_S, BCON_UTF8 (marti_p -> me_marti_id_s));
+
+							if (query_p)
+								{
+									mongoc_find_and_modify_opts_t *opts_p = mongoc_find_and_modify_opts_new ();
+
+									if (opts_p)
+										{
+											bson_t *fields_p = BCON_NEW (MONGO_ID_S, BCON_INT32 (1));
+
+											if (fields_p)
+												{
+													if (mongoc_find_and_modify_opts_set_update (opts_p, update_p) &&
+															mongoc_find_and_modify_opts_set_flags (opts_p, MONGOC_FIND_AND_MODIFY_UPSERT | MONGOC_FIND_AND_MODIFY_RETURN_NEW) &&
+															mongoc_find_and_modify_opts_set_fields (opts_p, fields_p))
+														{
+															bson_t reply;
+															uint32 attempt = 0;
+															bool retry_flag = false;
+
+															/*
+															 * If two upserts for the same MARTi id run at once, both can try to
+															 * insert and the unique index rejects one of them. By then the
+															 * document exists so trying again will update it instead.
+															 */
+															do
+																{
+																	bson_error_t error;
+
+																	memset (&error, 0, sizeof (error));
+																	retry_flag = false;
+
+																	success_flag = mongoc_collection_find_and_modify_with_opts (data_p -> msd_mongo_p -> mt_collection_p, query_p, opts_p, &reply, &error);
+
+																	if (success_flag)
+																		{
+																			bson_iter_t iter;
+																			bson_iter_t id_iter;
+
+																			if (bson_iter_init_find (&iter, &reply, "value") && BSON_ITER_HOLDS_DOCUMENT (&iter) &&
+																					bson_iter_recurse (&iter, &id_iter) && bson_iter_find (&id_iter, MONGO_ID_S) && BSON_ITER_HOLDS_OID (&id_iter))
+																				{
+																					bson_oid_copy (bson_iter_oid (&id_iter), marti_p -> me_id_p);
+																				}
+																			else
+																				{
+																					PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, &reply, "Failed to get id of upserted MARTi Entry \"%s\"", marti_p -> me_marti_id_s);
+																					success_flag = false;
+																				}
+																		}
+																	else
+																		{
+																			/* Only a failed call sets the error, so only it can be retried */
+																			retry_flag = (error.code == 11000);
+
+																			PrintErrors (retry_flag ? STM_LEVEL_WARNING : STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to upsert MARTi Entry \"%s\": \"%s\"", marti_p -> me_marti_id_s, error.message);
+																		}
+
+																	bson_destroy (&reply);
+																	++ attempt;
+																}
+															while (retry_flag && (attempt < 2));
+														}
+													else
+														{
+															PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to set up upsert of MARTi Entry \"%s\"", marti_p -> me_marti_id_s);
+														}
+
+													bson_destroy (fields_p);
+												}		/* if (fields_p) */
+
+											mongoc_find_and_modify_opts_destroy (opts_p);
+										}		/* if (opts_p) */
+
+									bson_destroy (query_p);
+								}		/* if (query_p) */
+
+							bson_destroy (update_p);
+						}		/* if (update_p) */
+				}
+
+			bson_destroy (set_p);
+		}		/* if (set_p) */
+
+	return success_flag;
+}
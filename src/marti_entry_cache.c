@@ -0,0 +1,514 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * marti_entry_cache.c
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "marti_entry_cache.h"
+#include "marti_oid_table.h"
+
+#include "memory_allocations.h"
+#include "json_util.h"
+#include "streams.h"
+
+
+/*
+ * A cached MartiEntry. The nodes in use are kept in a list with the
+ * most recently used one at the head and the unused ones are kept
+ * on a separate free list.
+ */
+typedef struct MartiEntryCacheNode
+{
+	MartiEntry *mecn_entry_p;
+
+	time_t mecn_expiry_time;
+
+	struct MartiEntryCacheNode *mecn_prev_p;
+
+	struct MartiEntryCacheNode *mecn_next_p;
+} MartiEntryCacheNode;
+
+
+typedef struct MartiEntryCache
+{
+	/* All of the nodes, allocated in one go */
+	MartiEntryCacheNode *mec_nodes_p;
+
+	/* Maps each cached entry's id to the position of its node */
+	MartiOidTable *mec_table_p;
+
+	MartiEntryCacheNode *mec_head_p;
+
+	MartiEntryCacheNode *mec_tail_p;
+
+	MartiEntryCacheNode *mec_free_p;
+
+	size_t mec_num_entries;
+
+	size_t mec_max_num_entries;
+
+	uint32 mec_ttl;
+
+	uint32 mec_generation;
+
+	uint64 mec_num_hits;
+
+	uint64 mec_num_misses;
+
+	pthread_mutex_t mec_mutex;
+} MartiEntryCache;
+
+
+static const size_t S_DEFAULT_CACHE_SIZE = 256;
+
+static const uint32 S_DEFAULT_CACHE_TTL = 60;
+
+
+static MartiEntryCache *s_cache_p = NULL;
+
+static pthread_mutex_t s_init_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static MartiEntryCache *AllocateMartiEntryCache (const size_t max_num_entries, const uint32 ttl);
+
+static MartiEntryCacheNode *FindCacheNode (MartiEntryCache *cache_p, const bson_oid_t *id_p);
+
+static MartiEntry *UseCacheNode (MartiEntryCache *cache_p, MartiEntryCacheNode *node_p);
+
+static void UnlinkCacheNode (MartiEntryCache *cache_p, MartiEntryCacheNode *node_p);
+
+static void PushCacheNode (MartiEntryCache *cache_p, MartiEntryCacheNode *node_p);
+
+static void RemoveCacheNode (MartiEntryCache *cache_p, MartiEntryCacheNode *node_p);
+
+
+
+bool InitMartiEntryCache (const json_t *service_config_p)
+{
+	pthread_mutex_lock (&s_init_mutex);
+
+	if (!s_cache_p)
+		{
+			const json_t *cache_config_p = json_object_get (service_config_p, "entry_cache");
+
+			if (cache_config_p)
+				{
+					size_t max_num_entries = S_DEFAULT_CACHE_SIZE;
+					uint32 ttl = S_DEFAULT_CACHE_TTL;
+					int value;
+
+					if (GetJSONInteger (cache_config_p, "size", &value) && (value > 0))
+						{
+							max_num_entries = (size_t) value;
+						}
+
+					if (GetJSONInteger (cache_config_p, "ttl", &value) && (value > 0))
+						{
+							ttl = (uint32) value;
+						}
+
+					s_cache_p = AllocateMartiEntryCache (max_num_entries, ttl);
+
+				}		/* if (cache_config_p) */
+
+		}		/* if (!s_cache_p) */
+
+	pthread_mutex_unlock (&s_init_mutex);
+
+	return (s_cache_p != NULL);
+}
+
+
+bool IsMartiEntryCacheEnabled (void)
+{
+	return (s_cache_p != NULL);
+}
+
+
+MartiEntry *GetCachedMartiEntryById (const bson_oid_t *id_p)
+{
+	MartiEntry *entry_p = NULL;
+	MartiEntryCache *cache_p = s_cache_p;
+
+	if (cache_p)
+		{
+			MartiEntryCacheNode *node_p;
+
+			pthread_mutex_lock (& (cache_p -> mec_mutex));
+
+			node_p = FindCacheNode (cache_p, id_p);
+
+			if (node_p)
+				{
+					entry_p = UseCacheNode (cache_p, node_p);
+				}
+
+			if (entry_p)
+				{
+					++ (cache_p -> mec_num_hits);
+				}
+			else
+				{
+					++ (cache_p -> mec_num_misses);
+				}
+
+			pthread_mutex_unlock (& (cache_p -> mec_mutex));
+		}
+
+	return entry_p;
+}
+
+
+MartiEntry *GetCachedMartiEntryByMartiId (const char *marti_id_s)
+{
+	MartiEntry *entry_p = NULL;
+	MartiEntryCache *cache_p = s_cache_p;
+
+	if (cache_p)
+		{
+			MartiEntryCacheNode *node_p;
+
+			pthread_mutex_lock (& (cache_p -> mec_mutex));
+
+			node_p = cache_p -> mec_head_p;
+
+			while (node_p && (strcmp (node_p -> mecn_entry_p -> me_marti_id_s, marti_id_s) != 0))
+				{
+					node_p = node_p -> mecn_next_p;
+				}
+
+			if (node_p)
+				{
+					entry_p = UseCacheNode (cache_p, node_p);
+				}
+
+			if (entry_p)
+				{
+					++ (cache_p -> mec_num_hits);
+				}
+			else
+				{
+					++ (cache_p -> mec_num_misses);
+				}
+
+			pthread_mutex_unlock (& (cache_p -> mec_mutex));
+		}
+
+	return entry_p;
+}
+
+
+bool SetCachedMartiEntry (const MartiEntry *entry_p, const uint32 generation)
+{
+	bool success_flag = false;
+	MartiEntryCache *cache_p = s_cache_p;
+
+	if (cache_p)
+		{
+			/* Do the copying before taking the lock */
+			MartiEntry *copied_entry_p = CopyMartiEntry (entry_p);
+
+			if (copied_entry_p)
+				{
+					pthread_mutex_lock (& (cache_p -> mec_mutex));
+
+					/*
+					 * If an entry was saved whilst this one was being
+					 * loaded, it might already be out of date.
+					 */
+					if (generation == cache_p -> mec_generation)
+						{
+							MartiEntryCacheNode *node_p = FindCacheNode (cache_p, entry_p -> me_id_p);
+
+							if (node_p)
+								{
+									RemoveCacheNode (cache_p, node_p);
+								}
+
+							if ((! (cache_p -> mec_free_p)) && (cache_p -> mec_tail_p))
+								{
+									RemoveCacheNode (cache_p, cache_p -> mec_tail_p);
+								}
+
+							node_p = cache_p -> mec_free_p;
+
+							if (node_p)
+								{
+									if (SetMartiOidTableValue (cache_p -> mec_table_p, copied_entry_p -> me_id_p, (uint32) (node_p - (cache_p -> mec_nodes_p))))
+										{
+											cache_p -> mec_free_p = node_p -> mecn_next_p;
+
+											node_p -> mecn_entry_p = copied_entry_p;
+											node_p -> mecn_expiry_time = time (NULL) + cache_p -> mec_ttl;
+											PushCacheNode (cache_p, node_p);
+
+											copied_entry_p = NULL;
+											success_flag = true;
+										}
+									else
+										{
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add \"%s\" to entry cache table", entry_p -> me_marti_id_s);
+										}
+								}
+						}
+
+					pthread_mutex_unlock (& (cache_p -> mec_mutex));
+
+					if (copied_entry_p)
+						{
+							FreeMartiEntry (copied_entry_p);
+						}
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to copy \"%s\" for entry cache", entry_p -> me_marti_id_s);
+				}
+		}
+
+	return success_flag;
+}
+
+
+uint32 GetMartiEntryCacheGeneration (void)
+{
+	uint32 generation = 0;
+	MartiEntryCache *cache_p = s_cache_p;
+
+	if (cache_p)
+		{
+			pthread_mutex_lock (& (cache_p -> mec_mutex));
+			generation = cache_p -> mec_generation;
+			pthread_mutex_unlock (& (cache_p -> mec_mutex));
+		}
+
+	return generation;
+}
+
+
+void RemoveCachedMartiEntry (const bson_oid_t *id_p)
+{
+	MartiEntryCache *cache_p = s_cache_p;
+
+	if (cache_p)
+		{
+			MartiEntryCacheNode *node_p;
+
+			pthread_mutex_lock (& (cache_p -> mec_mutex));
+
+			/* Stop any loads that are already running from storing old versions */
+			++ (cache_p -> mec_generation);
+
+			node_p = FindCacheNode (cache_p, id_p);
+
+			if (node_p)
+				{
+					RemoveCacheNode (cache_p, node_p);
+				}
+
+			pthread_mutex_unlock (& (cache_p -> mec_mutex));
+		}
+}
+
+
+json_t *GetMartiEntryCacheStatisticsAsJSON (void)
+{
+	json_t *stats_p = NULL;
+	MartiEntryCache *cache_p = s_cache_p;
+
+	if (cache_p)
+		{
+			json_int_t num_hits;
+			json_int_t num_misses;
+			json_int_t num_entries;
+
+			pthread_mutex_lock (& (cache_p -> mec_mutex));
+			num_hits = (json_int_t) cache_p -> mec_num_hits;
+			num_misses = (json_int_t) cache_p -> mec_num_misses;
+			num_entries = (json_int_t) cache_p -> mec_num_entries;
+			pthread_mutex_unlock (& (cache_p -> mec_mutex));
+
+			stats_p = json_pack ("{s:I,s:I,s:I}", "hits", num_hits, "misses", num_misses, "entries", num_entries);
+
+			if (!stats_p)
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create entry cache statistics");
+				}
+		}
+
+	return stats_p;
+}
+
+
+static MartiEntryCache *AllocateMartiEntryCache (const size_t max_num_entries, const uint32 ttl)
+{
+	MartiEntryCache *cache_p = (MartiEntryCache *) AllocMemory (sizeof (MartiEntryCache));
+
+	if (cache_p)
+		{
+			if ((cache_p -> mec_nodes_p = (MartiEntryCacheNode *) AllocMemoryArray (max_num_entries, sizeof (MartiEntryCacheNode))) != NULL)
+				{
+					if ((cache_p -> mec_table_p = AllocateMartiOidTable (max_num_entries)) != NULL)
+						{
+							if (pthread_mutex_init (& (cache_p -> mec_mutex), NULL) == 0)
+								{
+									size_t i;
+
+									/* All of the nodes start off on the free list */
+									for (i = 1; i < max_num_entries; ++ i)
+										{
+											(cache_p -> mec_nodes_p + i - 1) -> mecn_next_p = cache_p -> mec_nodes_p + i;
+										}
+
+									cache_p -> mec_head_p = NULL;
+									cache_p -> mec_tail_p = NULL;
+									cache_p -> mec_free_p = cache_p -> mec_nodes_p;
+									cache_p -> mec_num_entries = 0;
+									cache_p -> mec_max_num_entries = max_num_entries;
+									cache_p -> mec_ttl = ttl;
+									cache_p -> mec_generation = 0;
+									cache_p -> mec_num_hits = 0;
+									cache_p -> mec_num_misses = 0;
+
+									return cache_p;
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to initialise entry cache mutex");
+								}
+
+							FreeMartiOidTable (cache_p -> mec_table_p);
+						}
+
+					FreeMemory (cache_p -> mec_nodes_p);
+				}
+
+			FreeMemory (cache_p);
+		}
+
+	PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate entry cache of " SIZET_FMT " entries", max_num_entries);
+
+	return NULL;
+}
+
+
+static MartiEntryCacheNode *FindCacheNode (MartiEntryCache *cache_p, const bson_oid_t *id_p)
+{
+	uint32 i;
+
+	if (GetMartiOidTableValue (cache_p -> mec_table_p, id_p, &i))
+		{
+			return (cache_p -> mec_nodes_p) + i;
+		}
+
+	return NULL;
+}
+
+
+/*
+ * Get a copy of a node's entry and move the node to the front
+ * of the list, or remove it if it has expired.
+ */
+static MartiEntry *UseCacheNode (MartiEntryCache *cache_p, MartiEntryCacheNode *node_p)
+{
+	MartiEntry *entry_p = NULL;
+
+	if (time (NULL) < node_p -> mecn_expiry_time)
+		{
+			entry_p = CopyMartiEntry (node_p -> mecn_entry_p);
+
+			if (entry_p)
+				{
+					UnlinkCacheNode (cache_p, node_p);
+					PushCacheNode (cache_p, node_p);
+				}
+		}
+	else
+		{
+			RemoveCacheNode (cache_p, node_p);
+		}
+
+	return entry_p;
+}
+
+
+static void UnlinkCacheNode (MartiEntryCache *cache_p, MartiEntryCacheNode *node_p)
+{
+	if (node_p -> mecn_prev_p)
+		{
+			node_p -> mecn_prev_p -> mecn_next_p = node_p -> mecn_next_p;
+		}
+	else
+		{
+			cache_p -> mec_head_p = node_p -> mecn_next_p;
+		}
+
+	if (node_p -> mecn_next_p)
+		{
+			node_p -> mecn_next_p -> mecn_prev_p = node_p -> mecn_prev_p;
+		}
+	else
+		{
+			cache_p -> mec_tail_p = node_p -> mecn_prev_p;
+		}
+
+	node_p -> mecn_prev_p = NULL;
+	node_p -> mecn_next_p = NULL;
+
+	-- (cache_p -> mec_num_entries);
+}
+
+
+static void PushCacheNode (MartiEntryCache *cache_p, MartiEntryCacheNode *node_p)
+{
+	node_p -> mecn_prev_p = NULL;
+	node_p -> mecn_next_p = cache_p -> mec_head_p;
+
+	if (cache_p -> mec_head_p)
+		{
+			cache_p -> mec_head_p -> mecn_prev_p = node_p;
+		}
+	else
+		{
+			cache_p -> mec_tail_p = node_p;
+		}
+
+	cache_p -> mec_head_p = node_p;
+
+	++ (cache_p -> mec_num_entries);
+}
+
+
+/*
+ * Free a node's entry and put the node back on the free list.
+ */
+static void RemoveCacheNode (MartiEntryCache *cache_p, MartiEntryCacheNode *node_p)
+{
+	RemoveMartiOidTableValue (cache_p -> mec_table_p, node_p -> mecn_entry_p -> me_id_p);
+	UnlinkCacheNode (cache_p, node_p);
+
+	FreeMartiEntry (node_p -> mecn_entry_p);
+	node_p -> mecn_entry_p = NULL;
+
+	node_p -> mecn_next_p = cache_p -> mec_free_p;
+	cache_p -> mec_free_p = node_p;
+}
@@ -0,0 +1,1013 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * marti_import.c
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "marti_import.h"
+#include "marti_service.h"
+#include "marti_entry.h"
+#include "marti_search_cache.h"
+
+#include "memory_allocations.h"
+#include "streams.h"
+#include "string_utils.h"
+#include "json_util.h"
+#include "time_util.h"
+#include "mongodb_tool.h"
+#include "mongodb_util.h"
+
+
+/*
+ * The fields for each sample that aren't
+ * already named by the MartiEntry keys.
+ */
+static const char * const S_NAME_S = "name";
+
+static const char * const S_LATITUDE_S = "latitude";
+
+static const char * const S_LONGITUDE_S = "longitude";
+
+
+/*
+ * The key used for the number of rows that were
+ * read, imported and rejected in the job's metadata.
+ */
+static const char * const S_IMPORT_SUMMARY_S = "import";
+
+
+/*
+ * The current state of an import. The valid rows are queued up in
+ * an unordered bulk operation until there are enough for a batch.
+ */
+typedef struct MartiImport
+{
+	ServiceJob *mi_job_p;
+
+	MartiServiceData *mi_data_p;
+
+	User *mi_user_p;
+
+	mongoc_bulk_operation_t *mi_bulk_p;
+
+	/* The samples in the current batch along with their rows and line numbers */
+	MartiEntry **mi_entries_pp;
+
+	json_t **mi_rows_pp;
+
+	size_t *mi_lines_p;
+
+	size_t mi_num_entries;
+
+	size_t mi_batch_size;
+
+	size_t mi_num_rows;
+
+	size_t mi_num_imported;
+
+	/* If this is true, at least one batch couldn't be added to the Lucene index */
+	bool mi_index_failed_flag;
+} MartiImport;
+
+
+static bool InitMartiImport (MartiImport *import_p, User *user_p, ServiceJob *job_p, MartiServiceData *data_p);
+
+static void ClearMartiImport (MartiImport *import_p);
+
+static void ImportRow (MartiImport *import_p, json_t *row_p, const size_t line);
+
+static bool AddEntryToImportBatch (MartiImport *import_p, MartiEntry *entry_p, json_t *row_p, const size_t line);
+
+static void RunImportBatch (MartiImport *import_p);
+
+static void ClearImportBatch (MartiImport *import_p);
+
+static MartiEntry *GetMartiEntryFromImportRow (const json_t *row_p, User *user_p, const char **error_ss);
+
+static bool GetImportRowReal (const json_t *row_p, const char *key_s, double64 *value_p);
+
+static bool GetImportRowTaxa (const json_t *row_p, uint32 **taxa_pp, size_t *num_taxa_p);
+
+static char **SplitCSVLine (char *line_s, size_t *num_fields_p);
+
+static json_t *GetCSVRowAsJSON (char **headers_ss, const size_t num_headers, char *line_s, const char **error_ss);
+
+static bool IsBlankLine (const char *line_s);
+
+
+/*
+ * API definitions
+ */
+
+OperationStatus ImportMartiEntries (const char *data_s, User *user_p, ServiceJob *job_p, MartiServiceData *data_p)
+{
+	OperationStatus status = OS_FAILED;
+	MartiImport import;
+
+	if (InitMartiImport (&import, user_p, job_p, data_p))
+		{
+			const char *line_start_s = data_s;
+			char *header_s = NULL;
+			char **headers_ss = NULL;
+			size_t num_headers = 0;
+			bool csv_flag = true;
+			size_t line = 0;
+
+			while ((*line_start_s != '\0') && isspace (*line_start_s))
+				{
+					++ line_start_s;
+				}
+
+			csv_flag = (*line_start_s != '{');
+			line_start_s = data_s;
+
+			/*
+			 * Go through the data a line at a time so that only the
+			 * current batch of samples is held in memory.
+			 */
+			while (*line_start_s != '\0')
+				{
+					const char *line_end_s = strchr (line_start_s, '\n');
+					const size_t length = line_end_s ? (size_t) (line_end_s - line_start_s) : strlen (line_start_s);
+					char *line_s = CopyToNewString (line_start_s, length, false);
+
+					++ line;
+
+					if (line_s)
+						{
+							if (!IsBlankLine (line_s))
+								{
+									if (csv_flag)
+										{
+											if (headers_ss)
+												{
+													const char *error_s = NULL;
+													json_t *row_p = GetCSVRowAsJSON (headers_ss, num_headers, line_s, &error_s);
+
+													if (row_p)
+														{
+															ImportRow (&import, row_p, line);
+															json_decref (row_p);
+														}
+													else
+														{
+															AddErrorMessage (job_p, NULL, error_s, (int) line);
+															++ (import.mi_num_rows);
+														}
+												}
+											else
+												{
+													/* The first line is the column names which we keep */
+													if ((headers_ss = SplitCSVLine (line_s, &num_headers)) != NULL)
+														{
+															header_s = line_s;
+															line_s = NULL;
+														}
+													else
+														{
+															AddErrorMessage (job_p, NULL, "Invalid CSV header", (int) line);
+															break;
+														}
+												}
+										}
+									else
+										{
+											json_error_t error;
+											json_t *row_p = json_loads (line_s, 0, &error);
+
+											if (json_is_object (row_p))
+												{
+													ImportRow (&import, row_p, line);
+												}
+											else
+												{
+													AddErrorMessage (job_p, NULL, row_p ? "Each line must be a JSON object" : error.text, (int) line);
+													++ (import.mi_num_rows);
+												}
+
+											if (row_p)
+												{
+													json_decref (row_p);
+												}
+										}
+								}
+
+							if (line_s)
+								{
+									FreeCopiedString (line_s);
+								}
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to copy line " SIZET_FMT " of import", line);
+							AddErrorMessage (job_p, NULL, "Failed to read line", (int) line);
+							++ (import.mi_num_rows);
+						}
+
+					line_start_s += length;
+
+					if (*line_start_s == '\n')
+						{
+							++ line_start_s;
+						}
+				}
+
+			/* Write any samples left over from the last batch */
+			RunImportBatch (&import);
+
+			if (import.mi_num_rows > 0)
+				{
+					json_t *summary_p = json_pack ("{s:I,s:I,s:I}", "rows", (json_int_t) import.mi_num_rows, "imported", (json_int_t) import.mi_num_imported,
+																				 "failed", (json_int_t) (import.mi_num_rows - import.mi_num_imported));
+
+					if (summary_p)
+						{
+							AddMartiJobMetadata (job_p, S_IMPORT_SUMMARY_S, summary_p);
+						}
+
+					if (import.mi_num_imported == import.mi_num_rows)
+						{
+							status = (import.mi_index_failed_flag) ? OS_PARTIALLY_SUCCEEDED : OS_SUCCEEDED;
+						}
+					else if (import.mi_num_imported > 0)
+						{
+							status = OS_PARTIALLY_SUCCEEDED;
+						}
+				}
+			else
+				{
+					AddGeneralErrorMessageToServiceJob (job_p, "No samples were found to import");
+				}
+
+			if (headers_ss)
+				{
+					FreeMemory (headers_ss);
+				}
+
+			if (header_s)
+				{
+					FreeCopiedString (header_s);
+				}
+
+			ClearMartiImport (&import);
+		}
+
+	return status;
+}
+
+
+/*
+ * Static definitions
+ */
+
+static bool InitMartiImport (MartiImport *import_p, User *user_p, ServiceJob *job_p, MartiServiceData *data_p)
+{
+	const size_t batch_size = data_p -> msd_import_batch_size;
+
+	memset (import_p, 0, sizeof (MartiImport));
+
+	import_p -> mi_job_p = job_p;
+	import_p -> mi_data_p = data_p;
+	import_p -> mi_user_p = user_p;
+	import_p -> mi_batch_size = batch_size;
+
+	if ((import_p -> mi_entries_pp = (MartiEntry **) AllocMemoryArray (batch_size, sizeof (MartiEntry *))) != NULL)
+		{
+			if ((import_p -> mi_rows_pp = (json_t **) AllocMemoryArray (batch_size, sizeof (json_t *))) != NULL)
+				{
+					if ((import_p -> mi_lines_p = (size_t *) AllocMemoryArray (batch_size, sizeof (size_t))) != NULL)
+						{
+							return true;
+						}
+
+					FreeMemory (import_p -> mi_rows_pp);
+				}
+
+			FreeMemory (import_p -> mi_entries_pp);
+		}
+
+	PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate import batch of " SIZET_FMT " samples", batch_size);
+
+	return false;
+}
+
+
+static void ClearMartiImport (MartiImport *import_p)
+{
+	ClearImportBatch (import_p);
+
+	FreeMemory (import_p -> mi_entries_pp);
+	FreeMemory (import_p -> mi_rows_pp);
+	FreeMemory (import_p -> mi_lines_p);
+}
+
+
+/*
+ * Check a row and, if it is valid, add it to the current batch,
+ * writing the batch to the database if it is now full.
+ */
+static void ImportRow (MartiImport *import_p, json_t *row_p, const size_t line)
+{
+	const char *error_s = NULL;
+	MartiEntry *entry_p = GetMartiEntryFromImportRow (row_p, import_p -> mi_user_p, &error_s);
+
+	++ (import_p -> mi_num_rows);
+
+	if (entry_p)
+		{
+			if (AddEntryToImportBatch (import_p, entry_p, row_p, line))
+				{
+					if (import_p -> mi_num_entries == import_p -> mi_batch_size)
+						{
+							RunImportBatch (import_p);
+						}
+				}
+			else
+				{
+					FreeMartiEntry (entry_p);
+				}
+		}
+	else
+		{
+			AddErrorMessage (import_p -> mi_job_p, row_p, error_s, (int) line);
+		}
+}
+
+
+static bool AddEntryToImportBatch (MartiImport *import_p, MartiEntry *entry_p, json_t *row_p, const size_t line)
+{
+	bool success_flag = false;
+	const char *error_s = "Failed to prepare sample for saving";
+	json_t *marti_json_p = GetMartiEntryAsJSON (entry_p, import_p -> mi_data_p);
+
+	if (marti_json_p)
+		{
+			bson_t *doc_p = NULL;
+
+			if (!AddMartiEntryTaxaPreorderToJSON (marti_json_p, entry_p))
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to add taxonomy numbers for MARTi Entry \"%s\"", entry_p -> me_marti_id_s);
+				}
+
+			if ((doc_p = ConvertJSONToBSON (marti_json_p)) != NULL)
+				{
+					/* This is what SaveMongoDataWithTimestamp () adds for single saves */
+					if (BSON_APPEND_DATE_TIME (doc_p, MONGO_TIMESTAMP_S, ((int64) time (NULL)) * 1000))
+						{
+							bson_error_t error;
+
+							if (! (import_p -> mi_bulk_p))
+								{
+									bson_t *opts_p = BCON_NEW ("ordered", BCON_BOOL (false));
+
+									if (opts_p)
+										{
+											import_p -> mi_bulk_p = mongoc_collection_create_bulk_operation_with_opts (import_p -> mi_data_p -> msd_mongo_p -> mt_collection_p, opts_p);
+											bson_destroy (opts_p);
+										}
+								}
+
+							if (import_p -> mi_bulk_p)
+								{
+									if (mongoc_bulk_operation_insert_with_opts (import_p -> mi_bulk_p, doc_p, NULL, &error))
+										{
+											const size_t i = import_p -> mi_num_entries;
+
+											* ((import_p -> mi_entries_pp) + i) = entry_p;
+											* ((import_p -> mi_rows_pp) + i) = json_incref (row_p);
+											* ((import_p -> mi_lines_p) + i) = line;
+
+											++ (import_p -> mi_num_entries);
+											success_flag = true;
+										}
+									else
+										{
+											PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, doc_p, "Failed to add sample to bulk insert: \"%s\"", error.message);
+											error_s = "Failed to queue sample for saving";
+										}
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create bulk operation");
+								}
+						}
+
+					bson_destroy (doc_p);
+				}
+
+			json_decref (marti_json_p);
+		}
+
+	if (!success_flag)
+		{
+			AddErrorMessage (import_p -> mi_job_p, row_p, error_s, (int) line);
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * Write the current batch to the database and then update the in-memory
+ * indexes and the Lucene index with the samples that were saved. Since the
+ * bulk insert is unordered, the database tries every sample even if some
+ * of them fail, so each failure is matched back to its row.
+ */
+static void RunImportBatch (MartiImport *import_p)
+{
+	const size_t num_entries = import_p -> mi_num_entries;
+
+	if (num_entries > 0)
+		{
+			bool *failed_flags_p = (bool *) AllocMemoryArray (num_entries, sizeof (bool));
+
+			if (failed_flags_p)
+				{
+					bson_t reply;
+					bson_error_t error;
+					bson_iter_t iter;
+					bson_iter_t errors_iter;
+					size_t num_failed = 0;
+					size_t i;
+					json_t *index_data_p = NULL;
+					const uint32_t res = mongoc_bulk_operation_execute (import_p -> mi_bulk_p, &reply, &error);
+
+					if (bson_iter_init_find (&iter, &reply, "writeErrors") && BSON_ITER_HOLDS_ARRAY (&iter) && bson_iter_recurse (&iter, &errors_iter))
+						{
+							while (bson_iter_next (&errors_iter))
+								{
+									bson_iter_t error_iter;
+
+									if (BSON_ITER_HOLDS_DOCUMENT (&errors_iter) && bson_iter_recurse (&errors_iter, &error_iter))
+										{
+											int32 index = -1;
+											const char *message_s = "Failed to save sample";
+
+											while (bson_iter_next (&error_iter))
+												{
+													const char *key_s = bson_iter_key (&error_iter);
+
+													if ((strcmp (key_s, "index") == 0) && BSON_ITER_HOLDS_INT32 (&error_iter))
+														{
+															index = bson_iter_int32 (&error_iter);
+														}
+													else if ((strcmp (key_s, "errmsg") == 0) && BSON_ITER_HOLDS_UTF8 (&error_iter))
+														{
+															message_s = bson_iter_utf8 (&error_iter, NULL);
+														}
+												}
+
+											if ((index >= 0) && ((size_t) index < num_entries) && (! (* (failed_flags_p + index))))
+												{
+													* (failed_flags_p + index) = true;
+													AddErrorMessage (import_p -> mi_job_p, * ((import_p -> mi_rows_pp) + index), message_s, (int) (* ((import_p -> mi_lines_p) + index)));
+													++ num_failed;
+												}
+										}
+								}
+						}
+
+					/*
+					 * If the whole batch failed without any individual errors,
+					 * e.g. the connection was lost, then none of it was saved.
+					 */
+					if ((res == 0) && (num_failed == 0))
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to import batch of " SIZET_FMT " samples: \"%s\"", num_entries, error.message);
+
+							for (i = 0; i < num_entries; ++ i)
+								{
+									* (failed_flags_p + i) = true;
+									AddErrorMessage (import_p -> mi_job_p, * ((import_p -> mi_rows_pp) + i), error.message, (int) (* ((import_p -> mi_lines_p) + i)));
+								}
+
+							num_failed = num_entries;
+						}
+
+					bson_destroy (&reply);
+
+					if (num_failed < num_entries)
+						{
+							/* Any cached search results might now be out of date */
+							InvalidateMartiSearchCache ();
+
+							index_data_p = json_array ();
+
+							if (!index_data_p)
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate array for indexing imported samples");
+									import_p -> mi_index_failed_flag = true;
+								}
+						}
+
+					for (i = 0; i < num_entries; ++ i)
+						{
+							if (! (* (failed_flags_p + i)))
+								{
+									const MartiEntry *entry_p = * ((import_p -> mi_entries_pp) + i);
+
+									UpdateMartiIndexesForEntry (entry_p);
+
+									if (index_data_p)
+										{
+											json_t *marti_json_p = GetMartiEntryAsJSON (entry_p, import_p -> mi_data_p);
+
+											if (marti_json_p && PrepareMartiEntryJSONForIndexing (marti_json_p, entry_p, import_p -> mi_data_p) && (json_array_append_new (index_data_p, marti_json_p) == 0))
+												{
+													marti_json_p = NULL;
+												}
+											else
+												{
+													PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to prepare MARTi Entry \"%s\" for indexing", entry_p -> me_marti_id_s);
+													import_p -> mi_index_failed_flag = true;
+												}
+
+											if (marti_json_p)
+												{
+													json_decref (marti_json_p);
+												}
+										}
+								}
+						}
+
+					import_p -> mi_num_imported += num_entries - num_failed;
+
+					if (index_data_p)
+						{
+							if ((json_array_size (index_data_p) > 0) && (!IndexData (import_p -> mi_job_p, index_data_p, NULL)))
+								{
+									PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to index batch of " SIZET_FMT " imported samples", json_array_size (index_data_p));
+									import_p -> mi_index_failed_flag = true;
+								}
+
+							json_decref (index_data_p);
+						}
+
+					FreeMemory (failed_flags_p);
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate flags for batch of " SIZET_FMT " samples", num_entries);
+				}
+		}
+
+	ClearImportBatch (import_p);
+}
+
+
+static void ClearImportBatch (MartiImport *import_p)
+{
+	size_t i;
+
+	for (i = 0; i < import_p -> mi_num_entries; ++ i)
+		{
+			FreeMartiEntry (* ((import_p -> mi_entries_pp) + i));
+			json_decref (* ((import_p -> mi_rows_pp) + i));
+		}
+
+	import_p -> mi_num_entries = 0;
+
+	if (import_p -> mi_bulk_p)
+		{
+			mongoc_bulk_operation_destroy (import_p -> mi_bulk_p);
+			import_p -> mi_bulk_p = NULL;
+		}
+}
+
+
+static MartiEntry *GetMartiEntryFromImportRow (const json_t *row_p, User *user_p, const char **error_ss)
+{
+	MartiEntry *entry_p = NULL;
+	const char *name_s = GetJSONString (row_p, S_NAME_S);
+	const char *marti_id_s = GetJSONString (row_p, ME_MARTI_ID_S);
+	const char *date_s = GetJSONString (row_p, ME_START_DATE_S);
+	double64 latitude;
+	double64 longitude;
+
+	if (IsStringEmpty (name_s))
+		{
+			*error_ss = "name is a required field";
+		}
+	else if (IsStringEmpty (marti_id_s))
+		{
+			*error_ss = "marti_id is a required field";
+		}
+	else if ((!GetImportRowReal (row_p, S_LATITUDE_S, &latitude)) || (latitude < -90.0) || (latitude > 90.0))
+		{
+			*error_ss = "latitude must be a number between -90 and 90";
+		}
+	else if ((!GetImportRowReal (row_p, S_LONGITUDE_S, &longitude)) || (longitude < -180.0) || (longitude > 180.0))
+		{
+			*error_ss = "longitude must be a number between -180 and 180";
+		}
+	else if (IsStringEmpty (date_s))
+		{
+			*error_ss = "date is a required field";
+		}
+	else
+		{
+			struct tm *time_p = GetTimeFromString (date_s);
+
+			if (time_p)
+				{
+					uint32 *taxa_p = NULL;
+					size_t num_taxa = 0;
+
+					if (GetImportRowTaxa (row_p, &taxa_p, &num_taxa))
+						{
+							bson_oid_t *id_p = GetNewBSONOid ();
+
+							if (id_p)
+								{
+									entry_p = AllocateMartiEntry (id_p, user_p, NULL, false, name_s, marti_id_s, GetJSONString (row_p, ME_SITE_NAME_S),
+																								GetJSONString (row_p, ME_DESCRIPTION_S), latitude, longitude, time_p, taxa_p, num_taxa);
+
+									if (!entry_p)
+										{
+											FreeBSONOid (id_p);
+										}
+								}
+
+							if (!entry_p)
+								{
+									*error_ss = "Failed to allocate sample";
+								}
+
+							if (taxa_p)
+								{
+									FreeMemory (taxa_p);
+								}
+						}
+					else
+						{
+							*error_ss = "The taxa must be NCBI taxonomy ids";
+						}
+
+					FreeTime (time_p);
+				}
+			else
+				{
+					*error_ss = "date is not a valid date";
+				}
+		}
+
+	return entry_p;
+}
+
+
+/*
+ * Numbers can be given as JSON numbers or, as is always the case for CSV, as strings.
+ */
+static bool GetImportRowReal (const json_t *row_p, const char *key_s, double64 *value_p)
+{
+	const json_t *value_json_p = json_object_get (row_p, key_s);
+
+	if (json_is_number (value_json_p))
+		{
+			*value_p = json_number_value (value_json_p);
+			return true;
+		}
+	else if (json_is_string (value_json_p))
+		{
+			const char *value_s = json_string_value (value_json_p);
+			char *end_s = NULL;
+			const double64 d = strtod (value_s, &end_s);
+
+			if (end_s != value_s)
+				{
+					while (isspace (*end_s))
+						{
+							++ end_s;
+						}
+
+					if (*end_s == '\0')
+						{
+							*value_p = d;
+							return true;
+						}
+				}
+		}
+
+	return false;
+}
+
+
+/*
+ * The taxa can be a JSON array of numbers or strings or a single string
+ * with the taxa separated by semicolons, commas or spaces.
+ */
+static bool GetImportRowTaxa (const json_t *row_p, uint32 **taxa_pp, size_t *num_taxa_p)
+{
+	bool success_flag = true;
+	const json_t *taxa_json_p = json_object_get (row_p, ME_TAXA_S);
+
+	*taxa_pp = NULL;
+	*num_taxa_p = 0;
+
+	if (json_is_array (taxa_json_p))
+		{
+			const size_t num_values = json_array_size (taxa_json_p);
+
+			if (num_values > 0)
+				{
+					uint32 *taxa_p = (uint32 *) AllocMemoryArray (num_values, sizeof (uint32));
+
+					success_flag = false;
+
+					if (taxa_p)
+						{
+							size_t i;
+
+							success_flag = true;
+
+							for (i = 0; (i < num_values) && success_flag; ++ i)
+								{
+									const json_t *value_p = json_array_get (taxa_json_p, i);
+
+									if (json_is_integer (value_p))
+										{
+											const json_int_t taxon = json_integer_value (value_p);
+
+											/* The taxa are stored as 32-bit signed integers */
+											if ((taxon >= 0) && (taxon <= (json_int_t) INT32_MAX))
+												{
+													* (taxa_p + i) = (uint32) taxon;
+												}
+											else
+												{
+													success_flag = false;
+												}
+										}
+									else if (json_is_string (value_p))
+										{
+											success_flag = GetMartiTaxonIdFromString (json_string_value (value_p), taxa_p + i);
+										}
+									else
+										{
+											success_flag = false;
+										}
+								}
+
+							if (success_flag)
+								{
+									*taxa_pp = taxa_p;
+									*num_taxa_p = num_values;
+								}
+							else
+								{
+									FreeMemory (taxa_p);
+								}
+						}
+				}
+		}
+	else if (json_is_string (taxa_json_p))
+		{
+			char *taxa_s = EasyCopyToNewString (json_string_value (taxa_json_p));
+
+			success_flag = false;
+
+			if (taxa_s)
+				{
+					/* There can't be more taxa than half of the characters, rounded up */
+					const size_t max_taxa = (strlen (taxa_s) / 2) + 1;
+					uint32 *taxa_p = (uint32 *) AllocMemoryArray (max_taxa, sizeof (uint32));
+
+					if (taxa_p)
+						{
+							const char * const separators_s = ";, \t";
+							char *state_s = NULL;
+							char *taxon_s = strtok_r (taxa_s, separators_s, &state_s);
+							size_t num_taxa = 0;
+
+							success_flag = true;
+
+							while (taxon_s && success_flag)
+								{
+									if (GetMartiTaxonIdFromString (taxon_s, taxa_p + num_taxa))
+										{
+											++ num_taxa;
+											taxon_s = strtok_r (NULL, separators_s, &state_s);
+										}
+									else
+										{
+											success_flag = false;
+										}
+								}
+
+							if (success_flag && (num_taxa > 0))
+								{
+									*taxa_pp = taxa_p;
+									*num_taxa_p = num_taxa;
+								}
+							else
+								{
+									FreeMemory (taxa_p);
+								}
+						}
+
+					FreeCopiedString (taxa_s);
+				}
+		}
+	else if (json_is_integer (taxa_json_p))
+		{
+			const json_int_t taxon = json_integer_value (taxa_json_p);
+
+			success_flag = false;
+
+			if ((taxon >= 0) && (taxon <= (json_int_t) INT32_MAX))
+				{
+					uint32 *taxa_p = (uint32 *) AllocMemory (sizeof (uint32));
+
+					if (taxa_p)
+						{
+							*taxa_p = (uint32) taxon;
+							*taxa_pp = taxa_p;
+							*num_taxa_p = 1;
+							success_flag = true;
+						}
+				}
+		}
+	else if (taxa_json_p && !json_is_null (taxa_json_p))
+		{
+			success_flag = false;
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * Split a line of CSV into its fields in place. Fields can be quoted
+ * with double quotes, within which a pair of double quotes is a single
+ * one, but they can't span more than one line. The returned array
+ * points into line_s and should be freed with FreeMemory ().
+ */
+static char **SplitCSVLine (char *line_s, size_t *num_fields_p)
+{
+	size_t max_fields = 1;
+	const char *c_p;
+	char **fields_ss = NULL;
+
+	for (c_p = line_s; *c_p != '\0'; ++ c_p)
+		{
+			if (*c_p == ',')
+				{
+					++ max_fields;
+				}
+		}
+
+	fields_ss = (char **) AllocMemoryArray (max_fields, sizeof (char *));
+
+	if (fields_ss)
+		{
+			char *read_p = line_s;
+			size_t num_fields = 0;
+			bool loop_flag = true;
+
+			while (loop_flag)
+				{
+					char *write_p = read_p;
+					char *field_s = write_p;
+					char c;
+
+					if (*read_p == '"')
+						{
+							++ read_p;
+
+							while (*read_p != '"' || (* (read_p + 1) == '"'))
+								{
+									if (*read_p == '\0')
+										{
+											/* The quotes were never closed */
+											FreeMemory (fields_ss);
+											return NULL;
+										}
+									else if (*read_p == '"')
+										{
+											++ read_p;
+										}
+
+									*write_p = *read_p;
+									++ write_p;
+									++ read_p;
+								}
+
+							/* Skip the closing quote */
+							++ read_p;
+						}
+
+					while ((*read_p != ',') && (*read_p != '\0') && (*read_p != '\r'))
+						{
+							*write_p = *read_p;
+							++ write_p;
+							++ read_p;
+						}
+
+					c = *read_p;
+					*write_p = '\0';
+
+					* (fields_ss + num_fields) = field_s;
+					++ num_fields;
+
+					if (c == ',')
+						{
+							++ read_p;
+						}
+					else
+						{
+							loop_flag = false;
+						}
+				}
+
+			*num_fields_p = num_fields;
+		}
+
+	return fields_ss;
+}
+
+
+static json_t *GetCSVRowAsJSON (char **headers_ss, const size_t num_headers, char *line_s, const char **error_ss)
+{
+	size_t num_fields = 0;
+	char **fields_ss = SplitCSVLine (line_s, &num_fields);
+
+	*error_ss = "Invalid CSV row";
+
+	if (fields_ss)
+		{
+			if (num_fields == num_headers)
+				{
+					json_t *row_p = json_object ();
+
+					if (row_p)
+						{
+							bool success_flag = true;
+							size_t i;
+
+							for (i = 0; (i < num_fields) && success_flag; ++ i)
+								{
+									const char *field_s = * (fields_ss + i);
+
+									if (!IsStringEmpty (field_s))
+										{
+											success_flag = (json_object_set_new (row_p, * (headers_ss + i), json_string (field_s)) == 0);
+										}
+								}
+
+							if (success_flag)
+								{
+									FreeMemory (fields_ss);
+									return row_p;
+								}
+
+							json_decref (row_p);
+						}
+				}
+			else
+				{
+					*error_ss = "The row has a different number of columns to the header";
+				}
+
+			FreeMemory (fields_ss);
+		}
+
+	return NULL;
+}
+
+
+static bool IsBlankLine (const char *line_s)
+{
+	while (*line_s != '\0')
+		{
+			if (!isspace (*line_s))
+				{
+					return false;
+				}
+
+			++ line_s;
+		}
+
+	return true;
+}
@@ -0,0 +1,246 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * marti_oid_table.c
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#include <string.h>
+
+#include "marti_oid_table.h"
+
+#include "memory_allocations.h"
+#include "streams.h"
+
+
+static const size_t S_MIN_CAPACITY = 64;
+
+
+static bool AllocateSlots (MartiOidTable *table_p, const size_t capacity);
+
+static void FreeSlots (MartiOidTable *table_p);
+
+static size_t FindSlot (const MartiOidTable *table_p, const bson_oid_t *id_p);
+
+static bool ResizeMartiOidTable (MartiOidTable *table_p);
+
+
+MartiOidTable *AllocateMartiOidTable (size_t initial_capacity)
+{
+	MartiOidTable *table_p = (MartiOidTable *) AllocMemory (sizeof (MartiOidTable));
+
+	if (table_p)
+		{
+			size_t capacity = S_MIN_CAPACITY;
+
+			/* keep the load factor under a half */
+			while (capacity < (initial_capacity << 1))
+				{
+					capacity <<= 1;
+				}
+
+			if (AllocateSlots (table_p, capacity))
+				{
+					return table_p;
+				}
+
+			FreeMemory (table_p);
+		}
+
+	PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate MartiOidTable for " SIZET_FMT " entries", initial_capacity);
+
+	return NULL;
+}
+
+
+void FreeMartiOidTable (MartiOidTable *table_p)
+{
+	FreeSlots (table_p);
+	FreeMemory (table_p);
+}
+
+
+bool GetMartiOidTableValue (const MartiOidTable *table_p, const bson_oid_t *id_p, uint32 *value_p)
+{
+	const size_t i = FindSlot (table_p, id_p);
+
+	if (* ((table_p -> mot_used_p) + i))
+		{
+			*value_p = * ((table_p -> mot_values_p) + i);
+			return true;
+		}
+
+	return false;
+}
+
+
+bool SetMartiOidTableValue (MartiOidTable *table_p, const bson_oid_t *id_p, const uint32 value)
+{
+	size_t i = FindSlot (table_p, id_p);
+
+	if (! (* ((table_p -> mot_used_p) + i)))
+		{
+			if (((table_p -> mot_size + 1) << 1) > table_p -> mot_capacity)
+				{
+					if (!ResizeMartiOidTable (table_p))
+						{
+							return false;
+						}
+
+					i = FindSlot (table_p, id_p);
+				}
+
+			bson_oid_copy (id_p, (table_p -> mot_ids_p) + i);
+			* ((table_p -> mot_used_p) + i) = true;
+			++ (table_p -> mot_size);
+		}
+
+	* ((table_p -> mot_values_p) + i) = value;
+
+	return true;
+}
+
+
+bool RemoveMartiOidTableValue (MartiOidTable *table_p, const bson_oid_t *id_p)
+{
+	size_t i = FindSlot (table_p, id_p);
+
+	if (* ((table_p -> mot_used_p) + i))
+		{
+			const size_t mask = table_p -> mot_capacity - 1;
+			size_t j;
+
+			* ((table_p -> mot_used_p) + i) = false;
+			-- (table_p -> mot_size);
+
+			/*
+			 * Since we use linear probing, shift back any following
+			 * entries that would no longer be reachable.
+			 */
+			for (j = (i + 1) & mask; * ((table_p -> mot_used_p) + j); j = (j + 1) & mask)
+				{
+					const size_t home = ((size_t) bson_oid_hash ((table_p -> mot_ids_p) + j)) & mask;
+
+					/* Is home cyclically outside of (i, j]? */
+					if ((i <= j) ? ((home <= i) || (home > j)) : ((home <= i) && (home > j)))
+						{
+							bson_oid_copy ((table_p -> mot_ids_p) + j, (table_p -> mot_ids_p) + i);
+							* ((table_p -> mot_values_p) + i) = * ((table_p -> mot_values_p) + j);
+							* ((table_p -> mot_used_p) + i) = true;
+							* ((table_p -> mot_used_p) + j) = false;
+							i = j;
+						}
+				}
+
+			return true;
+		}
+
+	return false;
+}
+
+
+static size_t FindSlot (const MartiOidTable *table_p, const bson_oid_t *id_p)
+{
+	const size_t mask = table_p -> mot_capacity - 1;
+	size_t i = ((size_t) bson_oid_hash (id_p)) & mask;
+
+	while ((* ((table_p -> mot_used_p) + i)) && (!bson_oid_equal ((table_p -> mot_ids_p) + i, id_p)))
+		{
+			i = (i + 1) & mask;
+		}
+
+	return i;
+}
+
+
+static bool ResizeMartiOidTable (MartiOidTable *table_p)
+{
+	MartiOidTable old_table = *table_p;
+
+	if (AllocateSlots (table_p, (old_table.mot_capacity) << 1))
+		{
+			size_t i;
+
+			for (i = 0; i < old_table.mot_capacity; ++ i)
+				{
+					if (* ((old_table.mot_used_p) + i))
+						{
+							const size_t j = FindSlot (table_p, (old_table.mot_ids_p) + i);
+
+							bson_oid_copy ((old_table.mot_ids_p) + i, (table_p -> mot_ids_p) + j);
+							* ((table_p -> mot_values_p) + j) = * ((old_table.mot_values_p) + i);
+							* ((table_p -> mot_used_p) + j) = true;
+							++ (table_p -> mot_size);
+						}
+				}
+
+			FreeSlots (&old_table);
+
+			return true;
+		}
+	else
+		{
+			*table_p = old_table;
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to resize MartiOidTable from " SIZET_FMT " slots", old_table.mot_capacity);
+		}
+
+	return false;
+}
+
+
+static bool AllocateSlots (MartiOidTable *table_p, const size_t capacity)
+{
+	bson_oid_t *ids_p = (bson_oid_t *) AllocMemoryArray (capacity, sizeof (bson_oid_t));
+
+	if (ids_p)
+		{
+			uint32 *values_p = (uint32 *) AllocMemoryArray (capacity, sizeof (uint32));
+
+			if (values_p)
+				{
+					bool *used_p = (bool *) AllocMemoryArray (capacity, sizeof (bool));
+
+					if (used_p)
+						{
+							memset (used_p, 0, capacity * sizeof (bool));
+
+							table_p -> mot_ids_p = ids_p;
+							table_p -> mot_values_p = values_p;
+							table_p -> mot_used_p = used_p;
+							table_p -> mot_capacity = capacity;
+							table_p -> mot_size = 0;
+
+							return true;
+						}
+
+					FreeMemory (values_p);
+				}
+
+			FreeMemory (ids_p);
+		}
+
+	return false;
+}
+
+
+static void FreeSlots (MartiOidTable *table_p)
+{
+	FreeMemory (table_p -> mot_ids_p);
+	FreeMemory (table_p -> mot_values_p);
+	FreeMemory (table_p -> mot_used_p);
+}
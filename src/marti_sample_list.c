@@ -0,0 +1,565 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * marti_sample_list.c
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "marti_sample_list.h"
+#include "marti_entry.h"
+
+#include "memory_allocations.h"
+#include "json_util.h"
+#include "mongodb_tool.h"
+#include "streams.h"
+#include "string_utils.h"
+
+
+/*
+ * The id and name of a sample. The items are kept sorted
+ * by name and then by id.
+ */
+typedef struct MartiSampleListItem
+{
+	bson_oid_t msli_id;
+
+	char *msli_name_s;
+} MartiSampleListItem;
+
+
+typedef struct MartiSampleList
+{
+	MartiSampleListItem *msl_items_p;
+
+	size_t msl_num_items;
+
+	size_t msl_capacity;
+
+	time_t msl_load_time;
+} MartiSampleList;
+
+
+/*
+ * The key for a sample's id in the lookup results.
+ */
+static const char * const S_LOOKUP_ID_S = "id";
+
+
+/*
+ * How long, in seconds, before the list is reloaded so that
+ * any samples saved by other processes are picked up.
+ */
+static const time_t S_RELOAD_INTERVAL = 300;
+
+
+/*
+ * The list is empty and has no items until it is first loaded.
+ */
+static MartiSampleList s_list = { NULL, 0, 0, 0 };
+
+static pthread_mutex_t s_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static bool LoadSampleList (const MartiServiceData *data_p);
+
+static void ClearSampleList (void);
+
+static bool InsertSampleListItem (const bson_oid_t *id_p, const char *name_s);
+
+static int CompareSampleListItems (const void *v0_p, const void *v1_p);
+
+static char *GetPrefixRegex (const char *prefix_s);
+
+static bool AddPrefixMatches (json_t *matches_p, const char *key_s, const char *regex_s, const uint32 max_matches, const MartiServiceData *data_p);
+
+static bool HasMatch (const json_t *matches_p, const char *id_s);
+
+
+
+bool AddMartiSampleListOptions (const MartiServiceData *data_p, StringParameter *param_p, const char *value_s, bool *value_found_flag_p)
+{
+	bool success_flag = true;
+	const time_t now = time (NULL);
+
+	pthread_mutex_lock (&s_list_mutex);
+
+	if ((! (s_list.msl_items_p)) || (now - s_list.msl_load_time >= S_RELOAD_INTERVAL))
+		{
+			if (!LoadSampleList (data_p))
+				{
+					if (s_list.msl_items_p)
+						{
+							PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to reload MARTi sample list, using the previous one");
+						}
+					else
+						{
+							success_flag = false;
+						}
+				}
+		}
+
+	if (success_flag)
+		{
+			size_t i;
+			const MartiSampleListItem *item_p = s_list.msl_items_p;
+
+			for (i = s_list.msl_num_items; i > 0; -- i, ++ item_p)
+				{
+					char id_s [25];
+
+					bson_oid_to_string (& (item_p -> msli_id), id_s);
+
+					if (value_s && (strcmp (value_s, id_s) == 0))
+						{
+							*value_found_flag_p = true;
+						}
+
+					if (!CreateAndAddStringParameterOption (& (param_p -> sp_base_param), id_s, item_p -> msli_name_s))
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add param option \"%s\": \"%s\"", id_s, item_p -> msli_name_s);
+							success_flag = false;
+							break;
+						}
+				}
+		}
+
+	pthread_mutex_unlock (&s_list_mutex);
+
+	return success_flag;
+}
+
+
+void UpdateMartiSampleList (const bson_oid_t *id_p, const char *name_s)
+{
+	pthread_mutex_lock (&s_list_mutex);
+
+	if (s_list.msl_items_p)
+		{
+			if (!InsertSampleListItem (id_p, name_s))
+				{
+					/* Force the list to be loaded again rather than let it go out of date */
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to update MARTi sample list for \"%s\"", name_s);
+					ClearSampleList ();
+				}
+		}
+
+	pthread_mutex_unlock (&s_list_mutex);
+}
+
+
+json_t *FindMartiSamplesByPrefix (const char *prefix_s, const uint32 max_matches, const MartiServiceData *data_p)
+{
+	char *regex_s = GetPrefixRegex (prefix_s);
+
+	if (regex_s)
+		{
+			json_t *matches_p = json_array ();
+
+			if (matches_p)
+				{
+					/*
+					 * Each field is searched separately so that each query can be answered
+					 * by a short scan of that field's index, already in order, rather than
+					 * having to sort every sample that matches either field.
+					 */
+					if (SetMongoToolDatabaseAndCollection (data_p -> msd_mongo_p, data_p -> msd_database_s, data_p -> msd_collection_s))
+						{
+							if (AddPrefixMatches (matches_p, ME_NAME_S, regex_s, max_matches, data_p))
+								{
+									if (AddPrefixMatches (matches_p, ME_MARTI_ID_S, regex_s, max_matches, data_p))
+										{
+											FreeCopiedString (regex_s);
+											return matches_p;
+										}
+								}
+						}
+
+					json_decref (matches_p);
+				}		/* if (matches_p) */
+
+			FreeCopiedString (regex_s);
+		}		/* if (regex_s) */
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to make regular expression for \"%s\"", prefix_s);
+		}
+
+	return NULL;
+}
+
+
+/*
+ * Only the ids and names are fetched from the database. The
+ * new list replaces the current one only if it loads successfully.
+ */
+static bool LoadSampleList (const MartiServiceData *data_p)
+{
+	bool success_flag = false;
+
+	if (SetMongoToolDatabaseAndCollection (data_p -> msd_mongo_p, data_p -> msd_database_s, data_p -> msd_collection_s))
+		{
+			bson_t *opts_p = BCON_NEW ("projection", "{", ME_NAME_S, BCON_INT32 (1), "}");
+
+			if (opts_p)
+				{
+					json_t *results_p = GetAllMongoResultsAsJSON (data_p -> msd_mongo_p, NULL, opts_p);
+
+					if (results_p)
+						{
+							if (json_is_array (results_p))
+								{
+									const size_t num_results = json_array_size (results_p);
+									const size_t capacity = (num_results > 0) ? num_results : 1;
+									MartiSampleListItem *items_p = (MartiSampleListItem *) AllocMemoryArray (capacity, sizeof (MartiSampleListItem));
+
+									if (items_p)
+										{
+											size_t i;
+											size_t num_items = 0;
+
+											success_flag = true;
+
+											for (i = 0; (i < num_results) && success_flag; ++ i)
+												{
+													const json_t *entry_p = json_array_get (results_p, i);
+													const char *name_s = GetJSONString (entry_p, ME_NAME_S);
+													MartiSampleListItem *item_p = items_p + num_items;
+
+													if (name_s && GetMongoIdFromJSON (entry_p, & (item_p -> msli_id)))
+														{
+															if ((item_p -> msli_name_s = EasyCopyToNewString (name_s)) != NULL)
+																{
+																	++ num_items;
+																}
+															else
+																{
+																	PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to copy sample name \"%s\"", name_s);
+																	success_flag = false;
+																}
+														}
+													else
+														{
+															PrintJSONToErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, entry_p, "Failed to get id and \"%s\" for sample list", ME_NAME_S);
+														}
+												}
+
+											if (success_flag)
+												{
+													qsort (items_p, num_items, sizeof (MartiSampleListItem), CompareSampleListItems);
+
+													ClearSampleList ();
+
+													s_list.msl_items_p = items_p;
+													s_list.msl_num_items = num_items;
+													s_list.msl_capacity = capacity;
+													s_list.msl_load_time = time (NULL);
+												}
+											else
+												{
+													for (i = 0; i < num_items; ++ i)
+														{
+															FreeCopiedString ((items_p + i) -> msli_name_s);
+														}
+
+													FreeMemory (items_p);
+												}
+										}
+									else
+										{
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate sample list of " SIZET_FMT " items", capacity);
+										}
+
+								}		/* if (json_is_array (results_p)) */
+
+							json_decref (results_p);
+						}		/* if (results_p) */
+
+					bson_destroy (opts_p);
+				}		/* if (opts_p) */
+
+		}		/* if (SetMongoToolDatabaseAndCollection (data_p -> msd_mongo_p, data_p -> msd_database_s, data_p -> msd_collection_s)) */
+
+	return success_flag;
+}
+
+
+static void ClearSampleList (void)
+{
+	if (s_list.msl_items_p)
+		{
+			size_t i;
+
+			for (i = 0; i < s_list.msl_num_items; ++ i)
+				{
+					FreeCopiedString ((s_list.msl_items_p + i) -> msli_name_s);
+				}
+
+			FreeMemory (s_list.msl_items_p);
+			s_list.msl_items_p = NULL;
+		}
+
+	s_list.msl_num_items = 0;
+	s_list.msl_capacity = 0;
+	s_list.msl_load_time = 0;
+}
+
+
+/*
+ * Remove any existing item for the sample and then insert it
+ * at the position that keeps the list sorted.
+ */
+static bool InsertSampleListItem (const bson_oid_t *id_p, const char *name_s)
+{
+	MartiSampleListItem item;
+	size_t lo = 0;
+	size_t hi;
+	size_t i;
+
+	for (i = 0; i < s_list.msl_num_items; ++ i)
+		{
+			MartiSampleListItem *item_p = s_list.msl_items_p + i;
+
+			if (bson_oid_equal (& (item_p -> msli_id), id_p))
+				{
+					if (strcmp (item_p -> msli_name_s, name_s) == 0)
+						{
+							/* The name hasn't changed so there is nothing to do */
+							return true;
+						}
+
+					FreeCopiedString (item_p -> msli_name_s);
+
+					-- (s_list.msl_num_items);
+					memmove (item_p, item_p + 1, (s_list.msl_num_items - i) * sizeof (MartiSampleListItem));
+					break;
+				}
+		}
+
+	if (s_list.msl_num_items == s_list.msl_capacity)
+		{
+			const size_t new_capacity = (s_list.msl_capacity) << 1;
+			MartiSampleListItem *items_p = (MartiSampleListItem *) ReallocMemory (s_list.msl_items_p, new_capacity * sizeof (MartiSampleListItem), (s_list.msl_capacity) * sizeof (MartiSampleListItem));
+
+			if (items_p)
+				{
+					s_list.msl_items_p = items_p;
+					s_list.msl_capacity = new_capacity;
+				}
+			else
+				{
+					return false;
+				}
+		}
+
+	bson_oid_copy (id_p, & (item.msli_id));
+
+	if ((item.msli_name_s = EasyCopyToNewString (name_s)) == NULL)
+		{
+			return false;
+		}
+
+	hi = s_list.msl_num_items;
+
+	while (lo < hi)
+		{
+			const size_t mid = lo + ((hi - lo) >> 1);
+
+			if (CompareSampleListItems (s_list.msl_items_p + mid, &item) < 0)
+				{
+					lo = mid + 1;
+				}
+			else
+				{
+					hi = mid;
+				}
+		}
+
+	memmove (s_list.msl_items_p + lo + 1, s_list.msl_items_p + lo, (s_list.msl_num_items - lo) * sizeof (MartiSampleListItem));
+	* (s_list.msl_items_p + lo) = item;
+	++ (s_list.msl_num_items);
+
+	return true;
+}
+
+
+static int CompareSampleListItems (const void *v0_p, const void *v1_p)
+{
+	const MartiSampleListItem *item0_p = (const MartiSampleListItem *) v0_p;
+	const MartiSampleListItem *item1_p = (const MartiSampleListItem *) v1_p;
+	int res = strcmp (item0_p -> msli_name_s, item1_p -> msli_name_s);
+
+	if (res == 0)
+		{
+			res = bson_oid_compare (& (item0_p -> msli_id), & (item1_p -> msli_id));
+		}
+
+	return res;
+}
+
+
+/*
+ * An anchored, case-sensitive regular expression with no special characters
+ * other than the leading ^ lets MongoDB turn it into a range on the index.
+ */
+static char *GetPrefixRegex (const char *prefix_s)
+{
+	const char * const special_chars_s = "\\^$.|?*+()[]{}";
+	char *regex_s = (char *) AllocMemory ((strlen (prefix_s) << 1) + 2);
+
+	if (regex_s)
+		{
+			char *c_p = regex_s;
+
+			*c_p = '^';
+			++ c_p;
+
+			while (*prefix_s != '\0')
+				{
+					if (strchr (special_chars_s, *prefix_s))
+						{
+							*c_p = '\\';
+							++ c_p;
+						}
+
+					*c_p = *prefix_s;
+					++ c_p;
+					++ prefix_s;
+				}
+
+			*c_p = '\0';
+		}
+
+	return regex_s;
+}
+
+
+static bool AddPrefixMatches (json_t *matches_p, const char *key_s, const char *regex_s, const uint32 max_matches, const MartiServiceData *data_p)
+{
+	bool success_flag = false;
+	const size_t num_existing_matches = json_array_size (matches_p);
+
+	if (num_existing_matches >= max_matches)
+		{
+			return true;
+		}
+	else
+		{
+			bson_t *query_p = BCON_NEW (key_s, "{", "$regex", BCON_UTF8 (regex_s), "}");
+
+			if (query_p)
+				{
+					bson_t *opts_p = BCON_NEW ("projection", "{", ME_NAME_S, BCON_INT32 (1), ME_MARTI_ID_S, BCON_INT32 (1), "}",
+																		 "sort", "{", key_s, BCON_INT32 (1), "}",
+																		 "limit", BCON_INT64 ((int64) max_matches));
+
+					if (opts_p)
+						{
+							mongoc_cursor_t *cursor_p = mongoc_collection_find_with_opts (data_p -> msd_mongo_p -> mt_collection_p, query_p, opts_p, NULL);
+
+							if (cursor_p)
+								{
+									const bson_t *doc_p = NULL;
+									bson_error_t error;
+
+									success_flag = true;
+
+									while (success_flag && (json_array_size (matches_p) < max_matches) && mongoc_cursor_next (cursor_p, &doc_p))
+										{
+											bson_iter_t iter;
+											char id_s [25];
+											const char *name_s = NULL;
+											const char *marti_id_s = NULL;
+
+											*id_s = '\0';
+
+											if (bson_iter_init (&iter, doc_p))
+												{
+													while (bson_iter_next (&iter))
+														{
+															const char *iter_key_s = bson_iter_key (&iter);
+
+															if ((strcmp (iter_key_s, MONGO_ID_S) == 0) && BSON_ITER_HOLDS_OID (&iter))
+																{
+																	bson_oid_to_string (bson_iter_oid (&iter), id_s);
+																}
+															else if ((strcmp (iter_key_s, ME_NAME_S) == 0) && BSON_ITER_HOLDS_UTF8 (&iter))
+																{
+																	name_s = bson_iter_utf8 (&iter, NULL);
+																}
+															else if ((strcmp (iter_key_s, ME_MARTI_ID_S) == 0) && BSON_ITER_HOLDS_UTF8 (&iter))
+																{
+																	marti_id_s = bson_iter_utf8 (&iter, NULL);
+																}
+														}
+												}
+
+											/* A sample might match on both its name and its MARTi id */
+											if ((*id_s != '\0') && name_s && (!HasMatch (matches_p, id_s)))
+												{
+													json_t *match_p = json_pack ("{s:s,s:s,s:s?}", S_LOOKUP_ID_S, id_s, ME_NAME_S, name_s, ME_MARTI_ID_S, marti_id_s);
+
+													if (! (match_p && (json_array_append_new (matches_p, match_p) == 0)))
+														{
+															PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add sample \"%s\" to lookup results", name_s);
+															success_flag = false;
+														}
+												}
+										}
+
+									if (mongoc_cursor_error (cursor_p, &error))
+										{
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to look up samples by \"%s\": \"%s\"", key_s, error.message);
+											success_flag = false;
+										}
+
+									mongoc_cursor_destroy (cursor_p);
+								}		/* if (cursor_p) */
+
+							bson_destroy (opts_p);
+						}		/* if (opts_p) */
+
+					bson_destroy (query_p);
+				}		/* if (query_p) */
+		}
+
+	return success_flag;
+}
+
+
+static bool HasMatch (const json_t *matches_p, const char *id_s)
+{
+	size_t i;
+	const json_t *match_p;
+
+	json_array_foreach (matches_p, i, match_p)
+		{
+			const char *match_id_s = GetJSONString (match_p, S_LOOKUP_ID_S);
+
+			if (match_id_s && (strcmp (match_id_s, id_s) == 0))
+				{
+					return true;
+				}
+		}
+
+	return false;
+}
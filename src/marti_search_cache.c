@@ -0,0 +1,452 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * marti_search_cache.c
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "marti_search_cache.h"
+
+#include "memory_allocations.h"
+#include "json_util.h"
+#include "streams.h"
+#include "string_utils.h"
+
+
+/*
+ * A cached set of search results. The entries are kept in
+ * a list with the most recently used entry at the head.
+ */
+typedef struct MartiSearchCacheEntry
+{
+	char *msce_key_s;
+
+	json_t *msce_results_p;
+
+	json_t *msce_next_token_p;
+
+	OperationStatus msce_status;
+
+	time_t msce_expiry_time;
+
+	uint32 msce_generation;
+
+	struct MartiSearchCacheEntry *msce_prev_p;
+
+	struct MartiSearchCacheEntry *msce_next_p;
+} MartiSearchCacheEntry;
+
+
+typedef struct MartiSearchCache
+{
+	MartiSearchCacheEntry *msc_head_p;
+
+	MartiSearchCacheEntry *msc_tail_p;
+
+	size_t msc_num_entries;
+
+	size_t msc_max_num_entries;
+
+	uint32 msc_ttl;
+
+	uint32 msc_generation;
+
+	uint64 msc_num_hits;
+
+	uint64 msc_num_misses;
+
+	pthread_mutex_t msc_mutex;
+} MartiSearchCache;
+
+
+static const size_t S_DEFAULT_CACHE_SIZE = 128;
+
+static const uint32 S_DEFAULT_CACHE_TTL = 300;
+
+
+static MartiSearchCache *s_cache_p = NULL;
+
+static pthread_mutex_t s_init_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void UnlinkCacheEntry (MartiSearchCache *cache_p, MartiSearchCacheEntry *entry_p);
+
+static void PushCacheEntry (MartiSearchCache *cache_p, MartiSearchCacheEntry *entry_p);
+
+static void FreeCacheEntry (MartiSearchCacheEntry *entry_p);
+
+static MartiSearchCacheEntry *FindCacheEntry (MartiSearchCache *cache_p, const char *key_s);
+
+
+bool InitMartiSearchCache (const json_t *service_config_p)
+{
+	pthread_mutex_lock (&s_init_mutex);
+
+	if (!s_cache_p)
+		{
+			const json_t *cache_config_p = json_object_get (service_config_p, "search_cache");
+
+			if (cache_config_p)
+				{
+					MartiSearchCache *cache_p = (MartiSearchCache *) AllocMemory (sizeof (MartiSearchCache));
+
+					if (cache_p)
+						{
+							int value;
+
+							cache_p -> msc_head_p = NULL;
+							cache_p -> msc_tail_p = NULL;
+							cache_p -> msc_num_entries = 0;
+							cache_p -> msc_max_num_entries = S_DEFAULT_CACHE_SIZE;
+							cache_p -> msc_ttl = S_DEFAULT_CACHE_TTL;
+							cache_p -> msc_generation = 0;
+							cache_p -> msc_num_hits = 0;
+							cache_p -> msc_num_misses = 0;
+
+							if (GetJSONInteger (cache_config_p, "size", &value) && (value > 0))
+								{
+									cache_p -> msc_max_num_entries = (size_t) value;
+								}
+
+							if (GetJSONInteger (cache_config_p, "ttl", &value) && (value > 0))
+								{
+									cache_p -> msc_ttl = (uint32) value;
+								}
+
+							if (pthread_mutex_init (& (cache_p -> msc_mutex), NULL) == 0)
+								{
+									s_cache_p = cache_p;
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to initialise search cache mutex");
+									FreeMemory (cache_p);
+								}
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate search cache");
+						}
+
+				}		/* if (cache_config_p) */
+
+		}		/* if (!s_cache_p) */
+
+	pthread_mutex_unlock (&s_init_mutex);
+
+	return (s_cache_p != NULL);
+}
+
+
+bool IsMartiSearchCacheEnabled (void)
+{
+	return (s_cache_p != NULL);
+}
+
+
+bool GetCachedMartiSearchResults (const char *key_s, json_t **results_pp, json_t **next_token_pp, OperationStatus *status_p)
+{
+	bool found_flag = false;
+	MartiSearchCache *cache_p = s_cache_p;
+
+	if (cache_p)
+		{
+			MartiSearchCacheEntry *entry_p;
+
+			pthread_mutex_lock (& (cache_p -> msc_mutex));
+
+			entry_p = FindCacheEntry (cache_p, key_s);
+
+			if (entry_p)
+				{
+					if ((entry_p -> msce_generation == cache_p -> msc_generation) && (time (NULL) < entry_p -> msce_expiry_time))
+						{
+							json_t *results_p = json_deep_copy (entry_p -> msce_results_p);
+
+							if (results_p)
+								{
+									json_t *next_token_p = NULL;
+
+									if ((entry_p -> msce_next_token_p == NULL) || ((next_token_p = json_deep_copy (entry_p -> msce_next_token_p)) != NULL))
+										{
+											*results_pp = results_p;
+											*next_token_pp = next_token_p;
+											*status_p = entry_p -> msce_status;
+
+											/* Move it to the front of the list */
+											UnlinkCacheEntry (cache_p, entry_p);
+											PushCacheEntry (cache_p, entry_p);
+
+											found_flag = true;
+										}
+									else
+										{
+											json_decref (results_p);
+										}
+								}
+						}
+					else
+						{
+							/* The entry is out of date so remove it */
+							UnlinkCacheEntry (cache_p, entry_p);
+							FreeCacheEntry (entry_p);
+						}
+				}
+
+			if (found_flag)
+				{
+					++ (cache_p -> msc_num_hits);
+				}
+			else
+				{
+					++ (cache_p -> msc_num_misses);
+				}
+
+			pthread_mutex_unlock (& (cache_p -> msc_mutex));
+		}
+
+	return found_flag;
+}
+
+
+bool SetCachedMartiSearchResults (const char *key_s, const json_t *results_p, const json_t *next_token_p, const OperationStatus status, const uint32 generation)
+{
+	bool success_flag = false;
+	MartiSearchCache *cache_p = s_cache_p;
+
+	if (cache_p)
+		{
+			MartiSearchCacheEntry *entry_p = (MartiSearchCacheEntry *) AllocMemory (sizeof (MartiSearchCacheEntry));
+
+			if (entry_p)
+				{
+					/*
+					 * Do the copying before taking the lock as
+					 * the result sets can be large.
+					 */
+					entry_p -> msce_key_s = EasyCopyToNewString (key_s);
+					entry_p -> msce_results_p = json_deep_copy (results_p);
+					entry_p -> msce_next_token_p = next_token_p ? json_deep_copy (next_token_p) : NULL;
+					entry_p -> msce_status = status;
+					entry_p -> msce_expiry_time = time (NULL) + cache_p -> msc_ttl;
+					entry_p -> msce_generation = generation;
+					entry_p -> msce_prev_p = NULL;
+					entry_p -> msce_next_p = NULL;
+
+					if ((entry_p -> msce_key_s) && (entry_p -> msce_results_p) && ((next_token_p == NULL) || (entry_p -> msce_next_token_p)))
+						{
+							pthread_mutex_lock (& (cache_p -> msc_mutex));
+
+							/*
+							 * If an entry was saved whilst the search was running,
+							 * these results might already be out of date.
+							 */
+							if (generation == cache_p -> msc_generation)
+								{
+									MartiSearchCacheEntry *old_entry_p = FindCacheEntry (cache_p, key_s);
+
+									if (old_entry_p)
+										{
+											UnlinkCacheEntry (cache_p, old_entry_p);
+											FreeCacheEntry (old_entry_p);
+										}
+
+									while ((cache_p -> msc_num_entries >= cache_p -> msc_max_num_entries) && (cache_p -> msc_tail_p))
+										{
+											old_entry_p = cache_p -> msc_tail_p;
+											UnlinkCacheEntry (cache_p, old_entry_p);
+											FreeCacheEntry (old_entry_p);
+										}
+
+									PushCacheEntry (cache_p, entry_p);
+									entry_p = NULL;
+									success_flag = true;
+								}
+
+							pthread_mutex_unlock (& (cache_p -> msc_mutex));
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to copy search results for \"%s\"", key_s);
+						}
+
+					if (entry_p)
+						{
+							FreeCacheEntry (entry_p);
+						}
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate search cache entry for \"%s\"", key_s);
+				}
+		}
+
+	return success_flag;
+}
+
+
+uint32 GetMartiSearchCacheGeneration (void)
+{
+	uint32 generation = 0;
+	MartiSearchCache *cache_p = s_cache_p;
+
+	if (cache_p)
+		{
+			pthread_mutex_lock (& (cache_p -> msc_mutex));
+			generation = cache_p -> msc_generation;
+			pthread_mutex_unlock (& (cache_p -> msc_mutex));
+		}
+
+	return generation;
+}
+
+
+void InvalidateMartiSearchCache (void)
+{
+	MartiSearchCache *cache_p = s_cache_p;
+
+	if (cache_p)
+		{
+			/*
+			 * Rather than walk the list, we bump the generation and
+			 * any older entries get removed when they are next found.
+			 */
+			pthread_mutex_lock (& (cache_p -> msc_mutex));
+			++ (cache_p -> msc_generation);
+			pthread_mutex_unlock (& (cache_p -> msc_mutex));
+		}
+}
+
+
+json_t *GetMartiSearchCacheStatisticsAsJSON (void)
+{
+	json_t *stats_p = NULL;
+	MartiSearchCache *cache_p = s_cache_p;
+
+	if (cache_p)
+		{
+			json_int_t num_hits;
+			json_int_t num_misses;
+			json_int_t num_entries;
+
+			pthread_mutex_lock (& (cache_p -> msc_mutex));
+			num_hits = (json_int_t) cache_p -> msc_num_hits;
+			num_misses = (json_int_t) cache_p -> msc_num_misses;
+			num_entries = (json_int_t) cache_p -> msc_num_entries;
+			pthread_mutex_unlock (& (cache_p -> msc_mutex));
+
+			stats_p = json_pack ("{s:I,s:I,s:I}", "hits", num_hits, "misses", num_misses, "entries", num_entries);
+
+			if (!stats_p)
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create search cache statistics");
+				}
+		}
+
+	return stats_p;
+}
+
+
+static MartiSearchCacheEntry *FindCacheEntry (MartiSearchCache *cache_p, const char *key_s)
+{
+	MartiSearchCacheEntry *entry_p = cache_p -> msc_head_p;
+
+	while (entry_p)
+		{
+			if (strcmp (entry_p -> msce_key_s, key_s) == 0)
+				{
+					return entry_p;
+				}
+
+			entry_p = entry_p -> msce_next_p;
+		}
+
+	return NULL;
+}
+
+
+static void UnlinkCacheEntry (MartiSearchCache *cache_p, MartiSearchCacheEntry *entry_p)
+{
+	if (entry_p -> msce_prev_p)
+		{
+			entry_p -> msce_prev_p -> msce_next_p = entry_p -> msce_next_p;
+		}
+	else
+		{
+			cache_p -> msc_head_p = entry_p -> msce_next_p;
+		}
+
+	if (entry_p -> msce_next_p)
+		{
+			entry_p -> msce_next_p -> msce_prev_p = entry_p -> msce_prev_p;
+		}
+	else
+		{
+			cache_p -> msc_tail_p = entry_p -> msce_prev_p;
+		}
+
+	entry_p -> msce_prev_p = NULL;
+	entry_p -> msce_next_p = NULL;
+
+	-- (cache_p -> msc_num_entries);
+}
+
+
+static void PushCacheEntry (MartiSearchCache *cache_p, MartiSearchCacheEntry *entry_p)
+{
+	entry_p -> msce_prev_p = NULL;
+	entry_p -> msce_next_p = cache_p -> msc_head_p;
+
+	if (cache_p -> msc_head_p)
+		{
+			cache_p -> msc_head_p -> msce_prev_p = entry_p;
+		}
+	else
+		{
+			cache_p -> msc_tail_p = entry_p;
+		}
+
+	cache_p -> msc_head_p = entry_p;
+
+	++ (cache_p -> msc_num_entries);
+}
+
+
+static void FreeCacheEntry (MartiSearchCacheEntry *entry_p)
+{
+	if (entry_p -> msce_key_s)
+		{
+			FreeCopiedString (entry_p -> msce_key_s);
+		}
+
+	if (entry_p -> msce_results_p)
+		{
+			json_decref (entry_p -> msce_results_p);
+		}
+
+	if (entry_p -> msce_next_token_p)
+		{
+			json_decref (entry_p -> msce_next_token_p);
+		}
+
+	FreeMemory (entry_p);
+}
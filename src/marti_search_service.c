@@ -20,17 +20,35 @@
  *      Author: billy
  */
 
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
 #include "marti_search_service.h"
 #include "marti_service.h"
 #include "marti_entry.h"
+#include "marti_search_cache.h"
+#include "marti_spatial_index.h"
+#include "marti_taxonomy.h"
+#include "marti_taxa_index.h"
+#include "marti_similarity_index.h"
+#include "marti_oid_table.h"
 
 #include "audit.h"
 #include "streams.h"
 #include "math_utils.h"
 #include "string_utils.h"
 #include "time_util.h"
+#include "byte_buffer.h"
+#include "lucene_tool.h"
 
 #include "string_parameter.h"
+#include "string_array_parameter.h"
+#include "json_parameter.h"
 #include "boolean_parameter.h"
 #include "time_parameter.h"
 #include "unsigned_int_parameter.h"
@@ -42,6 +60,328 @@
 
 static NamedParameterType S_MAX_DISTANCE = { "Maximum Distance", PT_UNSIGNED_INT };
 static NamedParameterType S_END_DATE = { "End Date", PT_TIME };
+static NamedParameterType S_PROJECTION = { "Fields", PT_STRING };
+static NamedParameterType S_PAGE_SIZE = { "Page Size", PT_UNSIGNED_INT };
+static NamedParameterType S_CONTINUATION_TOKEN = { "Continuation Token", PT_STRING };
+static NamedParameterType S_TAXA_MATCH = { "Taxa Match", PT_STRING };
+static NamedParameterType S_SEARCH_MODE = { "Search Mode", PT_STRING };
+static NamedParameterType S_BOUNDING_BOX = { "Bounding Box", PT_STRING };
+static NamedParameterType S_POLYGON = { "Polygon", PT_JSON };
+static NamedParameterType S_COUNTS_ONLY = { "Counts Only", PT_BOOLEAN };
+static NamedParameterType S_POINTS = { "Points", PT_JSON };
+static NamedParameterType S_NUM_NEAREST = { "Number of Nearest", PT_UNSIGNED_INT };
+static NamedParameterType S_TAXA_SUBTREE = { "Include Descendant Taxa", PT_BOOLEAN };
+static NamedParameterType S_EXCLUDED_TAXA = { "Excluded Taxa", PT_STRING_ARRAY };
+static NamedParameterType S_SIMILAR_TO = { "Similar To", PT_STRING };
+static NamedParameterType S_KEYWORDS = { "Keywords", PT_KEYWORD };
+
+
+/*
+ * The key used for the token to get the next page
+ * of results in the job's metadata.
+ */
+static const char * const S_NEXT_TOKEN_S = "next_token";
+
+
+/*
+ * The key used for the search cache's hit and
+ * miss counts in the job's metadata.
+ */
+static const char * const S_CACHE_STATISTICS_S = "search_cache";
+
+
+static const char * const S_PROJECTION_NAMES_SS [MP_NUM_PROJECTIONS] = { "minimal", "standard", "full" };
+
+static const char * const S_TAXA_MATCH_NAMES_SS [MTM_NUM_MATCHES] = { "any", "all" };
+
+static const char * const S_SEARCH_MODE_NAMES_SS [MSM_NUM_MODES] = { "radius", "box", "polygon", "nearest", "similar" };
+
+
+/*
+ * The most points that can be searched for in a single batch
+ */
+static const size_t S_MAX_BATCH_POINTS = 1000;
+
+/*
+ * The default number of threads, each with their own
+ * connection to Mongo, used to run a batch search.
+ */
+static const int S_DEFAULT_BATCH_THREADS = 4;
+
+
+/*
+ * The default and maximum number of samples to
+ * get for a nearest neighbour search.
+ */
+static const uint32 S_DEFAULT_NUM_NEAREST = 20;
+
+static const uint32 S_MAX_NUM_NEAREST = 10000;
+
+
+/*
+ * A bounding box is sent to Mongo as pieces that are no wider than
+ * this number of degrees of longitude, so that the edges of each
+ * piece are always the shorter great circle arcs.
+ */
+static const double64 S_MAX_BOX_PIECE_WIDTH = 45.0;
+
+/*
+ * Polygon vertices at a pole would all be the same point, so the
+ * pieces of a bounding box stop just short of them.
+ */
+static const double64 S_MAX_BOX_LATITUDE = 89.999999;
+
+
+/*
+ * The field that $geoNear puts the distance, in metres,
+ * of each sample from the search point into.
+ */
+static const char * const S_DISTANCE_S = "distance";
+
+
+/*
+ * The field for the estimated similarity of each
+ * sample's taxa for MSM_SIMILAR searches.
+ */
+static const char * const S_SIMILARITY_S = "similarity";
+
+
+/*
+ * The running totals whilst adding the matching
+ * documents to a search ServiceJob.
+ */
+typedef struct SearchResults
+{
+	ServiceJob *sr_job_p;
+
+	const MartiServiceData *sr_data_p;
+
+	size_t sr_num_results;
+
+	size_t sr_num_successes;
+
+	/*
+	 * The id and location of the last sample that was added
+	 * which is used to create the continuation token
+	 */
+	bool sr_has_last_flag;
+
+	bson_oid_t sr_last_id;
+
+	double64 sr_last_latitude;
+
+	double64 sr_last_longitude;
+
+	/*
+	 * The distance of the last sample from the search point
+	 * as calculated by the database, or a negative value if
+	 * it wasn't included with the sample.
+	 */
+	double64 sr_last_distance;
+
+	/*
+	 * If this is not NULL, each result record is also
+	 * appended to it so that it can be cached.
+	 */
+	json_t *sr_cached_results_p;
+
+	/*
+	 * If this is true, the distance of each sample from the
+	 * search point is added to the result records. This is
+	 * only used by the spatial index as $geoNear does it
+	 * for us.
+	 */
+	bool sr_add_distance_flag;
+} SearchResults;
+
+
+/*
+ * The documents for a chunk of spatial index matches. MongoDB
+ * returns them in any order so each one is put into the slot
+ * of its match as it is read from the cursor.
+ */
+typedef struct IndexedDocuments
+{
+	/* The position of each match's id within the chunk */
+	MartiOidTable *id_positions_p;
+
+	/* The converted documents in the same order as the matches */
+	json_t **id_docs_pp;
+} IndexedDocuments;
+
+
+/*
+ * The values used to find the matching samples.
+ */
+typedef struct SearchQuery
+{
+	MartiSearchMode sq_mode;
+
+	double64 sq_latitude;
+
+	double64 sq_longitude;
+
+	double64 sq_min_distance;
+
+	uint32 sq_max_distance;
+
+	const struct tm *sq_start_p;
+
+	const struct tm *sq_end_p;
+
+	MartiProjection sq_projection;
+
+	uint32 sq_page_size;
+
+	const char *sq_token_s;
+
+	bool sq_resume_flag;
+
+	bson_oid_t sq_last_id;
+
+	/*
+	 * If this is true, sq_min_distance was worked out with
+	 * GetMartiDistance () rather than by $geoNear.
+	 */
+	bool sq_local_distance_flag;
+
+	/*
+	 * If there are any taxa, only samples
+	 * with matching taxa will be found
+	 */
+	const char **sq_taxa_ss;
+
+	size_t sq_num_taxa;
+
+	MartiTaxaMatch sq_taxa_match;
+
+	/*
+	 * If this is true, a sample also matches a taxon if it
+	 * has any of that taxon's descendants in the taxonomy.
+	 */
+	bool sq_taxa_subtree_flag;
+
+	/*
+	 * Samples with any of these taxa won't be found
+	 */
+	const char **sq_excluded_taxa_ss;
+
+	size_t sq_num_excluded_taxa;
+
+	/*
+	 * The area to search for MSM_BOX and MSM_POLYGON. The box
+	 * is stored as west, south, east and north.
+	 */
+	double64 sq_box [4];
+
+	const json_t *sq_polygon_p;
+
+	/*
+	 * If this is true, then rather than the matching samples,
+	 * only their counts for each site and month are returned.
+	 */
+	bool sq_counts_only_flag;
+
+	/* The number of samples to get for MSM_NEAREST and MSM_SIMILAR */
+	uint32 sq_num_nearest;
+
+	/*
+	 * For MSM_SIMILAR, if this is true, samples similar to the one with
+	 * sq_similar_id are found, otherwise samples similar to the taxa are.
+	 */
+	bool sq_has_similar_id_flag;
+
+	bson_oid_t sq_similar_id;
+
+	/*
+	 * If this is not NULL, only samples that match these
+	 * keywords in the Lucene index will be found.
+	 */
+	const char *sq_keywords_s;
+
+	/*
+	 * Once the keywords have been looked up, this is true and
+	 * these are the ids of the matching samples sorted by id.
+	 */
+	bool sq_keyword_ids_flag;
+
+	bson_oid_t *sq_keyword_ids_p;
+
+	size_t sq_num_keyword_ids;
+} SearchQuery;
+
+
+/*
+ * One of the points in a batch search along with its results.
+ */
+typedef struct BatchPoint
+{
+	SearchQuery bp_query;
+
+	/* The dates for this point if they are different to the main query's */
+	struct tm *bp_start_p;
+
+	struct tm *bp_end_p;
+
+	/* The point as given in the request */
+	const json_t *bp_point_p;
+
+	/* The matching documents */
+	json_t *bp_results_p;
+
+	size_t bp_num_failures;
+
+	OperationStatus bp_status;
+} BatchPoint;
+
+
+/*
+ * The points in a batch search that the worker threads take
+ * in turn until there are none left.
+ */
+typedef struct BatchSearch
+{
+	BatchPoint *bs_points_p;
+
+	size_t bs_num_points;
+
+	size_t bs_next_point;
+
+	pthread_mutex_t bs_mutex;
+
+	MartiServiceData *bs_data_p;
+
+	GrassrootsServer *bs_grassroots_p;
+} BatchSearch;
+
+
+/*
+ * The ids of the MARTi samples found by a Lucene search.
+ */
+typedef struct KeywordMatches
+{
+	bson_oid_t *km_ids_p;
+
+	size_t km_num_ids;
+
+	size_t km_max_ids;
+} KeywordMatches;
+
+
+/*
+ * The locations of the samples that matched a keyword
+ * search, as read from the database.
+ */
+typedef struct KeywordLocations
+{
+	const SearchQuery *kl_query_p;
+
+	MartiSpatialMatch *kl_matches_p;
+
+	size_t kl_num_matches;
+
+	size_t kl_max_matches;
+} KeywordLocations;
 
 
 
@@ -65,11 +405,178 @@ static bool CloseMartiSearchService (Service *service_p);
 
 static ServiceMetadata *GetMartiSearchServiceMetadata (Service *service_p);
 
-static json_t *GetSearchQuery (const double64 latitude, const double64 longitude, const struct tm *from_p, const struct tm *to_p, const uint32 min_distance, const uint32 max_distance);
+static bson_t *GetSearchQuery (const SearchQuery *query_p);
+
+static bool AppendUnsignedIntToBSON (bson_t *doc_p, const char * const key_s, const uint32 value);
+
+static bool AddNonTrivialTimeToQuery (bson_t *query_p, const struct tm *time_p, const char * const op_s);
+
+static bool AddProjectionParameter (ParameterSet *param_set_p, ServiceData *data_p);
+
+static MartiProjection GetProjectionFromParameterSet (ParameterSet *param_set_p);
+
+static bool AddTaxaParameters (ParameterSet *param_set_p, ServiceData *data_p);
+
+static MartiTaxaMatch GetTaxaMatchFromParameterSet (ParameterSet *param_set_p);
+
+static bool AddTaxaToQuery (bson_t *query_p, const SearchQuery *search_p);
+
+static bool AddTaxaIntervalsToQuery (bson_t *query_p, const SearchQuery *search_p);
+
+static bool AddTaxaArrayToQuery (bson_t *query_p, const char *key_s, const char **taxa_ss, const size_t num_taxa);
+
+static bool AddTaxaIntervalClausesToQuery (bson_t *query_p, const char *key_s, const char **taxa_ss, const size_t num_taxa);
+
+static char *GetTaxaCacheKey (const SearchQuery *query_p);
+
+static bool GetTaxaFromParameterSet (ParameterSet *param_set_p, const NamedParameterType *param_p, const bool subtree_flag, const char ***taxa_sss, size_t *num_taxa_p, ServiceJob *job_p);
+
+static bool HasTaxaFilter (const SearchQuery *query_p);
+
+static bool FilterSpatialMatchesByTaxa (const SearchQuery *query_p, MartiSpatialMatch *matches_p, size_t *num_matches_p);
+
+static bool AddAreaParameters (ParameterSet *param_set_p, ServiceData *data_p);
+
+static bool AddBatchParameters (ParameterSet *param_set_p, ServiceData *data_p);
+
+static MartiSearchMode GetSearchModeFromParameterSet (ParameterSet *param_set_p);
+
+static bool ParseBoundingBox (const char *box_s, double64 *box_p);
+
+static bool IsValidPolygon (const json_t *polygon_p);
+
+static bool AddGeoWithinToQuery (bson_t *location_p, const SearchQuery *query_p);
+
+static bool AddBoxGeometryToQuery (bson_t *geo_within_p, const SearchQuery *query_p);
+
+static bool AddBoxBoundsToQuery (bson_t *query_p, const SearchQuery *search_p);
+
+static double64 GetBoundingBoxWidth (const double64 *box_p);
+
+static char *GetAreaCacheKey (const SearchQuery *query_p);
+
+static bool AddDateRangeToQuery (bson_t *query_p, const SearchQuery *search_p);
+
+static OperationStatus RunCountSearch (const SearchQuery *query_p, ServiceJob *job_p, MartiServiceData *data_p, json_t **cached_results_pp);
+
+static bson_t *GetCountPipeline (const SearchQuery *query_p);
+
+static bool AddCountFromBSON (const bson_t *document_p, json_t *counts_p, json_int_t *total_p);
+
+static OperationStatus RunBatchSearch (const SearchQuery *query_p, const json_t *points_p, ServiceJob *job_p, MartiServiceData *data_p, GrassrootsServer *grassroots_p);
+
+static bool GetBatchPoint (const json_t *point_p, const SearchQuery *query_p, BatchPoint *batch_point_p);
+
+static void RunBatchPoints (BatchSearch *batch_p, MongoTool *tool_p);
+
+static void *RunBatchSearchThread (void *data_p);
+
+static void RunBatchPoint (BatchPoint *point_p, MongoTool *tool_p, const MartiServiceData *data_p);
+
+static bool AddBatchResultFromBSON (const bson_t *document_p, void *data_p);
+
+static bool AddBatchPointToServiceJob (ServiceJob *job_p, const BatchPoint *point_p, const size_t index);
+
+static void FreeBatchPoints (BatchPoint *points_p, const size_t num_points);
+
+static bson_t *GetFindOptions (const MartiProjection projection, const uint32 batch_size, const uint32 limit, const bool sort_by_id_flag);
+
+static bool AddProjectionFields (bson_t *fields_p, const MartiProjection projection, const bool distance_flag);
+
+static bool AddGeoNearStage (bson_t *stage_p, const SearchQuery *query_p);
+
+static OperationStatus RunGeoNearSearch (const SearchQuery *query_p, ServiceJob *job_p, MartiServiceData *data_p, json_t **cached_results_pp, json_t **next_token_pp);
+
+static bson_t *GetGeoNearPipeline (const SearchQuery *query_p);
+
+static bool AddDistanceResumeStage (bson_t *stage_p, const SearchQuery *query_p);
+
+static bool BeginPipelineStage (bson_t *pipeline_p, uint32 *num_stages_p, bson_t *stage_p);
+
+static bool AddSearchResult (const json_t *result_p, SearchResults *results_p);
+
+static bool AddSearchResultFromBSON (const bson_t *document_p, void *data_p);
+
+static json_t *GetSearchResultJSONFromBSON (const bson_t *document_p);
+
+static bool AddSearchResultRecord (json_t *result_p, const bson_oid_t *id_p, const char *name_s, const double64 latitude, const double64 longitude, SearchResults *results_p);
+
+static bool GetSearchResultDetailsFromJSON (const json_t *result_p, bson_oid_t *id_p, const char **name_ss, double64 *latitude_p, double64 *longitude_p);
+
+static bool GetSearchResultDetailsFromBSON (const bson_t *document_p, bson_oid_t *id_p, const char **name_ss, double64 *latitude_p, double64 *longitude_p);
+
+static json_t *GetBSONDocumentAsJSON (bson_iter_t *iter_p, const bool array_flag);
+
+static json_t *GetBSONValueAsJSON (const bson_iter_t *iter_p);
+
+static json_t *GetBSONDateAsJSON (const int64 millis);
+
+static OperationStatus GetSearchResultsStatus (const SearchResults *results_p);
+
+static bool AddPagingParameters (ParameterSet *param_set_p, ServiceData *data_p);
+
+static bool ParseContinuationToken (const char *token_s, bool *local_distance_flag_p, double64 *distance_p, bson_oid_t *id_p);
+
+static bool IsDistanceResume (const SearchQuery *query_p, const bool local_distance_flag);
+
+static OperationStatus RejectContinuationToken (ServiceJob *job_p);
+
+static json_t *GetContinuationToken (const SearchResults *results_p, const SearchQuery *query_p);
+
+static OperationStatus RunSearch (const SearchQuery *query_p, ServiceJob *job_p, MartiServiceData *data_p, json_t **cached_results_pp, json_t **next_token_pp);
+
+static OperationStatus RunIndexedSearch (const SearchQuery *query_p, ServiceJob *job_p, MartiServiceData *data_p, json_t **cached_results_pp, json_t **next_token_pp);
+
+static bool AddIndexedSearchResults (const MartiSpatialMatch *matches_p, const double64 *similarities_p, const size_t num_matches, const bson_t *opts_p, SearchResults *results_p);
+
+static bool AddIndexedDocumentFromBSON (const bson_t *document_p, void *data_p);
 
-static bool AddNumberToArray (json_t *array_p, const double64 value);
+static OperationStatus AddSpatialMatchesToResults (const SearchQuery *query_p, const MartiSpatialMatch *matches_p, const double64 *similarities_p, const size_t num_matches, const bool add_distance_flag,
+																									 ServiceJob *job_p, MartiServiceData *data_p, json_t **cached_results_pp, SearchResults *results_p);
+
+static OperationStatus RunSimilarSearch (const SearchQuery *query_p, ServiceJob *job_p, MartiServiceData *data_p, json_t **cached_results_pp);
+
+static bool GetSimilarSearchFromParameterSet (ParameterSet *param_set_p, SearchQuery *query_p, ServiceJob *job_p);
+
+static OperationStatus AddMatchedSearchResults (const SearchQuery *query_p, const MartiSpatialMatch *matches_p, size_t num_matches, const bool add_distance_flag,
+																								ServiceJob *job_p, MartiServiceData *data_p, json_t **cached_results_pp, json_t **next_token_pp);
+
+static bool CanUseSpatialIndex (const SearchQuery *query_p);
+
+static bool AddKeywordParameter (ParameterSet *param_set_p, ServiceData *data_p);
+
+static bool GetKeywordSearchQuery (const SearchQuery *query_p, ServiceJob *job_p, MartiServiceData *data_p, SearchQuery *keyword_query_p);
+
+static void ClearKeywordSearchQuery (SearchQuery *keyword_query_p);
+
+static bool AddKeywordMatchId (const json_t *document_p, const uint32 index, void *data_p);
+
+static size_t SortAndRemoveDuplicateIds (bson_oid_t *ids_p, const size_t num_ids);
+
+static int CompareIds (const void *v0_p, const void *v1_p);
+
+static int CompareSpatialMatchesById (const void *v0_p, const void *v1_p);
+
+static int CompareSpatialMatchesByDistance (const void *v0_p, const void *v1_p);
+
+static void FilterSpatialMatchesByKeywords (const SearchQuery *query_p, MartiSpatialMatch *matches_p, size_t *num_matches_p);
+
+static bool AddIdsToQuery (bson_t *query_p, const SearchQuery *search_p, const char *resume_op_s);
+
+static bson_t *GetSearchFilter (const SearchQuery *query_p);
+
+static OperationStatus RunKeywordSearch (const SearchQuery *query_p, ServiceJob *job_p, MartiServiceData *data_p, json_t **cached_results_pp, json_t **next_token_pp);
+
+static OperationStatus RunKeywordDrivenSearch (const SearchQuery *query_p, ServiceJob *job_p, MartiServiceData *data_p, json_t **cached_results_pp, json_t **next_token_pp);
+
+static bool AddKeywordLocationFromBSON (const bson_t *document_p, void *data_p);
+
+static char *GetSearchCacheKey (const SearchQuery *query_p);
+
+static bool AddCachedSearchResults (ServiceJob *job_p, json_t *results_p, json_t *next_token_p);
+
+static int64 GetEstimatedNumberOfResults (const SearchQuery *query_p, MongoTool *tool_p, const uint32 limit);
 
-static bool AddNonTrivialTimeToQuery (json_t *query_p, const struct tm *time_p, const char * const field_s, const char * const op_s);
 
 
 /*
@@ -108,6 +615,12 @@ Service *GetMartiSearchService (GrassrootsServer *grassroots_p)
 						{
 							if (ConfigureMartiService (data_p, grassroots_p))
 								{
+									InitMartiSearchCache (data_p -> msd_base_data.sd_config_p);
+									InitMartiSpatialIndex (data_p);
+									InitMartiTaxaIndex (data_p);
+									InitMartiSimilarityIndex (data_p);
+									InitMartiTaxonomy (data_p -> msd_base_data.sd_config_p);
+
 									return service_p;
 								}
 
@@ -167,7 +680,16 @@ static ParameterSet *GetMartiSearchServiceParameters (Service *service_p, DataRe
 
 					if (param_p)
 						{
-							return param_set_p;
+							if (AddAreaParameters (param_set_p, data_p) && AddBatchParameters (param_set_p, data_p) && AddTaxaParameters (param_set_p, data_p) && AddKeywordParameter (param_set_p, data_p))
+								{
+									if (AddProjectionParameter (param_set_p, data_p))
+										{
+											if (AddPagingParameters (param_set_p, data_p))
+												{
+													return param_set_p;
+												}
+										}
+								}
 						}
 				}
 
@@ -189,6 +711,21 @@ static bool GetMartiSearchServiceParameterTypesForNamedParameters (const Service
 		{
 			S_MAX_DISTANCE,
 			S_END_DATE,
+			S_PROJECTION,
+			S_PAGE_SIZE,
+			S_CONTINUATION_TOKEN,
+			MA_TAXA,
+			S_TAXA_MATCH,
+			S_SEARCH_MODE,
+			S_BOUNDING_BOX,
+			S_POLYGON,
+			S_COUNTS_ONLY,
+			S_POINTS,
+			S_NUM_NEAREST,
+			S_TAXA_SUBTREE,
+			S_EXCLUDED_TAXA,
+			S_SIMILAR_TO,
+			S_KEYWORDS,
 			NULL
 		};
 
@@ -233,6 +770,11 @@ static ServiceJobSet *RunMartiSearchService (Service *service_p, ParameterSet *p
 
 			LogParameterSet (param_set_p, job_p);
 
+			/* Pick up any samples that other processes have saved */
+			RefreshMartiSpatialIndex (data_p);
+			RefreshMartiTaxaIndex (data_p);
+			RefreshMartiSimilarityIndex (data_p);
+
 
 			if (param_set_p)
 				{
@@ -242,91 +784,268 @@ static ServiceJobSet *RunMartiSearchService (Service *service_p, ParameterSet *p
 
 					if (GetCommonParameters (param_set_p, &latitude_p, &longitude_p, &start_p, "search", job_p))
 						{
-							uint32 min_distance = 0;
-							uint32 max_distance = 1000;
+							SearchQuery query;
 							const uint32 *max_distance_p = NULL;
-							const struct tm *start_date_p = NULL;
-							const struct tm *end_date_p = NULL;
-							json_t *query_p = NULL;
+							const uint32 *page_size_p = NULL;
+							const bool *counts_only_p = NULL;
+							const bool *taxa_subtree_p = NULL;
+							bool valid_flag = true;
+
+							query.sq_mode = GetSearchModeFromParameterSet (param_set_p);
+							query.sq_latitude = *latitude_p;
+							query.sq_longitude = *longitude_p;
+							query.sq_min_distance = 0.0;
+							query.sq_max_distance = 1000;
+							query.sq_start_p = NULL;
+							query.sq_end_p = NULL;
+							query.sq_projection = GetProjectionFromParameterSet (param_set_p);
+							query.sq_page_size = 0;
+							query.sq_token_s = NULL;
+							query.sq_resume_flag = false;
+							query.sq_local_distance_flag = false;
+							query.sq_taxa_ss = NULL;
+							query.sq_num_taxa = 0;
+							query.sq_taxa_match = GetTaxaMatchFromParameterSet (param_set_p);
+							query.sq_taxa_subtree_flag = false;
+							query.sq_excluded_taxa_ss = NULL;
+							query.sq_num_excluded_taxa = 0;
+							query.sq_polygon_p = NULL;
+							query.sq_counts_only_flag = false;
+							query.sq_num_nearest = S_DEFAULT_NUM_NEAREST;
+							query.sq_has_similar_id_flag = false;
+							query.sq_keywords_s = NULL;
+							query.sq_keyword_ids_flag = false;
+							query.sq_keyword_ids_p = NULL;
+							query.sq_num_keyword_ids = 0;
 
 							GetCurrentUnsignedIntParameterValueFromParameterSet (param_set_p, S_MAX_DISTANCE.npt_name_s, &max_distance_p);
 
 							if (max_distance_p)
 								{
-									max_distance = *max_distance_p;
+									query.sq_max_distance = *max_distance_p;
 								}
 
-							GetCurrentTimeParameterValueFromParameterSet (param_set_p, MA_START_DATE.npt_name_s, &start_date_p);
-							GetCurrentTimeParameterValueFromParameterSet (param_set_p, S_END_DATE.npt_name_s, &start_date_p);
-
-							query_p = GetSearchQuery (*latitude_p, *longitude_p, start_date_p, end_date_p, min_distance, max_distance);
+							GetCurrentUnsignedIntParameterValueFromParameterSet (param_set_p, S_PAGE_SIZE.npt_name_s, &page_size_p);
 
-							if (query_p)
+							if (page_size_p)
 								{
-									bson_t *bson_query_p = ConvertJSONToBSON (query_p);
+									query.sq_page_size = *page_size_p;
+								}
 
-									if (bson_query_p)
-										{
-											if (FindMatchingMongoDocumentsByBSON (data_p -> msd_mongo_p, bson_query_p, NULL, NULL))
-												{
-													json_t *results_p = GetAllExistingMongoResultsAsJSON (data_p -> msd_mongo_p);
+							GetCurrentTimeParameterValueFromParameterSet (param_set_p, MA_START_DATE.npt_name_s, &query.sq_start_p);
+							GetCurrentTimeParameterValueFromParameterSet (param_set_p, S_END_DATE.npt_name_s, &query.sq_end_p);
 
-													if (results_p)
-														{
-															json_t *result_p;
-															size_t i;
-															size_t num_successes = 0;
-															const size_t num_results  = json_array_size (results_p);
+							GetCurrentStringParameterValueFromParameterSet (param_set_p, S_CONTINUATION_TOKEN.npt_name_s, &query.sq_token_s);
 
-															json_array_foreach (results_p, i, result_p)
-																{
-																	MartiEntry *marti_p = GetMartiEntryFromJSON (result_p, data_p);
+							if (GetCurrentStringParameterValueFromParameterSet (param_set_p, S_KEYWORDS.npt_name_s, &query.sq_keywords_s) && IsStringEmpty (query.sq_keywords_s))
+								{
+									query.sq_keywords_s = NULL;
+								}
 
-																	if (marti_p)
-																		{
-																			json_t *dest_record_p = GetDataResourceAsJSONByParts (PROTOCOL_INLINE_S, NULL, marti_p -> me_sample_name_s, result_p);
-
-																			if (dest_record_p)
-																				{
-																					if (AddResultToServiceJob (job_p, dest_record_p))
-																						{
-																							++ num_successes;
-																						}
-																					else
-																						{
-																							json_decref (dest_record_p);
-																						}
-																				}
-
-																			FreeMartiEntry (marti_p);
-																		}
+							if (GetCurrentBooleanParameterValueFromParameterSet (param_set_p, S_COUNTS_ONLY.npt_name_s, &counts_only_p) && counts_only_p)
+								{
+									query.sq_counts_only_flag = *counts_only_p;
+								}
 
+							if (GetCurrentBooleanParameterValueFromParameterSet (param_set_p, S_TAXA_SUBTREE.npt_name_s, &taxa_subtree_p) && taxa_subtree_p)
+								{
+									query.sq_taxa_subtree_flag = *taxa_subtree_p;
+								}
 
-																}		/* json_array_foreach (results_p, i, result_p) */
+							if (!GetTaxaFromParameterSet (param_set_p, &MA_TAXA, query.sq_taxa_subtree_flag, &query.sq_taxa_ss, &query.sq_num_taxa, job_p))
+								{
+									valid_flag = false;
+								}
 
-															if (num_successes == num_results)
-																{
-																	status = OS_SUCCEEDED;
-																}
-															else if (num_successes > 0)
-																{
-																	status = OS_PARTIALLY_SUCCEEDED;
-																}
+							if (!GetTaxaFromParameterSet (param_set_p, &S_EXCLUDED_TAXA, query.sq_taxa_subtree_flag, &query.sq_excluded_taxa_ss, &query.sq_num_excluded_taxa, job_p))
+								{
+									valid_flag = false;
+								}
 
-															json_decref (results_p);
-														}		/* if (results_p) */
+							if (query.sq_taxa_subtree_flag && HasTaxaFilter (&query) && !IsMartiTaxonomyLoaded ())
+								{
+									AddParameterErrorMessageToServiceJob (job_p, S_TAXA_SUBTREE.npt_name_s, S_TAXA_SUBTREE.npt_type, "Descendant taxa can't be searched for as no taxonomy has been loaded");
+									valid_flag = false;
+								}
 
-												}		/* if (FindMatchingMongoDocumentsByJSON (data_p -> msd_mongo_p, query_p, NULL, NULL)) */
-											else
-												{
-													status = OS_FAILED;
-												}
+							if (query.sq_mode == MSM_BOX)
+								{
+									const char *box_s = NULL;
 
-											bson_free (bson_query_p);
-										}		/* if (bson_query_p) */
+									GetCurrentStringParameterValueFromParameterSet (param_set_p, S_BOUNDING_BOX.npt_name_s, &box_s);
 
+									if (!ParseBoundingBox (box_s, query.sq_box))
+										{
+											AddParameterErrorMessageToServiceJob (job_p, S_BOUNDING_BOX.npt_name_s, S_BOUNDING_BOX.npt_type, "The bounding box must be \"west,south,east,north\" in degrees and cover a non-zero area");
+											valid_flag = false;
+										}
+								}
+							else if (query.sq_mode == MSM_POLYGON)
+								{
+									GetCurrentJSONParameterValueFromParameterSet (param_set_p, S_POLYGON.npt_name_s, &query.sq_polygon_p);
 
-									json_decref (query_p);
+									if (!IsValidPolygon (query.sq_polygon_p))
+										{
+											AddParameterErrorMessageToServiceJob (job_p, S_POLYGON.npt_name_s, S_POLYGON.npt_type, "A GeoJSON Polygon or MultiPolygon is required");
+											valid_flag = false;
+										}
+								}
+							else if ((query.sq_mode == MSM_NEAREST) || (query.sq_mode == MSM_SIMILAR))
+								{
+									const uint32 *num_nearest_p = NULL;
+
+									GetCurrentUnsignedIntParameterValueFromParameterSet (param_set_p, S_NUM_NEAREST.npt_name_s, &num_nearest_p);
+
+									if (num_nearest_p)
+										{
+											query.sq_num_nearest = *num_nearest_p;
+										}
+
+									if ((query.sq_num_nearest > 0) && (query.sq_num_nearest <= S_MAX_NUM_NEAREST))
+										{
+											/*
+											 * The whole point of these modes is that the caller doesn't need to
+											 * know the radius and since there is a fixed number of results,
+											 * they are neither paged nor counted.
+											 */
+											query.sq_max_distance = 0;
+											query.sq_page_size = 0;
+											query.sq_token_s = NULL;
+											query.sq_counts_only_flag = false;
+										}
+									else
+										{
+											char message_s [64];
+
+											snprintf (message_s, sizeof (message_s), "This must be between 1 and " UINT32_FMT, S_MAX_NUM_NEAREST);
+											AddParameterErrorMessageToServiceJob (job_p, S_NUM_NEAREST.npt_name_s, S_NUM_NEAREST.npt_type, message_s);
+											valid_flag = false;
+										}
+
+									if (query.sq_mode == MSM_SIMILAR)
+										{
+											/* A similarity search is only limited to a radius if one is given */
+											if (max_distance_p)
+												{
+													query.sq_max_distance = *max_distance_p;
+												}
+
+											if (!GetSimilarSearchFromParameterSet (param_set_p, &query, job_p))
+												{
+													valid_flag = false;
+												}
+
+											if (query.sq_keywords_s)
+												{
+													AddParameterErrorMessageToServiceJob (job_p, S_KEYWORDS.npt_name_s, S_KEYWORDS.npt_type, "Keywords can't be used to find similar samples");
+													valid_flag = false;
+												}
+										}
+								}
+
+							if (valid_flag && (!IsStringEmpty (query.sq_token_s)))
+								{
+									/*
+									 * Resume from the last sample of the previous page. The results
+									 * are sorted by distance so rather than skipping over all of
+									 * the earlier results, we start the search at the distance
+									 * of the last one and exclude it.
+									 */
+									if (ParseContinuationToken (query.sq_token_s, & (query.sq_local_distance_flag), & (query.sq_min_distance), & (query.sq_last_id)))
+										{
+											query.sq_resume_flag = true;
+										}
+									else
+										{
+											AddParameterErrorMessageToServiceJob (job_p, S_CONTINUATION_TOKEN.npt_name_s, S_CONTINUATION_TOKEN.npt_type, "Invalid continuation token");
+											valid_flag = false;
+										}
+								}
+
+							if (valid_flag)
+								{
+									const json_t *points_p = NULL;
+
+									GetCurrentJSONParameterValueFromParameterSet (param_set_p, S_POINTS.npt_name_s, &points_p);
+
+									if (json_is_array (points_p) && (json_array_size (points_p) > 0))
+										{
+											if (query.sq_keywords_s)
+												{
+													/*
+													 * Look up the keywords once for all of the points
+													 * and let each $geoNear filter on their ids.
+													 */
+													SearchQuery keyword_query;
+
+													if (GetKeywordSearchQuery (&query, job_p, data_p, &keyword_query))
+														{
+															status = RunBatchSearch (&keyword_query, points_p, job_p, data_p, service_p -> se_grassroots_p);
+															ClearKeywordSearchQuery (&keyword_query);
+														}
+													else
+														{
+															status = OS_FAILED;
+														}
+												}
+											else
+												{
+													status = RunBatchSearch (&query, points_p, job_p, data_p, service_p -> se_grassroots_p);
+												}
+										}
+									else if (IsMartiSearchCacheEnabled ())
+										{
+											char *cache_key_s = GetSearchCacheKey (&query);
+
+											if (cache_key_s)
+												{
+													json_t *cached_results_p = NULL;
+													json_t *next_token_p = NULL;
+
+													if (GetCachedMartiSearchResults (cache_key_s, &cached_results_p, &next_token_p, &status))
+														{
+															if (!AddCachedSearchResults (job_p, cached_results_p, next_token_p))
+																{
+																	status = OS_FAILED;
+																}
+														}
+													else
+														{
+															const uint32 generation = GetMartiSearchCacheGeneration ();
+
+															cached_results_p = json_array ();
+
+															status = RunSearch (&query, job_p, data_p, &cached_results_p, &next_token_p);
+
+															if ((status == OS_SUCCEEDED) && cached_results_p)
+																{
+																	SetCachedMartiSearchResults (cache_key_s, cached_results_p, next_token_p, status, generation);
+																}
+														}
+
+													if (cached_results_p)
+														{
+															json_decref (cached_results_p);
+														}
+
+													if (next_token_p)
+														{
+															json_decref (next_token_p);
+														}
+
+													FreeCopiedString (cache_key_s);
+												}
+											else
+												{
+													status = RunSearch (&query, job_p, data_p, NULL, NULL);
+												}
+
+											AddMartiJobMetadata (job_p, S_CACHE_STATISTICS_S, GetMartiSearchCacheStatisticsAsJSON ());
+										}
+									else
+										{
+											status = RunSearch (&query, job_p, data_p, NULL, NULL);
+										}
 								}
 
 						}		/* if (GetCommonParameters (param_set_p, &latitude_p, &longitude_p, &start_p, "search", job_p)) */
@@ -338,278 +1057,4225 @@ static ServiceJobSet *RunMartiSearchService (Service *service_p, ParameterSet *p
 			LogServiceJob (job_p);
 		}		/* if (service_p -> se_jobs_p) */
 
-	return service_p -> se_jobs_p;
+	return service_p -> se_jobs_p;
+}
+
+
+/*
+ * Run a search against the database, adding the results to the given ServiceJob.
+ *
+ * If cached_results_pp is not NULL, each result record will also be appended to
+ * the array that it points to. If this array cannot be completed, it will be
+ * freed and set to NULL. If next_token_pp is not NULL, it will be set to the
+ * token for the next page of results, if there is one.
+ */
+static OperationStatus RunSearch (const SearchQuery *query_p, ServiceJob *job_p, MartiServiceData *data_p, json_t **cached_results_pp, json_t **next_token_pp)
+{
+	OperationStatus status = OS_FAILED_TO_START;
+	bson_t *bson_query_p = NULL;
+
+	if (query_p -> sq_mode == MSM_SIMILAR)
+		{
+			return RunSimilarSearch (query_p, job_p, data_p, cached_results_pp);
+		}
+
+	/*
+	 * The keywords are looked up in the Lucene index first and the
+	 * search is then run again with the ids of the samples they found.
+	 */
+	if ((query_p -> sq_keywords_s) && (!query_p -> sq_keyword_ids_flag))
+		{
+			return RunKeywordSearch (query_p, job_p, data_p, cached_results_pp, next_token_pp);
+		}
+
+	if (query_p -> sq_mode == MSM_NEAREST)
+		{
+			/* Only keyword searches find the nearest samples themselves */
+			if (IsDistanceResume (query_p, true))
+				{
+					return RejectContinuationToken (job_p);
+				}
+
+			return RunGeoNearSearch (query_p, job_p, data_p, cached_results_pp, next_token_pp);
+		}
+
+	if (query_p -> sq_counts_only_flag)
+		{
+			return RunCountSearch (query_p, job_p, data_p, cached_results_pp);
+		}
+
+	/* If the previous page came from $geoNear, so must this one */
+	if (CanUseSpatialIndex (query_p) && (!IsDistanceResume (query_p, false)))
+		{
+			return RunIndexedSearch (query_p, job_p, data_p, cached_results_pp, next_token_pp);
+		}
+
+	if (query_p -> sq_mode == MSM_RADIUS)
+		{
+			/* The previous page's distances came from GetMartiDistance () but that's no longer possible */
+			if (IsDistanceResume (query_p, true))
+				{
+					return RejectContinuationToken (job_p);
+				}
+
+			return RunGeoNearSearch (query_p, job_p, data_p, cached_results_pp, next_token_pp);
+		}
+
+	bson_query_p = GetSearchQuery (query_p);
+
+	if (bson_query_p)
+		{
+			/*
+			 * Push the field selection down to Mongo so that any
+			 * unwanted fields, such as the taxa, are never sent to us
+			 */
+			/*
+			 * $geoWithin results have no natural order, so to page
+			 * through them we sort by id. This isn't needed for
+			 * a single unpaged set of results.
+			 */
+			const bool sort_by_id_flag = (query_p -> sq_page_size > 0);
+			bson_t *opts_p = GetFindOptions (query_p -> sq_projection, data_p -> msd_stream_results_flag ? data_p -> msd_search_batch_size : 0, query_p -> sq_page_size, sort_by_id_flag);
+
+			if (FindMatchingMongoDocumentsByBSON (data_p -> msd_mongo_p, bson_query_p, NULL, opts_p))
+				{
+					SearchResults results;
+
+					results.sr_job_p = job_p;
+					results.sr_data_p = data_p;
+					results.sr_num_results = 0;
+					results.sr_num_successes = 0;
+					results.sr_has_last_flag = false;
+					results.sr_cached_results_p = cached_results_pp ? *cached_results_pp : NULL;
+					results.sr_add_distance_flag = false;
+
+					if (data_p -> msd_stream_results_flag)
+						{
+							/*
+							 * Convert each document as the cursor gives it to us so
+							 * that only the current batch is held in memory.
+							 */
+							IterateOverMongoResults (data_p -> msd_mongo_p, AddSearchResultFromBSON, &results);
+							status = GetSearchResultsStatus (&results);
+						}
+					else
+						{
+							json_t *results_p = GetAllExistingMongoResultsAsJSON (data_p -> msd_mongo_p);
+
+							if (results_p)
+								{
+									json_t *result_p;
+									size_t i;
+
+									json_array_foreach (results_p, i, result_p)
+										{
+											AddSearchResult (result_p, &results);
+										}		/* json_array_foreach (results_p, i, result_p) */
+
+									status = GetSearchResultsStatus (&results);
+
+									json_decref (results_p);
+								}		/* if (results_p) */
+						}
+
+					if (cached_results_pp && (*cached_results_pp) && (results.sr_cached_results_p == NULL))
+						{
+							json_decref (*cached_results_pp);
+							*cached_results_pp = NULL;
+						}
+
+					/*
+					 * If we have a full page, there might be more results
+					 * so let the client know how to get them.
+					 */
+					if ((query_p -> sq_page_size > 0) && (results.sr_num_results == query_p -> sq_page_size))
+						{
+							json_t *next_token_p = GetContinuationToken (&results, query_p);
+
+							if (next_token_p)
+								{
+									if (next_token_pp)
+										{
+											*next_token_pp = json_incref (next_token_p);
+										}
+
+									AddMartiJobMetadata (job_p, S_NEXT_TOKEN_S, next_token_p);
+								}
+						}
+
+				}		/* if (FindMatchingMongoDocumentsByJSON (data_p -> msd_mongo_p, query_p, NULL, NULL)) */
+			else
+				{
+					status = OS_FAILED;
+				}
+
+			if (opts_p)
+				{
+					bson_destroy (opts_p);
+				}
+
+			bson_destroy (bson_query_p);
+		}		/* if (bson_query_p) */
+
+	return status;
+}
+
+
+/*
+ * Count the matching samples for each site and month with an aggregation
+ * pipeline so that none of the documents themselves are sent to us. The
+ * counts are added to the ServiceJob as a single result:
+ *
+ *	{
+ *		"total": <number of matching samples>,
+ *		"counts": [
+ *			{ "site_name": <site>, "month": "YYYY-MM", "count": <number> },
+ *			...
+ *		]
+ *	}
+ */
+static OperationStatus RunCountSearch (const SearchQuery *query_p, ServiceJob *job_p, MartiServiceData *data_p, json_t **cached_results_pp)
+{
+	OperationStatus status = OS_FAILED_TO_START;
+	bson_t *pipeline_p = GetCountPipeline (query_p);
+
+	if (pipeline_p)
+		{
+			mongoc_cursor_t *cursor_p = mongoc_collection_aggregate (data_p -> msd_mongo_p -> mt_collection_p, MONGOC_QUERY_NONE, pipeline_p, NULL, NULL);
+
+			status = OS_FAILED;
+
+			if (cursor_p)
+				{
+					json_t *counts_p = json_array ();
+
+					if (counts_p)
+						{
+							const bson_t *document_p = NULL;
+							json_int_t total = 0;
+							bool success_flag = true;
+							bson_error_t error;
+
+							while (success_flag && mongoc_cursor_next (cursor_p, &document_p))
+								{
+									success_flag = AddCountFromBSON (document_p, counts_p, &total);
+								}
+
+							if (mongoc_cursor_error (cursor_p, &error))
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to count samples: \"%s\"", error.message);
+									success_flag = false;
+								}
+
+							if (success_flag)
+								{
+									json_t *summary_p = json_pack ("{s:I,s:o}", "total", total, "counts", counts_p);
+
+									/* counts_p is stolen by json_pack () even on failure */
+									counts_p = NULL;
+
+									if (summary_p)
+										{
+											json_t *dest_record_p = GetDataResourceAsJSONByParts (PROTOCOL_INLINE_S, NULL, "counts", summary_p);
+
+											if (dest_record_p)
+												{
+													if (cached_results_pp && (*cached_results_pp))
+														{
+															if (json_array_append (*cached_results_pp, dest_record_p) != 0)
+																{
+																	json_decref (*cached_results_pp);
+																	*cached_results_pp = NULL;
+																}
+														}
+
+													if (AddResultToServiceJob (job_p, dest_record_p))
+														{
+															status = OS_SUCCEEDED;
+														}
+													else
+														{
+															json_decref (dest_record_p);
+														}
+												}
+
+											json_decref (summary_p);
+										}
+								}
+
+							if (counts_p)
+								{
+									json_decref (counts_p);
+								}
+						}
+
+					mongoc_cursor_destroy (cursor_p);
+				}
+			else
+				{
+					PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, pipeline_p, "Failed to run aggregation");
+				}
+
+			bson_destroy (pipeline_p);
+		}
+
+	return status;
+}
+
+
+/*
+ * For a radius search, $geoNear must be the first stage and it takes the
+ * other filters as its query. For the area searches, a normal $match
+ * with the same query as a document search is used instead.
+ *
+ * The month is taken from the date, which may either be stored as
+ * a string beginning with "YYYY-MM" or as a BSON date.
+ */
+static bson_t *GetCountPipeline (const SearchQuery *query_p)
+{
+	bson_t *pipeline_p = bson_new ();
+
+	if (pipeline_p)
+		{
+			bool success_flag = false;
+			bson_t stage;
+			SearchQuery count_query = *query_p;
+
+			/* Counts are never paged */
+			count_query.sq_resume_flag = false;
+			count_query.sq_min_distance = 0.0;
+
+			if (BSON_APPEND_DOCUMENT_BEGIN (pipeline_p, "0", &stage))
+				{
+					if (query_p -> sq_mode == MSM_RADIUS)
+						{
+							success_flag = AddGeoNearStage (&stage, &count_query);
+						}
+					else
+						{
+							bson_t *match_p = GetSearchQuery (&count_query);
+
+							if (match_p)
+								{
+									success_flag = BSON_APPEND_DOCUMENT (&stage, "$match", match_p);
+									bson_destroy (match_p);
+								}
+						}
+
+					success_flag = bson_append_document_end (pipeline_p, &stage) && success_flag;
+				}
+
+			if (success_flag)
+				{
+					char *site_field_s = ConcatenateStrings ("$", ME_SITE_NAME_S);
+					char *date_field_s = ConcatenateStrings ("$", ME_START_DATE_S);
+
+					success_flag = false;
+
+					if (site_field_s && date_field_s)
+						{
+							bson_t *group_p = BCON_NEW ("$group", "{",
+																						"_id", "{",
+																							"site", BCON_UTF8 (site_field_s),
+																							"month", "{",
+																								"$cond", "[",
+																									"{", "$eq", "[", "{", "$type", BCON_UTF8 (date_field_s), "}", BCON_UTF8 ("date"), "]", "}",
+																									"{", "$dateToString", "{", "format", BCON_UTF8 ("%Y-%m"), "date", BCON_UTF8 (date_field_s), "}", "}",
+																									"{", "$substrBytes", "[", BCON_UTF8 (date_field_s), BCON_INT32 (0), BCON_INT32 (7), "]", "}",
+																								"]",
+																							"}",
+																						"}",
+																						"count", "{", "$sum", BCON_INT32 (1), "}",
+																					"}");
+							bson_t *sort_p = BCON_NEW ("$sort", "{", "_id.site", BCON_INT32 (1), "_id.month", BCON_INT32 (1), "}");
+
+							if (group_p && sort_p)
+								{
+									success_flag = BSON_APPEND_DOCUMENT (pipeline_p, "1", group_p) && BSON_APPEND_DOCUMENT (pipeline_p, "2", sort_p);
+								}
+
+							if (group_p)
+								{
+									bson_destroy (group_p);
+								}
+
+							if (sort_p)
+								{
+									bson_destroy (sort_p);
+								}
+						}
+
+					if (site_field_s)
+						{
+							FreeCopiedString (site_field_s);
+						}
+
+					if (date_field_s)
+						{
+							FreeCopiedString (date_field_s);
+						}
+				}
+
+			if (success_flag)
+				{
+					return pipeline_p;
+				}
+
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to build count pipeline for %s search", S_SEARCH_MODE_NAMES_SS [query_p -> sq_mode]);
+			bson_destroy (pipeline_p);
+		}
+
+	return NULL;
+}
+
+
+/*
+ * Convert a { _id: { site: <site>, month: <month> }, count: <n> } document
+ * from the pipeline into a JSON object and add it to the counts.
+ */
+static bool AddCountFromBSON (const bson_t *document_p, json_t *counts_p, json_int_t *total_p)
+{
+	bson_iter_t iter;
+
+	if (bson_iter_init_find (&iter, document_p, "count") && (BSON_ITER_HOLDS_INT32 (&iter) || BSON_ITER_HOLDS_INT64 (&iter)))
+		{
+			const json_int_t count = (json_int_t) bson_iter_as_int64 (&iter);
+			const char *site_s = NULL;
+			const char *month_s = NULL;
+			json_t *count_p = NULL;
+			bson_iter_t value_iter;
+
+			if (bson_iter_init (&iter, document_p) && bson_iter_find_descendant (&iter, "_id.site", &value_iter) && BSON_ITER_HOLDS_UTF8 (&value_iter))
+				{
+					site_s = bson_iter_utf8 (&value_iter, NULL);
+				}
+
+			if (bson_iter_init (&iter, document_p) && bson_iter_find_descendant (&iter, "_id.month", &value_iter) && BSON_ITER_HOLDS_UTF8 (&value_iter))
+				{
+					month_s = bson_iter_utf8 (&value_iter, NULL);
+				}
+
+			/* Samples without a site or date are counted under null */
+			count_p = json_pack ("{s:s?,s:s?,s:I}", ME_SITE_NAME_S, site_s, "month", month_s, "count", count);
+
+			if (count_p)
+				{
+					if (json_array_append_new (counts_p, count_p) == 0)
+						{
+							*total_p += count;
+							return true;
+						}
+				}
+		}
+
+	PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, document_p, "Failed to get count");
+
+	return false;
+}
+
+
+/*
+ * Search around each of a list of points. The searches are shared between a
+ * number of threads, each with its own connection from the Mongo client pool,
+ * so that they run in parallel. Once they have all finished, the results are
+ * added to the ServiceJob in the same order as the points with one result
+ * for each point:
+ *
+ *	{
+ *		"point": <the point as given in the request>,
+ *		"results": [ <matching samples> ]
+ *	}
+ *
+ * Every point is searched by radius and the search mode, counts and
+ * paging parameters are ignored.
+ */
+static OperationStatus RunBatchSearch (const SearchQuery *query_p, const json_t *points_p, ServiceJob *job_p, MartiServiceData *data_p, GrassrootsServer *grassroots_p)
+{
+	OperationStatus status = OS_FAILED_TO_START;
+	const size_t num_points = json_array_size (points_p);
+
+	if (num_points <= S_MAX_BATCH_POINTS)
+		{
+			BatchPoint *batch_points_p = (BatchPoint *) AllocMemoryArray (num_points, sizeof (BatchPoint));
+
+			if (batch_points_p)
+				{
+					size_t num_valid_points = 0;
+					bool valid_flag = true;
+
+					memset (batch_points_p, 0, num_points * sizeof (BatchPoint));
+
+					for (num_valid_points = 0; (num_valid_points < num_points) && valid_flag; ++ num_valid_points)
+						{
+							if (!GetBatchPoint (json_array_get (points_p, num_valid_points), query_p, batch_points_p + num_valid_points))
+								{
+									char message_s [64];
+
+									snprintf (message_s, sizeof (message_s), "Point " SIZET_FMT " is invalid", num_valid_points);
+									AddParameterErrorMessageToServiceJob (job_p, S_POINTS.npt_name_s, S_POINTS.npt_type, message_s);
+									valid_flag = false;
+								}
+						}
+
+					if (valid_flag)
+						{
+							BatchSearch batch;
+
+							batch.bs_points_p = batch_points_p;
+							batch.bs_num_points = num_points;
+							batch.bs_next_point = 0;
+							batch.bs_data_p = data_p;
+							batch.bs_grassroots_p = grassroots_p;
+
+							if (pthread_mutex_init (& (batch.bs_mutex), NULL) == 0)
+								{
+									int num_threads = S_DEFAULT_BATCH_THREADS;
+									pthread_t *threads_p = NULL;
+									int num_started_threads = 0;
+									size_t num_succeeded = 0;
+									size_t i;
+
+									GetJSONInteger (data_p -> msd_base_data.sd_config_p, "batch_search_threads", &num_threads);
+
+									if ((size_t) num_threads > num_points)
+										{
+											num_threads = (int) num_points;
+										}
+
+									/*
+									 * This thread does its share of the work too,
+									 * so we only need to start the others.
+									 */
+									if (num_threads > 1)
+										{
+											threads_p = (pthread_t *) AllocMemoryArray (num_threads - 1, sizeof (pthread_t));
+
+											if (threads_p)
+												{
+													while ((num_started_threads < num_threads - 1) && (pthread_create (threads_p + num_started_threads, NULL, RunBatchSearchThread, &batch) == 0))
+														{
+															++ num_started_threads;
+														}
+												}
+										}
+
+									RunBatchPoints (&batch, data_p -> msd_mongo_p);
+
+									for (i = 0; i < (size_t) num_started_threads; ++ i)
+										{
+											pthread_join (* (threads_p + i), NULL);
+										}
+
+									if (threads_p)
+										{
+											FreeMemory (threads_p);
+										}
+
+									pthread_mutex_destroy (& (batch.bs_mutex));
+
+									for (i = 0; i < num_points; ++ i)
+										{
+											if (AddBatchPointToServiceJob (job_p, batch_points_p + i, i))
+												{
+													if ((batch_points_p + i) -> bp_status == OS_SUCCEEDED)
+														{
+															++ num_succeeded;
+														}
+												}
+										}
+
+									if (num_succeeded == num_points)
+										{
+											status = OS_SUCCEEDED;
+										}
+									else if (num_succeeded > 0)
+										{
+											status = OS_PARTIALLY_SUCCEEDED;
+										}
+									else
+										{
+											status = OS_FAILED;
+										}
+								}
+						}
+
+					FreeBatchPoints (batch_points_p, num_valid_points);
+				}
+		}
+	else
+		{
+			char message_s [64];
+
+			snprintf (message_s, sizeof (message_s), "At most " SIZET_FMT " points can be searched at once", S_MAX_BATCH_POINTS);
+			AddParameterErrorMessageToServiceJob (job_p, S_POINTS.npt_name_s, S_POINTS.npt_type, message_s);
+		}
+
+	return status;
+}
+
+
+static bool GetBatchPoint (const json_t *point_p, const SearchQuery *query_p, BatchPoint *batch_point_p)
+{
+	SearchQuery *point_query_p = & (batch_point_p -> bp_query);
+	const char *start_s = GetJSONString (point_p, "start_date");
+	const char *end_s = GetJSONString (point_p, "end_date");
+
+	*point_query_p = *query_p;
+
+	point_query_p -> sq_mode = MSM_RADIUS;
+	point_query_p -> sq_min_distance = 0.0;
+	point_query_p -> sq_page_size = 0;
+	point_query_p -> sq_token_s = NULL;
+	point_query_p -> sq_resume_flag = false;
+	point_query_p -> sq_counts_only_flag = false;
+
+	batch_point_p -> bp_point_p = point_p;
+	batch_point_p -> bp_status = OS_IDLE;
+
+	if (!json_is_object (point_p))
+		{
+			return false;
+		}
+
+	if (! ((GetJSONReal (point_p, "latitude", & (point_query_p -> sq_latitude))) && (GetJSONReal (point_p, "longitude", & (point_query_p -> sq_longitude)))))
+		{
+			PrintJSONToErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, point_p, "Batch point has no valid coordinates");
+			return false;
+		}
+
+	if ((point_query_p -> sq_latitude < -90.0) || (point_query_p -> sq_latitude > 90.0) || (point_query_p -> sq_longitude < -180.0) || (point_query_p -> sq_longitude > 180.0))
+		{
+			PrintJSONToErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, point_p, "Batch point coordinates are out of range");
+			return false;
+		}
+
+	if (json_object_get (point_p, "radius"))
+		{
+			double64 radius;
+
+			if ((!GetJSONReal (point_p, "radius", &radius)) || (radius < 1.0) || (radius > (double64) UINT32_MAX))
+				{
+					PrintJSONToErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, point_p, "Batch point has an invalid radius");
+					return false;
+				}
+
+			point_query_p -> sq_max_distance = (uint32) radius;
+		}
+
+	if (start_s)
+		{
+			batch_point_p -> bp_start_p = GetTimeFromString (start_s);
+
+			if (! (batch_point_p -> bp_start_p))
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to parse batch point start date \"%s\"", start_s);
+					return false;
+				}
+
+			point_query_p -> sq_start_p = batch_point_p -> bp_start_p;
+		}
+
+	if (end_s)
+		{
+			batch_point_p -> bp_end_p = GetTimeFromString (end_s);
+
+			if (! (batch_point_p -> bp_end_p))
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to parse batch point end date \"%s\"", end_s);
+					return false;
+				}
+
+			point_query_p -> sq_end_p = batch_point_p -> bp_end_p;
+		}
+
+	return true;
+}
+
+
+static void *RunBatchSearchThread (void *data_p)
+{
+	BatchSearch *batch_p = (BatchSearch *) data_p;
+	MongoTool *tool_p = AllocateMongoTool (NULL, batch_p -> bs_grassroots_p -> gs_mongo_manager_p);
+
+	if (tool_p)
+		{
+			MartiServiceData *marti_data_p = batch_p -> bs_data_p;
+
+			if (SetMongoToolDatabaseAndCollection (tool_p, marti_data_p -> msd_database_s, marti_data_p -> msd_collection_s))
+				{
+					RunBatchPoints (batch_p, tool_p);
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to set batch search database to \"%s\" and collection to \"%s\"", marti_data_p -> msd_database_s, marti_data_p -> msd_collection_s);
+				}
+
+			FreeMongoTool (tool_p);
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate MongoTool for batch search");
+		}
+
+	return NULL;
+}
+
+
+/*
+ * Keep taking the next unsearched point until there are none left.
+ */
+static void RunBatchPoints (BatchSearch *batch_p, MongoTool *tool_p)
+{
+	bool loop_flag = true;
+
+	while (loop_flag)
+		{
+			BatchPoint *point_p = NULL;
+
+			pthread_mutex_lock (& (batch_p -> bs_mutex));
+
+			if (batch_p -> bs_next_point < batch_p -> bs_num_points)
+				{
+					point_p = (batch_p -> bs_points_p) + (batch_p -> bs_next_point);
+					++ (batch_p -> bs_next_point);
+				}
+
+			pthread_mutex_unlock (& (batch_p -> bs_mutex));
+
+			if (point_p)
+				{
+					RunBatchPoint (point_p, tool_p, batch_p -> bs_data_p);
+				}
+			else
+				{
+					loop_flag = false;
+				}
+		}
+}
+
+
+static void RunBatchPoint (BatchPoint *point_p, MongoTool *tool_p, const MartiServiceData *data_p)
+{
+	bson_t *pipeline_p = GetGeoNearPipeline (& (point_p -> bp_query));
+
+	point_p -> bp_status = OS_FAILED;
+
+	if (pipeline_p)
+		{
+			bson_t *opts_p = BCON_NEW ("batchSize", BCON_INT32 ((int32) (data_p -> msd_search_batch_size)));
+
+			if (opts_p)
+				{
+					point_p -> bp_results_p = json_array ();
+
+					if (point_p -> bp_results_p)
+						{
+							mongoc_cursor_t *cursor_p = mongoc_collection_aggregate (tool_p -> mt_collection_p, MONGOC_QUERY_NONE, pipeline_p, opts_p, NULL);
+
+							if (cursor_p)
+								{
+									const bson_t *document_p = NULL;
+									bson_error_t error;
+
+									while (mongoc_cursor_next (cursor_p, &document_p))
+										{
+											AddBatchResultFromBSON (document_p, point_p);
+										}
+
+									if (mongoc_cursor_error (cursor_p, &error))
+										{
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to get batch search results: \"%s\"", error.message);
+										}
+									else
+										{
+											point_p -> bp_status = (point_p -> bp_num_failures == 0) ? OS_SUCCEEDED : OS_PARTIALLY_SUCCEEDED;
+										}
+
+									mongoc_cursor_destroy (cursor_p);
+								}
+						}
+
+					bson_destroy (opts_p);
+				}
+
+			bson_destroy (pipeline_p);
+		}
+}
+
+
+static bool AddBatchResultFromBSON (const bson_t *document_p, void *data_p)
+{
+	BatchPoint *point_p = (BatchPoint *) data_p;
+	json_t *result_p = GetSearchResultJSONFromBSON (document_p);
+
+	if (result_p)
+		{
+			if (json_array_append_new (point_p -> bp_results_p, result_p) == 0)
+				{
+					return true;
+				}
+
+			json_decref (result_p);
+		}
+
+	++ (point_p -> bp_num_failures);
+
+	/* Carry on with the rest of the matches */
+	return true;
+}
+
+
+static bool AddBatchPointToServiceJob (ServiceJob *job_p, const BatchPoint *point_p, const size_t index)
+{
+	bool success_flag = false;
+	json_t *data_p = json_pack ("{s:O,s:O}", "point", point_p -> bp_point_p, "results", point_p -> bp_results_p ? point_p -> bp_results_p : json_null ());
+
+	if (data_p)
+		{
+			char title_s [32];
+			json_t *resource_p;
+
+			snprintf (title_s, sizeof (title_s), "Point " SIZET_FMT, index);
+
+			resource_p = GetDataResourceAsJSONByParts (PROTOCOL_INLINE_S, NULL, title_s, data_p);
+
+			if (resource_p)
+				{
+					if (AddResultToServiceJob (job_p, resource_p))
+						{
+							success_flag = true;
+						}
+					else
+						{
+							json_decref (resource_p);
+						}
+				}
+
+			json_decref (data_p);
+		}
+
+	if (!success_flag)
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add results for batch point " SIZET_FMT, index);
+		}
+
+	return success_flag;
+}
+
+
+static void FreeBatchPoints (BatchPoint *points_p, const size_t num_points)
+{
+	BatchPoint *point_p = points_p;
+	size_t i;
+
+	for (i = 0; i < num_points; ++ i, ++ point_p)
+		{
+			if (point_p -> bp_start_p)
+				{
+					FreeTime (point_p -> bp_start_p);
+				}
+
+			if (point_p -> bp_end_p)
+				{
+					FreeTime (point_p -> bp_end_p);
+				}
+
+			if (point_p -> bp_results_p)
+				{
+					json_decref (point_p -> bp_results_p);
+				}
+		}
+
+	FreeMemory (points_p);
+}
+
+
+/*
+ * Count the samples in the search area, stopping once there are
+ * limit of them, so we know whether it is a big search without
+ * having to get the documents. For a radius search, the area
+ * is treated as a $centerSphere since $geoNear can't be
+ * used to count.
+ *
+ * Returns the count, which will be at most limit, or -1 upon error.
+ */
+static int64 GetEstimatedNumberOfResults (const SearchQuery *query_p, MongoTool *tool_p, const uint32 limit)
+{
+	int64 count = -1;
+	bson_t *filter_p = GetSearchFilter (query_p);
+
+	if (filter_p)
+		{
+			bson_t *opts_p = BCON_NEW ("limit", BCON_INT64 ((int64) limit));
+
+			if (opts_p)
+				{
+					bson_error_t error;
+
+					count = mongoc_collection_count_documents (tool_p -> mt_collection_p, filter_p, opts_p, NULL, NULL, &error);
+
+					if (count < 0)
+						{
+							PrintBSONToErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, filter_p, "Failed to estimate number of search results: \"%s\"", error.message);
+						}
+
+					bson_destroy (opts_p);
+				}
+
+			bson_destroy (filter_p);
+		}
+
+	return count;
+}
+
+
+/*
+ * Get a plain find () filter for a search's area, dates, taxa and keyword
+ * ids. Radius searches use $centerSphere rather than $geoNear and nearest
+ * neighbour searches have no area so only the other fields are used.
+ */
+static bson_t *GetSearchFilter (const SearchQuery *query_p)
+{
+	bson_t *filter_p = bson_new ();
+
+	if (filter_p)
+		{
+			bool success_flag = true;
+
+			if (query_p -> sq_mode != MSM_NEAREST)
+				{
+					bson_t location;
+
+					success_flag = false;
+
+					if (BSON_APPEND_DOCUMENT_BEGIN (filter_p, ME_LOCATION_S, &location))
+						{
+							if (query_p -> sq_mode == MSM_RADIUS)
+								{
+									/* $centerSphere wants the radius in radians */
+									const double64 radius = ((double64) (query_p -> sq_max_distance)) / 6378100.0;
+									bson_t *within_p = BCON_NEW ("$geoWithin", "{", "$centerSphere", "[", "[", BCON_DOUBLE (query_p -> sq_longitude), BCON_DOUBLE (query_p -> sq_latitude), "]", BCON_DOUBLE (radius), "]", "}");
+
+									if (within_p)
+										{
+											success_flag = bson_concat (&location, within_p);
+											bson_destroy (within_p);
+										}
+								}
+							else
+								{
+									success_flag = AddGeoWithinToQuery (&location, query_p);
+								}
+
+							success_flag = bson_append_document_end (filter_p, &location) && success_flag;
+						}
+
+					if (success_flag && (query_p -> sq_mode == MSM_BOX))
+						{
+							success_flag = AddBoxBoundsToQuery (filter_p, query_p);
+						}
+				}
+
+			if (success_flag)
+				{
+					success_flag = AddDateRangeToQuery (filter_p, query_p);
+				}
+
+			if (success_flag && HasTaxaFilter (query_p))
+				{
+					success_flag = AddTaxaToQuery (filter_p, query_p);
+				}
+
+			if (success_flag)
+				{
+					success_flag = AddIdsToQuery (filter_p, query_p, NULL);
+				}
+
+			if (success_flag)
+				{
+					return filter_p;
+				}
+
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to build %s search filter", S_SEARCH_MODE_NAMES_SS [query_p -> sq_mode]);
+			bson_destroy (filter_p);
+		}
+
+	return NULL;
+}
+
+
+/*
+ * Run a search using the in-memory spatial index to find the matching ids,
+ * so the database is only used to get the documents themselves. The
+ * matches are already sorted by distance, so the results are added in
+ * that order and paging works in the same way as for RunSearch ().
+ */
+static OperationStatus RunIndexedSearch (const SearchQuery *query_p, ServiceJob *job_p, MartiServiceData *data_p, json_t **cached_results_pp, json_t **next_token_pp)
+{
+	OperationStatus status = OS_FAILED;
+	size_t num_matches = 0;
+	size_t first_match = 0;
+	MartiSpatialMatch *matches_p = NULL;
+	bool taxa_flag = true;
+
+	if (query_p -> sq_mode == MSM_BOX)
+		{
+			matches_p = FindMartiSpatialIndexMatchesInBox (query_p -> sq_box [1], query_p -> sq_box [0], query_p -> sq_box [3], query_p -> sq_box [2],
+																										 query_p -> sq_start_p, query_p -> sq_end_p, &num_matches);
+		}
+	else
+		{
+			matches_p = FindMartiSpatialIndexMatches (query_p -> sq_latitude, query_p -> sq_longitude, query_p -> sq_min_distance,
+																								query_p -> sq_resume_flag ? & (query_p -> sq_last_id) : NULL,
+																								(double64) (query_p -> sq_max_distance), query_p -> sq_start_p, query_p -> sq_end_p, &num_matches);
+		}
+
+	/*
+	 * RunSearch () only gets here with taxa if the taxa index
+	 * can work out which of the matches have them.
+	 */
+	if (HasTaxaFilter (query_p) && (num_matches > 0))
+		{
+			taxa_flag = FilterSpatialMatchesByTaxa (query_p, matches_p, &num_matches);
+		}
+
+	if (query_p -> sq_keyword_ids_flag)
+		{
+			FilterSpatialMatchesByKeywords (query_p, matches_p, &num_matches);
+		}
+
+	/* Box matches are sorted by id so skip any up to and including the last one that we sent */
+	if ((query_p -> sq_mode == MSM_BOX) && (query_p -> sq_resume_flag))
+		{
+			while ((first_match < num_matches) && (bson_oid_compare (& ((matches_p + first_match) -> msm_id), & (query_p -> sq_last_id)) <= 0))
+				{
+					++ first_match;
+				}
+		}
+
+	num_matches -= first_match;
+
+	if (taxa_flag)
+		{
+			status = AddMatchedSearchResults (query_p, matches_p + first_match, num_matches, (query_p -> sq_mode == MSM_RADIUS), job_p, data_p, cached_results_pp, next_token_pp);
+		}
+
+	if (matches_p)
+		{
+			FreeMemory (matches_p);
+		}
+
+	return status;
+}
+
+
+/*
+ * Add the documents for a sorted set of matches to the results. If there
+ * is a full page of them, a token for the next page is added to the job too.
+ */
+static OperationStatus AddMatchedSearchResults (const SearchQuery *query_p, const MartiSpatialMatch *matches_p, size_t num_matches, const bool add_distance_flag,
+																								ServiceJob *job_p, MartiServiceData *data_p, json_t **cached_results_pp, json_t **next_token_pp)
+{
+	SearchResults results;
+	OperationStatus status;
+
+	if ((query_p -> sq_page_size > 0) && (num_matches > query_p -> sq_page_size))
+		{
+			num_matches = query_p -> sq_page_size;
+		}
+
+	status = AddSpatialMatchesToResults (query_p, matches_p, NULL, num_matches, add_distance_flag, job_p, data_p, cached_results_pp, &results);
+
+	if ((query_p -> sq_page_size > 0) && (results.sr_num_results == query_p -> sq_page_size))
+		{
+			json_t *next_token_p = GetContinuationToken (&results, query_p);
+
+			if (next_token_p)
+				{
+					if (next_token_pp)
+						{
+							*next_token_pp = json_incref (next_token_p);
+						}
+
+					AddMartiJobMetadata (job_p, S_NEXT_TOKEN_S, next_token_p);
+				}
+		}
+
+	return status;
+}
+
+
+/*
+ * Get the documents for a sorted set of matches, a chunk at a time so
+ * that only one chunk is held in memory, and add them to the results
+ * in the same order as the matches. If similarities_p is not NULL, it
+ * holds the similarity of each match.
+ */
+static OperationStatus AddSpatialMatchesToResults (const SearchQuery *query_p, const MartiSpatialMatch *matches_p, const double64 *similarities_p, const size_t num_matches, const bool add_distance_flag,
+																									 ServiceJob *job_p, MartiServiceData *data_p, json_t **cached_results_pp, SearchResults *results_p)
+{
+	OperationStatus status = OS_FAILED;
+	const size_t chunk_size = (data_p -> msd_search_batch_size > 0) ? data_p -> msd_search_batch_size : num_matches;
+	bool success_flag = true;
+	size_t i;
+
+	/* This is NULL for the full projection as no options are needed */
+	bson_t *opts_p = GetFindOptions (query_p -> sq_projection, 0, 0, false);
+
+	results_p -> sr_job_p = job_p;
+	results_p -> sr_data_p = data_p;
+	results_p -> sr_num_results = 0;
+	results_p -> sr_num_successes = 0;
+	results_p -> sr_has_last_flag = false;
+	results_p -> sr_cached_results_p = cached_results_pp ? *cached_results_pp : NULL;
+	results_p -> sr_add_distance_flag = add_distance_flag;
+
+	if ((query_p -> sq_projection != MP_FULL) && (!opts_p))
+		{
+			success_flag = false;
+		}
+
+	for (i = 0; (i < num_matches) && success_flag; i += chunk_size)
+		{
+			const size_t num_chunk_matches = (num_matches - i < chunk_size) ? (num_matches - i) : chunk_size;
+
+			success_flag = AddIndexedSearchResults (matches_p + i, similarities_p ? similarities_p + i : NULL, num_chunk_matches, opts_p, results_p);
+		}
+
+	if (success_flag)
+		{
+			status = GetSearchResultsStatus (results_p);
+		}
+	else if (results_p -> sr_num_successes > 0)
+		{
+			status = OS_PARTIALLY_SUCCEEDED;
+		}
+
+	if (cached_results_pp && (*cached_results_pp) && (results_p -> sr_cached_results_p == NULL))
+		{
+			json_decref (*cached_results_pp);
+			*cached_results_pp = NULL;
+		}
+
+	if (opts_p)
+		{
+			bson_destroy (opts_p);
+		}
+
+	return status;
+}
+
+
+/*
+ * The spatial index doesn't know about the taxa so unless the
+ * taxa index can filter its matches, let Mongo combine them
+ * with the location instead. The taxa index only stores each
+ * sample's own taxa so it can't be used for their descendants.
+ */
+static bool CanUseSpatialIndex (const SearchQuery *query_p)
+{
+	return ((!HasTaxaFilter (query_p) || (IsMartiTaxaIndexEnabled () && !query_p -> sq_taxa_subtree_flag)) && (query_p -> sq_mode != MSM_POLYGON) && IsMartiSpatialIndexEnabled ());
+}
+
+
+/*
+ * Look up the keywords in the Lucene index and then combine the matching
+ * ids with the rest of the query. Whichever of the two is likely to match
+ * fewer samples is used to drive the search: if the area has more samples
+ * than matched the keywords, only the keyword matches are fetched by id and
+ * checked against the area, otherwise the area is searched as normal with
+ * the ids as an extra filter.
+ */
+static OperationStatus RunKeywordSearch (const SearchQuery *query_p, ServiceJob *job_p, MartiServiceData *data_p, json_t **cached_results_pp, json_t **next_token_pp)
+{
+	OperationStatus status = OS_FAILED;
+	SearchQuery keyword_query;
+
+	if (GetKeywordSearchQuery (query_p, job_p, data_p, &keyword_query))
+		{
+			if (keyword_query.sq_num_keyword_ids == 0)
+				{
+					/* Nothing matched the keywords so there's nothing to intersect */
+					status = OS_SUCCEEDED;
+				}
+			else if (keyword_query.sq_mode == MSM_NEAREST)
+				{
+					/*
+					 * There is no area to narrow down the samples so it's
+					 * always cheaper to work out the distances of just the
+					 * keyword matches than to run $geoNear over them all.
+					 */
+					if (IsDistanceResume (&keyword_query, false))
+						{
+							status = RejectContinuationToken (job_p);
+						}
+					else
+						{
+							status = RunKeywordDrivenSearch (&keyword_query, job_p, data_p, cached_results_pp, next_token_pp);
+						}
+				}
+			else if ((keyword_query.sq_counts_only_flag) || CanUseSpatialIndex (&keyword_query) || IsDistanceResume (&keyword_query, false))
+				{
+					/*
+					 * The spatial index matches are checked against the ids in memory.
+					 * RunSearch () uses $geoNear instead if the previous page came from it.
+					 */
+					status = RunSearch (&keyword_query, job_p, data_p, cached_results_pp, next_token_pp);
+				}
+			else if (IsDistanceResume (&keyword_query, true))
+				{
+					/* Carry on in the same way as the previous page, whatever the estimate is now */
+					status = RunKeywordDrivenSearch (&keyword_query, job_p, data_p, cached_results_pp, next_token_pp);
+				}
+			else
+				{
+					/* We only need to know whether the area has more samples than the keywords */
+					const int64 estimate = GetEstimatedNumberOfResults (query_p, data_p -> msd_mongo_p, (uint32) (keyword_query.sq_num_keyword_ids + 1));
+
+					if ((estimate < 0) || (estimate > (int64) (keyword_query.sq_num_keyword_ids)))
+						{
+							status = RunKeywordDrivenSearch (&keyword_query, job_p, data_p, cached_results_pp, next_token_pp);
+						}
+					else
+						{
+							status = RunSearch (&keyword_query, job_p, data_p, cached_results_pp, next_token_pp);
+						}
+				}
+
+			ClearKeywordSearchQuery (&keyword_query);
+		}
+
+	return status;
+}
+
+
+/*
+ * Run a search starting from the samples that matched the keywords rather
+ * than from the area. Only the ids and locations of these samples are read,
+ * using the _id index, and they are then sorted and paged in the same way
+ * as the spatial index's matches before their documents are fetched.
+ */
+static OperationStatus RunKeywordDrivenSearch (const SearchQuery *query_p, ServiceJob *job_p, MartiServiceData *data_p, json_t **cached_results_pp, json_t **next_token_pp)
+{
+	OperationStatus status = OS_FAILED;
+	bson_t *filter_p = GetSearchFilter (query_p);
+
+	if (filter_p)
+		{
+			bson_t *opts_p = BCON_NEW ("projection", "{", ME_LOCATION_S, BCON_INT32 (1), "}", "hint", "{", MONGO_ID_S, BCON_INT32 (1), "}");
+
+			if (opts_p)
+				{
+					KeywordLocations locations;
+
+					locations.kl_query_p = query_p;
+					locations.kl_num_matches = 0;
+					locations.kl_max_matches = query_p -> sq_num_keyword_ids;
+					locations.kl_matches_p = (MartiSpatialMatch *) AllocMemoryArray (locations.kl_max_matches, sizeof (MartiSpatialMatch));
+
+					if (locations.kl_matches_p)
+						{
+							if (FindMatchingMongoDocumentsByBSON (data_p -> msd_mongo_p, filter_p, NULL, opts_p) && (IterateOverMongoResults (data_p -> msd_mongo_p, AddKeywordLocationFromBSON, &locations) >= 0))
+								{
+									MartiSpatialMatch *matches_p = locations.kl_matches_p;
+									size_t num_matches = locations.kl_num_matches;
+									size_t first_match = 0;
+									const bool distance_flag = (query_p -> sq_mode == MSM_RADIUS) || (query_p -> sq_mode == MSM_NEAREST);
+
+									qsort (matches_p, num_matches, sizeof (MartiSpatialMatch), distance_flag ? CompareSpatialMatchesByDistance : CompareSpatialMatchesById);
+
+									/* Skip any matches up to and including the last one that we sent */
+									if (query_p -> sq_resume_flag)
+										{
+											while (first_match < num_matches)
+												{
+													const MartiSpatialMatch *match_p = matches_p + first_match;
+
+													if (distance_flag && (match_p -> msm_distance != query_p -> sq_min_distance))
+														{
+															if (match_p -> msm_distance > query_p -> sq_min_distance)
+																{
+																	break;
+																}
+														}
+													else if (bson_oid_compare (& (match_p -> msm_id), & (query_p -> sq_last_id)) > 0)
+														{
+															break;
+														}
+
+													++ first_match;
+												}
+										}
+
+									num_matches -= first_match;
+
+									if ((query_p -> sq_mode == MSM_NEAREST) && (num_matches > query_p -> sq_num_nearest))
+										{
+											num_matches = query_p -> sq_num_nearest;
+										}
+
+									status = AddMatchedSearchResults (query_p, matches_p + first_match, num_matches, distance_flag, job_p, data_p, cached_results_pp, next_token_pp);
+								}
+							else
+								{
+									PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, filter_p, "Failed to get the locations of the keyword matches");
+								}
+
+							FreeMemory (locations.kl_matches_p);
+						}
+
+					bson_destroy (opts_p);
+				}
+
+			bson_destroy (filter_p);
+		}
+
+	return status;
+}
+
+
+static bool AddKeywordLocationFromBSON (const bson_t *document_p, void *data_p)
+{
+	KeywordLocations *locations_p = (KeywordLocations *) data_p;
+	bson_iter_t iter;
+
+	if (bson_iter_init_find (&iter, document_p, MONGO_ID_S) && BSON_ITER_HOLDS_OID (&iter))
+		{
+			double64 latitude;
+			double64 longitude;
+
+			if (GetMartiEntryCoordinatesFromBSON (document_p, &latitude, &longitude))
+				{
+					if (locations_p -> kl_num_matches < locations_p -> kl_max_matches)
+						{
+							const SearchQuery *query_p = locations_p -> kl_query_p;
+							MartiSpatialMatch *match_p = (locations_p -> kl_matches_p) + (locations_p -> kl_num_matches);
+
+							bson_oid_copy (bson_iter_oid (&iter), & (match_p -> msm_id));
+
+							if ((query_p -> sq_mode == MSM_RADIUS) || (query_p -> sq_mode == MSM_NEAREST))
+								{
+									match_p -> msm_distance = GetMartiDistance (query_p -> sq_latitude, query_p -> sq_longitude, latitude, longitude);
+								}
+							else
+								{
+									match_p -> msm_distance = 0.0;
+								}
+
+							++ (locations_p -> kl_num_matches);
+						}
+				}
+			else
+				{
+					PrintBSONToErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, document_p, "Sample has no valid location");
+				}
+		}
+
+	return true;
+}
+
+
+/*
+ * Copy a query and look up its keywords in the Lucene index to get the
+ * ids of the samples that match them. The copy's ids should be freed
+ * with ClearKeywordSearchQuery ().
+ */
+static bool GetKeywordSearchQuery (const SearchQuery *query_p, ServiceJob *job_p, MartiServiceData *data_p, SearchQuery *keyword_query_p)
+{
+	bool success_flag = false;
+	LuceneTool *lucene_p = AllocateLuceneTool (data_p -> msd_base_data.sd_service_p -> se_grassroots_p, job_p -> sj_id);
+
+	*keyword_query_p = *query_p;
+	keyword_query_p -> sq_keyword_ids_flag = true;
+	keyword_query_p -> sq_keyword_ids_p = NULL;
+	keyword_query_p -> sq_num_keyword_ids = 0;
+
+	if (lucene_p)
+		{
+			const uint32 max_matches = data_p -> msd_max_keyword_matches;
+
+			if (SearchLucene (lucene_p, query_p -> sq_keywords_s, NULL, "default", 0, max_matches))
+				{
+					const uint32 num_hits = lucene_p -> lt_num_total_hits;
+
+					if (num_hits <= max_matches)
+						{
+							KeywordMatches matches;
+
+							matches.km_ids_p = NULL;
+							matches.km_num_ids = 0;
+							matches.km_max_ids = num_hits;
+
+							if (num_hits == 0)
+								{
+									success_flag = true;
+								}
+							else if ((matches.km_ids_p = (bson_oid_t *) AllocMemoryArray (num_hits, sizeof (bson_oid_t))) != NULL)
+								{
+									if (ParseLuceneResults (lucene_p, lucene_p -> lt_hits_from_index, lucene_p -> lt_hits_to_index, AddKeywordMatchId, &matches) == OS_SUCCEEDED)
+										{
+											keyword_query_p -> sq_keyword_ids_p = matches.km_ids_p;
+											keyword_query_p -> sq_num_keyword_ids = SortAndRemoveDuplicateIds (matches.km_ids_p, matches.km_num_ids);
+											success_flag = true;
+										}
+									else
+										{
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to parse Lucene results for \"%s\"", query_p -> sq_keywords_s);
+											FreeMemory (matches.km_ids_p);
+										}
+								}
+						}
+					else
+						{
+							char message_s [128];
+
+							snprintf (message_s, sizeof (message_s), "The keywords match " UINT32_FMT " entries but at most " UINT32_FMT " are allowed", num_hits, max_matches);
+							AddParameterErrorMessageToServiceJob (job_p, S_KEYWORDS.npt_name_s, S_KEYWORDS.npt_type, message_s);
+						}
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to search Lucene for \"%s\"", query_p -> sq_keywords_s);
+				}
+
+			FreeLuceneTool (lucene_p);
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate LuceneTool");
+		}
+
+	return success_flag;
+}
+
+
+static void ClearKeywordSearchQuery (SearchQuery *keyword_query_p)
+{
+	if (keyword_query_p -> sq_keyword_ids_p)
+		{
+			FreeMemory (keyword_query_p -> sq_keyword_ids_p);
+			keyword_query_p -> sq_keyword_ids_p = NULL;
+		}
+
+	keyword_query_p -> sq_num_keyword_ids = 0;
+}
+
+
+/*
+ * The Lucene index is shared with the other Grassroots services,
+ * so any results that aren't MARTi samples are skipped.
+ */
+static bool AddKeywordMatchId (const json_t *document_p, const uint32 UNUSED_PARAM (index), void *data_p)
+{
+	KeywordMatches *matches_p = (KeywordMatches *) data_p;
+	const char *type_s = GetJSONString (document_p, INDEXING_TYPE_S);
+
+	if (type_s && (strcmp (type_s, ME_INDEXING_TYPE_S) == 0) && (matches_p -> km_num_ids < matches_p -> km_max_ids))
+		{
+			bson_oid_t *id_p = (matches_p -> km_ids_p) + (matches_p -> km_num_ids);
+			const char *id_s = GetJSONString (document_p, LUCENE_ID_S);
+
+			if (id_s && bson_oid_is_valid (id_s, strlen (id_s)))
+				{
+					bson_oid_init_from_string (id_p, id_s);
+					++ (matches_p -> km_num_ids);
+				}
+			else if (GetMongoIdFromJSON (document_p, id_p))
+				{
+					++ (matches_p -> km_num_ids);
+				}
+			else
+				{
+					PrintJSONToErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, document_p, "Failed to get id of Lucene result");
+				}
+		}
+
+	return true;
+}
+
+
+static size_t SortAndRemoveDuplicateIds (bson_oid_t *ids_p, const size_t num_ids)
+{
+	size_t num_unique_ids = 0;
+
+	if (num_ids > 0)
+		{
+			size_t i;
+
+			qsort (ids_p, num_ids, sizeof (bson_oid_t), CompareIds);
+
+			num_unique_ids = 1;
+
+			for (i = 1; i < num_ids; ++ i)
+				{
+					if (!bson_oid_equal (ids_p + i, ids_p + num_unique_ids - 1))
+						{
+							if (i != num_unique_ids)
+								{
+									bson_oid_copy (ids_p + i, ids_p + num_unique_ids);
+								}
+
+							++ num_unique_ids;
+						}
+				}
+		}
+
+	return num_unique_ids;
+}
+
+
+static int CompareIds (const void *v0_p, const void *v1_p)
+{
+	return bson_oid_compare ((const bson_oid_t *) v0_p, (const bson_oid_t *) v1_p);
+}
+
+
+static int CompareSpatialMatchesById (const void *v0_p, const void *v1_p)
+{
+	const MartiSpatialMatch *match_0_p = (const MartiSpatialMatch *) v0_p;
+	const MartiSpatialMatch *match_1_p = (const MartiSpatialMatch *) v1_p;
+
+	return bson_oid_compare (& (match_0_p -> msm_id), & (match_1_p -> msm_id));
+}
+
+
+static int CompareSpatialMatchesByDistance (const void *v0_p, const void *v1_p)
+{
+	const MartiSpatialMatch *match_0_p = (const MartiSpatialMatch *) v0_p;
+	const MartiSpatialMatch *match_1_p = (const MartiSpatialMatch *) v1_p;
+
+	if (match_0_p -> msm_distance < match_1_p -> msm_distance)
+		{
+			return -1;
+		}
+	else if (match_0_p -> msm_distance > match_1_p -> msm_distance)
+		{
+			return 1;
+		}
+
+	return bson_oid_compare (& (match_0_p -> msm_id), & (match_1_p -> msm_id));
+}
+
+
+/*
+ * Remove any spatial index matches that didn't match the
+ * keywords, keeping the order of the remaining ones.
+ */
+static void FilterSpatialMatchesByKeywords (const SearchQuery *query_p, MartiSpatialMatch *matches_p, size_t *num_matches_p)
+{
+	const size_t num_matches = *num_matches_p;
+	size_t num_kept = 0;
+	size_t i;
+
+	for (i = 0; i < num_matches; ++ i)
+		{
+			const MartiSpatialMatch *match_p = matches_p + i;
+
+			if (bsearch (& (match_p -> msm_id), query_p -> sq_keyword_ids_p, query_p -> sq_num_keyword_ids, sizeof (bson_oid_t), CompareIds))
+				{
+					if (i != num_kept)
+						{
+							* (matches_p + num_kept) = *match_p;
+						}
+
+					++ num_kept;
+				}
+		}
+
+	*num_matches_p = num_kept;
+}
+
+
+/*
+ * Add the conditions on the samples' ids to a query. These are the ids
+ * that matched the keywords, if any, and, if resume_op_s is not NULL and
+ * we are resuming from a previous page, the comparison with the last id
+ * that we sent. They go in the same document as each other since a query
+ * can only have one _id key.
+ */
+static bool AddIdsToQuery (bson_t *query_p, const SearchQuery *search_p, const char *resume_op_s)
+{
+	bool success_flag = true;
+	const bool resume_flag = (resume_op_s != NULL) && (search_p -> sq_resume_flag);
+
+	if (resume_flag || (search_p -> sq_keyword_ids_flag))
+		{
+			bson_t id_query;
+
+			success_flag = false;
+
+			if (BSON_APPEND_DOCUMENT_BEGIN (query_p, MONGO_ID_S, &id_query))
+				{
+					success_flag = true;
+
+					if (search_p -> sq_keyword_ids_flag)
+						{
+							bson_t ids;
+
+							success_flag = false;
+
+							if (BSON_APPEND_ARRAY_BEGIN (&id_query, "$in", &ids))
+								{
+									size_t i;
+									char key_s [16];
+
+									for (i = 0; i < search_p -> sq_num_keyword_ids; ++ i)
+										{
+											const char *index_key_s = NULL;
+
+											bson_uint32_to_string ((uint32_t) i, &index_key_s, key_s, sizeof (key_s));
+											bson_append_oid (&ids, index_key_s, -1, (search_p -> sq_keyword_ids_p) + i);
+										}
+
+									success_flag = bson_append_array_end (&id_query, &ids);
+								}
+						}
+
+					if (success_flag && resume_flag)
+						{
+							success_flag = BSON_APPEND_OID (&id_query, resume_op_s, & (search_p -> sq_last_id));
+						}
+
+					success_flag = bson_append_document_end (query_p, &id_query) && success_flag;
+				}
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * Find the most similar samples with the similarity index and then
+ * get their documents in the same way as RunIndexedSearch (). The
+ * taxa are what to compare the samples against rather than a filter
+ * but any excluded taxa are removed with the taxa index, which
+ * GetSimilarSearchFromParameterSet () has checked is available.
+ */
+static OperationStatus RunSimilarSearch (const SearchQuery *query_p, ServiceJob *job_p, MartiServiceData *data_p, json_t **cached_results_pp)
+{
+	OperationStatus status = OS_FAILED;
+	size_t num_matches = 0;
+	MartiSimilarMatch *similar_matches_p = NULL;
+	const bool exclude_flag = (query_p -> sq_num_excluded_taxa > 0);
+	/* If some samples will be excluded, we need all of the candidates to get enough that aren't */
+	const uint32 max_matches = exclude_flag ? UINT32_MAX : query_p -> sq_num_nearest;
+	bool success_flag = true;
+
+	if (query_p -> sq_has_similar_id_flag)
+		{
+			similar_matches_p = FindMartiSimilarSamples (& (query_p -> sq_similar_id), NULL, 0, max_matches,
+																									 query_p -> sq_latitude, query_p -> sq_longitude, (double64) (query_p -> sq_max_distance),
+																									 query_p -> sq_start_p, query_p -> sq_end_p, &num_matches);
+		}
+	else
+		{
+			size_t num_taxa = 0;
+			uint32 *taxa_p = GetMartiTaxonIdsFromStrings (query_p -> sq_taxa_ss, query_p -> sq_num_taxa, &num_taxa);
+
+			if (taxa_p)
+				{
+					similar_matches_p = FindMartiSimilarSamples (NULL, taxa_p, num_taxa, max_matches,
+																											 query_p -> sq_latitude, query_p -> sq_longitude, (double64) (query_p -> sq_max_distance),
+																											 query_p -> sq_start_p, query_p -> sq_end_p, &num_matches);
+					FreeMemory (taxa_p);
+				}
+			else
+				{
+					success_flag = false;
+				}
+		}
+
+	if (success_flag)
+		{
+			MartiSpatialMatch *matches_p = NULL;
+			double64 *similarities_p = NULL;
+
+			if (num_matches > 0)
+				{
+					matches_p = (MartiSpatialMatch *) AllocMemoryArray (num_matches, sizeof (MartiSpatialMatch));
+					similarities_p = (double64 *) AllocMemoryArray (num_matches, sizeof (double64));
+				}
+
+			if ((num_matches == 0) || (matches_p && similarities_p))
+				{
+					size_t i;
+
+					for (i = 0; i < num_matches; ++ i)
+						{
+							const MartiSimilarMatch *similar_match_p = similar_matches_p + i;
+
+							bson_oid_copy (& (similar_match_p -> msm_id), & ((matches_p + i) -> msm_id));
+							(matches_p + i) -> msm_distance = similar_match_p -> msm_distance;
+						}
+
+					if (exclude_flag && (num_matches > 0))
+						{
+							size_t num_excluded = 0;
+							uint32 *excluded_p = GetMartiTaxonIdsFromStrings (query_p -> sq_excluded_taxa_ss, query_p -> sq_num_excluded_taxa, &num_excluded);
+
+							success_flag = false;
+
+							if (excluded_p)
+								{
+									success_flag = FilterMartiSpatialMatchesByTaxa (matches_p, &num_matches, NULL, 0, false, excluded_p, num_excluded);
+									FreeMemory (excluded_p);
+								}
+
+							if (num_matches > query_p -> sq_num_nearest)
+								{
+									num_matches = query_p -> sq_num_nearest;
+								}
+						}
+
+					if (success_flag)
+						{
+							SearchResults results;
+							size_t j = 0;
+
+							/* The filtered matches are still in the same order as the similar ones */
+							for (i = 0; i < num_matches; ++ i, ++ j)
+								{
+									while (!bson_oid_equal (& ((similar_matches_p + j) -> msm_id), & ((matches_p + i) -> msm_id)))
+										{
+											++ j;
+										}
+
+									* (similarities_p + i) = (similar_matches_p + j) -> msm_similarity;
+								}
+
+							status = AddSpatialMatchesToResults (query_p, matches_p, similarities_p, num_matches, true, job_p, data_p, cached_results_pp, &results);
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to remove the samples with excluded taxa from " SIZET_FMT " similar samples", num_matches);
+						}
+				}
+
+			if (similarities_p)
+				{
+					FreeMemory (similarities_p);
+				}
+
+			if (matches_p)
+				{
+					FreeMemory (matches_p);
+				}
+		}
+
+	if (similar_matches_p)
+		{
+			FreeMemory (similar_matches_p);
+		}
+
+	return status;
+}
+
+
+/*
+ * Work out what to compare the samples against for MSM_SIMILAR. This
+ * is either the sample given by the S_SIMILAR_TO parameter or, if
+ * that isn't set, the taxa. Any errors are added to the ServiceJob.
+ */
+static bool GetSimilarSearchFromParameterSet (ParameterSet *param_set_p, SearchQuery *query_p, ServiceJob *job_p)
+{
+	bool valid_flag = false;
+
+	if (IsMartiSimilarityIndexEnabled ())
+		{
+			const char *id_s = NULL;
+
+			GetCurrentStringParameterValueFromParameterSet (param_set_p, S_SIMILAR_TO.npt_name_s, &id_s);
+
+			if (!IsStringEmpty (id_s))
+				{
+					if (bson_oid_is_valid (id_s, strlen (id_s)))
+						{
+							bson_oid_init_from_string (& (query_p -> sq_similar_id), id_s);
+
+							if (IsInMartiSimilarityIndex (& (query_p -> sq_similar_id)))
+								{
+									query_p -> sq_has_similar_id_flag = true;
+									valid_flag = true;
+								}
+							else
+								{
+									AddParameterErrorMessageToServiceJob (job_p, S_SIMILAR_TO.npt_name_s, S_SIMILAR_TO.npt_type, "There is no sample with this id that has any taxa");
+								}
+						}
+					else
+						{
+							AddParameterErrorMessageToServiceJob (job_p, S_SIMILAR_TO.npt_name_s, S_SIMILAR_TO.npt_type, "This must be the id of a sample");
+						}
+				}
+			else if (query_p -> sq_num_taxa > 0)
+				{
+					valid_flag = true;
+				}
+			else
+				{
+					AddParameterErrorMessageToServiceJob (job_p, S_SIMILAR_TO.npt_name_s, S_SIMILAR_TO.npt_type, "Either a sample id or some taxa are needed to find similar samples");
+				}
+
+			/* The dates are applied by the similarity index but the excluded taxa need the taxa index */
+			if (query_p -> sq_num_excluded_taxa > 0)
+				{
+					if (!IsMartiTaxaIndexEnabled ())
+						{
+							AddParameterErrorMessageToServiceJob (job_p, S_EXCLUDED_TAXA.npt_name_s, S_EXCLUDED_TAXA.npt_type, "Excluded taxa can't be used to find similar samples on this server");
+							valid_flag = false;
+						}
+					else if (query_p -> sq_taxa_subtree_flag)
+						{
+							AddParameterErrorMessageToServiceJob (job_p, S_TAXA_SUBTREE.npt_name_s, S_TAXA_SUBTREE.npt_type, "The descendants of excluded taxa can't be used to find similar samples");
+							valid_flag = false;
+						}
+				}
+		}
+	else
+		{
+			AddParameterErrorMessageToServiceJob (job_p, S_SEARCH_MODE.npt_name_s, S_SEARCH_MODE.npt_type, "Similarity searches aren't available on this server");
+		}
+
+	return valid_flag;
+}
+
+
+/*
+ * Get the documents for a set of spatial index matches and add
+ * them to the results in the same order as the matches. If
+ * similarities_p is not NULL, it holds the similarity of each
+ * match which is added to its document.
+ */
+static bool AddIndexedSearchResults (const MartiSpatialMatch *matches_p, const double64 *similarities_p, const size_t num_matches, const bson_t *opts_p, SearchResults *results_p)
+{
+	bool success_flag = false;
+	IndexedDocuments docs;
+	size_t i;
+
+	docs.id_positions_p = AllocateMartiOidTable (num_matches);
+	docs.id_docs_pp = (json_t **) AllocMemoryArray (num_matches, sizeof (json_t *));
+
+	if ((docs.id_positions_p) && (docs.id_docs_pp))
+		{
+			bson_t *query_p = bson_new ();
+
+			if (query_p)
+				{
+					bson_t id_query;
+					bson_t ids;
+
+					if (BSON_APPEND_DOCUMENT_BEGIN (query_p, MONGO_ID_S, &id_query) && BSON_APPEND_ARRAY_BEGIN (&id_query, "$in", &ids))
+						{
+							char key_s [16];
+							bool ids_flag = true;
+
+							for (i = 0; (i < num_matches) && ids_flag; ++ i)
+								{
+									const char *index_key_s = NULL;
+
+									bson_uint32_to_string ((uint32_t) i, &index_key_s, key_s, sizeof (key_s));
+
+									ids_flag = bson_append_oid (&ids, index_key_s, -1, & ((matches_p + i) -> msm_id)) &&
+										SetMartiOidTableValue (docs.id_positions_p, & ((matches_p + i) -> msm_id), (uint32) i);
+								}
+
+							if (ids_flag && bson_append_array_end (&id_query, &ids) && bson_append_document_end (query_p, &id_query))
+								{
+									MongoTool *tool_p = results_p -> sr_data_p -> msd_mongo_p;
+
+									/*
+									 * Each document is converted and put in its slot as it is read
+									 * from the cursor so only this chunk is ever held in memory.
+									 */
+									if (FindMatchingMongoDocumentsByBSON (tool_p, query_p, NULL, (bson_t *) opts_p) && (IterateOverMongoResults (tool_p, AddIndexedDocumentFromBSON, &docs) >= 0))
+										{
+											for (i = 0; i < num_matches; ++ i)
+												{
+													json_t *doc_p = * (docs.id_docs_pp + i);
+
+													if (doc_p)
+														{
+															/* The index has already worked out how far away each sample is */
+															if (results_p -> sr_add_distance_flag)
+																{
+																	json_object_set_new (doc_p, S_DISTANCE_S, json_real ((matches_p + i) -> msm_distance));
+																}
+
+															if (similarities_p)
+																{
+																	json_object_set_new (doc_p, S_SIMILARITY_S, json_real (* (similarities_p + i)));
+																}
+
+															AddSearchResult (doc_p, results_p);
+														}
+												}
+
+											success_flag = true;
+										}
+								}
+						}
+
+					bson_destroy (query_p);
+				}
+		}
+
+	if (docs.id_docs_pp)
+		{
+			for (i = 0; i < num_matches; ++ i)
+				{
+					json_t *doc_p = * (docs.id_docs_pp + i);
+
+					if (doc_p)
+						{
+							json_decref (doc_p);
+						}
+				}
+
+			FreeMemory (docs.id_docs_pp);
+		}
+
+	if (docs.id_positions_p)
+		{
+			FreeMartiOidTable (docs.id_positions_p);
+		}
+
+	if (!success_flag)
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to get " SIZET_FMT " documents for spatial index matches", num_matches);
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * The callback used by IterateOverMongoResults () for the documents
+ * of a chunk of spatial index matches.
+ */
+static bool AddIndexedDocumentFromBSON (const bson_t *document_p, void *data_p)
+{
+	IndexedDocuments *docs_p = (IndexedDocuments *) data_p;
+	bson_iter_t iter;
+
+	if (bson_iter_init_find (&iter, document_p, MONGO_ID_S) && BSON_ITER_HOLDS_OID (&iter))
+		{
+			uint32 i;
+
+			if (GetMartiOidTableValue (docs_p -> id_positions_p, bson_iter_oid (&iter), &i) && (* (docs_p -> id_docs_pp + i) == NULL))
+				{
+					/* Any failure has already been logged and the match will just be missing */
+					* (docs_p -> id_docs_pp + i) = GetSearchResultJSONFromBSON (document_p);
+				}
+		}
+	else
+		{
+			PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, document_p, "Document has no id");
+		}
+
+	/* Keep going so that we can return the rest of the matches */
+	return true;
+}
+
+
+static ServiceMetadata *GetMartiSearchServiceMetadata (Service * UNUSED_PARAM (service_p))
+{
+	const char *term_url_s = CONTEXT_PREFIX_EDAM_ONTOLOGY_S "topic_0625";
+	SchemaTerm *category_p = AllocateSchemaTerm (term_url_s, "Genotype and phenotype",
+																							 "The study of genetic constitution of a living entity, such as an individual, and organism, a cell and so on, "
+																							 "typically with respect to a particular observable phenotypic traits, or resources concerning such traits, which "
+																							 "might be an aspect of biochemistry, physiology, morphology, anatomy, development and so on.");
+
+	if (category_p)
+		{
+			SchemaTerm *subcategory_p;
+
+			term_url_s = CONTEXT_PREFIX_EDAM_ONTOLOGY_S "operation_0304";
+			subcategory_p = AllocateSchemaTerm (term_url_s, "Query and retrieval", "Search or query a data resource and retrieve entries and / or annotation.");
+
+			if (subcategory_p)
+				{
+					ServiceMetadata *metadata_p = AllocateServiceMetadata (category_p, subcategory_p);
+
+					if (metadata_p)
+						{
+							SchemaTerm *input_p;
+
+							term_url_s = CONTEXT_PREFIX_EDAM_ONTOLOGY_S "data_0968";
+							input_p = AllocateSchemaTerm (term_url_s, "Keyword",
+																						"Boolean operators (AND, OR and NOT) and wildcard characters may be allowed. Keyword(s) or phrase(s) used (typically) for text-searching purposes.");
+
+							if (input_p)
+								{
+									if (AddSchemaTermToServiceMetadataInput (metadata_p, input_p))
+										{
+											SchemaTerm *output_p;
+
+
+											/* Genotype */
+											term_url_s = CONTEXT_PREFIX_EXPERIMENTAL_FACTOR_ONTOLOGY_S "EFO_0000513";
+											output_p = AllocateSchemaTerm (term_url_s, "genotype", "Information, making the distinction between the actual physical material "
+																										 "(e.g. a cell) and the information about the genetic content (genotype).");
+
+											if (output_p)
+												{
+													if (AddSchemaTermToServiceMetadataOutput (metadata_p, output_p))
+														{
+															return metadata_p;
+														}		/* if (AddSchemaTermToServiceMetadataOutput (metadata_p, output_p)) */
+													else
+														{
+															PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add output term %s to service metadata", term_url_s);
+															FreeSchemaTerm (output_p);
+														}
+
+												}		/* if (output_p) */
+											else
+												{
+													PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate output term %s for service metadata", term_url_s);
+												}
+
+										}		/* if (AddSchemaTermToServiceMetadataInput (metadata_p, input_p)) */
+									else
+										{
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add input term %s to service metadata", term_url_s);
+											FreeSchemaTerm (input_p);
+										}
+
+								}		/* if (input_p) */
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate input term %s for service metadata", term_url_s);
+								}
+
+							FreeServiceMetadata (metadata_p);
+						}		/* if (metadata_p) */
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate service metadata");
+						}
+
+				}		/* if (subcategory_p) */
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate sub-category term %s for service metadata", term_url_s);
+				}
+
+		}		/* if (category_p) */
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate category term %s for service metadata", term_url_s);
+		}
+
+	return NULL;
+}
+
+
+static ParameterSet *IsResourceForMartiSearchService (Service * UNUSED_PARAM (service_p), DataResource * UNUSED_PARAM (resource_p), Handler * UNUSED_PARAM (handler_p))
+{
+	return NULL;
+}
+
+
+/*
+ * Build the query for an area search directly as BSON rather than going
+ * via JSON. Radius and nearest searches use $geoNear instead, see
+ * AddGeoNearStage ().
+ *
+ {
+		location: {
+			$geoWithin: { ... }
+		},
+		date: {
+			$gte: <start date>,
+			$lte: <end date>
+		},
+		taxa: {
+			$in | $all: [ <taxa> ]
+		},
+		_id: {
+			$gt: <id of the last result of the previous page>
+		}
+	}
+ */
+static bson_t *GetSearchQuery (const SearchQuery *query_p)
+{
+	bson_t *root_p = bson_new ();
+
+	if (root_p)
+		{
+			bool success_flag = false;
+			bson_t location;
+
+			if (BSON_APPEND_DOCUMENT_BEGIN (root_p, ME_LOCATION_S, &location))
+				{
+					success_flag = AddGeoWithinToQuery (&location, query_p);
+					success_flag = bson_append_document_end (root_p, &location) && success_flag;
+				}		/* if (BSON_APPEND_DOCUMENT_BEGIN (root_p, ME_LOCATION_S, &location)) */
+
+			if (success_flag && (query_p -> sq_mode == MSM_BOX))
+				{
+					success_flag = AddBoxBoundsToQuery (root_p, query_p);
+				}
+
+			/*
+			 * The date is a separate field to the location so it goes
+			 * alongside it rather than within it. With the compound
+			 * location and date index, this bounds the dates within
+			 * the same index scan as the geospatial query.
+			 */
+			if (success_flag)
+				{
+					success_flag = AddDateRangeToQuery (root_p, query_p);
+				}
+
+			if (success_flag && HasTaxaFilter (query_p))
+				{
+					success_flag = AddTaxaToQuery (root_p, query_p);
+				}
+
+			/*
+			 * If we are resuming from a previous page, then start after its
+			 * last result. $geoWithin results are sorted by id when paging.
+			 */
+			if (success_flag)
+				{
+					success_flag = AddIdsToQuery (root_p, query_p, "$gt");
+				}
+
+			if (success_flag)
+				{
+					return root_p;
+				}
+
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to build %s search query", S_SEARCH_MODE_NAMES_SS [query_p -> sq_mode]);
+			bson_destroy (root_p);
+		}		/* if (root_p) */
+
+	return NULL;
+}
+
+
+/*
+ * $geoWithin: {
+ *	 $geometry: <GeoJSON Polygon or MultiPolygon>
+ * }
+ *
+ * The legacy $box operator can't use a 2dsphere index, so a bounding
+ * box is sent as a MultiPolygon instead. See AddBoxGeometryToQuery ().
+ */
+static bool AddGeoWithinToQuery (bson_t *location_p, const SearchQuery *query_p)
+{
+	bool success_flag = false;
+	bson_t geo_within;
+
+	if (BSON_APPEND_DOCUMENT_BEGIN (location_p, "$geoWithin", &geo_within))
+		{
+			if (query_p -> sq_mode == MSM_BOX)
+				{
+					success_flag = AddBoxGeometryToQuery (&geo_within, query_p);
+				}
+			else
+				{
+					bson_t *geometry_p = ConvertJSONToBSON (query_p -> sq_polygon_p);
+
+					if (geometry_p)
+						{
+							success_flag = BSON_APPEND_DOCUMENT (&geo_within, "$geometry", geometry_p);
+							bson_destroy (geometry_p);
+						}
+				}
+
+			success_flag = bson_append_document_end (location_p, &geo_within) && success_flag;
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * The edges of a GeoJSON polygon are great circle arcs rather than
+ * lines of latitude, and an arc between two points at the same latitude
+ * bulges towards the nearer pole. So the box is split into pieces no
+ * wider than S_MAX_BOX_PIECE_WIDTH and any edge whose arc would bulge
+ * into the box is moved towards the equator until the arc only just
+ * reaches the box's edge. The pieces then cover all of the box, and a
+ * little more, which AddBoxBoundsToQuery () removes.
+ *
+ * $geometry: {
+ *	 type: "MultiPolygon",
+ *	 coordinates: [ [ [ [ <west>, <south> ], ... ] ], ... ]
+ * }
+ */
+static bool AddBoxGeometryToQuery (bson_t *geo_within_p, const SearchQuery *query_p)
+{
+	const double64 to_radians = M_PI / 180.0;
+	const double64 west = query_p -> sq_box [0];
+	const double64 east = query_p -> sq_box [2];
+	const double64 width = GetBoundingBoxWidth (query_p -> sq_box);
+	const uint32 num_pieces = (uint32) ceil (width / S_MAX_BOX_PIECE_WIDTH);
+	const double64 piece_width = width / num_pieces;
+	const double64 bulge = cos (piece_width * to_radians / 2.0);
+	double64 south = query_p -> sq_box [1];
+	double64 north = query_p -> sq_box [3];
+	bool success_flag = false;
+	bson_t geometry;
+
+	if (north > S_MAX_BOX_LATITUDE)
+		{
+			north = S_MAX_BOX_LATITUDE;
+		}
+	else if (north < 0.0)
+		{
+			north = atan (tan (north * to_radians) * bulge) / to_radians;
+		}
+
+	if (south < -S_MAX_BOX_LATITUDE)
+		{
+			south = -S_MAX_BOX_LATITUDE;
+		}
+	else if (south > 0.0)
+		{
+			south = atan (tan (south * to_radians) * bulge) / to_radians;
+		}
+
+	if (BSON_APPEND_DOCUMENT_BEGIN (geo_within_p, "$geometry", &geometry))
+		{
+			bson_t pieces;
+
+			if (BSON_APPEND_UTF8 (&geometry, "type", "MultiPolygon") && BSON_APPEND_ARRAY_BEGIN (&geometry, "coordinates", &pieces))
+				{
+					uint32 i;
+					char key_s [16];
+
+					success_flag = true;
+
+					for (i = 0; i < num_pieces; ++ i)
+						{
+							const char *index_key_s = NULL;
+							double64 piece_west = west + (i * piece_width);
+							double64 piece_east = (i == num_pieces - 1) ? east : piece_west + piece_width;
+							bson_t *piece_p;
+
+							if (piece_west > 180.0)
+								{
+									piece_west -= 360.0;
+								}
+
+							if (piece_east > 180.0)
+								{
+									piece_east -= 360.0;
+								}
+
+							piece_p = BCON_NEW ("0", "[",
+																		"[", BCON_DOUBLE (piece_west), BCON_DOUBLE (south), "]",
+																		"[", BCON_DOUBLE (piece_east), BCON_DOUBLE (south), "]",
+																		"[", BCON_DOUBLE (piece_east), BCON_DOUBLE (north), "]",
+																		"[", BCON_DOUBLE (piece_west), BCON_DOUBLE (north), "]",
+																		"[", BCON_DOUBLE (piece_west), BCON_DOUBLE (south), "]",
+																	"]");
+
+							bson_uint32_to_string (i, &index_key_s, key_s, sizeof (key_s));
+
+							if (!piece_p || !BSON_APPEND_ARRAY (&pieces, index_key_s, piece_p))
+								{
+									success_flag = false;
+									i = num_pieces;
+								}
+
+							if (piece_p)
+								{
+									bson_destroy (piece_p);
+								}
+						}
+
+					success_flag = bson_append_array_end (&geometry, &pieces) && success_flag;
+				}
+
+			success_flag = bson_append_document_end (geo_within_p, &geometry) && success_flag;
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * Remove the matches from AddBoxGeometryToQuery () that are outside
+ * of the box itself with
+ *
+ *	location.coordinates.1: { $gte: <south>, $lte: <north> },
+ *	location.coordinates.0: { $gte: <west>, $lte: <east> }
+ *
+ * or, if the box crosses the antimeridian,
+ *
+ *	location.coordinates.0: { $not: { $gt: <east>, $lt: <west> } }
+ *
+ * The longitude isn't checked for a box that goes all of the way
+ * around the world.
+ */
+static bool AddBoxBoundsToQuery (bson_t *query_p, const SearchQuery *search_p)
+{
+	const double64 west = search_p -> sq_box [0];
+	const double64 south = search_p -> sq_box [1];
+	const double64 east = search_p -> sq_box [2];
+	const double64 north = search_p -> sq_box [3];
+	bool success_flag = false;
+	char key_s [64];
+	bson_t *latitude_p;
+
+	/* GeoJSON coordinates are [ longitude, latitude ] */
+	snprintf (key_s, sizeof (key_s), "%s.%s.1", ME_LOCATION_S, ME_COORDINATES_S);
+
+	latitude_p = BCON_NEW ("$gte", BCON_DOUBLE (south), "$lte", BCON_DOUBLE (north));
+
+	if (latitude_p)
+		{
+			if (BSON_APPEND_DOCUMENT (query_p, key_s, latitude_p))
+				{
+					if (GetBoundingBoxWidth (search_p -> sq_box) < 360.0)
+						{
+							bson_t *longitude_p = NULL;
+
+							snprintf (key_s, sizeof (key_s), "%s.%s.0", ME_LOCATION_S, ME_COORDINATES_S);
+
+							if (west <= east)
+								{
+									longitude_p = BCON_NEW ("$gte", BCON_DOUBLE (west), "$lte", BCON_DOUBLE (east));
+								}
+							else
+								{
+									longitude_p = BCON_NEW ("$not", "{", "$gt", BCON_DOUBLE (east), "$lt", BCON_DOUBLE (west), "}");
+								}
+
+							if (longitude_p)
+								{
+									success_flag = BSON_APPEND_DOCUMENT (query_p, key_s, longitude_p);
+									bson_destroy (longitude_p);
+								}
+						}
+					else
+						{
+							success_flag = true;
+						}
+				}
+
+			bson_destroy (latitude_p);
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * Get the number of degrees of longitude that a "west,south,east,north"
+ * box covers, going eastwards from its west edge.
+ */
+static double64 GetBoundingBoxWidth (const double64 *box_p)
+{
+	const double64 west = *box_p;
+	const double64 east = * (box_p + 2);
+
+	return (west <= east) ? (east - west) : (360.0 - (west - east));
+}
+
+
+/*
+ * Add the optional start and end dates as
+ *
+ *	date: {
+ *		$gte: <start date>,
+ *		$lte: <end date>
+ *	}
+ */
+static bool AddDateRangeToQuery (bson_t *query_p, const SearchQuery *search_p)
+{
+	bool success_flag = true;
+
+	if ((search_p -> sq_start_p) || (search_p -> sq_end_p))
+		{
+			bson_t date;
+
+			if (BSON_APPEND_DOCUMENT_BEGIN (query_p, ME_START_DATE_S, &date))
+				{
+					success_flag = AddNonTrivialTimeToQuery (&date, search_p -> sq_start_p, "$gte") && AddNonTrivialTimeToQuery (&date, search_p -> sq_end_p, "$lte");
+
+					success_flag = bson_append_document_end (query_p, &date) && success_flag;
+				}
+			else
+				{
+					success_flag = false;
+				}
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * Use the smallest integer type that holds the value, as
+ * bson_new_from_json () does.
+ */
+static bool AppendUnsignedIntToBSON (bson_t *doc_p, const char * const key_s, const uint32 value)
+{
+	if (value <= INT32_MAX)
+		{
+			return BSON_APPEND_INT32 (doc_p, key_s, (int32) value);
+		}
+
+	return BSON_APPEND_INT64 (doc_p, key_s, (int64) value);
+}
+
+
+static bool AddNonTrivialTimeToQuery (bson_t *query_p, const struct tm *time_p, const char * const op_s)
+{
+	bool success_flag = false;
+
+	if (time_p)
+		{
+			/* The dates are stored as BSON Dates which are milliseconds since the epoch in UTC */
+			struct tm t = *time_p;
+			const time_t secs = timegm (&t);
+
+			if (secs != (time_t) -1)
+				{
+					success_flag = BSON_APPEND_DATE_TIME (query_p, op_s, ((int64) secs) * 1000);
+				}
+
+		}		/* if (time_p) */
+	else
+		{
+			success_flag = true;
+		}
+
+	return success_flag;
+}
+
+
+static bool AddProjectionParameter (ParameterSet *param_set_p, ServiceData *data_p)
+{
+	bool success_flag = false;
+	Parameter *param_p = EasyCreateAndAddStringParameterToParameterSet (data_p, param_set_p, NULL, S_PROJECTION.npt_type, S_PROJECTION.npt_name_s, "Fields",
+																																			"Which fields to return for each matching sample", S_PROJECTION_NAMES_SS [MP_FULL], PL_ADVANCED);
+
+	if (param_p)
+		{
+			if (CreateAndAddStringParameterOption (param_p, S_PROJECTION_NAMES_SS [MP_MINIMAL], "The id, names, location and date only"))
+				{
+					if (CreateAndAddStringParameterOption (param_p, S_PROJECTION_NAMES_SS [MP_STANDARD], "Everything apart from the taxa"))
+						{
+							if (CreateAndAddStringParameterOption (param_p, S_PROJECTION_NAMES_SS [MP_FULL], "The complete sample"))
+								{
+									success_flag = true;
+								}
+						}
+				}
+
+			if (!success_flag)
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add options for %s parameter", S_PROJECTION.npt_name_s);
+				}
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add %s parameter", S_PROJECTION.npt_name_s);
+		}
+
+	return success_flag;
+}
+
+
+static MartiProjection GetProjectionFromParameterSet (ParameterSet *param_set_p)
+{
+	MartiProjection projection = MP_FULL;
+	const char *value_s = NULL;
+
+	if (GetCurrentStringParameterValueFromParameterSet (param_set_p, S_PROJECTION.npt_name_s, &value_s))
+		{
+			if (value_s)
+				{
+					MartiProjection i;
+
+					for (i = MP_MINIMAL; i < MP_NUM_PROJECTIONS; ++ i)
+						{
+							if (strcmp (value_s, S_PROJECTION_NAMES_SS [i]) == 0)
+								{
+									projection = i;
+									i = MP_NUM_PROJECTIONS;
+								}
+						}
+				}
+		}
+
+	return projection;
+}
+
+
+static bool AddAreaParameters (ParameterSet *param_set_p, ServiceData *data_p)
+{
+	bool success_flag = false;
+	ParameterGroup *group_p = CreateAndAddParameterGroupToParameterSet ("Area", false, data_p, param_set_p);
+	Parameter *param_p = EasyCreateAndAddStringParameterToParameterSet (data_p, param_set_p, group_p, S_SEARCH_MODE.npt_type, S_SEARCH_MODE.npt_name_s, "Search Mode",
+																																			"How to choose the area to search", S_SEARCH_MODE_NAMES_SS [MSM_RADIUS], PL_ADVANCED);
+
+	if (param_p)
+		{
+			if (CreateAndAddStringParameterOption (param_p, S_SEARCH_MODE_NAMES_SS [MSM_RADIUS], "Within the radius of the given point, nearest first"))
+				{
+					if (CreateAndAddStringParameterOption (param_p, S_SEARCH_MODE_NAMES_SS [MSM_BOX], "Within the bounding box, in no particular order"))
+						{
+							if (CreateAndAddStringParameterOption (param_p, S_SEARCH_MODE_NAMES_SS [MSM_POLYGON], "Within the polygon, in no particular order") &&
+									CreateAndAddStringParameterOption (param_p, S_SEARCH_MODE_NAMES_SS [MSM_NEAREST], "The given number of samples nearest to the point, nearest first") &&
+									CreateAndAddStringParameterOption (param_p, S_SEARCH_MODE_NAMES_SS [MSM_SIMILAR], "The given number of samples with the most similar taxa, most similar first"))
+								{
+									if ((param_p = EasyCreateAndAddStringParameterToParameterSet (data_p, param_set_p, group_p, S_BOUNDING_BOX.npt_type, S_BOUNDING_BOX.npt_name_s, "Bounding Box",
+																																								"The area to search, as \"west,south,east,north\" in degrees, when the search mode is \"box\"", NULL, PL_ADVANCED)) != NULL)
+										{
+											if ((param_p = EasyCreateAndAddJSONParameterToParameterSet (data_p, param_set_p, group_p, S_POLYGON.npt_name_s, "Polygon",
+																																									"The area to search, as a GeoJSON Polygon or MultiPolygon, when the search mode is \"polygon\"", NULL, PL_ADVANCED)) != NULL)
+												{
+													const bool counts_only_flag = false;
+
+													if ((param_p = EasyCreateAndAddBooleanParameterToParameterSet (data_p, param_set_p, group_p, S_COUNTS_ONLY.npt_name_s, "Counts only",
+																																												 "Rather than the matching samples, just return how many there are for each site and month", &counts_only_flag, PL_ADVANCED)) != NULL)
+														{
+															if ((param_p = EasyCreateAndAddUnsignedIntParameterToParameterSet (data_p, param_set_p, group_p, S_NUM_NEAREST.npt_name_s, "Number of nearest",
+																																																"The number of samples to find when the search mode is \"nearest\" or \"similar\"", &S_DEFAULT_NUM_NEAREST, PL_ADVANCED)) != NULL)
+																{
+																	if ((param_p = EasyCreateAndAddStringParameterToParameterSet (data_p, param_set_p, group_p, S_SIMILAR_TO.npt_type, S_SIMILAR_TO.npt_name_s, "Similar to",
+																																																"The id of the sample to compare against when the search mode is \"similar\". If this is not set, the taxa are compared against instead", NULL, PL_ADVANCED)) != NULL)
+																		{
+																			success_flag = true;
+																		}
+																	else
+																		{
+																			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add %s parameter", S_SIMILAR_TO.npt_name_s);
+																		}
+																}
+															else
+																{
+																	PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add %s parameter", S_NUM_NEAREST.npt_name_s);
+																}
+														}
+													else
+														{
+															PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add %s parameter", S_COUNTS_ONLY.npt_name_s);
+														}
+												}
+											else
+												{
+													PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add %s parameter", S_POLYGON.npt_name_s);
+												}
+										}
+									else
+										{
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add %s parameter", S_BOUNDING_BOX.npt_name_s);
+										}
+								}
+						}
+				}
+
+			if (!success_flag)
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add area parameters");
+				}
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add %s parameter", S_SEARCH_MODE.npt_name_s);
+		}
+
+	return success_flag;
+}
+
+
+static MartiSearchMode GetSearchModeFromParameterSet (ParameterSet *param_set_p)
+{
+	MartiSearchMode mode = MSM_RADIUS;
+	const char *value_s = NULL;
+
+	if (GetCurrentStringParameterValueFromParameterSet (param_set_p, S_SEARCH_MODE.npt_name_s, &value_s))
+		{
+			if (value_s)
+				{
+					MartiSearchMode i;
+
+					for (i = MSM_RADIUS; i < MSM_NUM_MODES; ++ i)
+						{
+							if (strcmp (value_s, S_SEARCH_MODE_NAMES_SS [i]) == 0)
+								{
+									mode = i;
+									i = MSM_NUM_MODES;
+								}
+						}
+				}
+		}
+
+	return mode;
+}
+
+
+/*
+ * Parse "west,south,east,north". If west is greater than
+ * east, the box crosses the antimeridian. Boxes with no
+ * width or height, or which are only at a pole, are rejected.
+ */
+static bool ParseBoundingBox (const char *box_s, double64 *box_p)
+{
+	if (box_s)
+		{
+			double64 west;
+			double64 south;
+			double64 east;
+			double64 north;
+			char c;
+
+			if (sscanf (box_s, " %lf , %lf , %lf , %lf %c", &west, &south, &east, &north, &c) == 4)
+				{
+					if ((west >= -180.0) && (west <= 180.0) && (east >= -180.0) && (east <= 180.0) &&
+							(south >= -90.0) && (north <= 90.0) && (south < north) &&
+							(south < S_MAX_BOX_LATITUDE) && (north > -S_MAX_BOX_LATITUDE))
+						{
+							*box_p = west;
+							* (box_p + 1) = south;
+							* (box_p + 2) = east;
+							* (box_p + 3) = north;
+
+							if (GetBoundingBoxWidth (box_p) > 0.0)
+								{
+									return true;
+								}
+						}
+				}
+
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Invalid bounding box \"%s\"", box_s);
+		}
+
+	return false;
+}
+
+
+static bool IsValidPolygon (const json_t *polygon_p)
+{
+	if (polygon_p)
+		{
+			const char *type_s = GetJSONString (polygon_p, "type");
+
+			if (type_s && ((strcmp (type_s, "Polygon") == 0) || (strcmp (type_s, "MultiPolygon") == 0)))
+				{
+					const json_t *coords_p = json_object_get (polygon_p, "coordinates");
+
+					if (json_is_array (coords_p) && (json_array_size (coords_p) > 0))
+						{
+							return true;
+						}
+				}
+
+			PrintJSONToErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, polygon_p, "Invalid polygon");
+		}
+
+	return false;
+}
+
+
+/*
+ * The part of the cache key that describes where to search.
+ */
+static char *GetAreaCacheKey (const SearchQuery *query_p)
+{
+	char *key_s = NULL;
+
+	if (query_p -> sq_mode == MSM_POLYGON)
+		{
+			char *polygon_s = json_dumps (query_p -> sq_polygon_p, JSON_COMPACT | JSON_SORT_KEYS);
+
+			if (polygon_s)
+				{
+					key_s = ConcatenateStrings ("polygon|", polygon_s);
+					free (polygon_s);
+				}
+		}
+	else
+		{
+			char buffer_s [256];
+			int res;
+
+			if (query_p -> sq_mode == MSM_BOX)
+				{
+					res = snprintf (buffer_s, sizeof (buffer_s), "box|%.6f|%.6f|%.6f|%.6f",
+													query_p -> sq_box [0], query_p -> sq_box [1], query_p -> sq_box [2], query_p -> sq_box [3]);
+				}
+			else if (query_p -> sq_mode == MSM_NEAREST)
+				{
+					res = snprintf (buffer_s, sizeof (buffer_s), "nearest|%.6f|%.6f|" UINT32_FMT,
+													query_p -> sq_latitude, query_p -> sq_longitude, query_p -> sq_num_nearest);
+				}
+			else if (query_p -> sq_mode == MSM_SIMILAR)
+				{
+					/* If there's no sample id, the taxa are already in the key */
+					char id_s [25];
+
+					if (query_p -> sq_has_similar_id_flag)
+						{
+							bson_oid_to_string (& (query_p -> sq_similar_id), id_s);
+						}
+					else
+						{
+							*id_s = '\0';
+						}
+
+					res = snprintf (buffer_s, sizeof (buffer_s), "similar|%s|%.6f|%.6f|" UINT32_FMT "|" UINT32_FMT,
+													id_s, query_p -> sq_latitude, query_p -> sq_longitude, query_p -> sq_max_distance, query_p -> sq_num_nearest);
+				}
+			else
+				{
+					res = snprintf (buffer_s, sizeof (buffer_s), "radius|%.6f|%.6f|" UINT32_FMT,
+													query_p -> sq_latitude, query_p -> sq_longitude, query_p -> sq_max_distance);
+				}
+
+			if ((res > 0) && (res < (int) sizeof (buffer_s)))
+				{
+					key_s = EasyCopyToNewString (buffer_s);
+				}
+		}
+
+	return key_s;
+}
+
+
+static bool AddBatchParameters (ParameterSet *param_set_p, ServiceData *data_p)
+{
+	ParameterGroup *group_p = CreateAndAddParameterGroupToParameterSet ("Batch Search", false, data_p, param_set_p);
+	Parameter *param_p = EasyCreateAndAddJSONParameterToParameterSet (data_p, param_set_p, group_p, S_POINTS.npt_name_s, "Points",
+																																		"An array of points to search around, each of the form "
+																																		"{ \"latitude\": <degrees>, \"longitude\": <degrees>, \"radius\": <metres>, \"start_date\": <date>, \"end_date\": <date> } "
+																																		"where the radius and dates are optional. If this is set, the results are grouped by point.", NULL, PL_ADVANCED);
+
+	if (param_p)
+		{
+			return true;
+		}
+
+	PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add %s parameter", S_POINTS.npt_name_s);
+
+	return false;
+}
+
+
+static bool AddTaxaParameters (ParameterSet *param_set_p, ServiceData *data_p)
+{
+	bool success_flag = false;
+	ParameterGroup *group_p = CreateAndAddParameterGroupToParameterSet ("Taxa", false, data_p, param_set_p);
+	Parameter *param_p = EasyCreateAndAddStringArrayParameterToParameterSet (data_p, param_set_p, group_p, MA_TAXA.npt_name_s, "Taxa",
+																																					 "Only find samples with these taxonomy identifiers", NULL, 0, PL_ALL);
+
+	if (param_p)
+		{
+			param_p = EasyCreateAndAddStringParameterToParameterSet (data_p, param_set_p, group_p, S_TAXA_MATCH.npt_type, S_TAXA_MATCH.npt_name_s, "Match",
+																															 "Whether samples must have any or all of the taxa", S_TAXA_MATCH_NAMES_SS [MTM_ANY], PL_ALL);
+
+			if (param_p)
+				{
+					if (CreateAndAddStringParameterOption (param_p, S_TAXA_MATCH_NAMES_SS [MTM_ANY], "Any of the taxa"))
+						{
+							if (CreateAndAddStringParameterOption (param_p, S_TAXA_MATCH_NAMES_SS [MTM_ALL], "All of the taxa"))
+								{
+									const bool subtree_flag = false;
+
+									if (EasyCreateAndAddBooleanParameterToParameterSet (data_p, param_set_p, group_p, S_TAXA_SUBTREE.npt_name_s, "Include descendants",
+																																			"Also find samples with any of the taxa's descendants in the NCBI taxonomy", &subtree_flag, PL_ADVANCED))
+										{
+											if (EasyCreateAndAddStringArrayParameterToParameterSet (data_p, param_set_p, group_p, S_EXCLUDED_TAXA.npt_name_s, "Excluded Taxa",
+																																							"Don't find samples with any of these taxonomy identifiers", NULL, 0, PL_ADVANCED))
+												{
+													success_flag = true;
+												}
+											else
+												{
+													PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add %s parameter", S_EXCLUDED_TAXA.npt_name_s);
+												}
+										}
+									else
+										{
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add %s parameter", S_TAXA_SUBTREE.npt_name_s);
+										}
+								}
+						}
+
+					if (!success_flag)
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add options for %s parameter", S_TAXA_MATCH.npt_name_s);
+						}
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add %s parameter", S_TAXA_MATCH.npt_name_s);
+				}
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add %s parameter", MA_TAXA.npt_name_s);
+		}
+
+	return success_flag;
+}
+
+
+static bool AddKeywordParameter (ParameterSet *param_set_p, ServiceData *data_p)
+{
+	bool success_flag = false;
+
+	if (EasyCreateAndAddStringParameterToParameterSet (data_p, param_set_p, NULL, S_KEYWORDS.npt_type, S_KEYWORDS.npt_name_s, "Keywords",
+																										 "Only find samples whose sample name, site name or comments match these keywords", NULL, PL_ALL))
+		{
+			success_flag = true;
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add %s parameter", S_KEYWORDS.npt_name_s);
+		}
+
+	return success_flag;
+}
+
+
+static MartiTaxaMatch GetTaxaMatchFromParameterSet (ParameterSet *param_set_p)
+{
+	MartiTaxaMatch match = MTM_ANY;
+	const char *value_s = NULL;
+
+	if (GetCurrentStringParameterValueFromParameterSet (param_set_p, S_TAXA_MATCH.npt_name_s, &value_s))
+		{
+			if (value_s)
+				{
+					if (strcmp (value_s, S_TAXA_MATCH_NAMES_SS [MTM_ALL]) == 0)
+						{
+							match = MTM_ALL;
+						}
+				}
+		}
+
+	return match;
+}
+
+
+/*
+ * Since the taxa are stored as an array, Mongo can use
+ * a multikey index for $in, $all and $nin. The taxa are
+ * stored as 32-bit integers so the ids are converted to
+ * match, which RunMartiSearchService () has already
+ * checked that they can be.
+ */
+static bool AddTaxaToQuery (bson_t *query_p, const SearchQuery *search_p)
+{
+	bool success_flag = false;
+	bson_t taxa_query;
+
+	if (search_p -> sq_taxa_subtree_flag)
+		{
+			return AddTaxaIntervalsToQuery (query_p, search_p);
+		}
+
+	if (BSON_APPEND_DOCUMENT_BEGIN (query_p, ME_TAXA_S, &taxa_query))
+		{
+			success_flag = true;
+
+			if (search_p -> sq_num_taxa > 0)
+				{
+					success_flag = AddTaxaArrayToQuery (&taxa_query, (search_p -> sq_taxa_match == MTM_ALL) ? "$all" : "$in", search_p -> sq_taxa_ss, search_p -> sq_num_taxa);
+				}
+
+			if (success_flag && (search_p -> sq_num_excluded_taxa > 0))
+				{
+					success_flag = AddTaxaArrayToQuery (&taxa_query, "$nin", search_p -> sq_excluded_taxa_ss, search_p -> sq_num_excluded_taxa);
+				}
+
+			success_flag = bson_append_document_end (query_p, &taxa_query) && success_flag;
+		}
+
+	if (!success_flag)
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add " SIZET_FMT " taxa and " SIZET_FMT " excluded taxa to query", search_p -> sq_num_taxa, search_p -> sq_num_excluded_taxa);
+		}
+
+	return success_flag;
+}
+
+
+static bool AddTaxaArrayToQuery (bson_t *query_p, const char *key_s, const char **taxa_ss, const size_t num_taxa)
+{
+	bool success_flag = false;
+	bson_t values;
+
+	if (BSON_APPEND_ARRAY_BEGIN (query_p, key_s, &values))
+		{
+			size_t i;
+			uint32 j = 0;
+			char index_s [16];
+
+			success_flag = true;
+
+			for (i = 0; (i < num_taxa) && success_flag; ++ i, ++ taxa_ss)
+				{
+					uint32 taxon;
+
+					if (GetMartiTaxonIdFromString (*taxa_ss, &taxon))
+						{
+							const char *index_key_s = NULL;
+
+							bson_uint32_to_string (j, &index_key_s, index_s, sizeof (index_s));
+							success_flag = BSON_APPEND_INT32 (&values, index_key_s, (int32) taxon);
+							++ j;
+						}
+				}
+
+			success_flag = bson_append_array_end (query_p, &values) && success_flag;
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * Each sample stores the pre-order numbers of its taxa, so having a
+ * taxon or any of its descendants is a range query on those numbers:
+ *
+ *	$or | $and: [
+ *		{ taxa_preorder: { $elemMatch: { $gte: <first>, $lte: <last> } } },
+ *		...
+ *	],
+ *	$nor: [
+ *		<the same for each excluded taxon>
+ *	]
+ *
+ * $elemMatch makes sure that both bounds apply to the same number so
+ * that the multikey index can be scanned over just the one range.
+ */
+static bool AddTaxaIntervalsToQuery (bson_t *query_p, const SearchQuery *search_p)
+{
+	bool success_flag = true;
+
+	if (search_p -> sq_num_taxa > 0)
+		{
+			success_flag = AddTaxaIntervalClausesToQuery (query_p, (search_p -> sq_taxa_match == MTM_ALL) ? "$and" : "$or", search_p -> sq_taxa_ss, search_p -> sq_num_taxa);
+		}
+
+	if (success_flag && (search_p -> sq_num_excluded_taxa > 0))
+		{
+			success_flag = AddTaxaIntervalClausesToQuery (query_p, "$nor", search_p -> sq_excluded_taxa_ss, search_p -> sq_num_excluded_taxa);
+		}
+
+	if (!success_flag)
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add " SIZET_FMT " taxa subtrees and " SIZET_FMT " excluded taxa subtrees to query", search_p -> sq_num_taxa, search_p -> sq_num_excluded_taxa);
+		}
+
+	return success_flag;
+}
+
+
+static bool AddTaxaIntervalClausesToQuery (bson_t *query_p, const char *key_s, const char **taxa_ss, const size_t num_taxa)
+{
+	bool success_flag = false;
+	bson_t clauses;
+
+	if (BSON_APPEND_ARRAY_BEGIN (query_p, key_s, &clauses))
+		{
+			size_t i;
+			uint32 j = 0;
+			char index_s [16];
+
+			success_flag = true;
+
+			for (i = 0; (i < num_taxa) && success_flag; ++ i, ++ taxa_ss)
+				{
+					uint32 taxon;
+					uint32 first;
+					uint32 last;
+
+					if (GetMartiTaxonIdFromString (*taxa_ss, &taxon) && GetMartiTaxonInterval (taxon, &first, &last))
+						{
+							const char *index_key_s = NULL;
+							bson_t *clause_p = NULL;
+
+							bson_uint32_to_string (j, &index_key_s, index_s, sizeof (index_s));
+
+							clause_p = BCON_NEW (ME_TAXA_PREORDER_S, "{", "$elemMatch", "{", "$gte", BCON_INT32 ((int32) first), "$lte", BCON_INT32 ((int32) last), "}", "}");
+
+							if (clause_p)
+								{
+									success_flag = BSON_APPEND_DOCUMENT (&clauses, index_key_s, clause_p);
+									bson_destroy (clause_p);
+								}
+							else
+								{
+									success_flag = false;
+								}
+
+							++ j;
+						}
+				}
+
+			success_flag = bson_append_array_end (query_p, &clauses) && success_flag;
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * Get the taxa from one of the taxa parameters. If all of them are
+ * empty, then the parameter isn't used at all. Any errors are added
+ * to the ServiceJob.
+ */
+static bool GetTaxaFromParameterSet (ParameterSet *param_set_p, const NamedParameterType *param_p, const bool subtree_flag, const char ***taxa_sss, size_t *num_taxa_p, ServiceJob *job_p)
+{
+	bool valid_flag = true;
+
+	GetCurrentStringArrayParameterValuesFromParameterSet (param_set_p, param_p -> npt_name_s, taxa_sss, num_taxa_p);
+
+	if (*num_taxa_p > 0)
+		{
+			const char **taxa_ss = *taxa_sss;
+			size_t i;
+			bool empty_flag = true;
+
+			for (i = 0; (i < *num_taxa_p) && empty_flag; ++ i)
+				{
+					empty_flag = IsStringEmpty (* (taxa_ss + i));
+				}
+
+			if (empty_flag)
+				{
+					*num_taxa_p = 0;
+				}
+			else
+				{
+					/* If there isn't a taxonomy, RunMartiSearchService () reports it */
+					const bool check_interval_flag = subtree_flag && IsMartiTaxonomyLoaded ();
+
+					for (i = 0; (i < *num_taxa_p) && valid_flag; ++ i)
+						{
+							const char *taxon_s = * (taxa_ss + i);
+
+							if (!IsStringEmpty (taxon_s))
+								{
+									uint32 taxon;
+									uint32 first;
+									uint32 last;
+
+									if (!GetMartiTaxonIdFromString (taxon_s, &taxon))
+										{
+											AddParameterErrorMessageToServiceJob (job_p, param_p -> npt_name_s, param_p -> npt_type, "The taxa must be NCBI taxonomy ids");
+											valid_flag = false;
+										}
+									else if (check_interval_flag && !GetMartiTaxonInterval (taxon, &first, &last))
+										{
+											AddParameterErrorMessageToServiceJob (job_p, param_p -> npt_name_s, param_p -> npt_type, "The taxa must be in the taxonomy to search for their descendants");
+											valid_flag = false;
+										}
+								}
+						}
+				}
+		}
+
+	return valid_flag;
+}
+
+
+static bool HasTaxaFilter (const SearchQuery *query_p)
+{
+	return ((query_p -> sq_num_taxa > 0) || (query_p -> sq_num_excluded_taxa > 0));
+}
+
+
+/*
+ * Apply the taxa to the spatial index matches using the taxa index
+ * so that only the documents that match are fetched.
+ */
+static bool FilterSpatialMatchesByTaxa (const SearchQuery *query_p, MartiSpatialMatch *matches_p, size_t *num_matches_p)
+{
+	bool success_flag = false;
+	size_t num_taxa = 0;
+	uint32 *taxa_p = NULL;
+
+	if (query_p -> sq_num_taxa > 0)
+		{
+			taxa_p = GetMartiTaxonIdsFromStrings (query_p -> sq_taxa_ss, query_p -> sq_num_taxa, &num_taxa);
+		}
+
+	if ((query_p -> sq_num_taxa == 0) || taxa_p)
+		{
+			size_t num_excluded = 0;
+			uint32 *excluded_p = NULL;
+
+			if (query_p -> sq_num_excluded_taxa > 0)
+				{
+					excluded_p = GetMartiTaxonIdsFromStrings (query_p -> sq_excluded_taxa_ss, query_p -> sq_num_excluded_taxa, &num_excluded);
+				}
+
+			if ((query_p -> sq_num_excluded_taxa == 0) || excluded_p)
+				{
+					success_flag = FilterMartiSpatialMatchesByTaxa (matches_p, num_matches_p, taxa_p, num_taxa, (query_p -> sq_taxa_match == MTM_ALL), excluded_p, num_excluded);
+				}
+
+			if (excluded_p)
+				{
+					FreeMemory (excluded_p);
+				}
+		}
+
+	if (taxa_p)
+		{
+			FreeMemory (taxa_p);
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * Get the find options to only return the fields for the
+ * given projection and, if batch_size is non-zero, to
+ * read the matching documents in batches of that size.
+ * If limit is non-zero, then at most that many documents
+ * will be returned. This returns NULL if no options are
+ * needed.
+ */
+static bson_t *GetFindOptions (const MartiProjection projection, const uint32 batch_size, const uint32 limit, const bool sort_by_id_flag)
+{
+	bson_t *opts_p = NULL;
+
+	if ((projection != MP_FULL) || (batch_size > 0) || (limit > 0) || sort_by_id_flag)
+		{
+			opts_p = bson_new ();
+
+			if (opts_p)
+				{
+					bool success_flag = true;
+
+					if (projection != MP_FULL)
+						{
+							bson_t fields;
+
+							success_flag = false;
+
+							if (BSON_APPEND_DOCUMENT_BEGIN (opts_p, "projection", &fields))
+								{
+									success_flag = AddProjectionFields (&fields, projection, false);
+
+									if (!bson_append_document_end (opts_p, &fields))
+										{
+											success_flag = false;
+										}
+								}
+
+							if (!success_flag)
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create projection for \"%s\"", S_PROJECTION_NAMES_SS [projection]);
+								}
+						}
+
+					if (success_flag && (batch_size > 0))
+						{
+							if (!BSON_APPEND_INT32 (opts_p, "batchSize", (int32) batch_size))
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to set batch size to " UINT32_FMT, batch_size);
+									success_flag = false;
+								}
+						}
+
+					if (success_flag && (limit > 0))
+						{
+							if (!BSON_APPEND_INT64 (opts_p, "limit", (int64) limit))
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to set limit to " UINT32_FMT, limit);
+									success_flag = false;
+								}
+						}
+
+					if (success_flag && sort_by_id_flag)
+						{
+							bson_t sort;
+
+							success_flag = false;
+
+							if (BSON_APPEND_DOCUMENT_BEGIN (opts_p, "sort", &sort))
+								{
+									success_flag = BSON_APPEND_INT32 (&sort, MONGO_ID_S, 1);
+									success_flag = bson_append_document_end (opts_p, &sort) && success_flag;
+								}
+
+							if (!success_flag)
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to set sort order");
+								}
+						}
+
+					if (!success_flag)
+						{
+							bson_destroy (opts_p);
+							opts_p = NULL;
+						}
+				}
+		}
+
+	return opts_p;
+}
+
+
+/*
+ * Add the fields to keep, or remove, for a projection. If distance_flag
+ * is true, the distance added by $geoNear is kept too.
+ */
+static bool AddProjectionFields (bson_t *fields_p, const MartiProjection projection, const bool distance_flag)
+{
+	bool success_flag = false;
+
+	if (projection == MP_MINIMAL)
+		{
+			success_flag = BSON_APPEND_INT32 (fields_p, ME_NAME_S, 1) &&
+				BSON_APPEND_INT32 (fields_p, ME_MARTI_ID_S, 1) &&
+				BSON_APPEND_INT32 (fields_p, ME_LOCATION_S, 1) &&
+				BSON_APPEND_INT32 (fields_p, ME_START_DATE_S, 1);
+
+			if (success_flag && distance_flag)
+				{
+					success_flag = BSON_APPEND_INT32 (fields_p, S_DISTANCE_S, 1);
+				}
+		}
+	else
+		{
+			success_flag = BSON_APPEND_INT32 (fields_p, ME_TAXA_S, 0);
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * $geoNear: {
+ *	near: { type: "Point", coordinates: [ <longitude>, <latitude> ] },
+ *	key: "location",
+ *	distanceField: "distance",
+ *	spherical: true,
+ *	minDistance: <metres>,
+ *	maxDistance: <metres>,
+ *	query: { <dates, taxa and keyword ids> }
+ * }
+ *
+ * The distances are left out if they are 0. When resuming, minDistance
+ * is the distance of the last sample that we sent. It only bounds the
+ * index scan, since other samples can be at exactly the same distance,
+ * and AddDistanceResumeStage () picks the ones that come after it.
+ */
+static bool AddGeoNearStage (bson_t *stage_p, const SearchQuery *query_p)
+{
+	bool success_flag = false;
+	bson_t geo_near;
+
+	if (BSON_APPEND_DOCUMENT_BEGIN (stage_p, "$geoNear", &geo_near))
+		{
+			bson_t *near_p = BCON_NEW ("type", BCON_UTF8 ("Point"), "coordinates", "[", BCON_DOUBLE (query_p -> sq_longitude), BCON_DOUBLE (query_p -> sq_latitude), "]");
+
+			if (near_p)
+				{
+					if (BSON_APPEND_DOCUMENT (&geo_near, "near", near_p) &&
+							BSON_APPEND_UTF8 (&geo_near, "key", ME_LOCATION_S) &&
+							BSON_APPEND_UTF8 (&geo_near, "distanceField", S_DISTANCE_S) &&
+							BSON_APPEND_BOOL (&geo_near, "spherical", true))
+						{
+							success_flag = true;
+
+							if (query_p -> sq_min_distance > 0.0)
+								{
+									success_flag = BSON_APPEND_DOUBLE (&geo_near, "minDistance", query_p -> sq_min_distance);
+								}
+
+							if (success_flag && (query_p -> sq_max_distance > 0))
+								{
+									success_flag = AppendUnsignedIntToBSON (&geo_near, "maxDistance", query_p -> sq_max_distance);
+								}
+
+							if (success_flag)
+								{
+									bson_t filter;
+
+									success_flag = false;
+
+									if (BSON_APPEND_DOCUMENT_BEGIN (&geo_near, "query", &filter))
+										{
+											success_flag = AddDateRangeToQuery (&filter, query_p);
+
+											if (success_flag && HasTaxaFilter (query_p))
+												{
+													success_flag = AddTaxaToQuery (&filter, query_p);
+												}
+
+											if (success_flag)
+												{
+													success_flag = AddIdsToQuery (&filter, query_p, NULL);
+												}
+
+											success_flag = bson_append_document_end (&geo_near, &filter) && success_flag;
+										}
+								}
+						}
+
+					bson_destroy (near_p);
+				}
+
+			success_flag = bson_append_document_end (stage_p, &geo_near) && success_flag;
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * $match: {
+ *	$or: [
+ *		{ distance: { $gt: <last distance> } },
+ *		{ distance: <last distance>, _id: { $gt: <last id> } }
+ *	]
+ * }
+ *
+ * Samples at the same distance come back from $geoNear in no particular
+ * order, so paged searches sort them by id too. This selects the samples
+ * after the last one that we sent in that order.
+ */
+static bool AddDistanceResumeStage (bson_t *stage_p, const SearchQuery *query_p)
+{
+	bool success_flag = false;
+	bson_t *match_p = BCON_NEW ("$match", "{",
+															"$or", "[",
+																"{", S_DISTANCE_S, "{", "$gt", BCON_DOUBLE (query_p -> sq_min_distance), "}", "}",
+																"{", S_DISTANCE_S, BCON_DOUBLE (query_p -> sq_min_distance), MONGO_ID_S, "{", "$gt", BCON_OID (& (query_p -> sq_last_id)), "}", "}",
+															"]",
+														"}");
+
+	if (match_p)
+		{
+			success_flag = bson_concat (stage_p, match_p);
+			bson_destroy (match_p);
+		}
+
+	return success_flag;
+}
+
+/*
+ * Run a radius or nearest search with $geoNear. This returns the samples
+ * in order of distance so, with the following $limit, the index scan stops
+ * as soon as there are enough samples for a nearest search or a page of
+ * a radius search. Each sample's distance, in metres, is calculated once
+ * by the index scan and included in its result as "distance".
+ */
+static OperationStatus RunGeoNearSearch (const SearchQuery *query_p, ServiceJob *job_p, MartiServiceData *data_p, json_t **cached_results_pp, json_t **next_token_pp)
+{
+	OperationStatus status = OS_FAILED_TO_START;
+	bson_t *pipeline_p = GetGeoNearPipeline (query_p);
+
+	if (pipeline_p)
+		{
+			bson_t *opts_p = NULL;
+			mongoc_cursor_t *cursor_p = NULL;
+
+			if (data_p -> msd_stream_results_flag && (data_p -> msd_search_batch_size > 0))
+				{
+					opts_p = BCON_NEW ("batchSize", BCON_INT32 ((int32) (data_p -> msd_search_batch_size)));
+				}
+
+			cursor_p = mongoc_collection_aggregate (data_p -> msd_mongo_p -> mt_collection_p, MONGOC_QUERY_NONE, pipeline_p, opts_p, NULL);
+
+			status = OS_FAILED;
+
+			if (cursor_p)
+				{
+					SearchResults results;
+					const bson_t *document_p = NULL;
+					bson_error_t error;
+
+					results.sr_job_p = job_p;
+					results.sr_data_p = data_p;
+					results.sr_num_results = 0;
+					results.sr_num_successes = 0;
+					results.sr_has_last_flag = false;
+					results.sr_cached_results_p = cached_results_pp ? *cached_results_pp : NULL;
+					results.sr_add_distance_flag = false;
+
+					while (mongoc_cursor_next (cursor_p, &document_p))
+						{
+							AddSearchResultFromBSON (document_p, &results);
+						}
+
+					if (mongoc_cursor_error (cursor_p, &error))
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to get %s search results: \"%s\"", S_SEARCH_MODE_NAMES_SS [query_p -> sq_mode], error.message);
+
+							if (results.sr_num_successes > 0)
+								{
+									status = OS_PARTIALLY_SUCCEEDED;
+								}
+
+							/* Don't cache incomplete results */
+							results.sr_cached_results_p = NULL;
+						}
+					else
+						{
+							status = GetSearchResultsStatus (&results);
+						}
+
+					if (cached_results_pp && (*cached_results_pp) && (results.sr_cached_results_p == NULL))
+						{
+							json_decref (*cached_results_pp);
+							*cached_results_pp = NULL;
+						}
+
+					/*
+					 * If we have a full page, there might be more results
+					 * so let the client know how to get them.
+					 */
+					if ((query_p -> sq_page_size > 0) && (results.sr_num_results == query_p -> sq_page_size))
+						{
+							json_t *next_token_p = GetContinuationToken (&results, query_p);
+
+							if (next_token_p)
+								{
+									if (next_token_pp)
+										{
+											*next_token_pp = json_incref (next_token_p);
+										}
+
+									AddMartiJobMetadata (job_p, S_NEXT_TOKEN_S, next_token_p);
+								}
+						}
+
+					mongoc_cursor_destroy (cursor_p);
+				}
+			else
+				{
+					PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, pipeline_p, "Failed to run aggregation");
+				}
+
+			if (opts_p)
+				{
+					bson_destroy (opts_p);
+				}
+
+			bson_destroy (pipeline_p);
+		}
+
+	return status;
+}
+
+
+/*
+ * [
+ *	{ $geoNear: { ... } },
+ *	{ $match: { <samples after the last one that we sent> } },
+ *	{ $sort: { distance: 1, _id: 1 } },
+ *	{ $limit: <number of samples or page size> },
+ *	{ $project: { <fields for the projection> } }
+ * ]
+ *
+ * The $limit is left out of unpaged radius searches. Only paged
+ * radius searches are sorted, and the $match is only used when
+ * resuming one of them.
+ */
+static bson_t *GetGeoNearPipeline (const SearchQuery *query_p)
+{
+	bson_t *pipeline_p = bson_new ();
+
+	if (pipeline_p)
+		{
+			const uint32 limit = (query_p -> sq_mode == MSM_NEAREST) ? query_p -> sq_num_nearest : query_p -> sq_page_size;
+			const bool paged_flag = (query_p -> sq_mode != MSM_NEAREST) && (query_p -> sq_page_size > 0);
+			uint32 num_stages = 0;
+			bool success_flag = false;
+			bson_t stage;
+
+			if (BeginPipelineStage (pipeline_p, &num_stages, &stage))
+				{
+					success_flag = AddGeoNearStage (&stage, query_p);
+					success_flag = bson_append_document_end (pipeline_p, &stage) && success_flag;
+				}
+
+			if (success_flag && paged_flag && (query_p -> sq_resume_flag))
+				{
+					success_flag = false;
+
+					if (BeginPipelineStage (pipeline_p, &num_stages, &stage))
+						{
+							success_flag = AddDistanceResumeStage (&stage, query_p);
+							success_flag = bson_append_document_end (pipeline_p, &stage) && success_flag;
+						}
+				}
+
+			if (success_flag && paged_flag)
+				{
+					success_flag = false;
+
+					if (BeginPipelineStage (pipeline_p, &num_stages, &stage))
+						{
+							bson_t fields;
+
+							if (BSON_APPEND_DOCUMENT_BEGIN (&stage, "$sort", &fields))
+								{
+									success_flag = BSON_APPEND_INT32 (&fields, S_DISTANCE_S, 1) && BSON_APPEND_INT32 (&fields, MONGO_ID_S, 1);
+									success_flag = bson_append_document_end (&stage, &fields) && success_flag;
+								}
+
+							success_flag = bson_append_document_end (pipeline_p, &stage) && success_flag;
+						}
+				}
+
+			if (success_flag && (limit > 0))
+				{
+					success_flag = false;
+
+					if (BeginPipelineStage (pipeline_p, &num_stages, &stage))
+						{
+							success_flag = BSON_APPEND_INT64 (&stage, "$limit", (int64) limit);
+							success_flag = bson_append_document_end (pipeline_p, &stage) && success_flag;
+						}
+				}
+
+			if (success_flag && (query_p -> sq_projection != MP_FULL))
+				{
+					success_flag = false;
+
+					if (BeginPipelineStage (pipeline_p, &num_stages, &stage))
+						{
+							bson_t fields;
+
+							if (BSON_APPEND_DOCUMENT_BEGIN (&stage, "$project", &fields))
+								{
+									success_flag = AddProjectionFields (&fields, query_p -> sq_projection, true);
+									success_flag = bson_append_document_end (&stage, &fields) && success_flag;
+								}
+
+							success_flag = bson_append_document_end (pipeline_p, &stage) && success_flag;
+						}
+				}
+
+			if (success_flag)
+				{
+					return pipeline_p;
+				}
+
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to build %s search pipeline", S_SEARCH_MODE_NAMES_SS [query_p -> sq_mode]);
+			bson_destroy (pipeline_p);
+		}
+
+	return NULL;
+}
+
+
+/*
+ * Start the next stage of an aggregation pipeline. The pipeline
+ * is an array, so the stages are keyed by their indexes.
+ */
+static bool BeginPipelineStage (bson_t *pipeline_p, uint32 *num_stages_p, bson_t *stage_p)
+{
+	const char *key_s = NULL;
+	char buffer_s [16];
+
+	bson_uint32_to_string ((uint32_t) (*num_stages_p), &key_s, buffer_s, sizeof (buffer_s));
+	++ (*num_stages_p);
+
+	return bson_append_document_begin (pipeline_p, key_s, -1, stage_p);
+}
+
+
+/*
+ * Convert a matching document into a search result and add it to the ServiceJob.
+ */
+static bool AddSearchResult (const json_t *result_p, SearchResults *results_p)
+{
+	bson_oid_t id;
+	const char *name_s = NULL;
+	double64 latitude;
+	double64 longitude;
+
+	if (GetSearchResultDetailsFromJSON (result_p, &id, &name_s, &latitude, &longitude))
+		{
+			return AddSearchResultRecord ((json_t *) result_p, &id, name_s, latitude, longitude, results_p);
+		}
+
+	++ (results_p -> sr_num_results);
+	PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, result_p, "Invalid MARTi sample");
+
+	return false;
+}
+
+
+/*
+ * The callback used by IterateOverMongoResults () when streaming
+ * the search results. Each document is converted and freed before
+ * the next one is read from the cursor.
+ *
+ * The required fields are read straight from the BSON and the result
+ * record is built by walking the document, so there is no need to go
+ * via a JSON string or a MartiEntry.
+ */
+static bool AddSearchResultFromBSON (const bson_t *document_p, void *data_p)
+{
+	SearchResults *results_p = (SearchResults *) data_p;
+	bson_oid_t id;
+	const char *name_s = NULL;
+	double64 latitude;
+	double64 longitude;
+
+	if (GetSearchResultDetailsFromBSON (document_p, &id, &name_s, &latitude, &longitude))
+		{
+			json_t *result_p = GetSearchResultJSONFromBSON (document_p);
+
+			if (result_p)
+				{
+					AddSearchResultRecord (result_p, &id, name_s, latitude, longitude, results_p);
+					json_decref (result_p);
+				}
+			else
+				{
+					++ (results_p -> sr_num_results);
+				}
+		}
+	else
+		{
+			++ (results_p -> sr_num_results);
+			PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, document_p, "Invalid MARTi sample");
+		}
+
+	/*
+	 * Keep going even if this document failed so
+	 * we can return a partial set of results.
+	 */
+	return true;
+}
+
+
+/*
+ * Convert a matching document to JSON by walking it ourselves, falling back
+ * to the bson library's conversion for any types that we don't handle.
+ */
+static json_t *GetSearchResultJSONFromBSON (const bson_t *document_p)
+{
+	json_t *result_p = NULL;
+	bson_iter_t iter;
+
+	if (bson_iter_init (&iter, document_p))
+		{
+			result_p = GetBSONDocumentAsJSON (&iter, false);
+		}
+
+	if (!result_p)
+		{
+			size_t length = 0;
+			char *document_s = bson_as_relaxed_extended_json (document_p, &length);
+
+			if (document_s)
+				{
+					json_error_t err;
+
+					result_p = json_loadb (document_s, length, 0, &err);
+
+					if (!result_p)
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to parse \"%s\", error: \"%s\"", document_s, err.text);
+						}
+
+					bson_free (document_s);
+				}
+			else
+				{
+					PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, document_p, "Failed to convert document to JSON");
+				}
+		}
+
+	return result_p;
+}
+
+
+/*
+ * Wrap a matching document up as a result record and add it to the ServiceJob.
+ */
+static bool AddSearchResultRecord (json_t *result_p, const bson_oid_t *id_p, const char *name_s, const double64 latitude, const double64 longitude, SearchResults *results_p)
+{
+	bool success_flag = false;
+	json_t *dest_record_p = NULL;
+
+	++ (results_p -> sr_num_results);
+
+	bson_oid_copy (id_p, & (results_p -> sr_last_id));
+	results_p -> sr_last_latitude = latitude;
+	results_p -> sr_last_longitude = longitude;
+	results_p -> sr_has_last_flag = true;
+
+	if (!GetJSONReal (result_p, S_DISTANCE_S, & (results_p -> sr_last_distance)))
+		{
+			results_p -> sr_last_distance = -1.0;
+		}
+
+	dest_record_p = GetDataResourceAsJSONByParts (PROTOCOL_INLINE_S, NULL, name_s, result_p);
+
+	if (dest_record_p)
+		{
+			if (results_p -> sr_cached_results_p)
+				{
+					if (json_array_append (results_p -> sr_cached_results_p, dest_record_p) != 0)
+						{
+							/* Stop caching these results as they will be incomplete */
+							results_p -> sr_cached_results_p = NULL;
+						}
+				}
+
+			if (AddResultToServiceJob (results_p -> sr_job_p, dest_record_p))
+				{
+					++ (results_p -> sr_num_successes);
+					success_flag = true;
+				}
+			else
+				{
+					json_decref (dest_record_p);
+				}
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * Check that a matching document has the fields that every sample
+ * must have and get the ones that we need to build the result.
+ */
+static bool GetSearchResultDetailsFromJSON (const json_t *result_p, bson_oid_t *id_p, const char **name_ss, double64 *latitude_p, double64 *longitude_p)
+{
+	if (GetMongoIdFromJSON (result_p, id_p))
+		{
+			const char *name_s = GetJSONString (result_p, ME_NAME_S);
+
+			if (name_s && GetJSONString (result_p, ME_MARTI_ID_S))
+				{
+					const json_t *location_p = json_object_get (result_p, ME_LOCATION_S);
+
+					if (location_p)
+						{
+							const json_t *coords_p = json_object_get (location_p, ME_COORDINATES_S);
+
+							if ((json_is_array (coords_p)) && (json_array_size (coords_p) == 2))
+								{
+									/*
+									 * For GeoJSON objects, the longitude comes first
+									 */
+									const json_t *longitude_json_p = json_array_get (coords_p, 0);
+									const json_t *latitude_json_p = json_array_get (coords_p, 1);
+
+									if (json_is_number (longitude_json_p) && json_is_number (latitude_json_p))
+										{
+											*name_ss = name_s;
+											*longitude_p = json_number_value (longitude_json_p);
+											*latitude_p = json_number_value (latitude_json_p);
+
+											return true;
+										}
+								}
+						}
+				}
+		}
+
+	return false;
+}
+
+
+/*
+ * The BSON equivalent of GetSearchResultDetailsFromJSON (). The name
+ * points into the document so is only valid for as long as it is.
+ */
+static bool GetSearchResultDetailsFromBSON (const bson_t *document_p, bson_oid_t *id_p, const char **name_ss, double64 *latitude_p, double64 *longitude_p)
+{
+	bson_iter_t iter;
+
+	if (bson_iter_init_find (&iter, document_p, MONGO_ID_S) && BSON_ITER_HOLDS_OID (&iter))
+		{
+			bson_oid_copy (bson_iter_oid (&iter), id_p);
+
+			if (bson_iter_init_find (&iter, document_p, ME_NAME_S) && BSON_ITER_HOLDS_UTF8 (&iter))
+				{
+					const char *name_s = bson_iter_utf8 (&iter, NULL);
+
+					if (bson_iter_init_find (&iter, document_p, ME_MARTI_ID_S) && BSON_ITER_HOLDS_UTF8 (&iter))
+						{
+							if (GetMartiEntryCoordinatesFromBSON (document_p, latitude_p, longitude_p))
+								{
+									*name_ss = name_s;
+
+									return true;
+								}
+						}
+				}
+		}
+
+	return false;
+}
+
+
+/*
+ * Convert the remainder of a BSON document or array to JSON, using the same
+ * relaxed extended JSON representation as bson_as_relaxed_extended_json ().
+ * This returns NULL if the document contains a type that we don't handle.
+ */
+static json_t *GetBSONDocumentAsJSON (bson_iter_t *iter_p, const bool array_flag)
+{
+	json_t *json_p = array_flag ? json_array () : json_object ();
+
+	if (json_p)
+		{
+			while (bson_iter_next (iter_p))
+				{
+					json_t *value_p = GetBSONValueAsJSON (iter_p);
+
+					if (value_p)
+						{
+							int res = array_flag ? json_array_append_new (json_p, value_p) : json_object_set_new (json_p, bson_iter_key (iter_p), value_p);
+
+							if (res != 0)
+								{
+									json_decref (json_p);
+									return NULL;
+								}
+						}
+					else
+						{
+							json_decref (json_p);
+							return NULL;
+						}
+				}
+		}
+
+	return json_p;
 }
 
 
-static ServiceMetadata *GetMartiSearchServiceMetadata (Service * UNUSED_PARAM (service_p))
+static json_t *GetBSONValueAsJSON (const bson_iter_t *iter_p)
 {
-	const char *term_url_s = CONTEXT_PREFIX_EDAM_ONTOLOGY_S "topic_0625";
-	SchemaTerm *category_p = AllocateSchemaTerm (term_url_s, "Genotype and phenotype",
-																							 "The study of genetic constitution of a living entity, such as an individual, and organism, a cell and so on, "
-																							 "typically with respect to a particular observable phenotypic traits, or resources concerning such traits, which "
-																							 "might be an aspect of biochemistry, physiology, morphology, anatomy, development and so on.");
+	json_t *value_p = NULL;
 
-	if (category_p)
+	switch (bson_iter_type (iter_p))
 		{
-			SchemaTerm *subcategory_p;
+			case BSON_TYPE_DOUBLE:
+				value_p = json_real (bson_iter_double (iter_p));
+				break;
 
-			term_url_s = CONTEXT_PREFIX_EDAM_ONTOLOGY_S "operation_0304";
-			subcategory_p = AllocateSchemaTerm (term_url_s, "Query and retrieval", "Search or query a data resource and retrieve entries and / or annotation.");
+			case BSON_TYPE_UTF8:
+				{
+					uint32_t length = 0;
+					const char *value_s = bson_iter_utf8 (iter_p, &length);
 
-			if (subcategory_p)
+					value_p = json_stringn (value_s, length);
+				}
+				break;
+
+			case BSON_TYPE_DOCUMENT:
+			case BSON_TYPE_ARRAY:
 				{
-					ServiceMetadata *metadata_p = AllocateServiceMetadata (category_p, subcategory_p);
+					bson_iter_t child_iter;
 
-					if (metadata_p)
+					if (bson_iter_recurse (iter_p, &child_iter))
 						{
-							SchemaTerm *input_p;
+							value_p = GetBSONDocumentAsJSON (&child_iter, BSON_ITER_HOLDS_ARRAY (iter_p));
+						}
+				}
+				break;
 
-							term_url_s = CONTEXT_PREFIX_EDAM_ONTOLOGY_S "data_0968";
-							input_p = AllocateSchemaTerm (term_url_s, "Keyword",
-																						"Boolean operators (AND, OR and NOT) and wildcard characters may be allowed. Keyword(s) or phrase(s) used (typically) for text-searching purposes.");
+			case BSON_TYPE_OID:
+				{
+					char id_s [25];
 
-							if (input_p)
-								{
-									if (AddSchemaTermToServiceMetadataInput (metadata_p, input_p))
-										{
-											SchemaTerm *output_p;
+					bson_oid_to_string (bson_iter_oid (iter_p), id_s);
+					value_p = json_pack ("{s:s}", "$oid", id_s);
+				}
+				break;
 
+			case BSON_TYPE_BOOL:
+				value_p = bson_iter_bool (iter_p) ? json_true () : json_false ();
+				break;
 
-											/* Genotype */
-											term_url_s = CONTEXT_PREFIX_EXPERIMENTAL_FACTOR_ONTOLOGY_S "EFO_0000513";
-											output_p = AllocateSchemaTerm (term_url_s, "genotype", "Information, making the distinction between the actual physical material "
-																										 "(e.g. a cell) and the information about the genetic content (genotype).");
+			case BSON_TYPE_NULL:
+				value_p = json_null ();
+				break;
 
-											if (output_p)
-												{
-													if (AddSchemaTermToServiceMetadataOutput (metadata_p, output_p))
-														{
-															return metadata_p;
-														}		/* if (AddSchemaTermToServiceMetadataOutput (metadata_p, output_p)) */
-													else
-														{
-															PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add output term %s to service metadata", term_url_s);
-															FreeSchemaTerm (output_p);
-														}
+			case BSON_TYPE_INT32:
+				value_p = json_integer (bson_iter_int32 (iter_p));
+				break;
 
-												}		/* if (output_p) */
-											else
-												{
-													PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate output term %s for service metadata", term_url_s);
-												}
+			case BSON_TYPE_INT64:
+				value_p = json_integer (bson_iter_int64 (iter_p));
+				break;
 
-										}		/* if (AddSchemaTermToServiceMetadataInput (metadata_p, input_p)) */
-									else
-										{
-											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add input term %s to service metadata", term_url_s);
-											FreeSchemaTerm (input_p);
-										}
+			case BSON_TYPE_DATE_TIME:
+				value_p = GetBSONDateAsJSON (bson_iter_date_time (iter_p));
+				break;
 
-								}		/* if (input_p) */
+			default:
+				break;
+		}
+
+	return value_p;
+}
+
+
+/*
+ * Relaxed extended JSON uses an ISO-8601 string for dates from 1970
+ * to 9999. Anything else we leave to bson_as_relaxed_extended_json ().
+ */
+static json_t *GetBSONDateAsJSON (const int64 millis)
+{
+	/* 10000-01-01T00:00:00Z */
+	const int64 max_millis = INT64_C (253402300800000);
+
+	if ((millis >= 0) && (millis < max_millis))
+		{
+			const time_t secs = (time_t) (millis / 1000);
+			const int ms = (int) (millis % 1000);
+			struct tm t;
+
+			if (gmtime_r (&secs, &t))
+				{
+					char buffer_s [32];
+					size_t length = strftime (buffer_s, sizeof (buffer_s), "%Y-%m-%dT%H:%M:%S", &t);
+
+					if (length > 0)
+						{
+							if (ms > 0)
+								{
+									snprintf (buffer_s + length, sizeof (buffer_s) - length, ".%03dZ", ms);
+								}
 							else
 								{
-									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate input term %s for service metadata", term_url_s);
+									snprintf (buffer_s + length, sizeof (buffer_s) - length, "Z");
 								}
 
-							FreeServiceMetadata (metadata_p);
-						}		/* if (metadata_p) */
-					else
-						{
-							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate service metadata");
+							return json_pack ("{s:s}", "$date", buffer_s);
 						}
-
-				}		/* if (subcategory_p) */
-			else
-				{
-					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate sub-category term %s for service metadata", term_url_s);
 				}
-
-		}		/* if (category_p) */
-	else
-		{
-			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate category term %s for service metadata", term_url_s);
 		}
 
 	return NULL;
 }
 
 
-static ParameterSet *IsResourceForMartiSearchService (Service * UNUSED_PARAM (service_p), DataResource * UNUSED_PARAM (resource_p), Handler * UNUSED_PARAM (handler_p))
+static OperationStatus GetSearchResultsStatus (const SearchResults *results_p)
 {
-	return NULL;
+	OperationStatus status = OS_FAILED;
+
+	if (results_p -> sr_num_successes == results_p -> sr_num_results)
+		{
+			status = OS_SUCCEEDED;
+		}
+	else if (results_p -> sr_num_successes > 0)
+		{
+			status = OS_PARTIALLY_SUCCEEDED;
+		}
+
+	return status;
 }
 
 
-/*
- {
-		$nearSphere: {
-			 $geometry: {
-					type : "Point",
-					coordinates : [ <longitude>, <latitude> ]
-			 },
-			 $minDistance: <distance in meters>,
-			 $maxDistance: <distance in meters>
-		}
-	}
- */
-static json_t *GetSearchQuery (const double64 latitude, const double64 longitude, const struct tm *from_p, const struct tm *to_p, const uint32 min_distance, const uint32 max_distance)
+static bool AddPagingParameters (ParameterSet *param_set_p, ServiceData *data_p)
 {
-	json_t *root_p = json_object ();
+	bool success_flag = false;
+	Parameter *param_p = EasyCreateAndAddUnsignedIntParameterToParameterSet (data_p, param_set_p, NULL, S_PAGE_SIZE.npt_name_s, "Page size",
+																																					 "The maximum number of results to return. Leave empty to get all of them", NULL, PL_ADVANCED);
 
-	if (root_p)
+	if (param_p)
 		{
-			json_t *query_p = json_object ();
+			param_p = EasyCreateAndAddStringParameterToParameterSet (data_p, param_set_p, NULL, S_CONTINUATION_TOKEN.npt_type, S_CONTINUATION_TOKEN.npt_name_s, "Continuation token",
+																															 "The token returned with the previous page of results to get the next page", NULL, PL_ADVANCED);
 
-			if (query_p)
+			if (param_p)
 				{
-					if (json_object_set_new (root_p, ME_LOCATION_S, query_p) == 0)
-						{
-							json_t *near_sphere_p = json_object ();
+					success_flag = true;
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add %s parameter", S_CONTINUATION_TOKEN.npt_name_s);
+				}
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add %s parameter", S_PAGE_SIZE.npt_name_s);
+		}
 
-							if (near_sphere_p)
-								{
-									if (json_object_set_new (query_p, "$nearSphere", near_sphere_p) == 0)
-										{
-											json_t *geometry_p = json_object ();
+	return success_flag;
+}
 
-											if (geometry_p)
-												{
-													if (json_object_set_new (near_sphere_p, "$geometry", geometry_p) == 0)
-														{
-															if (SetJSONString (geometry_p, "type", "Point"))
-																{
-																	json_t *coords_p = json_array ();
 
-																	if (coords_p)
-																		{
-																			if (json_object_set_new (geometry_p, "coordinates", coords_p) == 0)
-																				{
-																					if (AddNumberToArray (coords_p, longitude))
-																						{
-																							if (AddNumberToArray (coords_p, latitude))
-																								{
-																									if ((min_distance == 0) || (SetJSONInteger (near_sphere_p, "$minDistance", min_distance)))
-																										{
-																											if ((max_distance == 0) || (SetJSONInteger (near_sphere_p, "$maxDistance", max_distance)))
-																												{
-																													if (AddNonTrivialTimeToQuery (query_p, from_p, ME_START_DATE_S, "$gte"))
-																														{
-																															if (AddNonTrivialTimeToQuery (query_p, to_p, ME_START_DATE_S, "$lte"))
-																																{
-																																	return root_p;
-																																}
-
-																														}
-																												}
-
-																										}
-																								}
-
-																						}
-
-																				}
-																			else
-																				{
-																					json_decref (coords_p);
-																				}
+/*
+ * The continuation token is of the form
+ *
+ *		<source>:<distance of last result>:<id of last result>
+ *
+ * where source is "l" if the distance was worked out by GetMartiDistance ()
+ * and "d" if it came from $geoNear.
+ */
+static bool ParseContinuationToken (const char *token_s, bool *local_distance_flag_p, double64 *distance_p, bson_oid_t *id_p)
+{
+	bool success_flag = false;
 
-																		}
+	if (((*token_s == 'l') || (*token_s == 'd')) && (* (token_s + 1) == ':'))
+		{
+			const char *distance_s = token_s + 2;
+			const char *sep_s = strchr (distance_s, ':');
 
+			if (sep_s)
+				{
+					char *end_s = NULL;
+					double64 distance = strtod (distance_s, &end_s);
 
-																}		/* if (SetJSONString (geometry_p, "type", "Point")) */
-														}
-													else
-														{
-															json_decref (geometry_p);
-														}
-												}
+					if ((end_s == sep_s) && (end_s != distance_s) && (distance >= 0.0))
+						{
+							const char *id_s = sep_s + 1;
 
-										}
-									else
-										{
-											json_decref (near_sphere_p);
-										}
+							if (bson_oid_is_valid (id_s, strlen (id_s)))
+								{
+									bson_oid_init_from_string (id_p, id_s);
+									*distance_p = distance;
+									*local_distance_flag_p = (*token_s == 'l');
+									success_flag = true;
 								}
-
-						}
-					else
-						{
-							json_decref (query_p);
 						}
-
-				}		/* if (query_p) */
-
-			json_decref (root_p);
+				}
 		}
 
+	if (!success_flag)
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Invalid continuation token \"%s\"", token_s);
+		}
 
-	return NULL;
+	return success_flag;
 }
 
 
-static bool AddNumberToArray (json_t *array_p, const double64 value)
+/*
+ * Area searches are sorted by id rather than distance so
+ * their tokens always have a distance of 0. For radius
+ * searches, use the distance that $geoNear worked out so
+ * that the next page's minDistance matches it exactly.
+ */
+static json_t *GetContinuationToken (const SearchResults *results_p, const SearchQuery *query_p)
 {
-	bool success_flag = false;
-	json_t *number_p = json_real (value);
+	json_t *token_p = NULL;
 
-	if (number_p)
+	if (results_p -> sr_has_last_flag)
 		{
-			if (json_array_append_new (array_p, number_p) == 0)
+			char id_s [25];
+			char token_s [64];
+			double64 distance = 0.0;
+			bool local_distance_flag = true;
+
+			if (results_p -> sr_last_distance >= 0.0)
 				{
-					success_flag = true;
+					distance = results_p -> sr_last_distance;
+
+					/* Distances that we added ourselves came from GetMartiDistance () */
+					local_distance_flag = results_p -> sr_add_distance_flag;
 				}
-			else
+			else if (query_p -> sq_mode == MSM_RADIUS)
+				{
+					distance = GetMartiDistance (query_p -> sq_latitude, query_p -> sq_longitude, results_p -> sr_last_latitude, results_p -> sr_last_longitude);
+				}
+
+			bson_oid_to_string (& (results_p -> sr_last_id), id_s);
+
+			if (snprintf (token_s, sizeof (token_s), "%c:%.17g:%s", local_distance_flag ? 'l' : 'd', distance, id_s) < (int) sizeof (token_s))
 				{
-					json_decref (number_p);
+					token_p = json_string (token_s);
 				}
 		}
 
-	return success_flag;
+	return token_p;
 }
 
 
-static bool AddNonTrivialTimeToQuery (json_t *query_p, const struct tm *time_p, const char * const field_s, const char * const op_s)
+/*
+ * Distances from $geoNear are worked out by MongoDB and differ slightly
+ * from those from GetMartiDistance (). So the next page of a search that
+ * is sorted by distance has to be found in the same way as the previous
+ * one, else samples at the boundary between the pages could be skipped
+ * or repeated. This checks whether the query is resuming such a search
+ * from a page whose distances came from the given source.
+ */
+static bool IsDistanceResume (const SearchQuery *query_p, const bool local_distance_flag)
 {
-	bool success_flag = false;
+	return ((query_p -> sq_resume_flag) && ((query_p -> sq_mode == MSM_RADIUS) || (query_p -> sq_mode == MSM_NEAREST)) && (query_p -> sq_local_distance_flag == local_distance_flag));
+}
 
-	if (time_p)
+
+/*
+ * Used when the way that the previous page was found is no longer
+ * available, e.g. the spatial index has since been turned off.
+ */
+static OperationStatus RejectContinuationToken (ServiceJob *job_p)
+{
+	AddParameterErrorMessageToServiceJob (job_p, S_CONTINUATION_TOKEN.npt_name_s, S_CONTINUATION_TOKEN.npt_type, "This continuation token can no longer be used, please run the search again");
+
+	return OS_FAILED;
+}
+
+
+/*
+ * The cache key is built from all of the values that
+ * affect the results, with the coordinates rounded
+ * to 6 decimal places, roughly 0.1 metres.
+ */
+static char *GetSearchCacheKey (const SearchQuery *query_p)
+{
+	char *key_s = NULL;
+	char *start_s = query_p -> sq_start_p ? GetTimeAsString (query_p -> sq_start_p, false, NULL) : NULL;
+
+	if ((query_p -> sq_start_p == NULL) || start_s)
 		{
-			char *time_s = GetTimeAsString (time_p, false, NULL);
+			char *end_s = query_p -> sq_end_p ? GetTimeAsString (query_p -> sq_end_p, false, NULL) : NULL;
 
-			if (time_s)
+			if ((query_p -> sq_end_p == NULL) || end_s)
 				{
-					json_t *op_p = json_object ();
+					char *taxa_s = GetTaxaCacheKey (query_p);
 
-					if (op_p)
+					if (!HasTaxaFilter (query_p) || taxa_s)
 						{
-							if (SetJSONString (op_p, op_s, time_s))
+							char *area_s = GetAreaCacheKey (query_p);
+
+							if (area_s)
 								{
+									ByteBuffer *buffer_p = AllocateByteBuffer (1024);
 
-									if (json_object_set_new (query_p, field_s, op_p) == 0)
-										{
-											success_flag = true;
-										}
-									else
+									if (buffer_p)
 										{
+											char buffer_s [256];
+											const int res = snprintf (buffer_s, sizeof (buffer_s), "|%s|%s|%s|" UINT32_FMT "|%s|",
+																								start_s ? start_s : "", end_s ? end_s : "",
+																								S_PROJECTION_NAMES_SS [query_p -> sq_projection], query_p -> sq_page_size,
+																								query_p -> sq_counts_only_flag ? "counts" : "");
+
+											if ((res > 0) && (res < (int) sizeof (buffer_s)))
+												{
+													if (AppendStringsToByteBuffer (buffer_p, area_s, buffer_s, query_p -> sq_token_s ? query_p -> sq_token_s : "", "|", taxa_s ? taxa_s : "",
+																										 "|", query_p -> sq_keywords_s ? query_p -> sq_keywords_s : "", NULL))
+														{
+															key_s = DetachByteBufferData (buffer_p);
+															buffer_p = NULL;
+														}
+												}
 
+											if (buffer_p)
+												{
+													FreeByteBuffer (buffer_p);
+												}
 										}
 
+									FreeCopiedString (area_s);
 								}
 
-							if (!success_flag)
+							if (taxa_s)
 								{
-									json_decref (op_p);
+									FreeCopiedString (taxa_s);
 								}
 						}
 
-					FreeTimeString (time_s);
+					if (end_s)
+						{
+							FreeTimeString (end_s);
+						}
 				}
 
-		}		/* if (time_p) */
-	else
+			if (start_s)
+				{
+					FreeTimeString (start_s);
+				}
+		}
+
+	return key_s;
+}
+
+
+/*
+ * Get the taxa and how they are matched as a string for the cache key.
+ * The taxa are used in the order given, which is fine as the same
+ * client will usually send them in the same order.
+ */
+static char *GetTaxaCacheKey (const SearchQuery *query_p)
+{
+	char *key_s = NULL;
+
+	if (HasTaxaFilter (query_p))
 		{
-			success_flag = true;
+			ByteBuffer *buffer_p = AllocateByteBuffer (1024);
+
+			if (buffer_p)
+				{
+					bool success_flag = AppendStringsToByteBuffer (buffer_p, S_TAXA_MATCH_NAMES_SS [query_p -> sq_taxa_match], query_p -> sq_taxa_subtree_flag ? "+descendants" : "", NULL);
+					const char **taxa_ss = query_p -> sq_taxa_ss;
+					size_t i;
+
+					for (i = query_p -> sq_num_taxa; (i > 0) && success_flag; -- i, ++ taxa_ss)
+						{
+							success_flag = AppendStringsToByteBuffer (buffer_p, ",", *taxa_ss ? *taxa_ss : "", NULL);
+						}
+
+					if (success_flag && (query_p -> sq_num_excluded_taxa > 0))
+						{
+							taxa_ss = query_p -> sq_excluded_taxa_ss;
+							success_flag = AppendStringsToByteBuffer (buffer_p, "-not", NULL);
+
+							for (i = query_p -> sq_num_excluded_taxa; (i > 0) && success_flag; -- i, ++ taxa_ss)
+								{
+									success_flag = AppendStringsToByteBuffer (buffer_p, ",", *taxa_ss ? *taxa_ss : "", NULL);
+								}
+						}
+
+					if (success_flag)
+						{
+							key_s = DetachByteBufferData (buffer_p);
+						}
+					else
+						{
+							FreeByteBuffer (buffer_p);
+						}
+				}
+		}
+
+	return key_s;
+}
+
+
+/*
+ * Add a set of cached results to the ServiceJob. Each result
+ * and the next token get a new reference, so the cached array
+ * and token are left unchanged for later searches.
+ */
+static bool AddCachedSearchResults (ServiceJob *job_p, json_t *results_p, json_t *next_token_p)
+{
+	bool success_flag = true;
+	size_t i;
+	json_t *result_p;
+
+	json_array_foreach (results_p, i, result_p)
+		{
+			json_incref (result_p);
+
+			if (!AddResultToServiceJob (job_p, result_p))
+				{
+					json_decref (result_p);
+					success_flag = false;
+				}
+		}
+
+	if (next_token_p)
+		{
+			json_incref (next_token_p);
+
+			if (!AddMartiJobMetadata (job_p, S_NEXT_TOKEN_S, next_token_p))
+				{
+					success_flag = false;
+				}
 		}
 
 	return success_flag;
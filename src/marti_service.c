@@ -13,6 +13,8 @@
  ** See the License for the specific language governing permissions and
  ** limitations under the License.
  */
+#include <math.h>
+#include <stdio.h>
 #include <string.h>
 
 #include "jansson.h"
@@ -22,6 +24,8 @@
 #include "marti_service_data.h"
 
 #include "marti_entry.h"
+#include "marti_taxonomy.h"
+#include "marti_entry_cache.h"
 
 #include "memory_allocations.h"
 #include "parameter.h"
@@ -48,12 +52,29 @@
 
 
 
+/*
+ * The radius of the Earth, in metres, used by MongoDB for its
+ * spherical geometry calculations.
+ */
+static const double64 S_EARTH_RADIUS = 6378100.0;
+
+
 /*
  * STATIC PROTOTYPES
  */
 
 static MartiEntry *GetMartiEntryByQuery (bson_t *query_p, const MartiServiceData *data_p);
 
+static bool AddMartiIndexes (MartiServiceData *data_p);
+
+static bool MigrateMartiDates (MartiServiceData *data_p);
+
+static bool MigrateMartiTaxa (MartiServiceData *data_p);
+
+static bool MigrateMartiTaxaPreorder (MartiServiceData *data_p);
+
+static bool SetMartiTaxaPreorderFromBSON (const bson_t *document_p, void *data_p);
+
 
 /*
  * API FUNCTIONS
@@ -99,13 +120,12 @@ ServicesArray *GetServices (User *user_p, GrassrootsServer *grassroots_p)
 
 					MartiServiceData *data_p =  (MartiServiceData *) ((* (services_p -> sa_services_pp)) -> se_data_p);
 
-					if (AddCollectionSingleIndex (data_p -> msd_mongo_p, data_p -> msd_database_s, data_p -> msd_collection_s, ME_LOCATION_S, "2dsphere", false, false))
+					if (AddMartiIndexes (data_p))
 						{
 							return services_p;
 						}
 					else
 						{
-							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add index for db \"%s\" collection \"%s\" field \"%s\"", data_p -> msd_database_s, data_p -> msd_collection_s, ME_LOCATION_S);
 							FreeServicesArray (services_p);
 							return NULL;
 						}
@@ -137,26 +157,37 @@ void ReleaseServices (ServicesArray *services_p)
 
 MartiEntry *GetMartiEntryByMartiIdString (const char * const marti_id_s, const MartiServiceData *data_p)
 {
-	MartiEntry *marti_p = NULL;
-	bson_t *query_p = bson_new ();
+	MartiEntry *marti_p = GetCachedMartiEntryByMartiId (marti_id_s);
 
-	if (query_p)
+	if (!marti_p)
 		{
-			if (BSON_APPEND_UTF8 (query_p, ME_MARTI_ID_S, marti_id_s))
+			const uint32 generation = GetMartiEntryCacheGeneration ();
+			bson_t *query_p = bson_new ();
+
+			if (query_p)
 				{
-					marti_p = GetMartiEntryByQuery (query_p, data_p);
-				}		/* if (BSON_APPEND_UTF8 (query_p, ME_MARTI_ID_S, marti_id_s) */
+					if (BSON_APPEND_UTF8 (query_p, ME_MARTI_ID_S, marti_id_s))
+						{
+							marti_p = GetMartiEntryByQuery (query_p, data_p);
+
+							if (marti_p && IsMartiEntryCacheEnabled ())
+								{
+									SetCachedMartiEntry (marti_p, generation);
+								}
+						}		/* if (BSON_APPEND_UTF8 (query_p, ME_MARTI_ID_S, marti_id_s) */
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to populate query for marti id \"%s\"", marti_id_s);
+						}
+
+					bson_destroy (query_p);
+				}		/* if (query_p) */
 			else
 				{
-					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to populate query for marti id \"%s\"", marti_id_s);
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create query for marti id \"%s\"", marti_id_s);
 				}
 
-			bson_destroy (query_p);
-		}		/* if (query_p) */
-	else
-		{
-			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create query for marti id \"%s\"", marti_id_s);
-		}
+		}		/* if (!marti_p) */
 
 	return marti_p;
 }
@@ -165,40 +196,300 @@ MartiEntry *GetMartiEntryByMartiIdString (const char * const marti_id_s, const M
 MartiEntry *GetMartiEntryByMongoIdString (const char * const id_s, const MartiServiceData *data_p)
 {
 	MartiEntry *marti_p = NULL;
-	bson_t *query_p = bson_new ();
 
-	if (query_p)
+	if (bson_oid_is_valid (id_s, strlen (id_s)))
 		{
-			if (bson_oid_is_valid (id_s, strlen (id_s)))
+			bson_oid_t oid;
+			bson_oid_init_from_string (&oid, id_s);
+
+			/*
+			 * The submission form asks for the same entry each time
+			 * that it is refreshed, so check the cache first.
+			 */
+			marti_p = GetCachedMartiEntryById (&oid);
+
+			if (!marti_p)
 				{
-					bson_oid_t oid;
-					bson_oid_init_from_string (&oid, id_s);
+					const uint32 generation = GetMartiEntryCacheGeneration ();
+					bson_t *query_p = bson_new ();
 
-					if (BSON_APPEND_OID (query_p, MONGO_ID_S, &oid))
+					if (query_p)
 						{
-							marti_p = GetMartiEntryByQuery (query_p, data_p);
-						}		/* if (BSON_APPEND_UTF8 (query_p, MONGO_ID_S, marti_id_s) */
+							if (BSON_APPEND_OID (query_p, MONGO_ID_S, &oid))
+								{
+									marti_p = GetMartiEntryByQuery (query_p, data_p);
+
+									if (marti_p && IsMartiEntryCacheEnabled ())
+										{
+											SetCachedMartiEntry (marti_p, generation);
+										}
+								}		/* if (BSON_APPEND_OID (query_p, MONGO_ID_S, &oid)) */
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to populate query for id \"%s\"", id_s);
+								}
+
+							bson_destroy (query_p);
+						}		/* if (query_p) */
 					else
 						{
-							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to populate query for id \"%s\"", id_s);
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create query for mongo id \"%s\"", id_s);
 						}
+
+				}		/* if (!marti_p) */
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "\"%s\" is not valid oid", id_s);
+		}
+
+	return marti_p;
+}
+
+
+
+bool AddErrorMessage (ServiceJob *job_p, const json_t *value_p, const char *error_s, const int index)
+{
+	char key_s [64];
+	const char *marti_id_s = value_p ? GetJSONString (value_p, ME_MARTI_ID_S) : NULL;
+
+	if (value_p)
+		{
+			PrintJSONToErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, value_p, "Error for row %d: \"%s\"", index, error_s);
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Error for row %d: \"%s\"", index, error_s);
+		}
+
+	if (marti_id_s)
+		{
+			snprintf (key_s, sizeof (key_s), "row %d (%.40s)", index, marti_id_s);
+		}
+	else
+		{
+			snprintf (key_s, sizeof (key_s), "row %d", index);
+		}
+
+	return AddErrorToServiceJob (job_p, key_s, error_s);
+}
+
+
+bool AddMartiJobMetadata (ServiceJob *job_p, const char * const key_s, json_t *value_p)
+{
+	if (! (job_p -> sj_metadata_p))
+		{
+			job_p -> sj_metadata_p = json_object ();
+
+			if (! (job_p -> sj_metadata_p))
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate metadata for job when adding \"%s\"", key_s);
+					json_decref (value_p);
+					return false;
+				}
+		}
+
+	if (json_object_set_new (job_p -> sj_metadata_p, key_s, value_p) == 0)
+		{
+			return true;
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add \"%s\" to job metadata", key_s);
+		}
+
+	return false;
+}
+
+
+bool AddMartiCollectionIndex (MartiServiceData *data_p, const char * const name_s, const bson_t *keys_p, const bool unique_flag)
+{
+	bool success_flag = false;
+	bson_t *command_p = BCON_NEW ("createIndexes", BCON_UTF8 (data_p -> msd_collection_s),
+																"indexes", "[", "{",
+																	"key", BCON_DOCUMENT (keys_p),
+																	"name", BCON_UTF8 (name_s),
+																	"unique", BCON_BOOL (unique_flag),
+																"}", "]");
+
+	if (command_p)
+		{
+			bson_t reply;
+			bson_error_t error;
+
+			if (mongoc_collection_command_simple (data_p -> msd_mongo_p -> mt_collection_p, command_p, NULL, &reply, &error))
+				{
+					success_flag = true;
 				}
 			else
 				{
-					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "\"%s\" is not valid oid", id_s);
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create index \"%s\" for db \"%s\" collection \"%s\": \"%s\"", name_s, data_p -> msd_database_s, data_p -> msd_collection_s, error.message);
 				}
 
-			bson_destroy (query_p);
-		}		/* if (query_p) */
+			bson_destroy (&reply);
+			bson_destroy (command_p);
+		}
 	else
 		{
-			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create query for mongo id \"%s\"", id_s);
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create command for index \"%s\"", name_s);
 		}
 
-	return marti_p;
+	return success_flag;
 }
 
 
+double64 GetMartiDistance (const double64 latitude_0, const double64 longitude_0, const double64 latitude_1, const double64 longitude_1)
+{
+	const double64 to_radians = M_PI / 180.0;
+	const double64 sin_half_dlat = sin ((latitude_1 - latitude_0) * to_radians * 0.5);
+	const double64 sin_half_dlon = sin ((longitude_1 - longitude_0) * to_radians * 0.5);
+	double64 a = (sin_half_dlat * sin_half_dlat) + (cos (latitude_0 * to_radians) * cos (latitude_1 * to_radians) * sin_half_dlon * sin_half_dlon);
+
+	if (a > 1.0)
+		{
+			a = 1.0;
+		}
+
+	return 2.0 * S_EARTH_RADIUS * asin (sqrt (a));
+}
+
+
+/*
+ * Make sure that the indexes used by the searches exist.
+ */
+static bool AddMartiIndexes (MartiServiceData *data_p)
+{
+	bool migrate_flag = false;
+	bool location_flag = false;
+	bson_t *location_keys_p = NULL;
+
+	/*
+	 * Only convert the dates and taxa when asked to as it
+	 * has to check every document in the collection.
+	 */
+	GetJSONBoolean (data_p -> msd_base_data.sd_config_p, "migrate_dates", &migrate_flag);
+
+	if (migrate_flag)
+		{
+			if (!MigrateMartiDates (data_p))
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to convert all dates in db \"%s\" collection \"%s\"", data_p -> msd_database_s, data_p -> msd_collection_s);
+				}
+		}
+
+	migrate_flag = false;
+	GetJSONBoolean (data_p -> msd_base_data.sd_config_p, "migrate_taxa", &migrate_flag);
+
+	if (migrate_flag)
+		{
+			if (!MigrateMartiTaxa (data_p))
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to convert all taxa in db \"%s\" collection \"%s\"", data_p -> msd_database_s, data_p -> msd_collection_s);
+				}
+		}
+
+	/* This needs the taxa as integers so it comes after their conversion */
+	migrate_flag = false;
+	GetJSONBoolean (data_p -> msd_base_data.sd_config_p, "migrate_taxa_preorder", &migrate_flag);
+
+	if (migrate_flag)
+		{
+			if (!MigrateMartiTaxaPreorder (data_p))
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to renumber the taxa of all samples in db \"%s\" collection \"%s\"", data_p -> msd_database_s, data_p -> msd_collection_s);
+				}
+		}
+
+	/*
+	 * Each MARTi id must only be used once so that entries can be
+	 * upserted by it. This also serves the prefix searches on the
+	 * MARTi ids used by the sample lookups. If the collection already
+	 * has duplicates, the index can't be built until they are removed.
+	 */
+	if (!AddCollectionSingleIndex (data_p -> msd_mongo_p, data_p -> msd_database_s, data_p -> msd_collection_s, ME_MARTI_ID_S, NULL, true, false))
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to add unique index for db \"%s\" collection \"%s\" field \"%s\", check for duplicate MARTi ids", data_p -> msd_database_s, data_p -> msd_collection_s, ME_MARTI_ID_S);
+		}
+
+	/*
+	 * Sample lookups are prefix searches on the names and MARTi ids
+	 */
+	if (data_p -> msd_sample_lookup_flag)
+		{
+			if (!AddCollectionSingleIndex (data_p -> msd_mongo_p, data_p -> msd_database_s, data_p -> msd_collection_s, ME_NAME_S, NULL, false, false))
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to add index for db \"%s\" collection \"%s\" field \"%s\"", data_p -> msd_database_s, data_p -> msd_collection_s, ME_NAME_S);
+				}
+		}
+
+	/*
+	 * Since nearly every search has a date range as well as a location,
+	 * the location index also holds the dates so that both can be
+	 * bounded in a single index scan.
+	 */
+	location_keys_p = BCON_NEW (ME_LOCATION_S, BCON_UTF8 ("2dsphere"), ME_START_DATE_S, BCON_INT32 (1));
+
+	if (location_keys_p)
+		{
+			location_flag = AddMartiCollectionIndex (data_p, "location_date", location_keys_p, false);
+			bson_destroy (location_keys_p);
+		}
+
+	/*
+	 * Subtree searches are range queries on the
+	 * taxonomy numbers, so index them too.
+	 */
+	if (location_flag && IsMartiTaxonomyLoaded ())
+		{
+			if (!AddCollectionSingleIndex (data_p -> msd_mongo_p, data_p -> msd_database_s, data_p -> msd_collection_s, ME_TAXA_PREORDER_S, NULL, false, false))
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add index for db \"%s\" collection \"%s\" field \"%s\"", data_p -> msd_database_s, data_p -> msd_collection_s, ME_TAXA_PREORDER_S);
+					location_flag = false;
+				}
+		}
+
+	if (location_flag)
+		{
+			/*
+			 * Since taxa is an array, this will be a multikey index
+			 */
+			if (AddCollectionSingleIndex (data_p -> msd_mongo_p, data_p -> msd_database_s, data_p -> msd_collection_s, ME_TAXA_S, NULL, false, false))
+				{
+					bool compound_flag = false;
+
+					GetJSONBoolean (data_p -> msd_base_data.sd_config_p, "taxa_location_index", &compound_flag);
+
+					if (compound_flag)
+						{
+							bson_t *keys_p = BCON_NEW (ME_LOCATION_S, BCON_UTF8 ("2dsphere"), ME_TAXA_S, BCON_INT32 (1));
+
+							if (keys_p)
+								{
+									bool success_flag = AddMartiCollectionIndex (data_p, "location_taxa", keys_p, false);
+
+									bson_destroy (keys_p);
+
+									return success_flag;
+								}
+
+							return false;
+						}
+
+					return true;
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add index for db \"%s\" collection \"%s\" field \"%s\"", data_p -> msd_database_s, data_p -> msd_collection_s, ME_TAXA_S);
+				}
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add index for db \"%s\" collection \"%s\" field \"%s\"", data_p -> msd_database_s, data_p -> msd_collection_s, ME_LOCATION_S);
+		}
+
+	return false;
+}
+
 
 static MartiEntry *GetMartiEntryByQuery (bson_t *query_p, const MartiServiceData *data_p)
 {
@@ -256,3 +547,278 @@ static MartiEntry *GetMartiEntryByQuery (bson_t *query_p, const MartiServiceData
 
 	return marti_p;
 }
+
+
+/*
+ * Convert any dates that are still stored as strings to BSON Dates with
+ * an update pipeline so that the documents don't have to be loaded:
+ *
+ *	[ { $set: { date: { $convert: { input: "$date", to: "date", onError: "$date" } } } } ]
+ *
+ * Any strings that can't be converted are left as they are.
+ */
+static bool MigrateMartiDates (MartiServiceData *data_p)
+{
+	bool success_flag = false;
+	bson_t *selector_p = BCON_NEW (ME_START_DATE_S, "{", "$type", BCON_UTF8 ("string"), "}");
+
+	if (selector_p)
+		{
+			char *date_field_s = ConcatenateStrings ("$", ME_START_DATE_S);
+
+			if (date_field_s)
+				{
+					bson_t *update_p = BCON_NEW ("0", "{",
+																				"$set", "{",
+																					ME_START_DATE_S, "{",
+																						"$convert", "{",
+																							"input", BCON_UTF8 (date_field_s),
+																							"to", BCON_UTF8 ("date"),
+																							"onError", BCON_UTF8 (date_field_s),
+																						"}",
+																					"}",
+																				"}",
+																			"}");
+
+					if (update_p)
+						{
+							bson_t reply;
+							bson_error_t error;
+
+							if (mongoc_collection_update_many (data_p -> msd_mongo_p -> mt_collection_p, selector_p, update_p, NULL, &reply, &error))
+								{
+									bson_iter_t iter;
+
+									if (bson_iter_init_find (&iter, &reply, "modifiedCount") && BSON_ITER_HOLDS_INT32 (&iter))
+										{
+											PrintLog (STM_LEVEL_INFO, __FILE__, __LINE__, "Converted %d dates in db \"%s\" collection \"%s\"", bson_iter_int32 (&iter), data_p -> msd_database_s, data_p -> msd_collection_s);
+										}
+
+									success_flag = true;
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to convert dates for db \"%s\" collection \"%s\": \"%s\"", data_p -> msd_database_s, data_p -> msd_collection_s, error.message);
+								}
+
+							bson_destroy (&reply);
+							bson_destroy (update_p);
+						}
+
+					FreeCopiedString (date_field_s);
+				}
+
+			bson_destroy (selector_p);
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * Convert any taxa that are still stored as strings to 32-bit integers
+ * with an update pipeline, in the same way as MigrateMartiDates ():
+ *
+ *	[ { $set: { taxa: { $map: { input: "$taxa", in: { $convert: { input: "$$this", to: "int", onError: "$$this" } } } } } } ]
+ *
+ * Any strings that can't be converted are left as they are.
+ */
+static bool MigrateMartiTaxa (MartiServiceData *data_p)
+{
+	bool success_flag = false;
+	bson_t *selector_p = BCON_NEW (ME_TAXA_S, "{", "$type", BCON_UTF8 ("string"), "}");
+
+	if (selector_p)
+		{
+			char *taxa_field_s = ConcatenateStrings ("$", ME_TAXA_S);
+
+			if (taxa_field_s)
+				{
+					bson_t *update_p = BCON_NEW ("0", "{",
+																				"$set", "{",
+																					ME_TAXA_S, "{",
+																						"$map", "{",
+																							"input", BCON_UTF8 (taxa_field_s),
+																							"in", "{",
+																								"$convert", "{",
+																									"input", BCON_UTF8 ("$$this"),
+																									"to", BCON_UTF8 ("int"),
+																									"onError", BCON_UTF8 ("$$this"),
+																								"}",
+																							"}",
+																						"}",
+																					"}",
+																				"}",
+																			"}");
+
+					if (update_p)
+						{
+							bson_t reply;
+							bson_error_t error;
+
+							if (mongoc_collection_update_many (data_p -> msd_mongo_p -> mt_collection_p, selector_p, update_p, NULL, &reply, &error))
+								{
+									bson_iter_t iter;
+
+									if (bson_iter_init_find (&iter, &reply, "modifiedCount") && BSON_ITER_HOLDS_INT32 (&iter))
+										{
+											PrintLog (STM_LEVEL_INFO, __FILE__, __LINE__, "Converted the taxa of %d samples in db \"%s\" collection \"%s\"", bson_iter_int32 (&iter), data_p -> msd_database_s, data_p -> msd_collection_s);
+										}
+
+									success_flag = true;
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to convert taxa for db \"%s\" collection \"%s\": \"%s\"", data_p -> msd_database_s, data_p -> msd_collection_s, error.message);
+								}
+
+							bson_destroy (&reply);
+							bson_destroy (update_p);
+						}
+
+					FreeCopiedString (taxa_field_s);
+				}
+
+			bson_destroy (selector_p);
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * Unlike the other migrations, the taxonomy numbers come from the tree
+ * loaded in this process rather than from the documents, so each sample
+ * that doesn't have the current taxonomy version is read and updated in
+ * turn. The timestamps are left alone as none of the in-memory indexes
+ * use the numbers.
+ */
+static bool MigrateMartiTaxaPreorder (MartiServiceData *data_p)
+{
+	bool success_flag = false;
+	const char *version_s = GetMartiTaxonomyVersion ();
+
+	if (version_s)
+		{
+			bson_t *query_p = BCON_NEW (ME_TAXA_PREORDER_VERSION_S, "{", "$ne", BCON_UTF8 (version_s), "}");
+
+			if (query_p)
+				{
+					bson_t *opts_p = BCON_NEW ("projection", "{", ME_TAXA_S, BCON_INT32 (1), "}");
+
+					if (opts_p)
+						{
+							if (FindMatchingMongoDocumentsByBSON (data_p -> msd_mongo_p, query_p, NULL, opts_p))
+								{
+									const int32 num_samples = IterateOverMongoResults (data_p -> msd_mongo_p, SetMartiTaxaPreorderFromBSON, data_p);
+
+									if (num_samples >= 0)
+										{
+											PrintLog (STM_LEVEL_INFO, __FILE__, __LINE__, "Renumbered the taxa of %d samples in db \"%s\" collection \"%s\" to taxonomy version %s", num_samples, data_p -> msd_database_s, data_p -> msd_collection_s, version_s);
+											success_flag = true;
+										}
+								}
+
+							bson_destroy (opts_p);
+						}
+
+					bson_destroy (query_p);
+				}
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "The taxa can't be renumbered as no taxonomy is configured");
+		}
+
+	return success_flag;
+}
+
+
+static bool SetMartiTaxaPreorderFromBSON (const bson_t *document_p, void *data_p)
+{
+	bool success_flag = false;
+	MartiServiceData *service_data_p = (MartiServiceData *) data_p;
+	bson_iter_t iter;
+
+	if (bson_iter_init_find (&iter, document_p, MONGO_ID_S) && BSON_ITER_HOLDS_OID (&iter))
+		{
+			const bson_oid_t *id_p = bson_iter_oid (&iter);
+			size_t num_taxa = 0;
+			uint32 *taxa_p = GetMartiEntryTaxaFromBSON (document_p, &num_taxa);
+			bson_t *update_p = bson_new ();
+
+			if (update_p)
+				{
+					bson_t set_doc;
+
+					if (BSON_APPEND_DOCUMENT_BEGIN (update_p, "$set", &set_doc))
+						{
+							bson_t numbers;
+
+							if (BSON_APPEND_ARRAY_BEGIN (&set_doc, ME_TAXA_PREORDER_S, &numbers))
+								{
+									uint32 num_numbers = 0;
+									size_t i;
+
+									success_flag = true;
+
+									for (i = 0; (i < num_taxa) && success_flag; ++ i)
+										{
+											uint32 first;
+											uint32 last;
+
+											if (GetMartiTaxonInterval (* (taxa_p + i), &first, &last))
+												{
+													char key_s [16];
+													const char *index_key_s = NULL;
+
+													bson_uint32_to_string (num_numbers, &index_key_s, key_s, sizeof (key_s));
+													success_flag = BSON_APPEND_INT32 (&numbers, index_key_s, (int32) first);
+													++ num_numbers;
+												}
+										}
+
+									success_flag = bson_append_array_end (&set_doc, &numbers) && success_flag;
+								}
+
+							success_flag = success_flag && BSON_APPEND_UTF8 (&set_doc, ME_TAXA_PREORDER_VERSION_S, GetMartiTaxonomyVersion ());
+							success_flag = bson_append_document_end (update_p, &set_doc) && success_flag;
+						}
+
+					if (success_flag)
+						{
+							bson_t *selector_p = BCON_NEW (MONGO_ID_S, BCON_OID (id_p));
+
+							success_flag = false;
+
+							if (selector_p)
+								{
+									bson_error_t error;
+
+									if (mongoc_collection_update_one (service_data_p -> msd_mongo_p -> mt_collection_p, selector_p, update_p, NULL, NULL, &error))
+										{
+											success_flag = true;
+										}
+									else
+										{
+											char id_s [25];
+
+											bson_oid_to_string (id_p, id_s);
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to renumber the taxa of \"%s\": \"%s\"", id_s, error.message);
+										}
+
+									bson_destroy (selector_p);
+								}
+						}
+
+					bson_destroy (update_p);
+				}
+
+			if (taxa_p)
+				{
+					FreeMemory (taxa_p);
+				}
+		}
+
+	return success_flag;
+}
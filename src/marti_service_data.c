@@ -29,6 +29,15 @@
 #include "time_parameter.h"
 
 
+static const uint32 S_DEFAULT_SEARCH_BATCH_SIZE = 100;
+
+static const uint32 S_DEFAULT_MAX_KEYWORD_MATCHES = 10000;
+
+static const uint32 S_DEFAULT_IMPORT_BATCH_SIZE = 500;
+
+static const uint32 S_DEFAULT_MAX_LOOKUP_MATCHES = 20;
+
+
 MartiServiceData *AllocateMartiServiceData  (void)
 {
 	MartiServiceData *data_p = (MartiServiceData *) AllocMemory (sizeof (MartiServiceData));
@@ -39,6 +48,12 @@ MartiServiceData *AllocateMartiServiceData  (void)
 			data_p -> msd_database_s = NULL;
 			data_p -> msd_collection_s = NULL;
 			data_p -> msd_api_url_s = NULL;
+			data_p -> msd_stream_results_flag = true;
+			data_p -> msd_search_batch_size = S_DEFAULT_SEARCH_BATCH_SIZE;
+			data_p -> msd_max_keyword_matches = S_DEFAULT_MAX_KEYWORD_MATCHES;
+			data_p -> msd_import_batch_size = S_DEFAULT_IMPORT_BATCH_SIZE;
+			data_p -> msd_sample_lookup_flag = false;
+			data_p -> msd_max_lookup_matches = S_DEFAULT_MAX_LOOKUP_MATCHES;
 
 			return data_p;
 		}
@@ -62,6 +77,10 @@ bool ConfigureMartiService (MartiServiceData *data_p, GrassrootsServer *grassroo
 {
 	bool success_flag = false;
 	const json_t *service_config_p = data_p -> msd_base_data.sd_config_p;
+	int batch_size;
+	int max_keyword_matches;
+	int import_batch_size;
+	int max_lookup_matches;
 
 	data_p -> msd_database_s = GetJSONString (service_config_p, "database");
 
@@ -80,6 +99,58 @@ bool ConfigureMartiService (MartiServiceData *data_p, GrassrootsServer *grassroo
 											PrintJSONToErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, service_config_p, "No MARTi API URL specified");
 										}
 
+									GetJSONBoolean (service_config_p, "stream_search_results", & (data_p -> msd_stream_results_flag));
+
+									if (GetJSONInteger (service_config_p, "search_batch_size", &batch_size))
+										{
+											if (batch_size > 0)
+												{
+													data_p -> msd_search_batch_size = (uint32) batch_size;
+												}
+											else
+												{
+													PrintJSONToErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, service_config_p, "Invalid search_batch_size %d, using " UINT32_FMT, batch_size, data_p -> msd_search_batch_size);
+												}
+										}
+
+									if (GetJSONInteger (service_config_p, "max_keyword_matches", &max_keyword_matches))
+										{
+											if (max_keyword_matches > 0)
+												{
+													data_p -> msd_max_keyword_matches = (uint32) max_keyword_matches;
+												}
+											else
+												{
+													PrintJSONToErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, service_config_p, "Invalid max_keyword_matches %d, using " UINT32_FMT, max_keyword_matches, data_p -> msd_max_keyword_matches);
+												}
+										}
+
+									if (GetJSONInteger (service_config_p, "import_batch_size", &import_batch_size))
+										{
+											if (import_batch_size > 0)
+												{
+													data_p -> msd_import_batch_size = (uint32) import_batch_size;
+												}
+											else
+												{
+													PrintJSONToErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, service_config_p, "Invalid import_batch_size %d, using " UINT32_FMT, import_batch_size, data_p -> msd_import_batch_size);
+												}
+										}
+
+									GetJSONBoolean (service_config_p, "sample_lookup", & (data_p -> msd_sample_lookup_flag));
+
+									if (GetJSONInteger (service_config_p, "max_lookup_matches", &max_lookup_matches))
+										{
+											if (max_lookup_matches > 0)
+												{
+													data_p -> msd_max_lookup_matches = (uint32) max_lookup_matches;
+												}
+											else
+												{
+													PrintJSONToErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, service_config_p, "Invalid max_lookup_matches %d, using " UINT32_FMT, max_lookup_matches, data_p -> msd_max_lookup_matches);
+												}
+										}
+
 									success_flag = true;
 								}
 							else
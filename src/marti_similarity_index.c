@@ -0,0 +1,920 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * marti_similarity_index.c
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "marti_similarity_index.h"
+#include "marti_service.h"
+#include "marti_entry.h"
+#include "marti_oid_table.h"
+#include "marti_bitmap.h"
+
+#include "memory_allocations.h"
+#include "streams.h"
+
+
+/*
+ * The number of MinHash values in each sketch. The sketches are split
+ * into S_NUM_BANDS bands of S_ROWS_PER_BAND values and two samples
+ * become candidates if all of the values in any one band are the same.
+ * For a similarity of s, the chance of this is 1 - (1 - s^4)^16, which
+ * is about 0.05 at s = 0.2, 0.65 at s = 0.5 and 0.99 at s = 0.8.
+ */
+#define S_NUM_HASHES (64)
+
+#define S_NUM_BANDS (16)
+
+#define S_ROWS_PER_BAND (S_NUM_HASHES / S_NUM_BANDS)
+
+
+/*
+ * Used for the end of a bucket's list of entries
+ */
+static const uint32 S_NO_ENTRY = UINT32_MAX;
+
+
+/*
+ * MixBits () is reversible, so for each seed there is one taxon whose
+ * hash is always 0 and so always the smallest. The seeds are made from
+ * values well above any NCBI taxonomy id so that this is never a real
+ * taxon, as otherwise the common low ids such as 1 and 2 would make
+ * almost every pair of samples look the same.
+ */
+static const uint32 S_SEED_BASE = 0x80000000u;
+
+
+/*
+ * A sample within the index
+ */
+typedef struct SimilarityEntry
+{
+	bson_oid_t se_id;
+
+	uint32 se_sketch [S_NUM_HASHES];
+
+	double64 se_latitude;
+
+	double64 se_longitude;
+
+	/* The sample date as seconds since the epoch */
+	int64 se_time;
+
+	bool se_has_time_flag;
+
+	/* The next entry in the same bucket for each band */
+	uint32 se_next [S_NUM_BANDS];
+
+	/*
+	 * Samples that no longer have any taxa are taken out of the
+	 * buckets but keep their entry in case they get some again.
+	 */
+	bool se_active_flag;
+} SimilarityEntry;
+
+
+typedef struct MartiSimilarityIndex
+{
+	SimilarityEntry *msi_entries_p;
+
+	size_t msi_num_entries;
+
+	size_t msi_capacity;
+
+	size_t msi_num_active_entries;
+
+	/* The first entry of each bucket, in S_NUM_BANDS blocks of msi_num_buckets */
+	uint32 *msi_buckets_p;
+
+	uint32 msi_num_buckets;
+
+	MartiOidTable *msi_ids_p;
+
+	/*
+	 * When the last load of the samples began, so that the next
+	 * refresh only needs the ones that have been saved since then.
+	 */
+	time_t msi_load_time;
+
+	pthread_rwlock_t msi_lock;
+} MartiSimilarityIndex;
+
+
+/*
+ * How long, in seconds, before the index is refreshed so that
+ * any samples saved by other processes are picked up.
+ */
+static const time_t S_REFRESH_INTERVAL = 300;
+
+/*
+ * Each refresh goes back this many seconds before the previous load began,
+ * to allow for the clocks of the processes that save the samples being
+ * slightly out from ours.
+ */
+static const time_t S_REFRESH_OVERLAP = 60;
+
+
+static MartiSimilarityIndex *s_index_p = NULL;
+
+/* This is held whilst the index is being loaded or refreshed */
+static pthread_mutex_t s_init_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The seed for each of the MinHash functions */
+static uint32 s_seeds [S_NUM_HASHES];
+
+
+static MartiSimilarityIndex *AllocateSimilarityIndex (void);
+
+static void FreeSimilarityIndex (MartiSimilarityIndex *index_p);
+
+static bool LoadSimilarityIndex (MartiSimilarityIndex *index_p, MartiServiceData *data_p, const time_t since);
+
+static bool RefreshSimilarityIndex (MartiSimilarityIndex *index_p, MartiServiceData *data_p);
+
+static bool AddSimilarityEntryFromBSON (const bson_t *document_p, void *data_p);
+
+static bool SetSimilarityEntry (MartiSimilarityIndex *index_p, const bson_oid_t *id_p, const uint32 *taxa_p, const size_t num_taxa, const double64 latitude, const double64 longitude,
+																const bool has_time_flag, const int64 time);
+
+static bool ResizeBuckets (MartiSimilarityIndex *index_p, const uint32 num_buckets);
+
+static void AddEntryToBuckets (MartiSimilarityIndex *index_p, const uint32 entry_index);
+
+static void RemoveEntryFromBuckets (MartiSimilarityIndex *index_p, const uint32 entry_index);
+
+static void GetSketch (const uint32 *taxa_p, const size_t num_taxa, uint32 *sketch_p);
+
+static uint32 GetBandHash (const uint32 *sketch_p, const uint32 band);
+
+static bool IsSameBand (const uint32 *sketch_0_p, const uint32 *sketch_1_p, const uint32 band);
+
+static uint32 MixBits (uint32 value);
+
+static void InitSeeds (void);
+
+static bool GetTimeAsSeconds (const struct tm *time_p, int64 *seconds_p);
+
+static bool IsEntryInDateRange (const SimilarityEntry *entry_p, const bool has_start_flag, const int64 start, const bool has_end_flag, const int64 end);
+
+static int CompareSimilarMatches (const void *v0_p, const void *v1_p);
+
+
+
+bool InitMartiSimilarityIndex (MartiServiceData *data_p)
+{
+	pthread_mutex_lock (&s_init_mutex);
+
+	if (!s_index_p)
+		{
+			if (json_object_get (data_p -> msd_base_data.sd_config_p, "similarity_index"))
+				{
+					MartiSimilarityIndex *index_p = NULL;
+
+					InitSeeds ();
+
+					index_p = AllocateSimilarityIndex ();
+
+					if (index_p)
+						{
+							const time_t load_time = time (NULL);
+
+							if (LoadSimilarityIndex (index_p, data_p, 0))
+								{
+									PrintLog (STM_LEVEL_INFO, __FILE__, __LINE__, "Loaded " SIZET_FMT " MARTi samples into the similarity index", index_p -> msi_num_active_entries);
+									index_p -> msi_load_time = load_time;
+									s_index_p = index_p;
+
+									/*
+									 * Any samples that were saved whilst we were loading could
+									 * have been read before they were updated, so now that saves
+									 * go straight into the index, read them again.
+									 */
+									RefreshSimilarityIndex (index_p, data_p);
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to load similarity index for db \"%s\" collection \"%s\"", data_p -> msd_database_s, data_p -> msd_collection_s);
+									FreeSimilarityIndex (index_p);
+								}
+						}
+				}
+		}
+
+	pthread_mutex_unlock (&s_init_mutex);
+
+	return (s_index_p != NULL);
+}
+
+
+bool IsMartiSimilarityIndexEnabled (void)
+{
+	return (s_index_p != NULL);
+}
+
+
+void RefreshMartiSimilarityIndex (MartiServiceData *data_p)
+{
+	MartiSimilarityIndex *index_p = s_index_p;
+
+	/* If another thread is already refreshing the index, just use it as it is */
+	if (index_p && (pthread_mutex_trylock (&s_init_mutex) == 0))
+		{
+			if (time (NULL) - (index_p -> msi_load_time) >= S_REFRESH_INTERVAL)
+				{
+					RefreshSimilarityIndex (index_p, data_p);
+				}
+
+			pthread_mutex_unlock (&s_init_mutex);
+		}
+}
+
+
+bool IsInMartiSimilarityIndex (const bson_oid_t *id_p)
+{
+	bool found_flag = false;
+	MartiSimilarityIndex *index_p = s_index_p;
+
+	if (index_p)
+		{
+			uint32 entry_index;
+
+			pthread_rwlock_rdlock (& (index_p -> msi_lock));
+
+			if (GetMartiOidTableValue (index_p -> msi_ids_p, id_p, &entry_index))
+				{
+					found_flag = ((index_p -> msi_entries_p) + entry_index) -> se_active_flag;
+				}
+
+			pthread_rwlock_unlock (& (index_p -> msi_lock));
+		}
+
+	return found_flag;
+}
+
+
+bool UpdateMartiSimilarityIndex (const bson_oid_t *id_p, const uint32 *taxa_p, const size_t num_taxa, const double64 latitude, const double64 longitude, const struct tm *time_p)
+{
+	bool success_flag = true;
+	MartiSimilarityIndex *index_p = s_index_p;
+
+	if (index_p)
+		{
+			int64 time = 0;
+			const bool has_time_flag = GetTimeAsSeconds (time_p, &time);
+
+			pthread_rwlock_wrlock (& (index_p -> msi_lock));
+			success_flag = SetSimilarityEntry (index_p, id_p, taxa_p, num_taxa, latitude, longitude, has_time_flag, time);
+			pthread_rwlock_unlock (& (index_p -> msi_lock));
+
+			if (!success_flag)
+				{
+					char id_s [25];
+
+					bson_oid_to_string (id_p, id_s);
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to update similarity index for \"%s\"", id_s);
+				}
+		}
+
+	return success_flag;
+}
+
+
+MartiSimilarMatch *FindMartiSimilarSamples (const bson_oid_t *id_p, const uint32 *taxa_p, const size_t num_taxa, const uint32 max_matches,
+																						const double64 latitude, const double64 longitude, const double64 max_distance,
+																						const struct tm *start_p, const struct tm *end_p, size_t *num_matches_p)
+{
+	MartiSimilarMatch *matches_p = NULL;
+	MartiSimilarityIndex *index_p = s_index_p;
+
+	*num_matches_p = 0;
+
+	if (index_p && (max_matches > 0))
+		{
+			uint32 sketch [S_NUM_HASHES];
+			uint32 self_index = S_NO_ENTRY;
+			bool has_sketch_flag = false;
+			int64 start = 0;
+			int64 end = 0;
+			const bool has_start_flag = GetTimeAsSeconds (start_p, &start);
+			const bool has_end_flag = GetTimeAsSeconds (end_p, &end);
+
+			pthread_rwlock_rdlock (& (index_p -> msi_lock));
+
+			if (id_p)
+				{
+					if (GetMartiOidTableValue (index_p -> msi_ids_p, id_p, &self_index))
+						{
+							const SimilarityEntry *entry_p = (index_p -> msi_entries_p) + self_index;
+
+							if (entry_p -> se_active_flag)
+								{
+									memcpy (sketch, entry_p -> se_sketch, sizeof (sketch));
+									has_sketch_flag = true;
+								}
+						}
+				}
+			else if (num_taxa > 0)
+				{
+					GetSketch (taxa_p, num_taxa, sketch);
+					has_sketch_flag = true;
+				}
+
+			if (has_sketch_flag && (index_p -> msi_num_active_entries > 0))
+				{
+					MartiBitmap *seen_p = AllocateMartiBitmap ();
+
+					if (seen_p)
+						{
+							size_t capacity = 0;
+							size_t num_matches = 0;
+							bool success_flag = true;
+							uint32 band;
+
+							for (band = 0; (band < S_NUM_BANDS) && success_flag; ++ band)
+								{
+									const uint32 bucket = GetBandHash (sketch, band) & ((index_p -> msi_num_buckets) - 1);
+									uint32 entry_index = * ((index_p -> msi_buckets_p) + (band * (index_p -> msi_num_buckets)) + bucket);
+
+									while ((entry_index != S_NO_ENTRY) && success_flag)
+										{
+											const SimilarityEntry *entry_p = (index_p -> msi_entries_p) + entry_index;
+
+											/* Different bands can share a bucket so check that this one matches */
+											if ((entry_index != self_index) && IsSameBand (sketch, entry_p -> se_sketch, band) && !IsInMartiBitmap (seen_p, entry_index))
+												{
+													const double64 distance = GetMartiDistance (latitude, longitude, entry_p -> se_latitude, entry_p -> se_longitude);
+
+													success_flag = AddToMartiBitmap (seen_p, entry_index);
+
+													if (success_flag && ((max_distance <= 0.0) || (distance <= max_distance)) && IsEntryInDateRange (entry_p, has_start_flag, start, has_end_flag, end))
+														{
+															if (num_matches == capacity)
+																{
+																	const size_t new_capacity = capacity ? (capacity << 1) : 64;
+																	MartiSimilarMatch *new_matches_p = (MartiSimilarMatch *) ReallocMemory (matches_p, new_capacity * sizeof (MartiSimilarMatch), capacity * sizeof (MartiSimilarMatch));
+
+																	if (new_matches_p)
+																		{
+																			matches_p = new_matches_p;
+																			capacity = new_capacity;
+																		}
+																	else
+																		{
+																			success_flag = false;
+																		}
+																}
+
+															if (success_flag)
+																{
+																	MartiSimilarMatch *match_p = matches_p + num_matches;
+																	uint32 num_same = 0;
+																	uint32 i;
+
+																	for (i = 0; i < S_NUM_HASHES; ++ i)
+																		{
+																			if (sketch [i] == (entry_p -> se_sketch) [i])
+																				{
+																					++ num_same;
+																				}
+																		}
+
+																	bson_oid_copy (& (entry_p -> se_id), & (match_p -> msm_id));
+																	match_p -> msm_similarity = ((double64) num_same) / ((double64) S_NUM_HASHES);
+																	match_p -> msm_distance = distance;
+																	++ num_matches;
+																}
+														}
+												}
+
+											entry_index = (entry_p -> se_next) [band];
+										}
+								}
+
+							if (success_flag)
+								{
+									if (num_matches > 0)
+										{
+											qsort (matches_p, num_matches, sizeof (MartiSimilarMatch), CompareSimilarMatches);
+
+											*num_matches_p = (num_matches < max_matches) ? num_matches : max_matches;
+										}
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to get similar samples");
+
+									if (matches_p)
+										{
+											FreeMemory (matches_p);
+											matches_p = NULL;
+										}
+								}
+
+							FreeMartiBitmap (seen_p);
+						}
+				}
+
+			pthread_rwlock_unlock (& (index_p -> msi_lock));
+		}
+
+	if ((*num_matches_p == 0) && matches_p)
+		{
+			FreeMemory (matches_p);
+			matches_p = NULL;
+		}
+
+	return matches_p;
+}
+
+
+static MartiSimilarityIndex *AllocateSimilarityIndex (void)
+{
+	MartiSimilarityIndex *index_p = (MartiSimilarityIndex *) AllocMemory (sizeof (MartiSimilarityIndex));
+
+	if (index_p)
+		{
+			MartiOidTable *ids_p = AllocateMartiOidTable (0);
+
+			if (ids_p)
+				{
+					if (pthread_rwlock_init (& (index_p -> msi_lock), NULL) == 0)
+						{
+							index_p -> msi_entries_p = NULL;
+							index_p -> msi_num_entries = 0;
+							index_p -> msi_capacity = 0;
+							index_p -> msi_num_active_entries = 0;
+							index_p -> msi_buckets_p = NULL;
+							index_p -> msi_num_buckets = 0;
+							index_p -> msi_ids_p = ids_p;
+							index_p -> msi_load_time = 0;
+
+							if (ResizeBuckets (index_p, 1024))
+								{
+									return index_p;
+								}
+
+							pthread_rwlock_destroy (& (index_p -> msi_lock));
+						}
+
+					FreeMartiOidTable (ids_p);
+				}
+
+			FreeMemory (index_p);
+		}
+
+	PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate similarity index");
+
+	return NULL;
+}
+
+
+static void FreeSimilarityIndex (MartiSimilarityIndex *index_p)
+{
+	if (index_p -> msi_entries_p)
+		{
+			FreeMemory (index_p -> msi_entries_p);
+		}
+
+	if (index_p -> msi_buckets_p)
+		{
+			FreeMemory (index_p -> msi_buckets_p);
+		}
+
+	FreeMartiOidTable (index_p -> msi_ids_p);
+	pthread_rwlock_destroy (& (index_p -> msi_lock));
+
+	FreeMemory (index_p);
+}
+
+
+/*
+ * Add the samples that have been saved since the given time, or all of
+ * them if it is 0, to the index.
+ */
+static bool LoadSimilarityIndex (MartiSimilarityIndex *index_p, MartiServiceData *data_p, const time_t since)
+{
+	bool success_flag = false;
+	bson_t *query_p = NULL;
+
+	if (since > 0)
+		{
+			query_p = BCON_NEW (MONGO_TIMESTAMP_S, "{", "$gte", BCON_DATE_TIME (((int64) since) * 1000), "}");
+		}
+	else
+		{
+			query_p = bson_new ();
+		}
+
+	if (query_p)
+		{
+			bson_t *opts_p = BCON_NEW ("projection", "{", ME_LOCATION_S, BCON_INT32 (1), ME_START_DATE_S, BCON_INT32 (1), ME_TAXA_S, BCON_INT32 (1), "}");
+
+			if (opts_p)
+				{
+					if (FindMatchingMongoDocumentsByBSON (data_p -> msd_mongo_p, query_p, NULL, opts_p))
+						{
+							success_flag = (IterateOverMongoResults (data_p -> msd_mongo_p, AddSimilarityEntryFromBSON, index_p) >= 0);
+						}
+
+					bson_destroy (opts_p);
+				}
+
+			bson_destroy (query_p);
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * Add the samples that have been saved since the previous load began.
+ * This must be called with s_init_mutex held.
+ */
+static bool RefreshSimilarityIndex (MartiSimilarityIndex *index_p, MartiServiceData *data_p)
+{
+	const time_t load_time = time (NULL);
+	bool success_flag = LoadSimilarityIndex (index_p, data_p, (index_p -> msi_load_time) - S_REFRESH_OVERLAP);
+
+	if (success_flag)
+		{
+			PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, "Refreshed the similarity index, it now has " SIZET_FMT " MARTi samples", index_p -> msi_num_active_entries);
+			index_p -> msi_load_time = load_time;
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to refresh the similarity index, using the previous one");
+		}
+
+	return success_flag;
+}
+
+
+static bool AddSimilarityEntryFromBSON (const bson_t *document_p, void *data_p)
+{
+	MartiSimilarityIndex *index_p = (MartiSimilarityIndex *) data_p;
+	bson_iter_t iter;
+
+	if (bson_iter_init_find (&iter, document_p, MONGO_ID_S) && BSON_ITER_HOLDS_OID (&iter))
+		{
+			const bson_oid_t *id_p = bson_iter_oid (&iter);
+			double64 latitude;
+			double64 longitude;
+
+			/* The spatial index reports any samples without a valid location */
+			if (GetMartiEntryCoordinatesFromBSON (document_p, &latitude, &longitude))
+				{
+					size_t num_taxa = 0;
+					uint32 *taxa_p = GetMartiEntryTaxaFromBSON (document_p, &num_taxa);
+
+					/*
+					 * A refreshed sample with no taxa might have had some before
+					 * so it still needs setting to take it out of the buckets.
+					 */
+					if (taxa_p || (num_taxa == 0))
+						{
+							int64 time = 0;
+							const bool has_time_flag = GetMartiEntryTimeFromBSON (document_p, &time);
+							bool success_flag;
+
+							/* Searches can be using the index whilst it is being refreshed */
+							pthread_rwlock_wrlock (& (index_p -> msi_lock));
+							success_flag = SetSimilarityEntry (index_p, id_p, taxa_p, num_taxa, latitude, longitude, has_time_flag, time);
+							pthread_rwlock_unlock (& (index_p -> msi_lock));
+
+							if (taxa_p)
+								{
+									FreeMemory (taxa_p);
+								}
+
+							if (!success_flag)
+								{
+									PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, document_p, "Failed to add sample to similarity index");
+									return false;
+								}
+						}
+				}
+		}
+
+	return true;
+}
+
+
+static bool SetSimilarityEntry (MartiSimilarityIndex *index_p, const bson_oid_t *id_p, const uint32 *taxa_p, const size_t num_taxa, const double64 latitude, const double64 longitude,
+																const bool has_time_flag, const int64 time)
+{
+	SimilarityEntry *entry_p = NULL;
+	uint32 entry_index;
+
+	if (GetMartiOidTableValue (index_p -> msi_ids_p, id_p, &entry_index))
+		{
+			entry_p = (index_p -> msi_entries_p) + entry_index;
+
+			if (entry_p -> se_active_flag)
+				{
+					RemoveEntryFromBuckets (index_p, entry_index);
+					entry_p -> se_active_flag = false;
+					-- (index_p -> msi_num_active_entries);
+				}
+		}
+	else if (num_taxa > 0)
+		{
+			if (index_p -> msi_num_entries == index_p -> msi_capacity)
+				{
+					const size_t new_capacity = (index_p -> msi_capacity) ? ((index_p -> msi_capacity) << 1) : 1024;
+					SimilarityEntry *entries_p = (SimilarityEntry *) ReallocMemory (index_p -> msi_entries_p, new_capacity * sizeof (SimilarityEntry), (index_p -> msi_capacity) * sizeof (SimilarityEntry));
+
+					if (entries_p)
+						{
+							index_p -> msi_entries_p = entries_p;
+							index_p -> msi_capacity = new_capacity;
+						}
+					else
+						{
+							return false;
+						}
+				}
+
+			entry_index = (uint32) (index_p -> msi_num_entries);
+
+			if (!SetMartiOidTableValue (index_p -> msi_ids_p, id_p, entry_index))
+				{
+					return false;
+				}
+
+			entry_p = (index_p -> msi_entries_p) + entry_index;
+			bson_oid_copy (id_p, & (entry_p -> se_id));
+			entry_p -> se_active_flag = false;
+			++ (index_p -> msi_num_entries);
+		}
+
+	if (num_taxa > 0)
+		{
+			/* Keep the buckets short */
+			if (index_p -> msi_num_active_entries >= index_p -> msi_num_buckets)
+				{
+					if (!ResizeBuckets (index_p, (index_p -> msi_num_buckets) << 1))
+						{
+							return false;
+						}
+				}
+
+			GetSketch (taxa_p, num_taxa, entry_p -> se_sketch);
+			entry_p -> se_latitude = latitude;
+			entry_p -> se_longitude = longitude;
+			entry_p -> se_time = time;
+			entry_p -> se_has_time_flag = has_time_flag;
+			entry_p -> se_active_flag = true;
+			++ (index_p -> msi_num_active_entries);
+
+			AddEntryToBuckets (index_p, entry_index);
+		}
+
+	return true;
+}
+
+
+static bool ResizeBuckets (MartiSimilarityIndex *index_p, const uint32 num_buckets)
+{
+	uint32 *buckets_p = (uint32 *) AllocMemoryArray (((size_t) num_buckets) * S_NUM_BANDS, sizeof (uint32));
+
+	if (buckets_p)
+		{
+			size_t i;
+
+			memset (buckets_p, 0xFF, ((size_t) num_buckets) * S_NUM_BANDS * sizeof (uint32));
+
+			if (index_p -> msi_buckets_p)
+				{
+					FreeMemory (index_p -> msi_buckets_p);
+				}
+
+			index_p -> msi_buckets_p = buckets_p;
+			index_p -> msi_num_buckets = num_buckets;
+
+			for (i = 0; i < index_p -> msi_num_entries; ++ i)
+				{
+					if (((index_p -> msi_entries_p) + i) -> se_active_flag)
+						{
+							AddEntryToBuckets (index_p, (uint32) i);
+						}
+				}
+
+			return true;
+		}
+
+	PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate " UINT32_FMT " buckets for similarity index", num_buckets);
+
+	return false;
+}
+
+
+static void AddEntryToBuckets (MartiSimilarityIndex *index_p, const uint32 entry_index)
+{
+	SimilarityEntry *entry_p = (index_p -> msi_entries_p) + entry_index;
+	uint32 band;
+
+	for (band = 0; band < S_NUM_BANDS; ++ band)
+		{
+			const uint32 bucket = GetBandHash (entry_p -> se_sketch, band) & ((index_p -> msi_num_buckets) - 1);
+			uint32 *head_p = (index_p -> msi_buckets_p) + (band * (index_p -> msi_num_buckets)) + bucket;
+
+			(entry_p -> se_next) [band] = *head_p;
+			*head_p = entry_index;
+		}
+}
+
+
+static void RemoveEntryFromBuckets (MartiSimilarityIndex *index_p, const uint32 entry_index)
+{
+	const SimilarityEntry *entry_p = (index_p -> msi_entries_p) + entry_index;
+	uint32 band;
+
+	for (band = 0; band < S_NUM_BANDS; ++ band)
+		{
+			const uint32 bucket = GetBandHash (entry_p -> se_sketch, band) & ((index_p -> msi_num_buckets) - 1);
+			uint32 *link_p = (index_p -> msi_buckets_p) + (band * (index_p -> msi_num_buckets)) + bucket;
+
+			while (*link_p != S_NO_ENTRY)
+				{
+					if (*link_p == entry_index)
+						{
+							*link_p = (entry_p -> se_next) [band];
+							break;
+						}
+
+					link_p = ((index_p -> msi_entries_p) + (*link_p)) -> se_next + band;
+				}
+		}
+}
+
+
+/*
+ * Each value in the sketch is the smallest hash of any of the
+ * taxa using a different hash function. The chance of two sets
+ * having the same value is their Jaccard similarity.
+ */
+static void GetSketch (const uint32 *taxa_p, const size_t num_taxa, uint32 *sketch_p)
+{
+	size_t i;
+	uint32 j;
+
+	for (j = 0; j < S_NUM_HASHES; ++ j)
+		{
+			* (sketch_p + j) = UINT32_MAX;
+		}
+
+	for (i = 0; i < num_taxa; ++ i, ++ taxa_p)
+		{
+			const uint32 value = MixBits (*taxa_p);
+
+			for (j = 0; j < S_NUM_HASHES; ++ j)
+				{
+					const uint32 h = MixBits (value ^ s_seeds [j]);
+
+					if (h < * (sketch_p + j))
+						{
+							* (sketch_p + j) = h;
+						}
+				}
+		}
+}
+
+
+static uint32 GetBandHash (const uint32 *sketch_p, const uint32 band)
+{
+	const uint32 *value_p = sketch_p + (band * S_ROWS_PER_BAND);
+	uint32 h = 2166136261u;
+	uint32 i;
+
+	for (i = 0; i < S_ROWS_PER_BAND; ++ i, ++ value_p)
+		{
+			h = (h ^ *value_p) * 16777619u;
+		}
+
+	return MixBits (h ^ band);
+}
+
+
+static bool IsSameBand (const uint32 *sketch_0_p, const uint32 *sketch_1_p, const uint32 band)
+{
+	const size_t offset = band * S_ROWS_PER_BAND;
+
+	return (memcmp (sketch_0_p + offset, sketch_1_p + offset, S_ROWS_PER_BAND * sizeof (uint32)) == 0);
+}
+
+
+/*
+ * The MurmurHash3 finaliser
+ */
+static uint32 MixBits (uint32 value)
+{
+	value ^= value >> 16;
+	value *= 0x85EBCA6Bu;
+	value ^= value >> 13;
+	value *= 0xC2B2AE35u;
+	value ^= value >> 16;
+
+	return value;
+}
+
+
+static void InitSeeds (void)
+{
+	uint32 i;
+
+	for (i = 0; i < S_NUM_HASHES; ++ i)
+		{
+			s_seeds [i] = MixBits (S_SEED_BASE + i);
+		}
+}
+
+
+static bool GetTimeAsSeconds (const struct tm *time_p, int64 *seconds_p)
+{
+	if (time_p)
+		{
+			struct tm t = *time_p;
+
+			*seconds_p = (int64) timegm (&t);
+
+			return true;
+		}
+
+	return false;
+}
+
+
+/*
+ * Samples without a date only match if there is no date range.
+ */
+static bool IsEntryInDateRange (const SimilarityEntry *entry_p, const bool has_start_flag, const int64 start, const bool has_end_flag, const int64 end)
+{
+	if (has_start_flag || has_end_flag)
+		{
+			if (entry_p -> se_has_time_flag)
+				{
+					if (has_start_flag && (entry_p -> se_time < start))
+						{
+							return false;
+						}
+
+					if (has_end_flag && (entry_p -> se_time > end))
+						{
+							return false;
+						}
+				}
+			else
+				{
+					return false;
+				}
+		}
+
+	return true;
+}
+
+
+static int CompareSimilarMatches (const void *v0_p, const void *v1_p)
+{
+	const MartiSimilarMatch *match_0_p = (const MartiSimilarMatch *) v0_p;
+	const MartiSimilarMatch *match_1_p = (const MartiSimilarMatch *) v1_p;
+
+	if (match_0_p -> msm_similarity > match_1_p -> msm_similarity)
+		{
+			return -1;
+		}
+	else if (match_0_p -> msm_similarity < match_1_p -> msm_similarity)
+		{
+			return 1;
+		}
+	else if (match_0_p -> msm_distance < match_1_p -> msm_distance)
+		{
+			return -1;
+		}
+	else if (match_0_p -> msm_distance > match_1_p -> msm_distance)
+		{
+			return 1;
+		}
+
+	return bson_oid_compare (& (match_0_p -> msm_id), & (match_1_p -> msm_id));
+}
@@ -0,0 +1,941 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * marti_spatial_index.c
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "marti_spatial_index.h"
+#include "marti_service.h"
+#include "marti_entry.h"
+#include "marti_oid_table.h"
+
+#include "memory_allocations.h"
+#include "streams.h"
+#include "time_util.h"
+
+
+/*
+ * A sample within the index
+ */
+typedef struct SpatialEntry
+{
+	bson_oid_t se_id;
+
+	double64 se_latitude;
+
+	double64 se_longitude;
+
+	/* The sample date as seconds since the epoch */
+	int64 se_time;
+
+	bool se_has_time_flag;
+
+	/* The index of the cell that this entry is in */
+	uint32 se_cell;
+} SpatialEntry;
+
+
+/*
+ * The entries within a grid cell
+ */
+typedef struct SpatialCell
+{
+	uint32 *sc_entries_p;
+
+	uint32 sc_num_entries;
+
+	uint32 sc_capacity;
+} SpatialCell;
+
+
+typedef struct MartiSpatialIndex
+{
+	SpatialEntry *msi_entries_p;
+
+	size_t msi_num_entries;
+
+	size_t msi_capacity;
+
+	SpatialCell *msi_cells_p;
+
+	uint32 msi_num_rows;
+
+	uint32 msi_num_cols;
+
+	double64 msi_cell_size;
+
+	MartiOidTable *msi_ids_p;
+
+	/*
+	 * When the last load of the samples began, so that the next
+	 * refresh only needs the ones that have been saved since then.
+	 */
+	time_t msi_load_time;
+
+	pthread_rwlock_t msi_lock;
+} MartiSpatialIndex;
+
+
+/*
+ * The growing set of matches whilst searching
+ */
+typedef struct SpatialMatches
+{
+	MartiSpatialMatch *sm_matches_p;
+
+	size_t sm_num_matches;
+
+	size_t sm_capacity;
+
+	bool sm_success_flag;
+} SpatialMatches;
+
+
+static const double64 S_DEFAULT_CELL_SIZE = 1.0;
+
+/*
+ * Every cell is allocated up front, so this keeps the grid to
+ * 720 x 1440 cells, which is about 16MB of SpatialCells.
+ */
+static const double64 S_MIN_CELL_SIZE = 0.25;
+
+/* The same radius as used by GetMartiDistance () */
+static const double64 S_EARTH_RADIUS = 6378100.0;
+
+/*
+ * How long, in seconds, before the index is refreshed so that
+ * any samples saved by other processes are picked up.
+ */
+static const time_t S_REFRESH_INTERVAL = 300;
+
+/*
+ * Each refresh goes back this many seconds before the previous load began,
+ * to allow for the clocks of the processes that save the samples being
+ * slightly out from ours.
+ */
+static const time_t S_REFRESH_OVERLAP = 60;
+
+
+static MartiSpatialIndex *s_index_p = NULL;
+
+/* This is held whilst the index is being loaded or refreshed */
+static pthread_mutex_t s_init_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static MartiSpatialIndex *AllocateSpatialIndex (const double64 cell_size);
+
+static void FreeSpatialIndex (MartiSpatialIndex *index_p);
+
+static bool LoadSpatialIndex (MartiSpatialIndex *index_p, MartiServiceData *data_p, const time_t since);
+
+static bool RefreshSpatialIndex (MartiSpatialIndex *index_p, MartiServiceData *data_p);
+
+/*
+ * Add the samples that have been saved since the previous load began.
+ * This must be called with s_init_mutex held.
+ */
+static bool RefreshSpatialIndex (MartiSpatialIndex *index_p, MartiServiceData *data_p)
+{
+	const time_t load_time = time (NULL);
+	const size_t num_entries = index_p -> msi_num_entries;
+	bool success_flag = LoadSpatialIndex (index_p, data_p, (index_p -> msi_load_time) - S_REFRESH_OVERLAP);
+
+	if (success_flag)
+		{
+			PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, "Refreshed the spatial index, it now has " SIZET_FMT " MARTi samples, " SIZET_FMT " of which are new", index_p -> msi_num_entries, (index_p -> msi_num_entries) - num_entries);
+			index_p -> msi_load_time = load_time;
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to refresh the spatial index, using the previous one");
+		}
+
+	return success_flag;
+}
+
+
+static bool AddSpatialEntryFromBSON (const bson_t *document_p, void *data_p);
+
+static bool SetSpatialEntry (MartiSpatialIndex *index_p, const bson_oid_t *id_p, const double64 latitude, const double64 longitude, const bool has_time_flag, const int64 time);
+
+static uint32 GetCellIndex (const MartiSpatialIndex *index_p, const double64 latitude, const double64 longitude);
+
+static uint32 GetRow (const MartiSpatialIndex *index_p, const double64 latitude);
+
+static uint32 GetColumn (const MartiSpatialIndex *index_p, const double64 longitude);
+
+static bool AddEntryToCell (SpatialCell *cell_p, const uint32 entry_index);
+
+static void RemoveEntryFromCell (SpatialCell *cell_p, const uint32 entry_index);
+
+static bool GetTimeAsSeconds (const struct tm *time_p, int64 *time_p_out);
+
+static bool IsEntryInDateRange (const SpatialEntry *entry_p, const bool has_start_flag, const int64 start, const bool has_end_flag, const int64 end);
+
+static void AddMatch (SpatialMatches *matches_p, const SpatialEntry *entry_p, const double64 distance);
+
+static int CompareMatchesByDistance (const void *v0_p, const void *v1_p);
+
+static int CompareMatchesById (const void *v0_p, const void *v1_p);
+
+
+
+bool InitMartiSpatialIndex (MartiServiceData *data_p)
+{
+	pthread_mutex_lock (&s_init_mutex);
+
+	if (!s_index_p)
+		{
+			const json_t *index_config_p = json_object_get (data_p -> msd_base_data.sd_config_p, "spatial_index");
+
+			if (index_config_p)
+				{
+					double64 cell_size = S_DEFAULT_CELL_SIZE;
+					const json_t *value_p = json_object_get (index_config_p, "cell_size");
+					MartiSpatialIndex *index_p = NULL;
+
+					if (json_is_number (value_p))
+						{
+							cell_size = json_number_value (value_p);
+
+							if (cell_size < S_MIN_CELL_SIZE)
+								{
+									PrintJSONToErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, index_config_p, "cell_size is too small, using %lf", S_MIN_CELL_SIZE);
+									cell_size = S_MIN_CELL_SIZE;
+								}
+						}
+
+					index_p = AllocateSpatialIndex (cell_size);
+
+					if (index_p)
+						{
+							const time_t load_time = time (NULL);
+
+							if (LoadSpatialIndex (index_p, data_p, 0))
+								{
+									PrintLog (STM_LEVEL_INFO, __FILE__, __LINE__, "Loaded " SIZET_FMT " MARTi samples into the spatial index", index_p -> msi_num_entries);
+									index_p -> msi_load_time = load_time;
+									s_index_p = index_p;
+
+									/*
+									 * Any samples that were saved whilst we were loading could
+									 * have been read before they were updated, so now that saves
+									 * go straight into the index, read them again.
+									 */
+									RefreshSpatialIndex (index_p, data_p);
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to load spatial index for db \"%s\" collection \"%s\"", data_p -> msd_database_s, data_p -> msd_collection_s);
+									FreeSpatialIndex (index_p);
+								}
+						}
+
+				}		/* if (index_config_p) */
+
+		}		/* if (!s_index_p) */
+
+	pthread_mutex_unlock (&s_init_mutex);
+
+	return (s_index_p != NULL);
+}
+
+
+bool IsMartiSpatialIndexEnabled (void)
+{
+	return (s_index_p != NULL);
+}
+
+
+void RefreshMartiSpatialIndex (MartiServiceData *data_p)
+{
+	MartiSpatialIndex *index_p = s_index_p;
+
+	/* If another thread is already refreshing the index, just use it as it is */
+	if (index_p && (pthread_mutex_trylock (&s_init_mutex) == 0))
+		{
+			if (time (NULL) - (index_p -> msi_load_time) >= S_REFRESH_INTERVAL)
+				{
+					RefreshSpatialIndex (index_p, data_p);
+				}
+
+			pthread_mutex_unlock (&s_init_mutex);
+		}
+}
+
+
+bool UpdateMartiSpatialIndex (const bson_oid_t *id_p, const double64 latitude, const double64 longitude, const struct tm *time_p)
+{
+	bool success_flag = true;
+	MartiSpatialIndex *index_p = s_index_p;
+
+	if (index_p)
+		{
+			int64 time = 0;
+			const bool has_time_flag = GetTimeAsSeconds (time_p, &time);
+
+			pthread_rwlock_wrlock (& (index_p -> msi_lock));
+			success_flag = SetSpatialEntry (index_p, id_p, latitude, longitude, has_time_flag, time);
+			pthread_rwlock_unlock (& (index_p -> msi_lock));
+
+			if (!success_flag)
+				{
+					char id_s [25];
+
+					bson_oid_to_string (id_p, id_s);
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to update spatial index for \"%s\"", id_s);
+				}
+		}
+
+	return success_flag;
+}
+
+
+MartiSpatialMatch *FindMartiSpatialIndexMatches (const double64 latitude, const double64 longitude, const double64 min_distance, const bson_oid_t *after_id_p,
+																								 const double64 max_distance, const struct tm *start_p, const struct tm *end_p, size_t *num_matches_p)
+{
+	MartiSpatialIndex *index_p = s_index_p;
+	SpatialMatches matches;
+
+	matches.sm_matches_p = NULL;
+	matches.sm_num_matches = 0;
+	matches.sm_capacity = 0;
+	matches.sm_success_flag = true;
+
+	if (index_p)
+		{
+			int64 start = 0;
+			int64 end = 0;
+			const bool has_start_flag = GetTimeAsSeconds (start_p, &start);
+			const bool has_end_flag = GetTimeAsSeconds (end_p, &end);
+			/* As with $geoNear, a maximum distance of 0 means that there is no limit */
+			const bool bounded_flag = (max_distance > 0.0);
+			uint32 first_row = 0;
+			uint32 last_row = index_p -> msi_num_rows - 1;
+			uint32 first_col = 0;
+			uint32 num_cols = index_p -> msi_num_cols;
+			uint32 row;
+
+			if (bounded_flag)
+				{
+					const double64 to_degrees = 180.0 / M_PI;
+					const double64 angle = max_distance / S_EARTH_RADIUS;
+					const double64 delta_latitude = angle * to_degrees;
+
+					first_row = GetRow (index_p, latitude - delta_latitude);
+					last_row = GetRow (index_p, latitude + delta_latitude);
+
+					/*
+					 * If the circle covers a pole or is large enough, we need to
+					 * check every longitude, otherwise just the ones that
+					 * bound the circle.
+					 */
+					if ((latitude + delta_latitude < 90.0) && (latitude - delta_latitude > -90.0))
+						{
+							const double64 s = sin (angle) / cos (latitude / to_degrees);
+
+							if (s < 1.0)
+								{
+									const double64 delta_longitude = asin (s) * to_degrees;
+									const double64 west = longitude - delta_longitude;
+									const double64 east = longitude + delta_longitude;
+									const uint32 span = (uint32) (floor ((east + 180.0) / index_p -> msi_cell_size) - floor ((west + 180.0) / index_p -> msi_cell_size)) + 1;
+
+									if (span < num_cols)
+										{
+											double64 wrapped_west = fmod (west + 180.0, 360.0);
+
+											if (wrapped_west < 0.0)
+												{
+													wrapped_west += 360.0;
+												}
+
+											first_col = GetColumn (index_p, wrapped_west - 180.0);
+											num_cols = span;
+										}
+								}
+						}
+				}
+
+			pthread_rwlock_rdlock (& (index_p -> msi_lock));
+
+			for (row = first_row; row <= last_row; ++ row)
+				{
+					uint32 i;
+
+					for (i = 0; i < num_cols; ++ i)
+						{
+							const uint32 col = (first_col + i) % (index_p -> msi_num_cols);
+							const SpatialCell *cell_p = (index_p -> msi_cells_p) + (row * (index_p -> msi_num_cols)) + col;
+							const uint32 *entry_index_p = cell_p -> sc_entries_p;
+							uint32 j;
+
+							for (j = 0; j < cell_p -> sc_num_entries; ++ j, ++ entry_index_p)
+								{
+									const SpatialEntry *entry_p = (index_p -> msi_entries_p) + (*entry_index_p);
+
+									if (IsEntryInDateRange (entry_p, has_start_flag, start, has_end_flag, end))
+										{
+											const double64 distance = GetMartiDistance (latitude, longitude, entry_p -> se_latitude, entry_p -> se_longitude);
+
+											if (((!bounded_flag) || (distance <= max_distance)) && (distance >= min_distance))
+												{
+													if ((distance > min_distance) || (after_id_p == NULL) || (bson_oid_compare (& (entry_p -> se_id), after_id_p) > 0))
+														{
+															AddMatch (&matches, entry_p, distance);
+														}
+												}
+										}
+								}
+						}
+				}
+
+			pthread_rwlock_unlock (& (index_p -> msi_lock));
+
+			if (matches.sm_success_flag)
+				{
+					if (matches.sm_num_matches > 1)
+						{
+							qsort (matches.sm_matches_p, matches.sm_num_matches, sizeof (MartiSpatialMatch), CompareMatchesByDistance);
+						}
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to get all spatial index matches for %lf, %lf", latitude, longitude);
+
+					if (matches.sm_matches_p)
+						{
+							FreeMemory (matches.sm_matches_p);
+							matches.sm_matches_p = NULL;
+						}
+
+					matches.sm_num_matches = 0;
+				}
+		}
+
+	*num_matches_p = matches.sm_num_matches;
+
+	return matches.sm_matches_p;
+}
+
+
+MartiSpatialMatch *FindMartiSpatialIndexMatchesInBox (const double64 min_latitude, const double64 min_longitude, const double64 max_latitude, const double64 max_longitude,
+																											const struct tm *start_p, const struct tm *end_p, size_t *num_matches_p)
+{
+	MartiSpatialIndex *index_p = s_index_p;
+	SpatialMatches matches;
+
+	matches.sm_matches_p = NULL;
+	matches.sm_num_matches = 0;
+	matches.sm_capacity = 0;
+	matches.sm_success_flag = true;
+
+	if (index_p)
+		{
+			int64 start = 0;
+			int64 end = 0;
+			const bool has_start_flag = GetTimeAsSeconds (start_p, &start);
+			const bool has_end_flag = GetTimeAsSeconds (end_p, &end);
+			const bool wraps_flag = (min_longitude > max_longitude);
+			const uint32 first_row = GetRow (index_p, min_latitude);
+			const uint32 last_row = GetRow (index_p, max_latitude);
+			const uint32 first_col = GetColumn (index_p, min_longitude);
+			const uint32 last_col = GetColumn (index_p, max_longitude);
+			const uint32 num_cols = wraps_flag ? (index_p -> msi_num_cols - first_col + last_col + 1) : (last_col - first_col + 1);
+			uint32 row;
+
+			pthread_rwlock_rdlock (& (index_p -> msi_lock));
+
+			for (row = first_row; row <= last_row; ++ row)
+				{
+					uint32 i;
+
+					for (i = 0; i < num_cols; ++ i)
+						{
+							const uint32 col = (first_col + i) % (index_p -> msi_num_cols);
+							const SpatialCell *cell_p = (index_p -> msi_cells_p) + (row * (index_p -> msi_num_cols)) + col;
+							const uint32 *entry_index_p = cell_p -> sc_entries_p;
+							uint32 j;
+
+							for (j = 0; j < cell_p -> sc_num_entries; ++ j, ++ entry_index_p)
+								{
+									const SpatialEntry *entry_p = (index_p -> msi_entries_p) + (*entry_index_p);
+
+									if ((entry_p -> se_latitude >= min_latitude) && (entry_p -> se_latitude <= max_latitude))
+										{
+											bool in_box_flag;
+
+											if (wraps_flag)
+												{
+													in_box_flag = (entry_p -> se_longitude >= min_longitude) || (entry_p -> se_longitude <= max_longitude);
+												}
+											else
+												{
+													in_box_flag = (entry_p -> se_longitude >= min_longitude) && (entry_p -> se_longitude <= max_longitude);
+												}
+
+											if (in_box_flag && IsEntryInDateRange (entry_p, has_start_flag, start, has_end_flag, end))
+												{
+													AddMatch (&matches, entry_p, 0.0);
+												}
+										}
+								}
+						}
+				}
+
+			pthread_rwlock_unlock (& (index_p -> msi_lock));
+
+			if (matches.sm_success_flag)
+				{
+					if (matches.sm_num_matches > 1)
+						{
+							qsort (matches.sm_matches_p, matches.sm_num_matches, sizeof (MartiSpatialMatch), CompareMatchesById);
+						}
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to get all spatial index matches for box [%lf, %lf] - [%lf, %lf]", min_latitude, min_longitude, max_latitude, max_longitude);
+
+					if (matches.sm_matches_p)
+						{
+							FreeMemory (matches.sm_matches_p);
+							matches.sm_matches_p = NULL;
+						}
+
+					matches.sm_num_matches = 0;
+				}
+		}
+
+	*num_matches_p = matches.sm_num_matches;
+
+	return matches.sm_matches_p;
+}
+
+
+static MartiSpatialIndex *AllocateSpatialIndex (const double64 cell_size)
+{
+	MartiSpatialIndex *index_p = (MartiSpatialIndex *) AllocMemory (sizeof (MartiSpatialIndex));
+
+	if (index_p)
+		{
+			const uint32 num_rows = (uint32) ceil (180.0 / cell_size);
+			const uint32 num_cols = (uint32) ceil (360.0 / cell_size);
+			SpatialCell *cells_p = (SpatialCell *) AllocMemoryArray (num_rows * num_cols, sizeof (SpatialCell));
+
+			if (cells_p)
+				{
+					MartiOidTable *ids_p = AllocateMartiOidTable (0);
+
+					memset (cells_p, 0, num_rows * num_cols * sizeof (SpatialCell));
+
+					if (ids_p)
+						{
+							if (pthread_rwlock_init (& (index_p -> msi_lock), NULL) == 0)
+								{
+									index_p -> msi_entries_p = NULL;
+									index_p -> msi_num_entries = 0;
+									index_p -> msi_capacity = 0;
+									index_p -> msi_cells_p = cells_p;
+									index_p -> msi_num_rows = num_rows;
+									index_p -> msi_num_cols = num_cols;
+									index_p -> msi_cell_size = cell_size;
+									index_p -> msi_ids_p = ids_p;
+									index_p -> msi_load_time = 0;
+
+									return index_p;
+								}
+
+							FreeMartiOidTable (ids_p);
+						}
+
+					FreeMemory (cells_p);
+				}
+
+			FreeMemory (index_p);
+		}
+
+	PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate spatial index with cell size %lf", cell_size);
+
+	return NULL;
+}
+
+
+static void FreeSpatialIndex (MartiSpatialIndex *index_p)
+{
+	const uint32 num_cells = (index_p -> msi_num_rows) * (index_p -> msi_num_cols);
+	uint32 i;
+
+	for (i = 0; i < num_cells; ++ i)
+		{
+			SpatialCell *cell_p = (index_p -> msi_cells_p) + i;
+
+			if (cell_p -> sc_entries_p)
+				{
+					FreeMemory (cell_p -> sc_entries_p);
+				}
+		}
+
+	FreeMemory (index_p -> msi_cells_p);
+
+	if (index_p -> msi_entries_p)
+		{
+			FreeMemory (index_p -> msi_entries_p);
+		}
+
+	FreeMartiOidTable (index_p -> msi_ids_p);
+	pthread_rwlock_destroy (& (index_p -> msi_lock));
+
+	FreeMemory (index_p);
+}
+
+
+/*
+ * Add the samples that have been saved since the given time, or all of
+ * them if it is 0, to the index.
+ */
+static bool LoadSpatialIndex (MartiSpatialIndex *index_p, MartiServiceData *data_p, const time_t since)
+{
+	bool success_flag = false;
+	bson_t *query_p = NULL;
+
+	if (since > 0)
+		{
+			query_p = BCON_NEW (MONGO_TIMESTAMP_S, "{", "$gte", BCON_DATE_TIME (((int64) since) * 1000), "}");
+		}
+	else
+		{
+			query_p = bson_new ();
+		}
+
+	if (query_p)
+		{
+			bson_t *opts_p = BCON_NEW ("projection", "{", ME_LOCATION_S, BCON_INT32 (1), ME_START_DATE_S, BCON_INT32 (1), "}");
+
+			if (opts_p)
+				{
+					if (FindMatchingMongoDocumentsByBSON (data_p -> msd_mongo_p, query_p, NULL, opts_p))
+						{
+							success_flag = (IterateOverMongoResults (data_p -> msd_mongo_p, AddSpatialEntryFromBSON, index_p) >= 0);
+						}
+
+					bson_destroy (opts_p);
+				}
+
+			bson_destroy (query_p);
+		}
+
+	return success_flag;
+}
+
+
+static bool AddSpatialEntryFromBSON (const bson_t *document_p, void *data_p)
+{
+	MartiSpatialIndex *index_p = (MartiSpatialIndex *) data_p;
+	bson_iter_t iter;
+
+	if (bson_iter_init_find (&iter, document_p, MONGO_ID_S) && BSON_ITER_HOLDS_OID (&iter))
+		{
+			const bson_oid_t *id_p = bson_iter_oid (&iter);
+			double64 latitude;
+			double64 longitude;
+
+			if (GetMartiEntryCoordinatesFromBSON (document_p, &latitude, &longitude))
+				{
+					int64 time = 0;
+					const bool has_time_flag = GetMartiEntryTimeFromBSON (document_p, &time);
+					bool success_flag;
+
+					/* Searches can be using the index whilst it is being refreshed */
+					pthread_rwlock_wrlock (& (index_p -> msi_lock));
+					success_flag = SetSpatialEntry (index_p, id_p, latitude, longitude, has_time_flag, time);
+					pthread_rwlock_unlock (& (index_p -> msi_lock));
+
+					if (!success_flag)
+						{
+							PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, document_p, "Failed to add sample to spatial index");
+							return false;
+						}
+				}
+			else
+				{
+					PrintBSONToErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, document_p, "Sample has no valid location");
+				}
+		}
+
+	return true;
+}
+
+
+static bool SetSpatialEntry (MartiSpatialIndex *index_p, const bson_oid_t *id_p, const double64 latitude, const double64 longitude, const bool has_time_flag, const int64 time)
+{
+	const uint32 cell_index = GetCellIndex (index_p, latitude, longitude);
+	SpatialEntry *entry_p = NULL;
+	uint32 entry_index;
+
+	if (GetMartiOidTableValue (index_p -> msi_ids_p, id_p, &entry_index))
+		{
+			entry_p = (index_p -> msi_entries_p) + entry_index;
+
+			if (entry_p -> se_cell != cell_index)
+				{
+					if (AddEntryToCell ((index_p -> msi_cells_p) + cell_index, entry_index))
+						{
+							RemoveEntryFromCell ((index_p -> msi_cells_p) + (entry_p -> se_cell), entry_index);
+						}
+					else
+						{
+							return false;
+						}
+				}
+		}
+	else
+		{
+			if (index_p -> msi_num_entries == index_p -> msi_capacity)
+				{
+					const size_t new_capacity = (index_p -> msi_capacity) ? ((index_p -> msi_capacity) << 1) : 1024;
+					SpatialEntry *entries_p = (SpatialEntry *) ReallocMemory (index_p -> msi_entries_p, new_capacity * sizeof (SpatialEntry), (index_p -> msi_capacity) * sizeof (SpatialEntry));
+
+					if (entries_p)
+						{
+							index_p -> msi_entries_p = entries_p;
+							index_p -> msi_capacity = new_capacity;
+						}
+					else
+						{
+							return false;
+						}
+				}
+
+			entry_index = (uint32) (index_p -> msi_num_entries);
+
+			if (AddEntryToCell ((index_p -> msi_cells_p) + cell_index, entry_index))
+				{
+					if (SetMartiOidTableValue (index_p -> msi_ids_p, id_p, entry_index))
+						{
+							entry_p = (index_p -> msi_entries_p) + entry_index;
+							bson_oid_copy (id_p, & (entry_p -> se_id));
+							++ (index_p -> msi_num_entries);
+						}
+					else
+						{
+							RemoveEntryFromCell ((index_p -> msi_cells_p) + cell_index, entry_index);
+							return false;
+						}
+				}
+			else
+				{
+					return false;
+				}
+		}
+
+	entry_p -> se_latitude = latitude;
+	entry_p -> se_longitude = longitude;
+	entry_p -> se_has_time_flag = has_time_flag;
+	entry_p -> se_time = time;
+	entry_p -> se_cell = cell_index;
+
+	return true;
+}
+
+
+static uint32 GetCellIndex (const MartiSpatialIndex *index_p, const double64 latitude, const double64 longitude)
+{
+	return (GetRow (index_p, latitude) * (index_p -> msi_num_cols)) + GetColumn (index_p, longitude);
+}
+
+
+static uint32 GetRow (const MartiSpatialIndex *index_p, const double64 latitude)
+{
+	double64 d = floor ((latitude + 90.0) / (index_p -> msi_cell_size));
+
+	if (d < 0.0)
+		{
+			return 0;
+		}
+	else if (d >= (double64) (index_p -> msi_num_rows))
+		{
+			return (index_p -> msi_num_rows) - 1;
+		}
+
+	return (uint32) d;
+}
+
+
+static uint32 GetColumn (const MartiSpatialIndex *index_p, const double64 longitude)
+{
+	double64 d = floor ((longitude + 180.0) / (index_p -> msi_cell_size));
+
+	if (d < 0.0)
+		{
+			return 0;
+		}
+	else if (d >= (double64) (index_p -> msi_num_cols))
+		{
+			return (index_p -> msi_num_cols) - 1;
+		}
+
+	return (uint32) d;
+}
+
+
+static bool AddEntryToCell (SpatialCell *cell_p, const uint32 entry_index)
+{
+	if (cell_p -> sc_num_entries == cell_p -> sc_capacity)
+		{
+			const uint32 new_capacity = (cell_p -> sc_capacity) ? ((cell_p -> sc_capacity) << 1) : 8;
+			uint32 *entries_p = (uint32 *) ReallocMemory (cell_p -> sc_entries_p, new_capacity * sizeof (uint32), (cell_p -> sc_capacity) * sizeof (uint32));
+
+			if (entries_p)
+				{
+					cell_p -> sc_entries_p = entries_p;
+					cell_p -> sc_capacity = new_capacity;
+				}
+			else
+				{
+					return false;
+				}
+		}
+
+	* ((cell_p -> sc_entries_p) + (cell_p -> sc_num_entries)) = entry_index;
+	++ (cell_p -> sc_num_entries);
+
+	return true;
+}
+
+
+static void RemoveEntryFromCell (SpatialCell *cell_p, const uint32 entry_index)
+{
+	uint32 i;
+
+	for (i = 0; i < cell_p -> sc_num_entries; ++ i)
+		{
+			if (* ((cell_p -> sc_entries_p) + i) == entry_index)
+				{
+					/* The order within a cell doesn't matter so move the last one into this slot */
+					-- (cell_p -> sc_num_entries);
+					* ((cell_p -> sc_entries_p) + i) = * ((cell_p -> sc_entries_p) + (cell_p -> sc_num_entries));
+
+					return;
+				}
+		}
+}
+
+
+static bool GetTimeAsSeconds (const struct tm *time_p, int64 *seconds_p)
+{
+	if (time_p)
+		{
+			struct tm t = *time_p;
+
+			*seconds_p = (int64) timegm (&t);
+
+			return true;
+		}
+
+	return false;
+}
+
+
+static bool IsEntryInDateRange (const SpatialEntry *entry_p, const bool has_start_flag, const int64 start, const bool has_end_flag, const int64 end)
+{
+	if (has_start_flag || has_end_flag)
+		{
+			if (entry_p -> se_has_time_flag)
+				{
+					if (has_start_flag && (entry_p -> se_time < start))
+						{
+							return false;
+						}
+
+					if (has_end_flag && (entry_p -> se_time > end))
+						{
+							return false;
+						}
+				}
+			else
+				{
+					return false;
+				}
+		}
+
+	return true;
+}
+
+
+static void AddMatch (SpatialMatches *matches_p, const SpatialEntry *entry_p, const double64 distance)
+{
+	if (matches_p -> sm_success_flag)
+		{
+			MartiSpatialMatch *match_p;
+
+			if (matches_p -> sm_num_matches == matches_p -> sm_capacity)
+				{
+					const size_t new_capacity = (matches_p -> sm_capacity) ? ((matches_p -> sm_capacity) << 1) : 64;
+					MartiSpatialMatch *new_matches_p = (MartiSpatialMatch *) ReallocMemory (matches_p -> sm_matches_p, new_capacity * sizeof (MartiSpatialMatch), (matches_p -> sm_capacity) * sizeof (MartiSpatialMatch));
+
+					if (new_matches_p)
+						{
+							matches_p -> sm_matches_p = new_matches_p;
+							matches_p -> sm_capacity = new_capacity;
+						}
+					else
+						{
+							matches_p -> sm_success_flag = false;
+							return;
+						}
+				}
+
+			match_p = (matches_p -> sm_matches_p) + (matches_p -> sm_num_matches);
+			bson_oid_copy (& (entry_p -> se_id), & (match_p -> msm_id));
+			match_p -> msm_distance = distance;
+			++ (matches_p -> sm_num_matches);
+		}
+}
+
+
+static int CompareMatchesByDistance (const void *v0_p, const void *v1_p)
+{
+	const MartiSpatialMatch *match_0_p = (const MartiSpatialMatch *) v0_p;
+	const MartiSpatialMatch *match_1_p = (const MartiSpatialMatch *) v1_p;
+
+	if (match_0_p -> msm_distance < match_1_p -> msm_distance)
+		{
+			return -1;
+		}
+	else if (match_0_p -> msm_distance > match_1_p -> msm_distance)
+		{
+			return 1;
+		}
+
+	return bson_oid_compare (& (match_0_p -> msm_id), & (match_1_p -> msm_id));
+}
+
+
+static int CompareMatchesById (const void *v0_p, const void *v1_p)
+{
+	const MartiSpatialMatch *match_0_p = (const MartiSpatialMatch *) v0_p;
+	const MartiSpatialMatch *match_1_p = (const MartiSpatialMatch *) v1_p;
+
+	return bson_oid_compare (& (match_0_p -> msm_id), & (match_1_p -> msm_id));
+}
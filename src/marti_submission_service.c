@@ -37,6 +37,10 @@
 #include "string_array_parameter.h"
 
 #include "marti_entry.h"
+#include "marti_taxonomy.h"
+#include "marti_import.h"
+#include "marti_sample_list.h"
+#include "marti_entry_cache.h"
 
 
 
@@ -46,6 +50,14 @@
 
 static const char * const S_EMPTY_LIST_OPTION_S = "<empty>";
 
+static NamedParameterType S_BULK_UPLOAD = { "Bulk Upload", PT_LARGE_STRING };
+
+static NamedParameterType S_SAMPLE_LOOKUP = { "Sample Lookup", PT_STRING };
+
+static NamedParameterType S_UPSERT = { "Update By MARTi ID", PT_BOOLEAN };
+
+static const char * const S_ENTRY_CACHE_STATISTICS_S = "entry_cache";
+
 
 static const char *GetMartiSubmissionServiceName (const Service *service_p);
 
@@ -67,12 +79,19 @@ static bool CloseMartiSubmissionService (Service *service_p);
 
 static ServiceMetadata *GetMartiSubmissionServiceMetadata (Service *service_p);
 
+static bool AddBulkUploadParameter (ParameterSet *param_set_p, ServiceData *data_p);
+
+static void AddSampleLookupParameter (ParameterSet *param_set_p, ParameterGroup *group_p, ServiceData *data_p);
+
+static void AddUpsertParameter (ParameterSet *param_set_p, ParameterGroup *group_p, ServiceData *data_p);
+
+static OperationStatus RunSampleLookup (const char *prefix_s, ServiceJob *job_p, const MartiServiceData *data_p);
+
 static bool GetMartiSubmissionServiceParameterTypesForNamedParameters (const Service *service_p, const char *param_name_s, ParameterType *pt_p);
 
 
 static bool SetUpEntriesListParameter (const MartiServiceData *data_p, StringParameter *param_p, const MartiEntry *active_entry_p, const bool empty_option_flag);
 
-static json_t *GetAllEntriesAsJSON (const MartiServiceData *data_p);
 
 static MartiEntry *GetMartiEntryFromResource (DataResource *resource_p, MartiServiceData *data_p);
 
@@ -114,6 +133,10 @@ Service *GetMartiSubmissionService (GrassrootsServer *grassroots_p)
 
 							if (ConfigureMartiService (data_p, grassroots_p))
 								{
+									/* Saved samples need their taxonomy numbers for subtree searches */
+									InitMartiTaxonomy (data_p -> msd_base_data.sd_config_p);
+									InitMartiEntryCache (data_p -> msd_base_data.sd_config_p);
+
 									return service_p;
 								}
 						}		/* if (InitialiseService (.... */
@@ -199,6 +222,11 @@ static ParameterSet *GetMartiSubmissionServiceParameters (Service *service_p, Da
 									id_s = NULL;
 								}
 
+							if (marti_data_p -> msd_sample_lookup_flag)
+								{
+									AddSampleLookupParameter (param_set_p, main_group_p, data_p);
+								}
+
 							if ((param_p = EasyCreateAndAddStringParameterToParameterSet (data_p, param_set_p, main_group_p, MA_NAME.npt_type, MA_NAME.npt_name_s, "Name", "The name of this sample", active_entry_p ? active_entry_p -> me_sample_name_s : NULL, PL_ALL)) != NULL)
 								{
 									param_p -> pa_required_flag = true;
@@ -207,6 +235,8 @@ static ParameterSet *GetMartiSubmissionServiceParameters (Service *service_p, Da
 										{
 											param_p -> pa_required_flag = true;
 
+											AddUpsertParameter (param_set_p, main_group_p, data_p);
+
 											if (AddCommonMartiParameters (param_set_p, NULL, active_entry_p, data_p))
 												{
 													if ((param_p = EasyCreateAndAddStringParameterToParameterSet (data_p, param_set_p, main_group_p, MA_SITE_NAME.npt_type, MA_SITE_NAME.npt_name_s, "Site", "The name of the location where this sample was taken", active_entry_p ? active_entry_p -> me_site_name_s : NULL, PL_ALL)) != NULL)
@@ -221,8 +251,12 @@ static ParameterSet *GetMartiSubmissionServiceParameters (Service *service_p, Da
 
 																	if (active_entry_p)
 																		{
-																			taxa_ss = active_entry_p -> me_taxa_ss;
-																			num_taxa = active_entry_p -> me_num_taxa;
+																			taxa_ss = GetMartiEntryTaxaAsStrings (active_entry_p);
+
+																			if (taxa_ss)
+																				{
+																					num_taxa = active_entry_p -> me_num_taxa;
+																				}
 																		}
 
 																	if (num_taxa > 1)
@@ -245,7 +279,10 @@ static ParameterSet *GetMartiSubmissionServiceParameters (Service *service_p, Da
 																		{
 																			if (AddRepeatableParameterGroupLabelParam (taxa_group_p, param_p))
 																				{
-																					return param_set_p;
+																					if (AddBulkUploadParameter (param_set_p, data_p))
+																						{
+																							return param_set_p;
+																						}
 																				}
 																			else
 																				{
@@ -308,6 +345,9 @@ static bool GetMartiSubmissionServiceParameterTypesForNamedParameters (const Ser
 			MA_SITE_NAME,
 			MA_DESCRIPTION,
 			MA_TAXA,
+			S_BULK_UPLOAD,
+			S_SAMPLE_LOOKUP,
+			S_UPSERT,
 			NULL
 		};
 
@@ -359,6 +399,8 @@ static ServiceJobSet *RunMartiSubmissionService (Service *service_p, ParameterSe
 					bool success_flag = false;
 					const char *name_s = NULL;
 					const char *id_s = NULL;
+					const char *upload_s = NULL;
+					const char *lookup_s = NULL;
 					bson_oid_t *id_p = NULL;
 
 					/*
@@ -381,7 +423,33 @@ static ServiceJobSet *RunMartiSubmissionService (Service *service_p, ParameterSe
 						}		/* if (id_value.st_string_value_s) */
 
 
-					if (GetCurrentStringParameterValueFromParameterSet (param_set_p, MA_NAME.npt_name_s, &name_s))
+					/*
+					 * If there is a sample lookup, just find the matching samples
+					 * and if there is a bulk upload, import its samples. Otherwise
+					 * save the single sample.
+					 */
+					GetCurrentStringParameterValueFromParameterSet (param_set_p, S_SAMPLE_LOOKUP.npt_name_s, &lookup_s);
+					GetCurrentStringParameterValueFromParameterSet (param_set_p, S_BULK_UPLOAD.npt_name_s, &upload_s);
+
+					if (!IsStringEmpty (lookup_s))
+						{
+							status = RunSampleLookup (lookup_s, job_p, data_p);
+
+							if (id_p)
+								{
+									FreeBSONOid (id_p);
+								}
+						}
+					else if (!IsStringEmpty (upload_s))
+						{
+							status = ImportMartiEntries (upload_s, user_p, job_p, data_p);
+
+							if (id_p)
+								{
+									FreeBSONOid (id_p);
+								}
+						}
+					else if (GetCurrentStringParameterValueFromParameterSet (param_set_p, MA_NAME.npt_name_s, &name_s))
 						{
 							if (!IsStringEmpty (name_s))
 								{
@@ -408,27 +476,70 @@ static ServiceJobSet *RunMartiSubmissionService (Service *service_p, ParameterSe
 																	const char *description_s = NULL;
 																	const char **taxa_ss = NULL;
 																	size_t num_taxa = 0;
+																	uint32 *taxa_p = NULL;
+																	size_t num_taxon_ids = 0;
+																	bool valid_taxa_flag = true;
 
 																	GetCurrentStringParameterValueFromParameterSet (param_set_p, MA_DESCRIPTION.npt_name_s, &description_s);
 
 
 																	GetCurrentStringArrayParameterValuesFromParameterSet (param_set_p, MA_TAXA.npt_name_s, &taxa_ss, &num_taxa);
 
-																	entry_p = AllocateMartiEntry (id_p, user_p, permissions_group_p, owns_user_flag,
-																																name_s, marti_id_s, site_name_s, description_s, *latitude_p, *longitude_p,
-																																start_p, taxa_ss, num_taxa);
-
+																	if (num_taxa > 0)
+																		{
+																			taxa_p = GetMartiTaxonIdsFromStrings (taxa_ss, num_taxa, &num_taxon_ids);
 
+																			/* Make sure that we don't silently drop any invalid taxa */
+																			if (!taxa_p)
+																				{
+																					size_t i;
+
+																					for (i = 0; (i < num_taxa) && valid_taxa_flag; ++ i)
+																						{
+																							if (!IsStringEmpty (* (taxa_ss + i)))
+																								{
+																									AddParameterErrorMessageToServiceJob (job_p, MA_TAXA.npt_name_s, MA_TAXA.npt_type, "The taxa must be NCBI taxonomy ids");
+																									valid_taxa_flag = false;
+																								}
+																						}
+																				}
+																		}
 
-																	if (entry_p)
+																	if (valid_taxa_flag)
 																		{
-																			status = SaveMartiEntry (entry_p, job_p, data_p);
+																			entry_p = AllocateMartiEntry (id_p, user_p, permissions_group_p, owns_user_flag,
+																																		name_s, marti_id_s, site_name_s, description_s, *latitude_p, *longitude_p,
+																																		start_p, taxa_p, num_taxon_ids);
 
-																			FreeMartiEntry (entry_p);
+																			if (entry_p)
+																				{
+																					const bool *upsert_p = NULL;
+
+																					/*
+																					 * Unless an existing sample has been loaded, replace
+																					 * any sample with the same MARTi id rather than
+																					 * adding another one.
+																					 */
+																					if ((!id_p) && GetCurrentBooleanParameterValueFromParameterSet (param_set_p, S_UPSERT.npt_name_s, &upsert_p) && upsert_p && (*upsert_p))
+																						{
+																							status = UpsertMartiEntryByMartiId (entry_p, job_p, data_p);
+																						}
+																					else
+																						{
+																							status = SaveMartiEntry (entry_p, job_p, data_p);
+																						}
+
+																					FreeMartiEntry (entry_p);
+																				}
+																			else
+																				{
+																					success_flag = false;
+																				}
 																		}
-																	else
+
+																	if (taxa_p)
 																		{
-																			success_flag = false;
+																			FreeMemory (taxa_p);
 																		}
 
 																}
@@ -461,6 +572,11 @@ static ServiceJobSet *RunMartiSubmissionService (Service *service_p, ParameterSe
 
 				}		/* if (param_set_p) */
 
+			if (IsMartiEntryCacheEnabled ())
+				{
+					AddMartiJobMetadata (job_p, S_ENTRY_CACHE_STATISTICS_S, GetMartiEntryCacheStatisticsAsJSON ());
+				}
+
 			SetServiceJobStatus (job_p, status);
 			LogServiceJob (job_p);
 		}		/* if (service_p -> se_jobs_p) */
@@ -469,6 +585,96 @@ static ServiceJobSet *RunMartiSubmissionService (Service *service_p, ParameterSe
 }
 
 
+static bool AddBulkUploadParameter (ParameterSet *param_set_p, ServiceData *data_p)
+{
+	ParameterGroup *group_p = CreateAndAddParameterGroupToParameterSet ("Bulk Import", false, data_p, param_set_p);
+	Parameter *param_p = EasyCreateAndAddStringParameterToParameterSet (data_p, param_set_p, group_p, S_BULK_UPLOAD.npt_type, S_BULK_UPLOAD.npt_name_s, "Bulk Upload",
+																																			"Import many samples at once, either as JSON lines with an object for each sample or as CSV with a header row. "
+																																			"The columns are name, marti_id, site_name, description, latitude, longitude, date and taxa. "
+																																			"If this is set, the single sample above is ignored.", NULL, PL_ADVANCED);
+
+	if (param_p)
+		{
+			return true;
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add %s parameter", S_BULK_UPLOAD.npt_name_s);
+		}
+
+	return false;
+}
+
+
+/*
+ * The lookup is optional so if it can't be added, the rest of the form can still be used.
+ */
+static void AddSampleLookupParameter (ParameterSet *param_set_p, ParameterGroup *group_p, ServiceData *data_p)
+{
+	Parameter *param_p = EasyCreateAndAddStringParameterToParameterSet (data_p, param_set_p, group_p, S_SAMPLE_LOOKUP.npt_type, S_SAMPLE_LOOKUP.npt_name_s, "Find Sample",
+																																			"Find the samples whose names or MARTi IDs start with this, to choose one to edit", NULL, PL_ALL);
+
+	if (!param_p)
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to add %s parameter", S_SAMPLE_LOOKUP.npt_name_s);
+		}
+}
+
+
+/*
+ * This is optional too, without it every submission is saved as a new sample.
+ */
+static void AddUpsertParameter (ParameterSet *param_set_p, ParameterGroup *group_p, ServiceData *data_p)
+{
+	const bool upsert_flag = false;
+	Parameter *param_p = EasyCreateAndAddBooleanParameterToParameterSet (data_p, param_set_p, group_p, S_UPSERT.npt_name_s, "Update by MARTi ID",
+																																			 "If there is already a sample with this MARTi ID, update it rather than adding a new sample. "
+																																			 "This is ignored if an existing sample has been loaded.", &upsert_flag, PL_ADVANCED);
+
+	if (!param_p)
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to add %s parameter", S_UPSERT.npt_name_s);
+		}
+}
+
+
+static OperationStatus RunSampleLookup (const char *prefix_s, ServiceJob *job_p, const MartiServiceData *data_p)
+{
+	OperationStatus status = OS_FAILED;
+	json_t *matches_p = FindMartiSamplesByPrefix (prefix_s, data_p -> msd_max_lookup_matches, data_p);
+
+	if (matches_p)
+		{
+			json_t *resource_p = GetDataResourceAsJSONByParts (PROTOCOL_INLINE_S, NULL, "samples", matches_p);
+
+			if (resource_p)
+				{
+					if (AddResultToServiceJob (job_p, resource_p))
+						{
+							status = OS_SUCCEEDED;
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add lookup results for \"%s\"", prefix_s);
+							json_decref (resource_p);
+						}
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create resource for lookup results for \"%s\"", prefix_s);
+				}
+
+			json_decref (matches_p);
+		}
+	else
+		{
+			AddGeneralErrorMessageToServiceJob (job_p, "Failed to look up samples");
+		}
+
+	return status;
+}
+
+
 static ServiceMetadata *GetMartiSubmissionServiceMetadata (Service *service_p)
 {
 	const char *term_url_s = CONTEXT_PREFIX_EDAM_ONTOLOGY_S "topic_0625";
@@ -566,141 +772,72 @@ static ParameterSet *IsResourceForMartiSubmissionService (Service * UNUSED_PARAM
 
 
 
-static json_t *GetAllEntriesAsJSON (const MartiServiceData *data_p)
-{
-	json_t *results_p = NULL;
-
-	if (SetMongoToolDatabaseAndCollection (data_p -> msd_mongo_p, data_p -> msd_database_s, data_p -> msd_collection_s))
-		{
-			bson_t *query_p = NULL;
-			bson_t *opts_p =  BCON_NEW ( "sort", "{", ME_NAME_S, BCON_INT32 (1), "}");
-
-			results_p = GetAllMongoResultsAsJSON (data_p -> msd_mongo_p, query_p, opts_p);
-
-			if (opts_p)
-				{
-					bson_destroy (opts_p);
-				}
-
-		}		/* if (SetMongoToolCollection (data_p -> dftsd_mongo_p, data_p -> dftsd_collection_ss [DFTD_PROGRAMME])) */
-
-	return results_p;
-}
-
-
-
 static bool SetUpEntriesListParameter (const MartiServiceData *data_p, StringParameter *param_p, const MartiEntry *active_entry_p, const bool empty_option_flag)
 {
 	bool success_flag = false;
-	json_t *results_p = GetAllEntriesAsJSON (data_p);
 	bool value_set_flag = false;
 
-	if (results_p)
+	/*
+	 * If there's an empty option, add it
+	 */
+	if (empty_option_flag)
 		{
-			if (json_is_array (results_p))
-				{
-					const size_t num_results = json_array_size (results_p);
+			success_flag = CreateAndAddStringParameterOption (& (param_p -> sp_base_param), S_EMPTY_LIST_OPTION_S, S_EMPTY_LIST_OPTION_S);
+		}
+	else
+		{
+			success_flag = true;
+		}
 
-					success_flag = true;
+	if (success_flag)
+		{
+			const char *param_value_s = GetStringParameterCurrentValue (param_p);
 
+			if (data_p -> msd_sample_lookup_flag)
+				{
 					/*
-					 * If there's an empty option, add it
+					 * Only the current sample goes on the list, any others
+					 * are found with a sample lookup.
 					 */
-					if (empty_option_flag)
+					if (active_entry_p)
 						{
-							success_flag = CreateAndAddStringParameterOption (& (param_p -> sp_base_param), S_EMPTY_LIST_OPTION_S, S_EMPTY_LIST_OPTION_S);
-						}
-
-					if (success_flag)
-						{
-							if (num_results > 0)
-								{
-									size_t i = 0;
-									const char *param_value_s = GetStringParameterCurrentValue (param_p);
+							char *id_s = GetBSONOidAsString (active_entry_p -> me_id_p);
 
-									bson_oid_t *id_p = GetNewUnitialisedBSONOid ();
+							success_flag = false;
 
-									if (id_p)
+							if (id_s)
+								{
+									if (CreateAndAddStringParameterOption (& (param_p -> sp_base_param), id_s, active_entry_p -> me_sample_name_s))
 										{
-											while ((i < num_results) && success_flag)
+											if (param_value_s && (strcmp (param_value_s, id_s) == 0))
 												{
-													json_t *entry_p = json_array_get (results_p, i);
-
-													if (GetMongoIdFromJSON (entry_p, id_p))
-														{
-															char *id_s = GetBSONOidAsString (id_p);
-
-															if (id_s)
-																{
-																	const char *name_s = GetJSONString (entry_p, ME_NAME_S);
-
-																	if (name_s)
-																		{
-																			if (param_value_s && (strcmp (param_value_s, id_s) == 0))
-																				{
-																					value_set_flag = true;
-																				}
-
-																			if (!CreateAndAddStringParameterOption (& (param_p -> sp_base_param), id_s, name_s))
-																				{
-																					success_flag = false;
-																					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add param option \"%s\": \"%s\"", id_s, name_s);
-																				}
-
-																		}		/* if (name_s) */
-																	else
-																		{
-																			success_flag = false;
-																			PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, entry_p, "Failed to get \"%s\"", ME_NAME_S);
-																		}
-
-																	FreeBSONOidString (id_s);
-																}
-															else
-																{
-																	success_flag = false;
-																	PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, entry_p, "Failed to get Programme BSON oid");
-																}
-
-														}		/* if (GetMongoIdFromJSON (entry_p, id_p)) */
-													else
-														{
-															success_flag = false;
-															PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, entry_p, "GetMongoIdFromJSON () failed");
-														}
-
-													if (success_flag)
-														{
-															++ i;
-														}
-
-												}		/* while ((i < num_results) && success_flag) */
-
-											FreeBSONOid (id_p);
-										}		/* if (id_p) */
+													value_set_flag = true;
+												}
 
-									/*
-									 * If the parameter's value isn't on the list, reset it
-									 */
-									if ((param_value_s != NULL) && (strcmp (param_value_s, S_EMPTY_LIST_OPTION_S) != 0) && (value_set_flag == false))
+											success_flag = true;
+										}
+									else
 										{
-											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "param value \"%s\" not on list of existing programmes", param_value_s);
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add param option \"%s\": \"%s\"", id_s, active_entry_p -> me_sample_name_s);
 										}
 
-								}		/* if (num_results > 0) */
-							else
-								{
-									/* nothing to add */
-									success_flag = true;
+									FreeBSONOidString (id_s);
 								}
+						}
+				}
+			else
+				{
+					success_flag = AddMartiSampleListOptions (data_p, param_p, param_value_s, &value_set_flag);
+				}
 
-						}		/* if (success_flag) */
-
-
-				}		/* if (json_is_array (results_p)) */
-
-			json_decref (results_p);
-		}		/* if (results_p) */
+			/*
+			 * If the parameter's value isn't on the list, reset it
+			 */
+			if (success_flag && (param_value_s != NULL) && (strcmp (param_value_s, S_EMPTY_LIST_OPTION_S) != 0) && (value_set_flag == false))
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "param value \"%s\" not on list of existing programmes", param_value_s);
+				}
+		}
 
 	if (success_flag)
 		{
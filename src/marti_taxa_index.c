@@ -0,0 +1,773 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * marti_taxa_index.c
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "marti_taxa_index.h"
+#include "marti_bitmap.h"
+#include "marti_entry.h"
+#include "marti_oid_table.h"
+
+#include "memory_allocations.h"
+#include "streams.h"
+
+
+/*
+ * The samples that have a given taxon
+ */
+typedef struct TaxonSamples
+{
+	uint32 ts_taxon;
+
+	MartiBitmap *ts_samples_p;
+} TaxonSamples;
+
+
+/*
+ * The taxa of a sample, so that they can be removed
+ * from their bitmaps when the sample is updated.
+ */
+typedef struct SampleTaxa
+{
+	uint32 *st_taxa_p;
+
+	size_t st_num_taxa;
+} SampleTaxa;
+
+
+typedef struct MartiTaxaIndex
+{
+	/* The taxa sorted by id */
+	TaxonSamples *mti_taxa_p;
+
+	size_t mti_num_taxa;
+
+	size_t mti_capacity;
+
+	/* The number given to each sample */
+	MartiOidTable *mti_ids_p;
+
+	/* The taxa of each sample, by its number */
+	SampleTaxa *mti_samples_p;
+
+	uint32 mti_num_samples;
+
+	uint32 mti_samples_capacity;
+
+	/*
+	 * When the last load of the samples began, so that the next
+	 * refresh only needs the ones that have been saved since then.
+	 */
+	time_t mti_load_time;
+
+	pthread_rwlock_t mti_lock;
+} MartiTaxaIndex;
+
+
+/*
+ * How long, in seconds, before the index is refreshed so that
+ * any samples saved by other processes are picked up.
+ */
+static const time_t S_REFRESH_INTERVAL = 300;
+
+/*
+ * Each refresh goes back this many seconds before the previous load began,
+ * to allow for the clocks of the processes that save the samples being
+ * slightly out from ours.
+ */
+static const time_t S_REFRESH_OVERLAP = 60;
+
+
+static MartiTaxaIndex *s_index_p = NULL;
+
+/* This is held whilst the index is being loaded or refreshed */
+static pthread_mutex_t s_init_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static MartiTaxaIndex *AllocateTaxaIndex (void);
+
+static void FreeTaxaIndex (MartiTaxaIndex *index_p);
+
+static bool LoadTaxaIndex (MartiTaxaIndex *index_p, MartiServiceData *data_p, const time_t since);
+
+static bool RefreshTaxaIndex (MartiTaxaIndex *index_p, MartiServiceData *data_p);
+
+static bool AddTaxaIndexEntryFromBSON (const bson_t *document_p, void *data_p);
+
+static bool SetTaxaIndexEntry (MartiTaxaIndex *index_p, const bson_oid_t *id_p, const uint32 *taxa_p, const size_t num_taxa);
+
+static bool FindTaxon (const MartiTaxaIndex *index_p, const uint32 taxon, size_t *position_p);
+
+static MartiBitmap *GetTaxonSamples (MartiTaxaIndex *index_p, const uint32 taxon);
+
+static MartiBitmap *GetTaxaUnion (const MartiTaxaIndex *index_p, const uint32 *taxa_p, const size_t num_taxa);
+
+static MartiBitmap *GetTaxaIntersection (const MartiTaxaIndex *index_p, const uint32 *taxa_p, const size_t num_taxa);
+
+
+
+bool InitMartiTaxaIndex (MartiServiceData *data_p)
+{
+	pthread_mutex_lock (&s_init_mutex);
+
+	if (!s_index_p)
+		{
+			if (json_object_get (data_p -> msd_base_data.sd_config_p, "taxa_index"))
+				{
+					MartiTaxaIndex *index_p = AllocateTaxaIndex ();
+
+					if (index_p)
+						{
+							const time_t load_time = time (NULL);
+
+							if (LoadTaxaIndex (index_p, data_p, 0))
+								{
+									PrintLog (STM_LEVEL_INFO, __FILE__, __LINE__, "Loaded " SIZET_FMT " taxa for " UINT32_FMT " MARTi samples into the taxa index", index_p -> mti_num_taxa, index_p -> mti_num_samples);
+									index_p -> mti_load_time = load_time;
+									s_index_p = index_p;
+
+									/*
+									 * Any samples that were saved whilst we were loading could
+									 * have been read before they were updated, so now that saves
+									 * go straight into the index, read them again.
+									 */
+									RefreshTaxaIndex (index_p, data_p);
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to load taxa index for db \"%s\" collection \"%s\"", data_p -> msd_database_s, data_p -> msd_collection_s);
+									FreeTaxaIndex (index_p);
+								}
+						}
+				}
+		}
+
+	pthread_mutex_unlock (&s_init_mutex);
+
+	return (s_index_p != NULL);
+}
+
+
+bool IsMartiTaxaIndexEnabled (void)
+{
+	return (s_index_p != NULL);
+}
+
+
+void RefreshMartiTaxaIndex (MartiServiceData *data_p)
+{
+	MartiTaxaIndex *index_p = s_index_p;
+
+	/* If another thread is already refreshing the index, just use it as it is */
+	if (index_p && (pthread_mutex_trylock (&s_init_mutex) == 0))
+		{
+			if (time (NULL) - (index_p -> mti_load_time) >= S_REFRESH_INTERVAL)
+				{
+					RefreshTaxaIndex (index_p, data_p);
+				}
+
+			pthread_mutex_unlock (&s_init_mutex);
+		}
+}
+
+
+bool UpdateMartiTaxaIndex (const bson_oid_t *id_p, const uint32 *taxa_p, const size_t num_taxa)
+{
+	bool success_flag = true;
+	MartiTaxaIndex *index_p = s_index_p;
+
+	if (index_p)
+		{
+			pthread_rwlock_wrlock (& (index_p -> mti_lock));
+			success_flag = SetTaxaIndexEntry (index_p, id_p, taxa_p, num_taxa);
+			pthread_rwlock_unlock (& (index_p -> mti_lock));
+
+			if (!success_flag)
+				{
+					char id_s [25];
+
+					bson_oid_to_string (id_p, id_s);
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to update taxa index for \"%s\"", id_s);
+				}
+		}
+
+	return success_flag;
+}
+
+
+bool FilterMartiSpatialMatchesByTaxa (MartiSpatialMatch *matches_p, size_t *num_matches_p, const uint32 *taxa_p, const size_t num_taxa, const bool all_flag,
+																		 const uint32 *excluded_p, const size_t num_excluded)
+{
+	bool success_flag = false;
+	MartiTaxaIndex *index_p = s_index_p;
+
+	if (index_p)
+		{
+			MartiBitmap *included_p = NULL;
+			MartiBitmap *excluded_samples_p = NULL;
+
+			pthread_rwlock_rdlock (& (index_p -> mti_lock));
+
+			/*
+			 * Work out the matching samples with bitmap operations
+			 * before looking at any of the spatial matches.
+			 */
+			if (num_taxa > 0)
+				{
+					included_p = all_flag ? GetTaxaIntersection (index_p, taxa_p, num_taxa) : GetTaxaUnion (index_p, taxa_p, num_taxa);
+				}
+
+			if ((num_taxa == 0) || included_p)
+				{
+					if (num_excluded > 0)
+						{
+							excluded_samples_p = GetTaxaUnion (index_p, excluded_p, num_excluded);
+
+							if (excluded_samples_p && included_p)
+								{
+									MartiBitmap *difference_p = GetMartiBitmapDifference (included_p, excluded_samples_p);
+
+									FreeMartiBitmap (included_p);
+									included_p = difference_p;
+
+									FreeMartiBitmap (excluded_samples_p);
+									excluded_samples_p = NULL;
+
+									success_flag = (included_p != NULL);
+								}
+							else
+								{
+									success_flag = (excluded_samples_p != NULL);
+								}
+						}
+					else
+						{
+							success_flag = true;
+						}
+				}
+
+			if (success_flag)
+				{
+					const size_t num_matches = *num_matches_p;
+					size_t i;
+					size_t j = 0;
+
+					for (i = 0; i < num_matches; ++ i)
+						{
+							const MartiSpatialMatch *match_p = matches_p + i;
+							uint32 sample;
+							bool match_flag;
+
+							/* Samples without any taxa aren't in the index */
+							if (GetMartiOidTableValue (index_p -> mti_ids_p, & (match_p -> msm_id), &sample))
+								{
+									if (included_p)
+										{
+											match_flag = IsInMartiBitmap (included_p, sample);
+										}
+									else if (excluded_samples_p)
+										{
+											match_flag = !IsInMartiBitmap (excluded_samples_p, sample);
+										}
+									else
+										{
+											match_flag = true;
+										}
+								}
+							else
+								{
+									match_flag = (num_taxa == 0);
+								}
+
+							if (match_flag)
+								{
+									if (j != i)
+										{
+											* (matches_p + j) = *match_p;
+										}
+
+									++ j;
+								}
+						}
+
+					*num_matches_p = j;
+				}
+
+			pthread_rwlock_unlock (& (index_p -> mti_lock));
+
+			if (included_p)
+				{
+					FreeMartiBitmap (included_p);
+				}
+
+			if (excluded_samples_p)
+				{
+					FreeMartiBitmap (excluded_samples_p);
+				}
+
+			if (!success_flag)
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to filter " SIZET_FMT " matches by " SIZET_FMT " taxa and " SIZET_FMT " excluded taxa", *num_matches_p, num_taxa, num_excluded);
+				}
+		}
+
+	return success_flag;
+}
+
+
+static MartiTaxaIndex *AllocateTaxaIndex (void)
+{
+	MartiTaxaIndex *index_p = (MartiTaxaIndex *) AllocMemory (sizeof (MartiTaxaIndex));
+
+	if (index_p)
+		{
+			MartiOidTable *ids_p = AllocateMartiOidTable (0);
+
+			if (ids_p)
+				{
+					if (pthread_rwlock_init (& (index_p -> mti_lock), NULL) == 0)
+						{
+							index_p -> mti_taxa_p = NULL;
+							index_p -> mti_num_taxa = 0;
+							index_p -> mti_capacity = 0;
+							index_p -> mti_ids_p = ids_p;
+							index_p -> mti_samples_p = NULL;
+							index_p -> mti_num_samples = 0;
+							index_p -> mti_samples_capacity = 0;
+							index_p -> mti_load_time = 0;
+
+							return index_p;
+						}
+
+					FreeMartiOidTable (ids_p);
+				}
+
+			FreeMemory (index_p);
+		}
+
+	PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate taxa index");
+
+	return NULL;
+}
+
+
+static void FreeTaxaIndex (MartiTaxaIndex *index_p)
+{
+	size_t i;
+
+	for (i = 0; i < index_p -> mti_num_taxa; ++ i)
+		{
+			FreeMartiBitmap (((index_p -> mti_taxa_p) + i) -> ts_samples_p);
+		}
+
+	if (index_p -> mti_taxa_p)
+		{
+			FreeMemory (index_p -> mti_taxa_p);
+		}
+
+	for (i = 0; i < index_p -> mti_num_samples; ++ i)
+		{
+			SampleTaxa *sample_taxa_p = (index_p -> mti_samples_p) + i;
+
+			if (sample_taxa_p -> st_taxa_p)
+				{
+					FreeMemory (sample_taxa_p -> st_taxa_p);
+				}
+		}
+
+	if (index_p -> mti_samples_p)
+		{
+			FreeMemory (index_p -> mti_samples_p);
+		}
+
+	FreeMartiOidTable (index_p -> mti_ids_p);
+	pthread_rwlock_destroy (& (index_p -> mti_lock));
+
+	FreeMemory (index_p);
+}
+
+
+/*
+ * Add the samples that have been saved since the given time, or all of
+ * them if it is 0, to the index.
+ */
+static bool LoadTaxaIndex (MartiTaxaIndex *index_p, MartiServiceData *data_p, const time_t since)
+{
+	bool success_flag = false;
+	bson_t *query_p = NULL;
+
+	if (since > 0)
+		{
+			query_p = BCON_NEW (MONGO_TIMESTAMP_S, "{", "$gte", BCON_DATE_TIME (((int64) since) * 1000), "}");
+		}
+	else
+		{
+			query_p = bson_new ();
+		}
+
+	if (query_p)
+		{
+			bson_t *opts_p = BCON_NEW ("projection", "{", ME_TAXA_S, BCON_INT32 (1), "}");
+
+			if (opts_p)
+				{
+					if (FindMatchingMongoDocumentsByBSON (data_p -> msd_mongo_p, query_p, NULL, opts_p))
+						{
+							success_flag = (IterateOverMongoResults (data_p -> msd_mongo_p, AddTaxaIndexEntryFromBSON, index_p) >= 0);
+						}
+
+					bson_destroy (opts_p);
+				}
+
+			bson_destroy (query_p);
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * Add the samples that have been saved since the previous load began.
+ * This must be called with s_init_mutex held.
+ */
+static bool RefreshTaxaIndex (MartiTaxaIndex *index_p, MartiServiceData *data_p)
+{
+	const time_t load_time = time (NULL);
+	const uint32 num_samples = index_p -> mti_num_samples;
+	bool success_flag = LoadTaxaIndex (index_p, data_p, (index_p -> mti_load_time) - S_REFRESH_OVERLAP);
+
+	if (success_flag)
+		{
+			PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, "Refreshed the taxa index, it now has " UINT32_FMT " MARTi samples, " UINT32_FMT " of which are new", index_p -> mti_num_samples, (index_p -> mti_num_samples) - num_samples);
+			index_p -> mti_load_time = load_time;
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to refresh the taxa index, using the previous one");
+		}
+
+	return success_flag;
+}
+
+
+static bool AddTaxaIndexEntryFromBSON (const bson_t *document_p, void *data_p)
+{
+	MartiTaxaIndex *index_p = (MartiTaxaIndex *) data_p;
+	bson_iter_t iter;
+
+	if (bson_iter_init_find (&iter, document_p, MONGO_ID_S) && BSON_ITER_HOLDS_OID (&iter))
+		{
+			const bson_oid_t *id_p = bson_iter_oid (&iter);
+			size_t num_taxa = 0;
+			uint32 *taxa_p = GetMartiEntryTaxaFromBSON (document_p, &num_taxa);
+
+			/*
+			 * A refreshed sample with no taxa might have had some before
+			 * so it still needs setting to clear them.
+			 */
+			if (taxa_p || (num_taxa == 0))
+				{
+					bool success_flag;
+
+					/* Searches can be using the index whilst it is being refreshed */
+					pthread_rwlock_wrlock (& (index_p -> mti_lock));
+					success_flag = SetTaxaIndexEntry (index_p, id_p, taxa_p, num_taxa);
+					pthread_rwlock_unlock (& (index_p -> mti_lock));
+
+					if (taxa_p)
+						{
+							FreeMemory (taxa_p);
+						}
+
+					if (!success_flag)
+						{
+							PrintBSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, document_p, "Failed to add sample to taxa index");
+							return false;
+						}
+				}
+		}
+
+	return true;
+}
+
+
+/*
+ * Samples keep the same number for as long as the index exists. When
+ * a sample is updated, it is removed from the bitmaps of the taxa that
+ * it had before being added to those of its new taxa.
+ */
+static bool SetTaxaIndexEntry (MartiTaxaIndex *index_p, const bson_oid_t *id_p, const uint32 *taxa_p, const size_t num_taxa)
+{
+	bool success_flag = true;
+	uint32 *copied_taxa_p = NULL;
+	SampleTaxa *sample_taxa_p = NULL;
+	uint32 sample;
+
+	/* Copy the taxa first so that the index is left as it was if this fails */
+	if (num_taxa > 0)
+		{
+			copied_taxa_p = (uint32 *) AllocMemoryArray (num_taxa, sizeof (uint32));
+
+			if (copied_taxa_p)
+				{
+					memcpy (copied_taxa_p, taxa_p, num_taxa * sizeof (uint32));
+				}
+			else
+				{
+					return false;
+				}
+		}
+
+	if (GetMartiOidTableValue (index_p -> mti_ids_p, id_p, &sample))
+		{
+			const uint32 *old_taxa_p;
+			size_t i;
+
+			sample_taxa_p = (index_p -> mti_samples_p) + sample;
+			old_taxa_p = sample_taxa_p -> st_taxa_p;
+
+			for (i = sample_taxa_p -> st_num_taxa; i > 0; -- i, ++ old_taxa_p)
+				{
+					size_t position;
+
+					if (FindTaxon (index_p, *old_taxa_p, &position))
+						{
+							RemoveFromMartiBitmap (((index_p -> mti_taxa_p) + position) -> ts_samples_p, sample);
+						}
+				}
+
+			if (sample_taxa_p -> st_taxa_p)
+				{
+					FreeMemory (sample_taxa_p -> st_taxa_p);
+				}
+
+			sample_taxa_p -> st_taxa_p = NULL;
+			sample_taxa_p -> st_num_taxa = 0;
+		}
+	else if (num_taxa > 0)
+		{
+			if (index_p -> mti_num_samples == index_p -> mti_samples_capacity)
+				{
+					const uint32 new_capacity = (index_p -> mti_samples_capacity) ? ((index_p -> mti_samples_capacity) << 1) : 1024;
+					SampleTaxa *samples_p = (SampleTaxa *) ReallocMemory (index_p -> mti_samples_p, new_capacity * sizeof (SampleTaxa), (index_p -> mti_samples_capacity) * sizeof (SampleTaxa));
+
+					if (samples_p)
+						{
+							index_p -> mti_samples_p = samples_p;
+							index_p -> mti_samples_capacity = new_capacity;
+						}
+					else
+						{
+							success_flag = false;
+						}
+				}
+
+			if (success_flag)
+				{
+					sample = index_p -> mti_num_samples;
+
+					if (SetMartiOidTableValue (index_p -> mti_ids_p, id_p, sample))
+						{
+							sample_taxa_p = (index_p -> mti_samples_p) + sample;
+							sample_taxa_p -> st_taxa_p = NULL;
+							sample_taxa_p -> st_num_taxa = 0;
+
+							++ (index_p -> mti_num_samples);
+						}
+					else
+						{
+							success_flag = false;
+						}
+				}
+		}
+
+	if (success_flag && sample_taxa_p)
+		{
+			size_t i;
+
+			sample_taxa_p -> st_taxa_p = copied_taxa_p;
+			sample_taxa_p -> st_num_taxa = num_taxa;
+			copied_taxa_p = NULL;
+
+			for (i = 0; (i < num_taxa) && success_flag; ++ i, ++ taxa_p)
+				{
+					MartiBitmap *samples_p = GetTaxonSamples (index_p, *taxa_p);
+
+					success_flag = (samples_p != NULL) && AddToMartiBitmap (samples_p, sample);
+				}
+		}
+
+	if (copied_taxa_p)
+		{
+			FreeMemory (copied_taxa_p);
+		}
+
+	return success_flag;
+}
+
+
+static bool FindTaxon (const MartiTaxaIndex *index_p, const uint32 taxon, size_t *position_p)
+{
+	size_t low = 0;
+	size_t high = index_p -> mti_num_taxa;
+
+	while (low < high)
+		{
+			const size_t mid = (low + high) >> 1;
+			const uint32 mid_taxon = ((index_p -> mti_taxa_p) + mid) -> ts_taxon;
+
+			if (mid_taxon < taxon)
+				{
+					low = mid + 1;
+				}
+			else if (mid_taxon > taxon)
+				{
+					high = mid;
+				}
+			else
+				{
+					*position_p = mid;
+					return true;
+				}
+		}
+
+	*position_p = low;
+
+	return false;
+}
+
+
+/*
+ * Get the bitmap of samples for a taxon, adding it if it isn't there.
+ */
+static MartiBitmap *GetTaxonSamples (MartiTaxaIndex *index_p, const uint32 taxon)
+{
+	size_t position;
+	TaxonSamples *entry_p = NULL;
+	MartiBitmap *samples_p = NULL;
+
+	if (FindTaxon (index_p, taxon, &position))
+		{
+			return ((index_p -> mti_taxa_p) + position) -> ts_samples_p;
+		}
+
+	if (index_p -> mti_num_taxa == index_p -> mti_capacity)
+		{
+			const size_t new_capacity = (index_p -> mti_capacity) ? ((index_p -> mti_capacity) << 1) : 1024;
+			TaxonSamples *taxa_p = (TaxonSamples *) ReallocMemory (index_p -> mti_taxa_p, new_capacity * sizeof (TaxonSamples), (index_p -> mti_capacity) * sizeof (TaxonSamples));
+
+			if (!taxa_p)
+				{
+					return NULL;
+				}
+
+			index_p -> mti_taxa_p = taxa_p;
+			index_p -> mti_capacity = new_capacity;
+		}
+
+	samples_p = AllocateMartiBitmap ();
+
+	if (samples_p)
+		{
+			entry_p = (index_p -> mti_taxa_p) + position;
+
+			memmove (entry_p + 1, entry_p, ((index_p -> mti_num_taxa) - position) * sizeof (TaxonSamples));
+			entry_p -> ts_taxon = taxon;
+			entry_p -> ts_samples_p = samples_p;
+			++ (index_p -> mti_num_taxa);
+		}
+
+	return samples_p;
+}
+
+
+static MartiBitmap *GetTaxaUnion (const MartiTaxaIndex *index_p, const uint32 *taxa_p, const size_t num_taxa)
+{
+	MartiBitmap *result_p = AllocateMartiBitmap ();
+	size_t i;
+
+	for (i = 0; (i < num_taxa) && result_p; ++ i, ++ taxa_p)
+		{
+			size_t position;
+
+			if (FindTaxon (index_p, *taxa_p, &position))
+				{
+					MartiBitmap *union_p = GetMartiBitmapUnion (result_p, ((index_p -> mti_taxa_p) + position) -> ts_samples_p);
+
+					FreeMartiBitmap (result_p);
+					result_p = union_p;
+				}
+		}
+
+	return result_p;
+}
+
+
+/*
+ * Start from the first taxon and stop as soon as there
+ * are no samples left or a taxon isn't in the index.
+ */
+static MartiBitmap *GetTaxaIntersection (const MartiTaxaIndex *index_p, const uint32 *taxa_p, const size_t num_taxa)
+{
+	MartiBitmap *result_p = NULL;
+	size_t position;
+
+	if (FindTaxon (index_p, *taxa_p, &position))
+		{
+			MartiBitmap *empty_p = AllocateMartiBitmap ();
+
+			if (empty_p)
+				{
+					size_t i;
+
+					/* Copy the first taxon's samples */
+					result_p = GetMartiBitmapUnion (empty_p, ((index_p -> mti_taxa_p) + position) -> ts_samples_p);
+
+					for (i = 1, ++ taxa_p; (i < num_taxa) && result_p && (GetMartiBitmapCardinality (result_p) > 0); ++ i, ++ taxa_p)
+						{
+							MartiBitmap *intersection_p = NULL;
+
+							if (FindTaxon (index_p, *taxa_p, &position))
+								{
+									intersection_p = GetMartiBitmapIntersection (result_p, ((index_p -> mti_taxa_p) + position) -> ts_samples_p);
+								}
+							else
+								{
+									intersection_p = AllocateMartiBitmap ();
+								}
+
+							FreeMartiBitmap (result_p);
+							result_p = intersection_p;
+						}
+
+					FreeMartiBitmap (empty_p);
+				}
+		}
+	else
+		{
+			result_p = AllocateMartiBitmap ();
+		}
+
+	return result_p;
+}
@@ -0,0 +1,571 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * marti_taxonomy.c
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "marti_taxonomy.h"
+
+#include "memory_allocations.h"
+#include "streams.h"
+#include "json_util.h"
+
+
+/*
+ * Both arrays are indexed by taxonomy id. Ids that
+ * aren't in the tree have a first number of 0.
+ */
+typedef struct MartiTaxonomy
+{
+	uint32 *mt_first_p;
+
+	uint32 *mt_last_p;
+
+	uint32 mt_max_taxon;
+
+	uint32 mt_num_taxa;
+
+	/* A hash of the numbers as 16 hex digits */
+	char mt_version_s [17];
+} MartiTaxonomy;
+
+
+/*
+ * The nodes read from nodes.dmp before the tree is built
+ */
+typedef struct TaxonomyNodes
+{
+	uint32 *tn_taxa_p;
+
+	uint32 *tn_parents_p;
+
+	uint32 tn_num_nodes;
+
+	uint32 tn_capacity;
+
+	uint32 tn_max_taxon;
+} TaxonomyNodes;
+
+
+/*
+ * Where we are up to in a node's children during the walk
+ */
+typedef struct WalkEntry
+{
+	uint32 we_taxon;
+
+	uint32 we_next_child;
+} WalkEntry;
+
+
+static const uint32 S_INITIAL_NUM_NODES = 1 << 16;
+
+
+static MartiTaxonomy *s_taxonomy_p = NULL;
+
+static pthread_mutex_t s_init_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static bool ReadTaxonomyNodes (const char *filename_s, TaxonomyNodes *nodes_p);
+
+static bool ParseTaxonomyNode (const char *line_s, uint32 *taxon_p, uint32 *parent_p);
+
+static bool AddTaxonomyNode (TaxonomyNodes *nodes_p, const uint32 taxon, const uint32 parent);
+
+static MartiTaxonomy *BuildTaxonomy (const TaxonomyNodes *nodes_p);
+
+static bool NumberTaxonomy (MartiTaxonomy *taxonomy_p, const TaxonomyNodes *nodes_p, const uint32 *parents_p, const uint32 *child_starts_p, const uint32 *children_p);
+
+static void SetTaxonomyVersion (MartiTaxonomy *taxonomy_p);
+
+static void FreeTaxonomy (MartiTaxonomy *taxonomy_p);
+
+
+
+bool InitMartiTaxonomy (const json_t *service_config_p)
+{
+	pthread_mutex_lock (&s_init_mutex);
+
+	if (!s_taxonomy_p)
+		{
+			const json_t *taxonomy_config_p = json_object_get (service_config_p, "taxonomy");
+
+			if (taxonomy_config_p)
+				{
+					const char *filename_s = GetJSONString (taxonomy_config_p, "nodes_file");
+
+					if (filename_s)
+						{
+							TaxonomyNodes nodes;
+
+							memset (&nodes, 0, sizeof (TaxonomyNodes));
+
+							if (ReadTaxonomyNodes (filename_s, &nodes))
+								{
+									MartiTaxonomy *taxonomy_p = BuildTaxonomy (&nodes);
+
+									if (taxonomy_p)
+										{
+											PrintLog (STM_LEVEL_INFO, __FILE__, __LINE__, "Loaded " UINT32_FMT " taxa from \"%s\" as taxonomy version %s", taxonomy_p -> mt_num_taxa, filename_s, taxonomy_p -> mt_version_s);
+											s_taxonomy_p = taxonomy_p;
+										}
+									else
+										{
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to build taxonomy from \"%s\"", filename_s);
+										}
+								}
+
+							if (nodes.tn_taxa_p)
+								{
+									FreeMemory (nodes.tn_taxa_p);
+								}
+
+							if (nodes.tn_parents_p)
+								{
+									FreeMemory (nodes.tn_parents_p);
+								}
+						}
+					else
+						{
+							PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, taxonomy_config_p, "No nodes_file for the taxonomy");
+						}
+
+				}		/* if (taxonomy_config_p) */
+
+		}		/* if (!s_taxonomy_p) */
+
+	pthread_mutex_unlock (&s_init_mutex);
+
+	return (s_taxonomy_p != NULL);
+}
+
+
+bool IsMartiTaxonomyLoaded (void)
+{
+	return (s_taxonomy_p != NULL);
+}
+
+
+const char *GetMartiTaxonomyVersion (void)
+{
+	const MartiTaxonomy *taxonomy_p = s_taxonomy_p;
+
+	return taxonomy_p ? taxonomy_p -> mt_version_s : NULL;
+}
+
+
+bool GetMartiTaxonInterval (const uint32 taxon, uint32 *first_p, uint32 *last_p)
+{
+	const MartiTaxonomy *taxonomy_p = s_taxonomy_p;
+
+	if (taxonomy_p && (taxon <= taxonomy_p -> mt_max_taxon))
+		{
+			const uint32 first = * ((taxonomy_p -> mt_first_p) + taxon);
+
+			if (first > 0)
+				{
+					*first_p = first;
+					*last_p = * ((taxonomy_p -> mt_last_p) + taxon);
+
+					return true;
+				}
+		}
+
+	return false;
+}
+
+
+/*
+ * Each line of nodes.dmp is
+ *
+ *	<taxon>\t|\t<parent>\t|\t<rank>\t|\t...
+ *
+ * and we only need the first two columns.
+ */
+static bool ReadTaxonomyNodes (const char *filename_s, TaxonomyNodes *nodes_p)
+{
+	bool success_flag = false;
+	FILE *nodes_f = fopen (filename_s, "r");
+
+	if (nodes_f)
+		{
+			char line_s [1024];
+			uint32 line_number = 0;
+
+			success_flag = true;
+
+			while (success_flag && fgets (line_s, sizeof (line_s), nodes_f))
+				{
+					uint32 taxon;
+					uint32 parent;
+
+					++ line_number;
+
+					/* Skip the rest of any overlong line */
+					if (!strchr (line_s, '\n'))
+						{
+							int c;
+
+							while (((c = fgetc (nodes_f)) != EOF) && (c != '\n'))
+								{
+								}
+						}
+
+					if (ParseTaxonomyNode (line_s, &taxon, &parent))
+						{
+							success_flag = AddTaxonomyNode (nodes_p, taxon, parent);
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Skipping invalid line " UINT32_FMT " of \"%s\"", line_number, filename_s);
+						}
+				}
+
+			if (ferror (nodes_f))
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to read \"%s\"", filename_s);
+					success_flag = false;
+				}
+
+			fclose (nodes_f);
+
+			if (success_flag && (nodes_p -> tn_num_nodes == 0))
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "No taxa in \"%s\"", filename_s);
+					success_flag = false;
+				}
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to open \"%s\"", filename_s);
+		}
+
+	return success_flag;
+}
+
+
+static bool ParseTaxonomyNode (const char *line_s, uint32 *taxon_p, uint32 *parent_p)
+{
+	char *end_s = NULL;
+	unsigned long value = strtoul (line_s, &end_s, 10);
+
+	/* The taxa are stored as 32-bit signed integers and 0 isn't a valid id */
+	if ((end_s != line_s) && (value > 0) && (value <= INT32_MAX))
+		{
+			*taxon_p = (uint32) value;
+
+			while ((*end_s == '\t') || (*end_s == ' ') || (*end_s == '|'))
+				{
+					++ end_s;
+				}
+
+			line_s = end_s;
+			value = strtoul (line_s, &end_s, 10);
+
+			if ((end_s != line_s) && (value > 0) && (value <= INT32_MAX))
+				{
+					*parent_p = (uint32) value;
+					return true;
+				}
+		}
+
+	return false;
+}
+
+
+static bool AddTaxonomyNode (TaxonomyNodes *nodes_p, const uint32 taxon, const uint32 parent)
+{
+	if (nodes_p -> tn_num_nodes == nodes_p -> tn_capacity)
+		{
+			const uint32 new_capacity = (nodes_p -> tn_capacity > 0) ? (nodes_p -> tn_capacity) << 1 : S_INITIAL_NUM_NODES;
+			uint32 *taxa_p = (uint32 *) ReallocMemory (nodes_p -> tn_taxa_p, new_capacity * sizeof (uint32), (nodes_p -> tn_capacity) * sizeof (uint32));
+			uint32 *parents_p = NULL;
+
+			if (taxa_p)
+				{
+					nodes_p -> tn_taxa_p = taxa_p;
+					parents_p = (uint32 *) ReallocMemory (nodes_p -> tn_parents_p, new_capacity * sizeof (uint32), (nodes_p -> tn_capacity) * sizeof (uint32));
+				}
+
+			if (!parents_p)
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate space for " UINT32_FMT " taxa", new_capacity);
+					return false;
+				}
+
+			nodes_p -> tn_parents_p = parents_p;
+			nodes_p -> tn_capacity = new_capacity;
+		}
+
+	* ((nodes_p -> tn_taxa_p) + (nodes_p -> tn_num_nodes)) = taxon;
+	* ((nodes_p -> tn_parents_p) + (nodes_p -> tn_num_nodes)) = parent;
+	++ (nodes_p -> tn_num_nodes);
+
+	if (taxon > nodes_p -> tn_max_taxon)
+		{
+			nodes_p -> tn_max_taxon = taxon;
+		}
+
+	return true;
+}
+
+
+/*
+ * Build the children of each taxon as a single array, with each taxon's
+ * children starting at its entry in child_starts_p, and then number them.
+ */
+static MartiTaxonomy *BuildTaxonomy (const TaxonomyNodes *nodes_p)
+{
+	MartiTaxonomy *taxonomy_p = (MartiTaxonomy *) AllocMemory (sizeof (MartiTaxonomy));
+
+	if (taxonomy_p)
+		{
+			const size_t num_slots = ((size_t) (nodes_p -> tn_max_taxon)) + 1;
+
+			taxonomy_p -> mt_max_taxon = nodes_p -> tn_max_taxon;
+			taxonomy_p -> mt_num_taxa = 0;
+			taxonomy_p -> mt_first_p = (uint32 *) AllocMemoryArray (num_slots, sizeof (uint32));
+			taxonomy_p -> mt_last_p = (uint32 *) AllocMemoryArray (num_slots, sizeof (uint32));
+
+			if ((taxonomy_p -> mt_first_p) && (taxonomy_p -> mt_last_p))
+				{
+					uint32 *parents_p = (uint32 *) AllocMemoryArray (num_slots, sizeof (uint32));
+
+					if (parents_p)
+						{
+							uint32 *child_starts_p = (uint32 *) AllocMemoryArray (num_slots + 1, sizeof (uint32));
+
+							if (child_starts_p)
+								{
+									uint32 *children_p = (uint32 *) AllocMemoryArray (nodes_p -> tn_num_nodes, sizeof (uint32));
+
+									if (children_p)
+										{
+											bool success_flag = false;
+											uint32 i;
+
+											memset (parents_p, 0, num_slots * sizeof (uint32));
+											memset (child_starts_p, 0, (num_slots + 1) * sizeof (uint32));
+
+											for (i = 0; i < nodes_p -> tn_num_nodes; ++ i)
+												{
+													* (parents_p + * ((nodes_p -> tn_taxa_p) + i)) = * ((nodes_p -> tn_parents_p) + i);
+												}
+
+											/* Count each taxon's children, the root is its own parent */
+											for (i = 1; i < num_slots; ++ i)
+												{
+													const uint32 parent = * (parents_p + i);
+
+													if ((parent > 0) && (parent != i) && (parent < num_slots) && (* (parents_p + parent) > 0))
+														{
+															++ (* (child_starts_p + parent + 1));
+														}
+												}
+
+											for (i = 1; i <= num_slots; ++ i)
+												{
+													* (child_starts_p + i) += * (child_starts_p + i - 1);
+												}
+
+											/*
+											 * Use the taxonomy's first numbers to track where we are up
+											 * to whilst filling in the children as they aren't set yet.
+											 */
+											memcpy (taxonomy_p -> mt_first_p, child_starts_p, num_slots * sizeof (uint32));
+
+											for (i = 1; i < num_slots; ++ i)
+												{
+													const uint32 parent = * (parents_p + i);
+
+													if ((parent > 0) && (parent != i) && (parent < num_slots) && (* (parents_p + parent) > 0))
+														{
+															uint32 *next_p = (taxonomy_p -> mt_first_p) + parent;
+
+															* (children_p + *next_p) = i;
+															++ (*next_p);
+														}
+												}
+
+											memset (taxonomy_p -> mt_first_p, 0, num_slots * sizeof (uint32));
+											memset (taxonomy_p -> mt_last_p, 0, num_slots * sizeof (uint32));
+
+											success_flag = NumberTaxonomy (taxonomy_p, nodes_p, parents_p, child_starts_p, children_p);
+
+											FreeMemory (children_p);
+
+											if (success_flag)
+												{
+													SetTaxonomyVersion (taxonomy_p);
+
+													FreeMemory (child_starts_p);
+													FreeMemory (parents_p);
+
+													return taxonomy_p;
+												}
+										}
+
+									FreeMemory (child_starts_p);
+								}
+
+							FreeMemory (parents_p);
+						}
+				}
+
+			FreeTaxonomy (taxonomy_p);
+		}
+
+	return NULL;
+}
+
+
+/*
+ * Walk the tree from each root, which is a taxon that is its own parent
+ * or whose parent is missing from the file, numbering the taxa as we
+ * first reach them and setting each one's last number once all of its
+ * children have been walked.
+ */
+static bool NumberTaxonomy (MartiTaxonomy *taxonomy_p, const TaxonomyNodes *nodes_p, const uint32 *parents_p, const uint32 *child_starts_p, const uint32 *children_p)
+{
+	WalkEntry *stack_p = (WalkEntry *) AllocMemoryArray (nodes_p -> tn_num_nodes, sizeof (WalkEntry));
+
+	if (stack_p)
+		{
+			const uint32 max_taxon = taxonomy_p -> mt_max_taxon;
+			uint32 number = 0;
+			uint32 root;
+
+			for (root = 1; root <= max_taxon; ++ root)
+				{
+					const uint32 parent = * (parents_p + root);
+
+					if ((parent > 0) && ((parent == root) || (parent > max_taxon) || (* (parents_p + parent) == 0)))
+						{
+							uint32 depth = 0;
+
+							* ((taxonomy_p -> mt_first_p) + root) = ++ number;
+							stack_p -> we_taxon = root;
+							stack_p -> we_next_child = * (child_starts_p + root);
+							depth = 1;
+
+							while (depth > 0)
+								{
+									WalkEntry *top_p = stack_p + (depth - 1);
+
+									if (top_p -> we_next_child < * (child_starts_p + (top_p -> we_taxon) + 1))
+										{
+											const uint32 child = * (children_p + (top_p -> we_next_child));
+
+											++ (top_p -> we_next_child);
+
+											/* Guard against any cycles in the file */
+											if (* ((taxonomy_p -> mt_first_p) + child) == 0)
+												{
+													WalkEntry *entry_p = stack_p + depth;
+
+													* ((taxonomy_p -> mt_first_p) + child) = ++ number;
+													entry_p -> we_taxon = child;
+													entry_p -> we_next_child = * (child_starts_p + child);
+													++ depth;
+												}
+										}
+									else
+										{
+											* ((taxonomy_p -> mt_last_p) + (top_p -> we_taxon)) = number;
+											-- depth;
+										}
+								}
+						}
+				}
+
+			FreeMemory (stack_p);
+
+			taxonomy_p -> mt_num_taxa = number;
+
+			if (number < nodes_p -> tn_num_nodes)
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, UINT32_FMT " of the " UINT32_FMT " taxa are not connected to a root", nodes_p -> tn_num_nodes - number, nodes_p -> tn_num_nodes);
+				}
+
+			return true;
+		}
+
+	return false;
+}
+
+
+/*
+ * The version is a 64-bit FNV-1a hash of each numbered taxon and its
+ * interval so it only changes if the numbers that are stored with the
+ * samples would be different, not when nodes.dmp is just reordered.
+ */
+static void SetTaxonomyVersion (MartiTaxonomy *taxonomy_p)
+{
+	const uint64_t prime = UINT64_C (1099511628211);
+	uint64_t hash = UINT64_C (14695981039346656037);
+	uint32 taxon;
+
+	for (taxon = 1; taxon <= taxonomy_p -> mt_max_taxon; ++ taxon)
+		{
+			const uint32 first = * ((taxonomy_p -> mt_first_p) + taxon);
+
+			if (first > 0)
+				{
+					const uint32 values [3] = { taxon, first, * ((taxonomy_p -> mt_last_p) + taxon) };
+					size_t i;
+
+					for (i = 0; i < 3; ++ i)
+						{
+							uint32 value = values [i];
+							uint32 j;
+
+							for (j = 0; j < 4; ++ j, value >>= 8)
+								{
+									hash ^= (value & 0xFF);
+									hash *= prime;
+								}
+						}
+				}
+		}
+
+	snprintf (taxonomy_p -> mt_version_s, sizeof (taxonomy_p -> mt_version_s), "%016" PRIx64, hash);
+}
+
+
+static void FreeTaxonomy (MartiTaxonomy *taxonomy_p)
+{
+	if (taxonomy_p -> mt_first_p)
+		{
+			FreeMemory (taxonomy_p -> mt_first_p);
+		}
+
+	if (taxonomy_p -> mt_last_p)
+		{
+			FreeMemory (taxonomy_p -> mt_last_p);
+		}
+
+	FreeMemory (taxonomy_p);
+}
@@ -0,0 +1,54 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * marti_test.h
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#ifndef SERVICES_MARTI_TESTS_MARTI_TEST_H_
+#define SERVICES_MARTI_TESTS_MARTI_TEST_H_
+
+#include <stdio.h>
+
+
+static int s_num_failures = 0;
+
+
+/*
+ * Report the check if it fails and carry on
+ * so that all of the failures are shown.
+ */
+#define MARTI_TEST_CHECK(cond) \
+	do \
+		{ \
+			if (!(cond)) \
+				{ \
+					fprintf (stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+					++ s_num_failures; \
+				} \
+		} \
+	while (0)
+
+
+/*
+ * The exit code for a test program's main ()
+ */
+#define MARTI_TEST_RESULT() ((s_num_failures == 0) ? 0 : 1)
+
+
+#endif /* SERVICES_MARTI_TESTS_MARTI_TEST_H_ */
@@ -0,0 +1,279 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * test_bitmap.c
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#include "marti_bitmap.c"
+
+#include "marti_test.h"
+
+
+/* Values go into four containers */
+#define NUM_VALUES (4 * 65536)
+
+
+typedef enum TestOperation
+{
+	TO_AND,
+
+	TO_OR,
+
+	TO_AND_NOT
+} TestOperation;
+
+
+static bool s_values_0 [NUM_VALUES];
+
+static bool s_values_1 [NUM_VALUES];
+
+
+static uint32 GetRandomValue (uint32 *state_p);
+
+static void FillBitmap (MartiBitmap *bitmap_p, bool *values_p, const uint32 seed, const uint32 num_random, const uint32 first_dense_key, const uint32 dense_step);
+
+static bool IsSameAsValues (const MartiBitmap *bitmap_p, const bool *values_p);
+
+static void TestAddAndRemove (void);
+
+static void TestCombine (const MartiBitmap *bitmap_0_p, const bool *values_0_p, const MartiBitmap *bitmap_1_p, const bool *values_1_p, const TestOperation op);
+
+
+
+int main (int argc, char *argv [])
+{
+	MartiBitmap *bitmap_0_p;
+	MartiBitmap *bitmap_1_p;
+
+	TestAddAndRemove ();
+
+	bitmap_0_p = AllocateMartiBitmap ();
+	bitmap_1_p = AllocateMartiBitmap ();
+
+	MARTI_TEST_CHECK (bitmap_0_p != NULL);
+	MARTI_TEST_CHECK (bitmap_1_p != NULL);
+
+	if (bitmap_0_p && bitmap_1_p)
+		{
+			/*
+			 * Each has two containers with bitmaps rather than arrays
+			 * and they share one of them so that arrays get combined
+			 * with arrays, bitmaps with bitmaps and arrays with bitmaps.
+			 */
+			FillBitmap (bitmap_0_p, s_values_0, 1, 3000, 1, 2);
+			FillBitmap (bitmap_1_p, s_values_1, 2, 3000, 2, 3);
+
+			TestCombine (bitmap_0_p, s_values_0, bitmap_1_p, s_values_1, TO_AND);
+			TestCombine (bitmap_0_p, s_values_0, bitmap_1_p, s_values_1, TO_OR);
+			TestCombine (bitmap_0_p, s_values_0, bitmap_1_p, s_values_1, TO_AND_NOT);
+			TestCombine (bitmap_1_p, s_values_1, bitmap_0_p, s_values_0, TO_AND_NOT);
+		}
+
+	if (bitmap_0_p)
+		{
+			FreeMartiBitmap (bitmap_0_p);
+		}
+
+	if (bitmap_1_p)
+		{
+			FreeMartiBitmap (bitmap_1_p);
+		}
+
+	return MARTI_TEST_RESULT ();
+}
+
+
+static uint32 GetRandomValue (uint32 *state_p)
+{
+	uint32 x = *state_p;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state_p = x;
+
+	return x % NUM_VALUES;
+}
+
+
+/*
+ * Add some random values and, so that their containers have to
+ * be bitmaps, every dense_step'th value for two adjacent keys.
+ */
+static void FillBitmap (MartiBitmap *bitmap_p, bool *values_p, const uint32 seed, const uint32 num_random, const uint32 first_dense_key, const uint32 dense_step)
+{
+	uint32 state = seed;
+	uint32 i;
+
+	memset (values_p, 0, NUM_VALUES * sizeof (bool));
+
+	for (i = 0; i < num_random; ++ i)
+		{
+			const uint32 value = GetRandomValue (&state);
+
+			MARTI_TEST_CHECK (AddToMartiBitmap (bitmap_p, value));
+			* (values_p + value) = true;
+		}
+
+	for (i = first_dense_key << 16; i < ((first_dense_key + 2) << 16); i += dense_step)
+		{
+			MARTI_TEST_CHECK (AddToMartiBitmap (bitmap_p, i));
+			* (values_p + i) = true;
+		}
+}
+
+
+static bool IsSameAsValues (const MartiBitmap *bitmap_p, const bool *values_p)
+{
+	uint64 cardinality = 0;
+	uint32 i;
+
+	for (i = 0; i < NUM_VALUES; ++ i)
+		{
+			if (IsInMartiBitmap (bitmap_p, i) != * (values_p + i))
+				{
+					fprintf (stderr, "value " UINT32_FMT " is wrong\n", i);
+					return false;
+				}
+
+			if (* (values_p + i))
+				{
+					++ cardinality;
+				}
+		}
+
+	return (GetMartiBitmapCardinality (bitmap_p) == cardinality);
+}
+
+
+static void TestAddAndRemove (void)
+{
+	MartiBitmap *bitmap_p = AllocateMartiBitmap ();
+
+	MARTI_TEST_CHECK (bitmap_p != NULL);
+
+	if (bitmap_p)
+		{
+			uint32 index;
+			uint32 i;
+
+			MARTI_TEST_CHECK (GetMartiBitmapCardinality (bitmap_p) == 0);
+			MARTI_TEST_CHECK (!IsInMartiBitmap (bitmap_p, 0));
+
+			/* Adding a value twice only adds it once */
+			MARTI_TEST_CHECK (AddToMartiBitmap (bitmap_p, 70000));
+			MARTI_TEST_CHECK (AddToMartiBitmap (bitmap_p, 70000));
+			MARTI_TEST_CHECK (GetMartiBitmapCardinality (bitmap_p) == 1);
+
+			/* Removing a value that isn't there is fine */
+			MARTI_TEST_CHECK (RemoveFromMartiBitmap (bitmap_p, 5));
+			MARTI_TEST_CHECK (GetMartiBitmapCardinality (bitmap_p) == 1);
+
+			/* The container goes once its last value has gone */
+			MARTI_TEST_CHECK (RemoveFromMartiBitmap (bitmap_p, 70000));
+			MARTI_TEST_CHECK (!IsInMartiBitmap (bitmap_p, 70000));
+			MARTI_TEST_CHECK (bitmap_p -> mb_num_containers == 0);
+
+			/* One more than an array can hold turns the container into a bitmap */
+			for (i = 0; i <= S_MAX_ARRAY_SIZE; ++ i)
+				{
+					MARTI_TEST_CHECK (AddToMartiBitmap (bitmap_p, i * 3));
+				}
+
+			MARTI_TEST_CHECK (FindContainer (bitmap_p, 0, &index));
+			MARTI_TEST_CHECK (((bitmap_p -> mb_containers_p) + index) -> bc_words_p != NULL);
+			MARTI_TEST_CHECK (GetMartiBitmapCardinality (bitmap_p) == S_MAX_ARRAY_SIZE + 1);
+
+			/* and taking one away turns it back into an array */
+			MARTI_TEST_CHECK (RemoveFromMartiBitmap (bitmap_p, 0));
+			MARTI_TEST_CHECK (((bitmap_p -> mb_containers_p) + index) -> bc_words_p == NULL);
+			MARTI_TEST_CHECK (GetMartiBitmapCardinality (bitmap_p) == S_MAX_ARRAY_SIZE);
+
+			for (i = 1; i <= S_MAX_ARRAY_SIZE; ++ i)
+				{
+					MARTI_TEST_CHECK (IsInMartiBitmap (bitmap_p, i * 3));
+					MARTI_TEST_CHECK (!IsInMartiBitmap (bitmap_p, (i * 3) + 1));
+				}
+
+			/* The largest value has its own container */
+			MARTI_TEST_CHECK (AddToMartiBitmap (bitmap_p, UINT32_MAX));
+			MARTI_TEST_CHECK (IsInMartiBitmap (bitmap_p, UINT32_MAX));
+			MARTI_TEST_CHECK (bitmap_p -> mb_num_containers == 2);
+
+			FreeMartiBitmap (bitmap_p);
+		}
+}
+
+
+static void TestCombine (const MartiBitmap *bitmap_0_p, const bool *values_0_p, const MartiBitmap *bitmap_1_p, const bool *values_1_p, const TestOperation op)
+{
+	MartiBitmap *result_p = NULL;
+
+	switch (op)
+		{
+			case TO_AND:
+				result_p = GetMartiBitmapIntersection (bitmap_0_p, bitmap_1_p);
+				break;
+
+			case TO_OR:
+				result_p = GetMartiBitmapUnion (bitmap_0_p, bitmap_1_p);
+				break;
+
+			case TO_AND_NOT:
+				result_p = GetMartiBitmapDifference (bitmap_0_p, bitmap_1_p);
+				break;
+		}
+
+	MARTI_TEST_CHECK (result_p != NULL);
+
+	if (result_p)
+		{
+			static bool expected [NUM_VALUES];
+			uint32 i;
+
+			for (i = 0; i < NUM_VALUES; ++ i)
+				{
+					const bool in_0_flag = * (values_0_p + i);
+					const bool in_1_flag = * (values_1_p + i);
+
+					switch (op)
+						{
+							case TO_AND:
+								expected [i] = in_0_flag && in_1_flag;
+								break;
+
+							case TO_OR:
+								expected [i] = in_0_flag || in_1_flag;
+								break;
+
+							case TO_AND_NOT:
+								expected [i] = in_0_flag && !in_1_flag;
+								break;
+						}
+				}
+
+			MARTI_TEST_CHECK (IsSameAsValues (result_p, expected));
+
+			FreeMartiBitmap (result_p);
+		}
+
+	/* The inputs are left alone */
+	MARTI_TEST_CHECK (IsSameAsValues (bitmap_0_p, values_0_p));
+	MARTI_TEST_CHECK (IsSameAsValues (bitmap_1_p, values_1_p));
+}
@@ -0,0 +1,150 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * test_entry.c
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#include "marti_entry.c"
+
+#include "marti_test.h"
+
+
+/* The code that MongoDB uses for a duplicate key error */
+#define DUPLICATE_KEY_ERROR (11000)
+
+
+/*
+ * How the fake find and modify below behaves
+ */
+static uint32 s_num_calls = 0;
+
+static uint32 s_num_failures_left = 0;
+
+static uint32 s_error_code = 0;
+
+static bson_oid_t s_stored_id;
+
+
+static void SetUpsertFailures (const uint32 num_failures, const uint32 error_code);
+
+static void TestUpsert (const uint32 num_failures, const uint32 error_code, const bool expected_success_flag, const uint32 expected_num_calls);
+
+
+
+int main (int argc, char *argv [])
+{
+	bson_oid_init (&s_stored_id, NULL);
+
+	/* It works straight away */
+	TestUpsert (0, 0, true, 1);
+
+	/* A concurrent insert won so it updates the document that was inserted */
+	TestUpsert (1, DUPLICATE_KEY_ERROR, true, 2);
+
+	/* but it only tries again once */
+	TestUpsert (2, DUPLICATE_KEY_ERROR, false, 2);
+
+	/* Other errors aren't retried */
+	TestUpsert (1, 13, false, 1);
+
+	return MARTI_TEST_RESULT ();
+}
+
+
+/*
+ * Used instead of the MongoDB driver's function. It fails the given number of
+ * times and then returns the stored id as the id of the upserted document.
+ */
+bool mongoc_collection_find_and_modify_with_opts (mongoc_collection_t *collection_p, const bson_t *query_p, const mongoc_find_and_modify_opts_t *opts_p, bson_t *reply_p, bson_error_t *error_p)
+{
+	bool success_flag = false;
+
+	++ s_num_calls;
+	bson_init (reply_p);
+
+	if (s_num_failures_left > 0)
+		{
+			-- s_num_failures_left;
+			bson_set_error (error_p, MONGOC_ERROR_SERVER, s_error_code, "fake error " UINT32_FMT, s_error_code);
+		}
+	else
+		{
+			bson_t value;
+
+			if (BSON_APPEND_DOCUMENT_BEGIN (reply_p, "value", &value))
+				{
+					if (BSON_APPEND_OID (&value, MONGO_ID_S, &s_stored_id))
+						{
+							success_flag = true;
+						}
+
+					bson_append_document_end (reply_p, &value);
+				}
+		}
+
+	return success_flag;
+}
+
+
+static void SetUpsertFailures (const uint32 num_failures, const uint32 error_code)
+{
+	s_num_calls = 0;
+	s_num_failures_left = num_failures;
+	s_error_code = error_code;
+}
+
+
+static void TestUpsert (const uint32 num_failures, const uint32 error_code, const bool expected_success_flag, const uint32 expected_num_calls)
+{
+	bson_t *doc_p = BCON_NEW (ME_MARTI_ID_S, BCON_UTF8 ("test_marti_id"));
+
+	MARTI_TEST_CHECK (doc_p != NULL);
+
+	if (doc_p)
+		{
+			MongoTool tool;
+			MartiServiceData data;
+			MartiEntry entry;
+			bson_oid_t id;
+
+			memset (&tool, 0, sizeof (tool));
+			memset (&data, 0, sizeof (data));
+			memset (&entry, 0, sizeof (entry));
+
+			data.msd_mongo_p = &tool;
+
+			/* The id that would be used if the upsert inserts the document */
+			bson_oid_init (&id, NULL);
+			entry.me_id_p = &id;
+			entry.me_marti_id_s = "test_marti_id";
+
+			SetUpsertFailures (num_failures, error_code);
+
+			MARTI_TEST_CHECK (RunMartiEntryUpsert (&entry, doc_p, &data) == expected_success_flag);
+			MARTI_TEST_CHECK (s_num_calls == expected_num_calls);
+
+			/* The entry gets the id of the document in the database */
+			if (expected_success_flag)
+				{
+					MARTI_TEST_CHECK (bson_oid_equal (&id, &s_stored_id));
+				}
+
+			bson_destroy (doc_p);
+		}
+}
@@ -0,0 +1,259 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * test_entry_cache.c
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#include "marti_entry_cache.c"
+
+#include "marti_test.h"
+
+
+#define NUM_ENTRIES (3)
+
+
+static MartiEntry *AllocateTestEntry (const char *marti_id_s);
+
+static bool IsCachedEntry (const MartiEntry *entry_p);
+
+static void FreeTestCache (void);
+
+static void TestLookups (MartiEntry **entries_pp);
+
+static void TestEviction (MartiEntry **entries_pp);
+
+static void TestGenerations (MartiEntry **entries_pp);
+
+static void TestExpiry (MartiEntry **entries_pp);
+
+
+
+int main (int argc, char *argv [])
+{
+	MartiEntry *entries_p [NUM_ENTRIES];
+	uint32 i;
+
+	for (i = 0; i < NUM_ENTRIES; ++ i)
+		{
+			char marti_id_s [16];
+
+			snprintf (marti_id_s, sizeof (marti_id_s), "marti_" UINT32_FMT, i);
+			entries_p [i] = AllocateTestEntry (marti_id_s);
+			MARTI_TEST_CHECK (entries_p [i] != NULL);
+		}
+
+	/* Without a cache, nothing is stored */
+	MARTI_TEST_CHECK (!IsMartiEntryCacheEnabled ());
+
+	if (entries_p [0])
+		{
+			MARTI_TEST_CHECK (!SetCachedMartiEntry (entries_p [0], GetMartiEntryCacheGeneration ()));
+			MARTI_TEST_CHECK (GetCachedMartiEntryById (entries_p [0] -> me_id_p) == NULL);
+		}
+
+	if (entries_p [0] && entries_p [1] && entries_p [2])
+		{
+			/* The same set up as InitMartiEntryCache () with room for two entries */
+			s_cache_p = AllocateMartiEntryCache (2, 60);
+			MARTI_TEST_CHECK (s_cache_p != NULL);
+
+			if (s_cache_p)
+				{
+					TestLookups (entries_p);
+					TestEviction (entries_p);
+					TestGenerations (entries_p);
+					TestExpiry (entries_p);
+
+					FreeTestCache ();
+				}
+		}
+
+	for (i = 0; i < NUM_ENTRIES; ++ i)
+		{
+			if (entries_p [i])
+				{
+					FreeMartiEntry (entries_p [i]);
+				}
+		}
+
+	return MARTI_TEST_RESULT ();
+}
+
+
+static MartiEntry *AllocateTestEntry (const char *marti_id_s)
+{
+	MartiEntry *entry_p = NULL;
+	bson_oid_t *id_p = GetNewBSONOid ();
+
+	if (id_p)
+		{
+			struct tm sample_time;
+			const uint32 taxa [] = { 9606, 562 };
+
+			memset (&sample_time, 0, sizeof (sample_time));
+			sample_time.tm_year = 124;
+			sample_time.tm_mday = 1;
+
+			entry_p = AllocateMartiEntry (id_p, NULL, NULL, false, "sample", marti_id_s, "site", NULL, 52.6, 1.2, &sample_time, taxa, 2);
+
+			if (!entry_p)
+				{
+					FreeBSONOid (id_p);
+				}
+		}
+
+	return entry_p;
+}
+
+
+/*
+ * Check that an entry is in the cache and that we get our
+ * own copy of it rather than the cached one.
+ */
+static bool IsCachedEntry (const MartiEntry *entry_p)
+{
+	bool match_flag = false;
+	MartiEntry *cached_p = GetCachedMartiEntryById (entry_p -> me_id_p);
+
+	if (cached_p)
+		{
+			match_flag = (cached_p != entry_p) && bson_oid_equal (cached_p -> me_id_p, entry_p -> me_id_p) &&
+				(strcmp (cached_p -> me_marti_id_s, entry_p -> me_marti_id_s) == 0) && (cached_p -> me_num_taxa == entry_p -> me_num_taxa);
+
+			FreeMartiEntry (cached_p);
+		}
+
+	return match_flag;
+}
+
+
+static void FreeTestCache (void)
+{
+	while (s_cache_p -> mec_head_p)
+		{
+			RemoveCacheNode (s_cache_p, s_cache_p -> mec_head_p);
+		}
+
+	pthread_mutex_destroy (& (s_cache_p -> mec_mutex));
+	FreeMartiOidTable (s_cache_p -> mec_table_p);
+	FreeMemory (s_cache_p -> mec_nodes_p);
+	FreeMemory (s_cache_p);
+
+	s_cache_p = NULL;
+}
+
+
+static void TestLookups (MartiEntry **entries_pp)
+{
+	MartiEntry *cached_p;
+	uint64 num_hits;
+	uint64 num_misses;
+
+	MARTI_TEST_CHECK (SetCachedMartiEntry (*entries_pp, GetMartiEntryCacheGeneration ()));
+	MARTI_TEST_CHECK (s_cache_p -> mec_num_entries == 1);
+
+	num_hits = s_cache_p -> mec_num_hits;
+	num_misses = s_cache_p -> mec_num_misses;
+
+	MARTI_TEST_CHECK (IsCachedEntry (*entries_pp));
+
+	cached_p = GetCachedMartiEntryByMartiId ("marti_0");
+	MARTI_TEST_CHECK (cached_p != NULL);
+
+	if (cached_p)
+		{
+			MARTI_TEST_CHECK (bson_oid_equal (cached_p -> me_id_p, (*entries_pp) -> me_id_p));
+			FreeMartiEntry (cached_p);
+		}
+
+	MARTI_TEST_CHECK (GetCachedMartiEntryById (entries_pp [1] -> me_id_p) == NULL);
+	MARTI_TEST_CHECK (GetCachedMartiEntryByMartiId ("marti_1") == NULL);
+
+	MARTI_TEST_CHECK (s_cache_p -> mec_num_hits == num_hits + 2);
+	MARTI_TEST_CHECK (s_cache_p -> mec_num_misses == num_misses + 2);
+
+	/* Storing the same entry again replaces it */
+	MARTI_TEST_CHECK (SetCachedMartiEntry (*entries_pp, GetMartiEntryCacheGeneration ()));
+	MARTI_TEST_CHECK (s_cache_p -> mec_num_entries == 1);
+}
+
+
+/*
+ * When the cache is full, the least recently used entry is replaced
+ */
+static void TestEviction (MartiEntry **entries_pp)
+{
+	MARTI_TEST_CHECK (SetCachedMartiEntry (entries_pp [1], GetMartiEntryCacheGeneration ()));
+	MARTI_TEST_CHECK (s_cache_p -> mec_num_entries == 2);
+
+	/* Using entry 0 makes entry 1 the least recently used one */
+	MARTI_TEST_CHECK (IsCachedEntry (entries_pp [0]));
+
+	MARTI_TEST_CHECK (SetCachedMartiEntry (entries_pp [2], GetMartiEntryCacheGeneration ()));
+	MARTI_TEST_CHECK (s_cache_p -> mec_num_entries == 2);
+
+	MARTI_TEST_CHECK (IsCachedEntry (entries_pp [0]));
+	MARTI_TEST_CHECK (!IsCachedEntry (entries_pp [1]));
+	MARTI_TEST_CHECK (IsCachedEntry (entries_pp [2]));
+}
+
+
+/*
+ * An entry that was loaded before another one was saved isn't stored
+ * as it might have been loaded before its own save.
+ */
+static void TestGenerations (MartiEntry **entries_pp)
+{
+	const uint32 generation = GetMartiEntryCacheGeneration ();
+
+	RemoveCachedMartiEntry (entries_pp [0] -> me_id_p);
+	MARTI_TEST_CHECK (GetMartiEntryCacheGeneration () != generation);
+	MARTI_TEST_CHECK (!IsCachedEntry (entries_pp [0]));
+	MARTI_TEST_CHECK (s_cache_p -> mec_num_entries == 1);
+
+	MARTI_TEST_CHECK (!SetCachedMartiEntry (entries_pp [0], generation));
+	MARTI_TEST_CHECK (!IsCachedEntry (entries_pp [0]));
+
+	MARTI_TEST_CHECK (SetCachedMartiEntry (entries_pp [0], GetMartiEntryCacheGeneration ()));
+	MARTI_TEST_CHECK (IsCachedEntry (entries_pp [0]));
+}
+
+
+/*
+ * Expired entries are removed when they are next asked for
+ */
+static void TestExpiry (MartiEntry **entries_pp)
+{
+	MartiEntryCacheNode *node_p = FindCacheNode (s_cache_p, entries_pp [2] -> me_id_p);
+	const size_t num_entries = s_cache_p -> mec_num_entries;
+
+	MARTI_TEST_CHECK (node_p != NULL);
+
+	if (node_p)
+		{
+			node_p -> mecn_expiry_time = time (NULL) - 1;
+
+			MARTI_TEST_CHECK (!IsCachedEntry (entries_pp [2]));
+			MARTI_TEST_CHECK (FindCacheNode (s_cache_p, entries_pp [2] -> me_id_p) == NULL);
+			MARTI_TEST_CHECK (s_cache_p -> mec_num_entries == num_entries - 1);
+
+			/* and the others are still there */
+			MARTI_TEST_CHECK (IsCachedEntry (entries_pp [0]));
+		}
+}
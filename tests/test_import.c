@@ -0,0 +1,167 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * test_import.c
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#include <stdarg.h>
+
+#include "marti_import.c"
+
+#include "marti_test.h"
+
+
+static bool IsSplitInto (const char *line_s, const size_t num_expected_fields, ...);
+
+static bool AreRowTaxaValid (json_t *taxa_p);
+
+
+
+int main (int argc, char *argv [])
+{
+	MARTI_TEST_CHECK (IsSplitInto ("a,b,c", 3, "a", "b", "c"));
+	MARTI_TEST_CHECK (IsSplitInto ("", 1, ""));
+	MARTI_TEST_CHECK (IsSplitInto ("single", 1, "single"));
+
+	/* Empty fields, including a trailing one */
+	MARTI_TEST_CHECK (IsSplitInto ("a,,c,", 4, "a", "", "c", ""));
+	MARTI_TEST_CHECK (IsSplitInto (",", 2, "", ""));
+
+	/* Spaces are kept */
+	MARTI_TEST_CHECK (IsSplitInto (" a , b", 2, " a ", " b"));
+
+	/* A carriage return from a Windows line ending isn't part of the last field */
+	MARTI_TEST_CHECK (IsSplitInto ("a,b\r", 2, "a", "b"));
+
+	/* Quoted fields can have commas and quotes in them */
+	MARTI_TEST_CHECK (IsSplitInto ("\"Norwich, UK\",52.6", 2, "Norwich, UK", "52.6"));
+	MARTI_TEST_CHECK (IsSplitInto ("\"say \"\"hi\"\"\",b", 2, "say \"hi\"", "b"));
+	MARTI_TEST_CHECK (IsSplitInto ("a,\"\"", 2, "a", ""));
+	MARTI_TEST_CHECK (IsSplitInto ("\"\"\"\"", 1, "\""));
+	MARTI_TEST_CHECK (IsSplitInto ("\"a,b\",\"c,d\",e", 3, "a,b", "c,d", "e"));
+
+	/* A quote that is never closed is an error */
+	MARTI_TEST_CHECK (IsSplitInto ("a,\"b,c", 0));
+	MARTI_TEST_CHECK (IsSplitInto ("\"a\"\"", 0));
+
+	/* Taxa that can't be stored as 32-bit signed integers are rejected */
+	MARTI_TEST_CHECK (AreRowTaxaValid (json_integer (2147483647)));
+	MARTI_TEST_CHECK (!AreRowTaxaValid (json_integer (2147483648LL)));
+	MARTI_TEST_CHECK (!AreRowTaxaValid (json_integer (4294967295LL)));
+	MARTI_TEST_CHECK (!AreRowTaxaValid (json_integer (-1)));
+	MARTI_TEST_CHECK (AreRowTaxaValid (json_pack ("[i,s]", 9606, "2147483647")));
+	MARTI_TEST_CHECK (!AreRowTaxaValid (json_pack ("[i,I]", 9606, (json_int_t) 2147483648LL)));
+
+	return MARTI_TEST_RESULT ();
+}
+
+
+/*
+ * Check that a line is split into the given fields, or
+ * that it can't be split if num_expected_fields is 0.
+ */
+static bool IsSplitInto (const char *line_s, const size_t num_expected_fields, ...)
+{
+	bool match_flag = false;
+	char *copied_line_s = EasyCopyToNewString (line_s);
+
+	if (copied_line_s)
+		{
+			size_t num_fields = 0;
+			char **fields_ss = SplitCSVLine (copied_line_s, &num_fields);
+
+			if (fields_ss)
+				{
+					if (num_fields == num_expected_fields)
+						{
+							va_list args;
+							size_t i;
+
+							match_flag = true;
+							va_start (args, num_expected_fields);
+
+							for (i = 0; i < num_fields; ++ i)
+								{
+									const char *expected_s = va_arg (args, const char *);
+
+									if (strcmp (* (fields_ss + i), expected_s) != 0)
+										{
+											fprintf (stderr, "field " SIZET_FMT " of \"%s\" is \"%s\" rather than \"%s\"\n", i, line_s, * (fields_ss + i), expected_s);
+											match_flag = false;
+										}
+								}
+
+							va_end (args);
+						}
+					else
+						{
+							fprintf (stderr, "\"%s\" has " SIZET_FMT " fields rather than " SIZET_FMT "\n", line_s, num_fields, num_expected_fields);
+						}
+
+					FreeMemory (fields_ss);
+				}
+			else
+				{
+					match_flag = (num_expected_fields == 0);
+				}
+
+			FreeCopiedString (copied_line_s);
+		}
+
+	return match_flag;
+}
+
+
+/*
+ * Check whether a row with the given taxa, which are freed,
+ * would be imported.
+ */
+static bool AreRowTaxaValid (json_t *taxa_p)
+{
+	bool valid_flag = false;
+	json_t *row_p = json_object ();
+
+	if (row_p && taxa_p)
+		{
+			if (json_object_set (row_p, ME_TAXA_S, taxa_p) == 0)
+				{
+					uint32 *row_taxa_p = NULL;
+					size_t num_taxa = 0;
+
+					valid_flag = GetImportRowTaxa (row_p, &row_taxa_p, &num_taxa);
+
+					if (row_taxa_p)
+						{
+							FreeMemory (row_taxa_p);
+						}
+				}
+		}
+
+	if (taxa_p)
+		{
+			json_decref (taxa_p);
+		}
+
+	if (row_p)
+		{
+			json_decref (row_p);
+		}
+
+	return valid_flag;
+}
@@ -0,0 +1,261 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * test_oid_table.c
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#include "marti_oid_table.c"
+
+#include "marti_test.h"
+
+
+#define NUM_IDS (5000)
+
+
+static void GetTestId (const uint32 i, bson_oid_t *id_p);
+
+static size_t GetHomeSlot (const MartiOidTable *table_p, const bson_oid_t *id_p);
+
+static uint32 FindIdsWithHome (const MartiOidTable *table_p, const size_t home, const uint32 start, bson_oid_t *ids_p, const uint32 num_ids);
+
+static void TestCollisions (const size_t home);
+
+static void TestAgainstReference (void);
+
+
+
+int main (int argc, char *argv [])
+{
+	/* A cluster in the middle of the slots and one that wraps around the end */
+	TestCollisions (17);
+	TestCollisions (S_MIN_CAPACITY - 1);
+
+	TestAgainstReference ();
+
+	return MARTI_TEST_RESULT ();
+}
+
+
+static void GetTestId (const uint32 i, bson_oid_t *id_p)
+{
+	uint8_t data [12];
+
+	memset (data, 0, sizeof (data));
+	data [8] = (uint8_t) (i >> 24);
+	data [9] = (uint8_t) (i >> 16);
+	data [10] = (uint8_t) (i >> 8);
+	data [11] = (uint8_t) i;
+
+	bson_oid_init_from_data (id_p, data);
+}
+
+
+static size_t GetHomeSlot (const MartiOidTable *table_p, const bson_oid_t *id_p)
+{
+	return ((size_t) bson_oid_hash (id_p)) & (table_p -> mot_capacity - 1);
+}
+
+
+/*
+ * Get ids that all hash to the given slot, starting the search at the given
+ * id number. The number of the id after the last one found is returned.
+ */
+static uint32 FindIdsWithHome (const MartiOidTable *table_p, const size_t home, const uint32 start, bson_oid_t *ids_p, const uint32 num_ids)
+{
+	uint32 i = start;
+	uint32 num_found = 0;
+
+	while (num_found < num_ids)
+		{
+			GetTestId (i, ids_p + num_found);
+
+			if (GetHomeSlot (table_p, ids_p + num_found) == home)
+				{
+					++ num_found;
+				}
+
+			++ i;
+		}
+
+	return i;
+}
+
+
+/*
+ * Fill a run of slots with ids that collide, some of which belong to the
+ * next slot along, and check that removing entries from the start and the
+ * middle of the run leaves all of the others reachable.
+ */
+static void TestCollisions (const size_t home)
+{
+	/* Small enough that it won't resize */
+	MartiOidTable *table_p = AllocateMartiOidTable (4);
+
+	MARTI_TEST_CHECK (table_p != NULL);
+
+	if (table_p)
+		{
+			const size_t next_home = (home + 1) & (table_p -> mot_capacity - 1);
+			bson_oid_t ids [6];
+			uint32 next_id;
+			uint32 value;
+			uint32 i;
+
+			MARTI_TEST_CHECK (table_p -> mot_capacity == S_MIN_CAPACITY);
+
+			/* ids 0, 1 and 3 are in the home slot and ids 2, 4 and 5 are in the one after it */
+			next_id = FindIdsWithHome (table_p, home, 0, ids, 2);
+			next_id = FindIdsWithHome (table_p, next_home, next_id, ids + 2, 1);
+			next_id = FindIdsWithHome (table_p, home, next_id, ids + 3, 1);
+			FindIdsWithHome (table_p, next_home, next_id, ids + 4, 2);
+
+			for (i = 0; i < 6; ++ i)
+				{
+					MARTI_TEST_CHECK (SetMartiOidTableValue (table_p, ids + i, i * 10));
+				}
+
+			MARTI_TEST_CHECK (table_p -> mot_size == 6);
+
+			/* The run fills the six slots from the home slot onwards */
+			for (i = 0; i < 6; ++ i)
+				{
+					MARTI_TEST_CHECK (* ((table_p -> mot_used_p) + ((home + i) & (table_p -> mot_capacity - 1))));
+				}
+
+			/* Remove the first entry in the run */
+			MARTI_TEST_CHECK (RemoveMartiOidTableValue (table_p, ids));
+			MARTI_TEST_CHECK (!GetMartiOidTableValue (table_p, ids, &value));
+			MARTI_TEST_CHECK (!RemoveMartiOidTableValue (table_p, ids));
+
+			for (i = 1; i < 6; ++ i)
+				{
+					MARTI_TEST_CHECK (GetMartiOidTableValue (table_p, ids + i, &value) && (value == i * 10));
+				}
+
+			/* Remove one from the middle of the run */
+			MARTI_TEST_CHECK (RemoveMartiOidTableValue (table_p, ids + 3));
+
+			for (i = 1; i < 6; ++ i)
+				{
+					if (i != 3)
+						{
+							MARTI_TEST_CHECK (GetMartiOidTableValue (table_p, ids + i, &value) && (value == i * 10));
+						}
+				}
+
+			/* No entry can be in a slot before its home slot */
+			for (i = 0; i < table_p -> mot_capacity; ++ i)
+				{
+					if (* ((table_p -> mot_used_p) + i))
+						{
+							const size_t entry_home = GetHomeSlot (table_p, (table_p -> mot_ids_p) + i);
+							size_t j = entry_home;
+
+							while (j != i)
+								{
+									MARTI_TEST_CHECK (* ((table_p -> mot_used_p) + j));
+									j = (j + 1) & (table_p -> mot_capacity - 1);
+								}
+						}
+				}
+
+			MARTI_TEST_CHECK (table_p -> mot_size == 4);
+
+			/* Put one back */
+			MARTI_TEST_CHECK (SetMartiOidTableValue (table_p, ids, 99));
+			MARTI_TEST_CHECK (GetMartiOidTableValue (table_p, ids, &value) && (value == 99));
+			MARTI_TEST_CHECK (table_p -> mot_size == 5);
+
+			FreeMartiOidTable (table_p);
+		}
+}
+
+
+/*
+ * Add, update and remove lots of ids, so that the table has to grow,
+ * and check it against a plain array of what it should hold.
+ */
+static void TestAgainstReference (void)
+{
+	MartiOidTable *table_p = AllocateMartiOidTable (0);
+
+	MARTI_TEST_CHECK (table_p != NULL);
+
+	if (table_p)
+		{
+			static bool present [NUM_IDS];
+			static uint32 values [NUM_IDS];
+			size_t num_present = 0;
+			uint32 i;
+
+			memset (present, 0, sizeof (present));
+
+			for (i = 0; i < NUM_IDS; ++ i)
+				{
+					bson_oid_t id;
+
+					GetTestId (i, &id);
+					MARTI_TEST_CHECK (SetMartiOidTableValue (table_p, &id, i));
+					present [i] = true;
+					values [i] = i;
+					++ num_present;
+				}
+
+			/* Remove every third id and change the value of every seventh */
+			for (i = 0; i < NUM_IDS; ++ i)
+				{
+					bson_oid_t id;
+
+					GetTestId (i, &id);
+
+					if (i % 3 == 0)
+						{
+							MARTI_TEST_CHECK (RemoveMartiOidTableValue (table_p, &id));
+							present [i] = false;
+							-- num_present;
+						}
+					else if (i % 7 == 0)
+						{
+							MARTI_TEST_CHECK (SetMartiOidTableValue (table_p, &id, i + NUM_IDS));
+							values [i] = i + NUM_IDS;
+						}
+				}
+
+			MARTI_TEST_CHECK (table_p -> mot_size == num_present);
+
+			for (i = 0; i < NUM_IDS; ++ i)
+				{
+					bson_oid_t id;
+					uint32 value = 0;
+					bool found_flag;
+
+					GetTestId (i, &id);
+					found_flag = GetMartiOidTableValue (table_p, &id, &value);
+
+					MARTI_TEST_CHECK (found_flag == present [i]);
+
+					if (found_flag)
+						{
+							MARTI_TEST_CHECK (value == values [i]);
+						}
+				}
+
+			FreeMartiOidTable (table_p);
+		}
+}
@@ -0,0 +1,68 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * test_sample_list.c
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#include "marti_sample_list.c"
+
+#include "marti_test.h"
+
+
+static bool IsPrefixRegex (const char *prefix_s, const char *expected_regex_s);
+
+
+
+int main (int argc, char *argv [])
+{
+	MARTI_TEST_CHECK (IsPrefixRegex ("", "^"));
+	MARTI_TEST_CHECK (IsPrefixRegex ("Sample", "^Sample"));
+	MARTI_TEST_CHECK (IsPrefixRegex ("barcode01_2023-06", "^barcode01_2023-06"));
+
+	/* Each of the special characters matches itself */
+	MARTI_TEST_CHECK (IsPrefixRegex ("a.b", "^a\\.b"));
+	MARTI_TEST_CHECK (IsPrefixRegex ("run (1)", "^run \\(1\\)"));
+	MARTI_TEST_CHECK (IsPrefixRegex ("\\^$.|?*+()[]{}", "^\\\\\\^\\$\\.\\|\\?\\*\\+\\(\\)\\[\\]\\{\\}"));
+
+	/* A prefix of nothing but special characters needs twice the space */
+	MARTI_TEST_CHECK (IsPrefixRegex ("....", "^\\.\\.\\.\\."));
+
+	return MARTI_TEST_RESULT ();
+}
+
+
+static bool IsPrefixRegex (const char *prefix_s, const char *expected_regex_s)
+{
+	bool match_flag = false;
+	char *regex_s = GetPrefixRegex (prefix_s);
+
+	if (regex_s)
+		{
+			match_flag = (strcmp (regex_s, expected_regex_s) == 0);
+
+			if (!match_flag)
+				{
+					fprintf (stderr, "the regex for \"%s\" is \"%s\" rather than \"%s\"\n", prefix_s, regex_s, expected_regex_s);
+				}
+
+			FreeCopiedString (regex_s);
+		}
+
+	return match_flag;
+}
@@ -0,0 +1,251 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * test_search_cache.c
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#include "marti_search_cache.c"
+
+#include "marti_test.h"
+
+
+static json_t *GetTestResults (const char *name_s);
+
+static bool IsCached (const char *key_s, const json_t *expected_results_p, const json_t *expected_next_token_p);
+
+static void TestDisabled (void);
+
+static void TestGetAndSet (void);
+
+static void TestGenerations (void);
+
+static void TestEviction (void);
+
+static void TestExpiry (void);
+
+
+
+int main (int argc, char *argv [])
+{
+	TestDisabled ();
+
+	/* This one needs the cache to be empty */
+	TestEviction ();
+
+	TestGetAndSet ();
+	TestGenerations ();
+	TestExpiry ();
+
+	return MARTI_TEST_RESULT ();
+}
+
+
+static json_t *GetTestResults (const char *name_s)
+{
+	json_t *results_p = json_array ();
+
+	if (results_p)
+		{
+			json_t *result_p = json_object ();
+
+			if (result_p)
+				{
+					if (json_array_append_new (results_p, result_p) == 0)
+						{
+							if (SetJSONString (result_p, "name", name_s))
+								{
+									return results_p;
+								}
+						}
+					else
+						{
+							json_decref (result_p);
+						}
+				}
+
+			json_decref (results_p);
+		}
+
+	return NULL;
+}
+
+
+static bool IsCached (const char *key_s, const json_t *expected_results_p, const json_t *expected_next_token_p)
+{
+	bool match_flag = false;
+	json_t *results_p = NULL;
+	json_t *next_token_p = NULL;
+	OperationStatus status = OS_IDLE;
+
+	if (GetCachedMartiSearchResults (key_s, &results_p, &next_token_p, &status))
+		{
+			match_flag = json_equal (results_p, expected_results_p) && (status == OS_SUCCEEDED);
+
+			/* We get our own copies */
+			MARTI_TEST_CHECK (results_p != expected_results_p);
+
+			if (expected_next_token_p)
+				{
+					match_flag = match_flag && next_token_p && json_equal (next_token_p, expected_next_token_p);
+				}
+			else
+				{
+					match_flag = match_flag && (next_token_p == NULL);
+				}
+
+			json_decref (results_p);
+
+			if (next_token_p)
+				{
+					json_decref (next_token_p);
+				}
+		}
+
+	return match_flag;
+}
+
+
+static void TestDisabled (void)
+{
+	json_t *config_p = json_object ();
+	json_t *cache_config_p = json_object ();
+	json_t *results_p = GetTestResults ("a");
+
+	MARTI_TEST_CHECK (config_p != NULL);
+	MARTI_TEST_CHECK (cache_config_p != NULL);
+	MARTI_TEST_CHECK (results_p != NULL);
+
+	/* Without a "search_cache" object, there is no cache and nothing is stored */
+	MARTI_TEST_CHECK (!InitMartiSearchCache (config_p));
+	MARTI_TEST_CHECK (!IsMartiSearchCacheEnabled ());
+	MARTI_TEST_CHECK (!SetCachedMartiSearchResults ("a", results_p, NULL, OS_SUCCEEDED, GetMartiSearchCacheGeneration ()));
+	MARTI_TEST_CHECK (!IsCached ("a", results_p, NULL));
+
+	/* With one, it is on */
+	MARTI_TEST_CHECK (SetJSONInteger (cache_config_p, "size", 2));
+	MARTI_TEST_CHECK (json_object_set_new (config_p, "search_cache", cache_config_p) == 0);
+	MARTI_TEST_CHECK (InitMartiSearchCache (config_p));
+	MARTI_TEST_CHECK (IsMartiSearchCacheEnabled ());
+
+	json_decref (config_p);
+	json_decref (results_p);
+}
+
+
+static void TestGetAndSet (void)
+{
+	json_t *results_a_p = GetTestResults ("a");
+	json_t *results_b_p = GetTestResults ("b");
+	json_t *next_token_p = json_string ("l:0:0123456789abcdef01234567");
+	const uint32 generation = GetMartiSearchCacheGeneration ();
+	size_t num_entries;
+
+	MARTI_TEST_CHECK (SetCachedMartiSearchResults ("a", results_a_p, next_token_p, OS_SUCCEEDED, generation));
+	MARTI_TEST_CHECK (IsCached ("a", results_a_p, next_token_p));
+
+	/* A key is only matched by the same key */
+	MARTI_TEST_CHECK (!IsCached ("b", results_a_p, next_token_p));
+	MARTI_TEST_CHECK (!IsCached ("a|", results_a_p, next_token_p));
+
+	/* Setting the same key replaces the old results */
+	num_entries = s_cache_p -> msc_num_entries;
+	MARTI_TEST_CHECK (SetCachedMartiSearchResults ("a", results_b_p, NULL, OS_SUCCEEDED, generation));
+	MARTI_TEST_CHECK (IsCached ("a", results_b_p, NULL));
+	MARTI_TEST_CHECK (s_cache_p -> msc_num_entries == num_entries);
+
+	/* Changing the results after they were cached doesn't change the cached copy */
+	MARTI_TEST_CHECK (SetJSONString (json_array_get (results_b_p, 0), "name", "c"));
+	MARTI_TEST_CHECK (!IsCached ("a", results_b_p, NULL));
+
+	json_decref (results_a_p);
+	json_decref (results_b_p);
+	json_decref (next_token_p);
+}
+
+
+static void TestGenerations (void)
+{
+	json_t *results_p = GetTestResults ("a");
+	const uint32 old_generation = GetMartiSearchCacheGeneration ();
+	uint32 new_generation;
+
+	MARTI_TEST_CHECK (SetCachedMartiSearchResults ("gen", results_p, NULL, OS_SUCCEEDED, old_generation));
+	MARTI_TEST_CHECK (IsCached ("gen", results_p, NULL));
+
+	/* Saving a sample makes all of the cached results out of date */
+	InvalidateMartiSearchCache ();
+	new_generation = GetMartiSearchCacheGeneration ();
+
+	MARTI_TEST_CHECK (new_generation != old_generation);
+	MARTI_TEST_CHECK (!IsCached ("gen", results_p, NULL));
+
+	/* and they are removed when they are next looked for */
+	MARTI_TEST_CHECK (FindCacheEntry (s_cache_p, "gen") == NULL);
+
+	/*
+	 * Results from a search that started before the save might
+	 * not include it, so they aren't cached.
+	 */
+	MARTI_TEST_CHECK (!SetCachedMartiSearchResults ("gen", results_p, NULL, OS_SUCCEEDED, old_generation));
+	MARTI_TEST_CHECK (!IsCached ("gen", results_p, NULL));
+
+	/* but those from a search that started after it are */
+	MARTI_TEST_CHECK (SetCachedMartiSearchResults ("gen", results_p, NULL, OS_SUCCEEDED, new_generation));
+	MARTI_TEST_CHECK (IsCached ("gen", results_p, NULL));
+
+	json_decref (results_p);
+}
+
+
+static void TestEviction (void)
+{
+	json_t *results_p = GetTestResults ("a");
+	const uint32 generation = GetMartiSearchCacheGeneration ();
+
+	/* The cache holds 2 entries */
+	MARTI_TEST_CHECK (SetCachedMartiSearchResults ("x", results_p, NULL, OS_SUCCEEDED, generation));
+	MARTI_TEST_CHECK (SetCachedMartiSearchResults ("y", results_p, NULL, OS_SUCCEEDED, generation));
+	MARTI_TEST_CHECK (s_cache_p -> msc_num_entries == 2);
+
+	/* Using x makes y the least recently used, so adding z removes y */
+	MARTI_TEST_CHECK (IsCached ("x", results_p, NULL));
+	MARTI_TEST_CHECK (SetCachedMartiSearchResults ("z", results_p, NULL, OS_SUCCEEDED, generation));
+	MARTI_TEST_CHECK (s_cache_p -> msc_num_entries == 2);
+
+	MARTI_TEST_CHECK (IsCached ("x", results_p, NULL));
+	MARTI_TEST_CHECK (!IsCached ("y", results_p, NULL));
+	MARTI_TEST_CHECK (IsCached ("z", results_p, NULL));
+
+	json_decref (results_p);
+}
+
+
+static void TestExpiry (void)
+{
+	json_t *results_p = GetTestResults ("a");
+	const uint32 ttl = s_cache_p -> msc_ttl;
+
+	/* With no time to live, the results have expired as soon as they are stored */
+	s_cache_p -> msc_ttl = 0;
+	MARTI_TEST_CHECK (SetCachedMartiSearchResults ("old", results_p, NULL, OS_SUCCEEDED, GetMartiSearchCacheGeneration ()));
+	MARTI_TEST_CHECK (!IsCached ("old", results_p, NULL));
+	s_cache_p -> msc_ttl = ttl;
+
+	json_decref (results_p);
+}
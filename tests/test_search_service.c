@@ -0,0 +1,1036 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * test_search_service.c
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#include "marti_search_service.c"
+
+#include "marti_test.h"
+
+
+static const char * const S_TEST_ID_S = "0123456789abcdef01234567";
+
+#define NUM_TEST_DOCS (3)
+
+#define NUM_CO_LOCATED_DOCS (5)
+
+
+/*
+ * The documents that the fake MongoDB functions below return
+ */
+static bson_t *s_docs_p [NUM_TEST_DOCS];
+
+static uint32 s_num_finds = 0;
+
+static bool s_find_opts_flag = false;
+
+static uint32 s_num_added_results = 0;
+
+
+/*
+ * The samples, all at the same distance from the search point, that the
+ * fake aggregation below returns, and the pages that it has returned.
+ */
+static const double64 S_CO_LOCATED_DISTANCE = 321.123456789;
+
+static bson_t *s_co_located_docs_p [NUM_CO_LOCATED_DOCS];
+
+static uint32 s_num_sent [NUM_CO_LOCATED_DOCS];
+
+static uint32 s_num_aggregations = 0;
+
+static const bson_t *s_page_docs_p [NUM_CO_LOCATED_DOCS];
+
+static uint32 s_num_page_docs = 0;
+
+static uint32 s_next_page_doc = 0;
+
+
+static void InitTestQuery (SearchQuery *query_p, const MartiSearchMode mode);
+
+static void InitTestResults (SearchResults *results_p, const double64 last_distance, const bool add_distance_flag);
+
+static bool IsTokenParsedAs (const char *token_s, const bool expected_local_distance_flag, const double64 expected_distance);
+
+static bool IsSameCacheKey (const SearchQuery *query_0_p, const SearchQuery *query_1_p);
+
+static void TestParseContinuationToken (void);
+
+static void TestGetContinuationToken (void);
+
+static void TestDistanceResume (void);
+
+static void TestCacheKeys (void);
+
+static bool IsSameAsJSON (const bson_t *doc_p, json_t *expected_p);
+
+static void TestGeoNearStage (void);
+
+static void TestGeoNearPipeline (void);
+
+static void TestCoLocatedGeoNearPages (void);
+
+static void TestSearchFilter (void);
+
+static void TestSearchQuery (void);
+
+static void TestSpatialMatchResults (const MartiProjection projection);
+
+
+
+int main (int argc, char *argv [])
+{
+	TestParseContinuationToken ();
+	TestGetContinuationToken ();
+	TestDistanceResume ();
+
+	TestCacheKeys ();
+
+	TestGeoNearStage ();
+	TestGeoNearPipeline ();
+	TestCoLocatedGeoNearPages ();
+	TestSearchFilter ();
+	TestSearchQuery ();
+
+	TestSpatialMatchResults (MP_FULL);
+	TestSpatialMatchResults (MP_STANDARD);
+
+	return MARTI_TEST_RESULT ();
+}
+
+
+/*
+ * The same defaults as RunMartiSearchService () uses
+ */
+static void InitTestQuery (SearchQuery *query_p, const MartiSearchMode mode)
+{
+	memset (query_p, 0, sizeof (SearchQuery));
+
+	query_p -> sq_mode = mode;
+	query_p -> sq_latitude = 52.622;
+	query_p -> sq_longitude = 1.222;
+	query_p -> sq_max_distance = 1000;
+	query_p -> sq_projection = MP_STANDARD;
+	query_p -> sq_taxa_match = MTM_ANY;
+	query_p -> sq_num_nearest = S_DEFAULT_NUM_NEAREST;
+}
+
+
+static void InitTestResults (SearchResults *results_p, const double64 last_distance, const bool add_distance_flag)
+{
+	memset (results_p, 0, sizeof (SearchResults));
+
+	results_p -> sr_has_last_flag = true;
+	bson_oid_init_from_string (& (results_p -> sr_last_id), S_TEST_ID_S);
+	results_p -> sr_last_latitude = 52.63;
+	results_p -> sr_last_longitude = 1.3;
+	results_p -> sr_last_distance = last_distance;
+	results_p -> sr_add_distance_flag = add_distance_flag;
+}
+
+
+static bool IsTokenParsedAs (const char *token_s, const bool expected_local_distance_flag, const double64 expected_distance)
+{
+	bool local_distance_flag = !expected_local_distance_flag;
+	double64 distance = -1.0;
+	bson_oid_t id;
+
+	if (ParseContinuationToken (token_s, &local_distance_flag, &distance, &id))
+		{
+			char id_s [25];
+
+			bson_oid_to_string (&id, id_s);
+
+			return ((local_distance_flag == expected_local_distance_flag) && (distance == expected_distance) && (strcmp (id_s, S_TEST_ID_S) == 0));
+		}
+
+	return false;
+}
+
+
+static void TestParseContinuationToken (void)
+{
+	bool local_distance_flag;
+	double64 distance;
+	bson_oid_t id;
+
+	MARTI_TEST_CHECK (IsTokenParsedAs ("l:0:0123456789abcdef01234567", true, 0.0));
+	MARTI_TEST_CHECK (IsTokenParsedAs ("d:1234.5:0123456789abcdef01234567", false, 1234.5));
+	MARTI_TEST_CHECK (IsTokenParsedAs ("l:1e3:0123456789abcdef01234567", true, 1000.0));
+
+	/* Tokens from before the distance source was recorded */
+	MARTI_TEST_CHECK (!ParseContinuationToken ("1234.5:0123456789abcdef01234567", &local_distance_flag, &distance, &id));
+	MARTI_TEST_CHECK (!ParseContinuationToken ("0123456789abcdef01234567", &local_distance_flag, &distance, &id));
+
+	/* Unknown distance sources */
+	MARTI_TEST_CHECK (!ParseContinuationToken ("x:0:0123456789abcdef01234567", &local_distance_flag, &distance, &id));
+	MARTI_TEST_CHECK (!ParseContinuationToken ("L:0:0123456789abcdef01234567", &local_distance_flag, &distance, &id));
+	MARTI_TEST_CHECK (!ParseContinuationToken ("ld:0:0123456789abcdef01234567", &local_distance_flag, &distance, &id));
+
+	/* Bad distances */
+	MARTI_TEST_CHECK (!ParseContinuationToken ("l::0123456789abcdef01234567", &local_distance_flag, &distance, &id));
+	MARTI_TEST_CHECK (!ParseContinuationToken ("l:-1:0123456789abcdef01234567", &local_distance_flag, &distance, &id));
+	MARTI_TEST_CHECK (!ParseContinuationToken ("l:12km:0123456789abcdef01234567", &local_distance_flag, &distance, &id));
+
+	/* Bad ids */
+	MARTI_TEST_CHECK (!ParseContinuationToken ("l:0:", &local_distance_flag, &distance, &id));
+	MARTI_TEST_CHECK (!ParseContinuationToken ("l:0", &local_distance_flag, &distance, &id));
+	MARTI_TEST_CHECK (!ParseContinuationToken ("l:0:0123456789abcdef0123456", &local_distance_flag, &distance, &id));
+	MARTI_TEST_CHECK (!ParseContinuationToken ("l:0:0123456789abcdef012345678", &local_distance_flag, &distance, &id));
+	MARTI_TEST_CHECK (!ParseContinuationToken ("l:0:0123456789abcdef0123456z", &local_distance_flag, &distance, &id));
+
+	MARTI_TEST_CHECK (!ParseContinuationToken ("", &local_distance_flag, &distance, &id));
+}
+
+
+static void TestGetContinuationToken (void)
+{
+	SearchQuery query;
+	SearchResults results;
+	json_t *token_p;
+	const double64 distance = 1234.56789012345;
+
+	/* A distance from $geoNear */
+	InitTestQuery (&query, MSM_NEAREST);
+	InitTestResults (&results, distance, false);
+	token_p = GetContinuationToken (&results, &query);
+	MARTI_TEST_CHECK (token_p != NULL);
+
+	if (token_p)
+		{
+			/* The distance has to survive the round trip exactly as the next page starts after it */
+			MARTI_TEST_CHECK (IsTokenParsedAs (json_string_value (token_p), false, distance));
+			json_decref (token_p);
+		}
+
+	/* A distance that we worked out ourselves */
+	InitTestResults (&results, distance, true);
+	token_p = GetContinuationToken (&results, &query);
+	MARTI_TEST_CHECK (token_p != NULL);
+
+	if (token_p)
+		{
+			MARTI_TEST_CHECK (IsTokenParsedAs (json_string_value (token_p), true, distance));
+			json_decref (token_p);
+		}
+
+	/* A radius search without the distances works them out from the last sample */
+	InitTestQuery (&query, MSM_RADIUS);
+	InitTestResults (&results, -1.0, false);
+	token_p = GetContinuationToken (&results, &query);
+	MARTI_TEST_CHECK (token_p != NULL);
+
+	if (token_p)
+		{
+			MARTI_TEST_CHECK (IsTokenParsedAs (json_string_value (token_p), true, GetMartiDistance (query.sq_latitude, query.sq_longitude, results.sr_last_latitude, results.sr_last_longitude)));
+			json_decref (token_p);
+		}
+
+	/* Other searches are sorted by id so the distance doesn't matter */
+	InitTestQuery (&query, MSM_BOX);
+	token_p = GetContinuationToken (&results, &query);
+	MARTI_TEST_CHECK (token_p != NULL);
+
+	if (token_p)
+		{
+			MARTI_TEST_CHECK (IsTokenParsedAs (json_string_value (token_p), true, 0.0));
+			json_decref (token_p);
+		}
+
+	/* No results, no token */
+	results.sr_has_last_flag = false;
+	MARTI_TEST_CHECK (GetContinuationToken (&results, &query) == NULL);
+}
+
+
+static void TestDistanceResume (void)
+{
+	SearchQuery query;
+
+	InitTestQuery (&query, MSM_NEAREST);
+
+	/* Only when resuming */
+	MARTI_TEST_CHECK (!IsDistanceResume (&query, false));
+
+	query.sq_resume_flag = true;
+	MARTI_TEST_CHECK (IsDistanceResume (&query, false));
+	MARTI_TEST_CHECK (!IsDistanceResume (&query, true));
+
+	/* and only with the same distances as the previous page */
+	query.sq_mode = MSM_RADIUS;
+	query.sq_local_distance_flag = true;
+	MARTI_TEST_CHECK (IsDistanceResume (&query, true));
+	MARTI_TEST_CHECK (!IsDistanceResume (&query, false));
+
+	/* The other searches aren't sorted by distance */
+	query.sq_mode = MSM_BOX;
+	MARTI_TEST_CHECK (!IsDistanceResume (&query, true));
+	MARTI_TEST_CHECK (!IsDistanceResume (&query, false));
+}
+
+
+static bool IsSameCacheKey (const SearchQuery *query_0_p, const SearchQuery *query_1_p)
+{
+	bool same_flag = false;
+	char *key_0_s = GetSearchCacheKey (query_0_p);
+	char *key_1_s = GetSearchCacheKey (query_1_p);
+
+	MARTI_TEST_CHECK (key_0_s != NULL);
+	MARTI_TEST_CHECK (key_1_s != NULL);
+
+	if (key_0_s && key_1_s)
+		{
+			same_flag = (strcmp (key_0_s, key_1_s) == 0);
+		}
+
+	if (key_0_s)
+		{
+			FreeCopiedString (key_0_s);
+		}
+
+	if (key_1_s)
+		{
+			FreeCopiedString (key_1_s);
+		}
+
+	return same_flag;
+}
+
+
+/*
+ * Anything that changes the results has to change the
+ * key and anything that doesn't, shouldn't.
+ */
+static void TestCacheKeys (void)
+{
+	const char *taxa_ss [] = { "562", "1280" };
+	const char *reversed_taxa_ss [] = { "1280", "562" };
+	struct tm start_time;
+	struct tm end_time;
+	SearchQuery query;
+	SearchQuery other_query;
+
+	memset (&start_time, 0, sizeof (start_time));
+	start_time.tm_year = 123;
+	start_time.tm_mon = 5;
+	start_time.tm_mday = 1;
+
+	end_time = start_time;
+	end_time.tm_mon = 6;
+
+	InitTestQuery (&query, MSM_RADIUS);
+	InitTestQuery (&other_query, MSM_RADIUS);
+	MARTI_TEST_CHECK (IsSameCacheKey (&query, &other_query));
+
+	/* The coordinates are rounded to 6 decimal places */
+	other_query.sq_latitude += 0.00000001;
+	MARTI_TEST_CHECK (IsSameCacheKey (&query, &other_query));
+	other_query.sq_latitude += 0.00001;
+	MARTI_TEST_CHECK (!IsSameCacheKey (&query, &other_query));
+
+	InitTestQuery (&other_query, MSM_RADIUS);
+	other_query.sq_longitude += 0.00001;
+	MARTI_TEST_CHECK (!IsSameCacheKey (&query, &other_query));
+
+	InitTestQuery (&other_query, MSM_RADIUS);
+	other_query.sq_max_distance = 2000;
+	MARTI_TEST_CHECK (!IsSameCacheKey (&query, &other_query));
+
+	InitTestQuery (&other_query, MSM_NEAREST);
+	MARTI_TEST_CHECK (!IsSameCacheKey (&query, &other_query));
+
+	/* The dates */
+	InitTestQuery (&other_query, MSM_RADIUS);
+	other_query.sq_start_p = &start_time;
+	MARTI_TEST_CHECK (!IsSameCacheKey (&query, &other_query));
+
+	other_query.sq_start_p = NULL;
+	other_query.sq_end_p = &start_time;
+	MARTI_TEST_CHECK (!IsSameCacheKey (&query, &other_query));
+
+	query.sq_start_p = &start_time;
+	query.sq_end_p = &end_time;
+	other_query.sq_start_p = &start_time;
+	other_query.sq_end_p = &start_time;
+	MARTI_TEST_CHECK (!IsSameCacheKey (&query, &other_query));
+
+	other_query.sq_end_p = &end_time;
+	MARTI_TEST_CHECK (IsSameCacheKey (&query, &other_query));
+
+	/* What is returned and how much of it */
+	InitTestQuery (&query, MSM_RADIUS);
+	InitTestQuery (&other_query, MSM_RADIUS);
+	other_query.sq_projection = MP_FULL;
+	MARTI_TEST_CHECK (!IsSameCacheKey (&query, &other_query));
+
+	InitTestQuery (&other_query, MSM_RADIUS);
+	other_query.sq_page_size = 10;
+	MARTI_TEST_CHECK (!IsSameCacheKey (&query, &other_query));
+
+	InitTestQuery (&other_query, MSM_RADIUS);
+	other_query.sq_counts_only_flag = true;
+	MARTI_TEST_CHECK (!IsSameCacheKey (&query, &other_query));
+
+	InitTestQuery (&other_query, MSM_RADIUS);
+	other_query.sq_token_s = "l:0:0123456789abcdef01234567";
+	MARTI_TEST_CHECK (!IsSameCacheKey (&query, &other_query));
+
+	InitTestQuery (&other_query, MSM_RADIUS);
+	other_query.sq_keywords_s = "soil";
+	MARTI_TEST_CHECK (!IsSameCacheKey (&query, &other_query));
+
+	/* The taxa */
+	InitTestQuery (&query, MSM_RADIUS);
+	query.sq_taxa_ss = taxa_ss;
+	query.sq_num_taxa = 2;
+
+	InitTestQuery (&other_query, MSM_RADIUS);
+	MARTI_TEST_CHECK (!IsSameCacheKey (&query, &other_query));
+
+	other_query.sq_taxa_ss = taxa_ss;
+	other_query.sq_num_taxa = 1;
+	MARTI_TEST_CHECK (!IsSameCacheKey (&query, &other_query));
+
+	other_query.sq_num_taxa = 2;
+	MARTI_TEST_CHECK (IsSameCacheKey (&query, &other_query));
+
+	other_query.sq_taxa_match = MTM_ALL;
+	MARTI_TEST_CHECK (!IsSameCacheKey (&query, &other_query));
+
+	other_query.sq_taxa_match = MTM_ANY;
+	other_query.sq_taxa_subtree_flag = true;
+	MARTI_TEST_CHECK (!IsSameCacheKey (&query, &other_query));
+
+	/* The same taxa, whether they are wanted or not, give different keys */
+	InitTestQuery (&other_query, MSM_RADIUS);
+	other_query.sq_excluded_taxa_ss = taxa_ss;
+	other_query.sq_num_excluded_taxa = 2;
+	MARTI_TEST_CHECK (!IsSameCacheKey (&query, &other_query));
+
+	/* The taxa are used in the order given, so this is just a miss rather than a wrong hit */
+	InitTestQuery (&other_query, MSM_RADIUS);
+	other_query.sq_taxa_ss = reversed_taxa_ss;
+	other_query.sq_num_taxa = 2;
+	MARTI_TEST_CHECK (!IsSameCacheKey (&query, &other_query));
+
+	/* Bounding boxes */
+	InitTestQuery (&query, MSM_BOX);
+	query.sq_box [0] = -10.0;
+	query.sq_box [1] = 50.0;
+	query.sq_box [2] = 2.0;
+	query.sq_box [3] = 60.0;
+
+	other_query = query;
+	MARTI_TEST_CHECK (IsSameCacheKey (&query, &other_query));
+
+	/* The search point isn't used for a box */
+	other_query.sq_latitude = 0.0;
+	MARTI_TEST_CHECK (IsSameCacheKey (&query, &other_query));
+
+	other_query.sq_box [2] = 3.0;
+	MARTI_TEST_CHECK (!IsSameCacheKey (&query, &other_query));
+
+	/* Nor the distance for the nearest samples */
+	InitTestQuery (&query, MSM_NEAREST);
+	other_query = query;
+	other_query.sq_max_distance = 5;
+	MARTI_TEST_CHECK (IsSameCacheKey (&query, &other_query));
+
+	other_query.sq_num_nearest = 5;
+	MARTI_TEST_CHECK (!IsSameCacheKey (&query, &other_query));
+}
+
+
+/*
+ * The queries used to be built with jansson and then converted with
+ * ConvertJSONToBSON (). Check that building them directly as BSON gives
+ * exactly the same documents, including the types of the numbers, as
+ * building the JSON equivalent and converting it. The expected JSON is
+ * freed.
+ */
+static bool IsSameAsJSON (const bson_t *doc_p, json_t *expected_p)
+{
+	bool same_flag = false;
+
+	if (doc_p && expected_p)
+		{
+			bson_t *expected_bson_p = ConvertJSONToBSON (expected_p);
+
+			if (expected_bson_p)
+				{
+					same_flag = bson_equal (doc_p, expected_bson_p);
+
+					if (!same_flag)
+						{
+							char *doc_s = bson_as_canonical_extended_json (doc_p, NULL);
+							char *expected_s = bson_as_canonical_extended_json (expected_bson_p, NULL);
+
+							fprintf (stderr, "got:      %s\nexpected: %s\n", doc_s ? doc_s : "", expected_s ? expected_s : "");
+
+							if (doc_s)
+								{
+									bson_free (doc_s);
+								}
+
+							if (expected_s)
+								{
+									bson_free (expected_s);
+								}
+						}
+
+					bson_destroy (expected_bson_p);
+				}
+		}
+
+	if (expected_p)
+		{
+			json_decref (expected_p);
+		}
+
+	return same_flag;
+}
+
+
+static void TestGeoNearStage (void)
+{
+	SearchQuery query;
+	struct tm start_time;
+	struct tm end_time;
+	bson_t *stage_p;
+
+	memset (&start_time, 0, sizeof (start_time));
+	start_time.tm_year = 123;
+	start_time.tm_mon = 5;
+	start_time.tm_mday = 1;
+
+	end_time = start_time;
+	end_time.tm_mon = 6;
+
+	/* A first page */
+	InitTestQuery (&query, MSM_RADIUS);
+	stage_p = bson_new ();
+
+	if (stage_p)
+		{
+			MARTI_TEST_CHECK (AddGeoNearStage (stage_p, &query));
+			MARTI_TEST_CHECK (IsSameAsJSON (stage_p, json_pack ("{s:{s:{s:s,s:[f,f]},s:s,s:s,s:b,s:I,s:{}}}",
+																													"$geoNear",
+																													"near", "type", "Point", "coordinates", query.sq_longitude, query.sq_latitude,
+																													"key", ME_LOCATION_S,
+																													"distanceField", S_DISTANCE_S,
+																													"spherical", 1,
+																													"maxDistance", (json_int_t) 1000,
+																													"query")));
+			bson_destroy (stage_p);
+		}
+
+	/*
+	 * A later page with dates and a radius that is too big for an int32.
+	 * Other samples can be at the same distance as the last one, so it
+	 * is up to the following $match to skip the ones that we have sent.
+	 */
+	query.sq_start_p = &start_time;
+	query.sq_end_p = &end_time;
+	query.sq_max_distance = 3000000000u;
+	query.sq_min_distance = 1234.56789;
+	query.sq_resume_flag = true;
+	bson_oid_init_from_string (& (query.sq_last_id), S_TEST_ID_S);
+
+	stage_p = bson_new ();
+
+	if (stage_p)
+		{
+			MARTI_TEST_CHECK (AddGeoNearStage (stage_p, &query));
+			MARTI_TEST_CHECK (IsSameAsJSON (stage_p, json_pack ("{s:{s:{s:s,s:[f,f]},s:s,s:s,s:b,s:f,s:I,s:{s:{s:{s:s},s:{s:s}}}}}",
+																													"$geoNear",
+																													"near", "type", "Point", "coordinates", query.sq_longitude, query.sq_latitude,
+																													"key", ME_LOCATION_S,
+																													"distanceField", S_DISTANCE_S,
+																													"spherical", 1,
+																													"minDistance", query.sq_min_distance,
+																													"maxDistance", (json_int_t) 3000000000u,
+																													"query",
+																													ME_START_DATE_S,
+																													"$gte", "$date", "$numberLong", "1685577600000",
+																													"$lte", "$date", "$numberLong", "1688169600000")));
+			bson_destroy (stage_p);
+		}
+}
+
+
+static void TestGeoNearPipeline (void)
+{
+	SearchQuery query;
+	bson_t *pipeline_p;
+
+	InitTestQuery (&query, MSM_RADIUS);
+	query.sq_projection = MP_FULL;
+	query.sq_page_size = 2;
+	query.sq_min_distance = S_CO_LOCATED_DISTANCE;
+	query.sq_resume_flag = true;
+	bson_oid_init_from_string (& (query.sq_last_id), S_TEST_ID_S);
+
+	pipeline_p = GetGeoNearPipeline (&query);
+	MARTI_TEST_CHECK (pipeline_p != NULL);
+
+	if (pipeline_p)
+		{
+			MARTI_TEST_CHECK (IsSameAsJSON (pipeline_p, json_pack ("{s:{s:{s:{s:s,s:[f,f]},s:s,s:s,s:b,s:f,s:I,s:{}}},s:{s:{s:[{s:{s:f}},{s:f,s:{s:{s:s}}}]}},s:{s:{s:i,s:i}},s:{s:{s:s}}}",
+																														 "0", "$geoNear",
+																														 "near", "type", "Point", "coordinates", query.sq_longitude, query.sq_latitude,
+																														 "key", ME_LOCATION_S,
+																														 "distanceField", S_DISTANCE_S,
+																														 "spherical", 1,
+																														 "minDistance", S_CO_LOCATED_DISTANCE,
+																														 "maxDistance", (json_int_t) 1000,
+																														 "query",
+																														 "1", "$match", "$or",
+																														 S_DISTANCE_S, "$gt", S_CO_LOCATED_DISTANCE,
+																														 S_DISTANCE_S, S_CO_LOCATED_DISTANCE, MONGO_ID_S, "$gt", "$oid", S_TEST_ID_S,
+																														 "2", "$sort", S_DISTANCE_S, 1, MONGO_ID_S, 1,
+																														 "3", "$limit", "$numberLong", "2")));
+			bson_destroy (pipeline_p);
+		}
+
+	/* The nearest samples aren't paged so they don't need sorting by id */
+	InitTestQuery (&query, MSM_NEAREST);
+	query.sq_projection = MP_FULL;
+
+	pipeline_p = GetGeoNearPipeline (&query);
+	MARTI_TEST_CHECK (pipeline_p != NULL);
+
+	if (pipeline_p)
+		{
+			MARTI_TEST_CHECK (bson_count_keys (pipeline_p) == 2);
+			bson_destroy (pipeline_p);
+		}
+}
+
+
+/*
+ * Page through more samples at exactly the same distance than fit on a
+ * page and check that each of them is sent once. The fake aggregation
+ * returns samples at the same distance in a different order each time
+ * unless the pipeline sorts them.
+ */
+static void TestCoLocatedGeoNearPages (void)
+{
+	SearchQuery query;
+	MartiServiceData data;
+	MongoTool tool;
+	ServiceJob job;
+	uint32 num_pages = 0;
+	bool more_flag = true;
+	uint32 i;
+
+	memset (&data, 0, sizeof (data));
+	memset (&tool, 0, sizeof (tool));
+	memset (&job, 0, sizeof (job));
+	data.msd_mongo_p = &tool;
+
+	for (i = 0; i < NUM_CO_LOCATED_DOCS; ++ i)
+		{
+			bson_oid_t id;
+			char name_s [32];
+
+			bson_oid_init (&id, NULL);
+			snprintf (name_s, sizeof (name_s), "co-located sample " UINT32_FMT, i);
+
+			/* $geoNear adds the distance to each document */
+			s_co_located_docs_p [i] = BCON_NEW (MONGO_ID_S, BCON_OID (&id),
+																					ME_NAME_S, BCON_UTF8 (name_s),
+																					ME_MARTI_ID_S, BCON_UTF8 (name_s),
+																					ME_LOCATION_S, "{", "type", BCON_UTF8 ("Point"), ME_COORDINATES_S, "[", BCON_DOUBLE (1.23), BCON_DOUBLE (52.62), "]", "}",
+																					S_DISTANCE_S, BCON_DOUBLE (S_CO_LOCATED_DISTANCE));
+			MARTI_TEST_CHECK (s_co_located_docs_p [i] != NULL);
+
+			s_num_sent [i] = 0;
+		}
+
+	InitTestQuery (&query, MSM_RADIUS);
+	query.sq_page_size = 2;
+	s_num_aggregations = 0;
+
+	while (more_flag && (num_pages <= NUM_CO_LOCATED_DOCS))
+		{
+			json_t *next_token_p = NULL;
+
+			MARTI_TEST_CHECK (RunGeoNearSearch (&query, &job, &data, NULL, &next_token_p) == OS_SUCCEEDED);
+			++ num_pages;
+
+			if (next_token_p)
+				{
+					MARTI_TEST_CHECK (ParseContinuationToken (json_string_value (next_token_p), & (query.sq_local_distance_flag), & (query.sq_min_distance), & (query.sq_last_id)));
+					MARTI_TEST_CHECK (!query.sq_local_distance_flag);
+					query.sq_resume_flag = true;
+
+					json_decref (next_token_p);
+				}
+			else
+				{
+					more_flag = false;
+				}
+		}
+
+	/* 2 + 2 + 1 */
+	MARTI_TEST_CHECK (num_pages == 3);
+
+	for (i = 0; i < NUM_CO_LOCATED_DOCS; ++ i)
+		{
+			MARTI_TEST_CHECK (s_num_sent [i] == 1);
+			bson_destroy (s_co_located_docs_p [i]);
+		}
+
+	if (job.sj_metadata_p)
+		{
+			json_decref (job.sj_metadata_p);
+		}
+}
+
+static void TestSearchFilter (void)
+{
+	SearchQuery query;
+	struct tm end_time;
+	bson_t *filter_p;
+
+	memset (&end_time, 0, sizeof (end_time));
+	end_time.tm_year = 123;
+	end_time.tm_mon = 6;
+	end_time.tm_mday = 1;
+
+	InitTestQuery (&query, MSM_RADIUS);
+	query.sq_end_p = &end_time;
+
+	filter_p = GetSearchFilter (&query);
+	MARTI_TEST_CHECK (filter_p != NULL);
+
+	if (filter_p)
+		{
+			MARTI_TEST_CHECK (IsSameAsJSON (filter_p, json_pack ("{s:{s:{s:[[f,f],f]}},s:{s:{s:s}}}",
+																												 ME_LOCATION_S, "$geoWithin", "$centerSphere", query.sq_longitude, query.sq_latitude, 1000.0 / 6378100.0,
+																												 ME_START_DATE_S, "$lte", "$date", "$numberLong", "1688169600000")));
+			bson_destroy (filter_p);
+		}
+
+	/* The nearest samples can be anywhere */
+	InitTestQuery (&query, MSM_NEAREST);
+	filter_p = GetSearchFilter (&query);
+	MARTI_TEST_CHECK (filter_p != NULL);
+
+	if (filter_p)
+		{
+			MARTI_TEST_CHECK (IsSameAsJSON (filter_p, json_object ()));
+			bson_destroy (filter_p);
+		}
+}
+
+
+static void TestSearchQuery (void)
+{
+	json_t *polygon_p = json_pack ("{s:s,s:[[[f,f],[f,f],[f,f],[f,f]]]}", "type", "Polygon", "coordinates", 0.5, 52.0, 1.5, 52.0, 1.5, 53.0, 0.5, 52.0);
+
+	MARTI_TEST_CHECK (polygon_p != NULL);
+
+	if (polygon_p)
+		{
+			SearchQuery query;
+			bson_t *query_p;
+
+			InitTestQuery (&query, MSM_POLYGON);
+			query.sq_polygon_p = polygon_p;
+			query.sq_resume_flag = true;
+			bson_oid_init_from_string (& (query.sq_last_id), S_TEST_ID_S);
+
+			query_p = GetSearchQuery (&query);
+			MARTI_TEST_CHECK (query_p != NULL);
+
+			if (query_p)
+				{
+					MARTI_TEST_CHECK (IsSameAsJSON (query_p, json_pack ("{s:{s:{s:O}},s:{s:{s:s}}}",
+																															ME_LOCATION_S, "$geoWithin", "$geometry", polygon_p,
+																															MONGO_ID_S, "$gt", "$oid", S_TEST_ID_S)));
+					bson_destroy (query_p);
+				}
+
+			json_decref (polygon_p);
+		}
+}
+
+
+/*
+ * Used instead of the Grassroots MongoDB function. It just records how it was called.
+ */
+bool FindMatchingMongoDocumentsByBSON (MongoTool *tool_p, const bson_t *query_p, const char **fields_ss, bson_t *opts_p)
+{
+	++ s_num_finds;
+	s_find_opts_flag = (opts_p != NULL);
+
+	return true;
+}
+
+
+/*
+ * Used instead of the Grassroots MongoDB function. Every test document is
+ * returned, in the opposite order to the matches, whatever the query was.
+ */
+int32 IterateOverMongoResults (MongoTool *tool_p, bool (*process_bson_fn) (const bson_t *document_p, void *data_p), void *data_p)
+{
+	int32 num_docs = 0;
+	int32 i;
+
+	for (i = NUM_TEST_DOCS - 1; i >= 0; -- i)
+		{
+			if (s_docs_p [i])
+				{
+					++ num_docs;
+
+					if (!process_bson_fn (s_docs_p [i], data_p))
+						{
+							i = -1;
+						}
+				}
+		}
+
+	return num_docs;
+}
+
+
+/*
+ * Used instead of the Grassroots function so that no ServiceJob is needed
+ */
+bool AddResultToServiceJob (ServiceJob *job_p, json_t *result_p)
+{
+	++ s_num_added_results;
+	json_decref (result_p);
+
+	return true;
+}
+
+
+/*
+ * Used instead of the MongoDB driver's function. It returns the co-located
+ * test documents that the pipeline's $match, $sort and $limit select. All
+ * of them are at the same distance so, unless they are sorted, they are
+ * returned in a different order each time, like $geoNear can.
+ */
+mongoc_cursor_t *mongoc_collection_aggregate (mongoc_collection_t *collection_p, mongoc_query_flags_t flags, const bson_t *pipeline_p, const bson_t *opts_p, const mongoc_read_prefs_t *read_prefs_p)
+{
+	bson_iter_t iter;
+	bool resume_flag = false;
+	bool sort_flag = false;
+	double64 last_distance = 0.0;
+	const bson_oid_t *last_id_p = NULL;
+	int64 limit = 0;
+	uint32 i;
+
+	if (bson_iter_init (&iter, pipeline_p))
+		{
+			while (bson_iter_next (&iter))
+				{
+					bson_iter_t stage_iter;
+					bson_iter_t value_iter;
+
+					if (BSON_ITER_HOLDS_DOCUMENT (&iter) && bson_iter_recurse (&iter, &stage_iter))
+						{
+							if (bson_iter_find_descendant (&stage_iter, "$match.$or.1._id.$gt", &value_iter) && BSON_ITER_HOLDS_OID (&value_iter))
+								{
+									last_id_p = bson_iter_oid (&value_iter);
+
+									bson_iter_recurse (&iter, &stage_iter);
+
+									if (bson_iter_find_descendant (&stage_iter, "$match.$or.1.distance", &value_iter) && BSON_ITER_HOLDS_DOUBLE (&value_iter))
+										{
+											last_distance = bson_iter_double (&value_iter);
+											resume_flag = true;
+										}
+								}
+
+							bson_iter_recurse (&iter, &stage_iter);
+
+							if (bson_iter_find (&stage_iter, "$sort"))
+								{
+									sort_flag = true;
+								}
+
+							bson_iter_recurse (&iter, &stage_iter);
+
+							if (bson_iter_find (&stage_iter, "$limit") && BSON_ITER_HOLDS_INT64 (&stage_iter))
+								{
+									limit = bson_iter_int64 (&stage_iter);
+								}
+						}
+				}
+		}
+
+	s_num_page_docs = 0;
+	s_next_page_doc = 0;
+
+	for (i = 0; i < NUM_CO_LOCATED_DOCS; ++ i)
+		{
+			const uint32 doc_index = sort_flag ? i : (i + s_num_aggregations) % NUM_CO_LOCATED_DOCS;
+			bson_t *doc_p = s_co_located_docs_p [doc_index];
+			bson_iter_t id_iter;
+
+			if (bson_iter_init_find (&id_iter, doc_p, MONGO_ID_S))
+				{
+					const bson_oid_t *id_p = bson_iter_oid (&id_iter);
+					bool match_flag = true;
+
+					if (resume_flag)
+						{
+							match_flag = (S_CO_LOCATED_DISTANCE > last_distance) || ((S_CO_LOCATED_DISTANCE == last_distance) && (bson_oid_compare (id_p, last_id_p) > 0));
+						}
+
+					if (match_flag && ((limit == 0) || (s_num_page_docs < limit)))
+						{
+							s_page_docs_p [s_num_page_docs] = doc_p;
+							++ s_num_page_docs;
+							++ s_num_sent [doc_index];
+						}
+				}
+		}
+
+	/* The documents are sorted by id so that only the order of the co-located ones is unspecified */
+	if (sort_flag)
+		{
+			for (i = 1; i < s_num_page_docs; ++ i)
+				{
+					uint32 j;
+
+					for (j = i; j > 0; -- j)
+						{
+							bson_iter_t iter_0;
+							bson_iter_t iter_1;
+
+							if (bson_iter_init_find (&iter_0, s_page_docs_p [j - 1], MONGO_ID_S) && bson_iter_init_find (&iter_1, s_page_docs_p [j], MONGO_ID_S) &&
+									(bson_oid_compare (bson_iter_oid (&iter_0), bson_iter_oid (&iter_1)) > 0))
+								{
+									const bson_t *doc_p = s_page_docs_p [j - 1];
+
+									s_page_docs_p [j - 1] = s_page_docs_p [j];
+									s_page_docs_p [j] = doc_p;
+								}
+						}
+				}
+		}
+
+	++ s_num_aggregations;
+
+	return (mongoc_cursor_t *) s_page_docs_p;
+}
+
+
+/*
+ * Used instead of the MongoDB driver's function, to go through the
+ * documents that the fake aggregation above selected.
+ */
+bool mongoc_cursor_next (mongoc_cursor_t *cursor_p, const bson_t **bson_pp)
+{
+	if (s_next_page_doc < s_num_page_docs)
+		{
+			*bson_pp = s_page_docs_p [s_next_page_doc];
+			++ s_next_page_doc;
+
+			return true;
+		}
+
+	return false;
+}
+
+
+bool mongoc_cursor_error (mongoc_cursor_t *cursor_p, bson_error_t *error_p)
+{
+	return false;
+}
+
+
+void mongoc_cursor_destroy (mongoc_cursor_t *cursor_p)
+{
+}
+
+/*
+ * Get the documents for some spatial index matches, in chunks of 2,
+ * and check that they are all added to the results in the same order
+ * as the matches. The full projection fetches the documents without
+ * any find options.
+ */
+static void TestSpatialMatchResults (const MartiProjection projection)
+{
+	MartiSpatialMatch matches [NUM_TEST_DOCS];
+	SearchQuery query;
+	SearchResults results;
+	MartiServiceData data;
+	MongoTool tool;
+	OperationStatus status;
+	uint32 i;
+
+	memset (&data, 0, sizeof (data));
+	memset (&tool, 0, sizeof (tool));
+	data.msd_search_batch_size = 2;
+	data.msd_mongo_p = &tool;
+
+	InitTestQuery (&query, MSM_RADIUS);
+	query.sq_projection = projection;
+
+	for (i = 0; i < NUM_TEST_DOCS; ++ i)
+		{
+			char name_s [32];
+
+			bson_oid_init (& ((matches + i) -> msm_id), NULL);
+			(matches + i) -> msm_distance = 100.0 * (i + 1);
+
+			snprintf (name_s, sizeof (name_s), "sample " UINT32_FMT, i);
+
+			s_docs_p [i] = BCON_NEW (MONGO_ID_S, BCON_OID (& ((matches + i) -> msm_id)),
+															 ME_NAME_S, BCON_UTF8 (name_s),
+															 ME_MARTI_ID_S, BCON_UTF8 (name_s),
+															 ME_LOCATION_S, "{", "type", BCON_UTF8 ("Point"), ME_COORDINATES_S, "[", BCON_DOUBLE (1.2 + (0.001 * i)), BCON_DOUBLE (52.6), "]", "}",
+															 ME_TAXA_S, "[", BCON_INT32 (562), BCON_INT32 (1280), "]");
+			MARTI_TEST_CHECK (s_docs_p [i] != NULL);
+		}
+
+	s_num_finds = 0;
+	s_num_added_results = 0;
+
+	status = AddSpatialMatchesToResults (&query, matches, NULL, NUM_TEST_DOCS, true, NULL, &data, NULL, &results);
+
+	MARTI_TEST_CHECK (status == OS_SUCCEEDED);
+	MARTI_TEST_CHECK (results.sr_num_results == NUM_TEST_DOCS);
+	MARTI_TEST_CHECK (results.sr_num_successes == NUM_TEST_DOCS);
+	MARTI_TEST_CHECK (s_num_added_results == NUM_TEST_DOCS);
+
+	/* Two chunks */
+	MARTI_TEST_CHECK (s_num_finds == 2);
+	MARTI_TEST_CHECK (s_find_opts_flag == (projection != MP_FULL));
+
+	/* The last result is the last match, with its distance from the index */
+	MARTI_TEST_CHECK (results.sr_has_last_flag);
+	MARTI_TEST_CHECK (bson_oid_equal (& (results.sr_last_id), & ((matches + NUM_TEST_DOCS - 1) -> msm_id)));
+	MARTI_TEST_CHECK (results.sr_last_distance == (matches + NUM_TEST_DOCS - 1) -> msm_distance);
+
+	for (i = 0; i < NUM_TEST_DOCS; ++ i)
+		{
+			if (s_docs_p [i])
+				{
+					bson_destroy (s_docs_p [i]);
+					s_docs_p [i] = NULL;
+				}
+		}
+}
@@ -0,0 +1,484 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * test_similarity_index.c
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#include <math.h>
+
+#include "marti_similarity_index.c"
+
+#include "marti_test.h"
+
+
+#define NUM_TAXA (400)
+
+
+/*
+ * The finds made by the fake database functions below, the time
+ * that they asked for the samples since and the samples that they return.
+ */
+#define NUM_DOCS (2)
+
+static uint32 s_num_finds = 0;
+
+static int64 s_since = -1;
+
+static bson_t *s_docs_p [NUM_DOCS];
+
+
+static void GetTestId (const uint32 i, bson_oid_t *id_p);
+
+static void GetTaxaRange (const uint32 first_taxon, const uint32 num_taxa, uint32 *taxa_p);
+
+static double64 GetSketchSimilarity (const uint32 *taxa_0_p, const size_t num_taxa_0, const uint32 *taxa_1_p, const size_t num_taxa_1);
+
+static void TestSketches (void);
+
+static void TestFindSimilarSamples (void);
+
+static void TestDateRange (void);
+
+static void TestRefresh (void);
+
+
+
+int main (int argc, char *argv [])
+{
+	/* The same set up as InitMartiSimilarityIndex () but without loading any samples */
+	InitSeeds ();
+
+	TestSketches ();
+
+	s_index_p = AllocateSimilarityIndex ();
+	MARTI_TEST_CHECK (s_index_p != NULL);
+
+	if (s_index_p)
+		{
+			TestFindSimilarSamples ();
+			TestDateRange ();
+			TestRefresh ();
+
+			FreeSimilarityIndex (s_index_p);
+			s_index_p = NULL;
+		}
+
+	return MARTI_TEST_RESULT ();
+}
+
+
+/*
+ * Used instead of the Grassroots MongoDB function. It records the time that
+ * the samples were asked for since or -1 if they all were.
+ */
+bool FindMatchingMongoDocumentsByBSON (MongoTool *tool_p, const bson_t *query_p, const char **fields_ss, bson_t *opts_p)
+{
+	bson_iter_t iter;
+
+	s_since = -1;
+
+	if (bson_iter_init_find (&iter, query_p, MONGO_TIMESTAMP_S) && BSON_ITER_HOLDS_DOCUMENT (&iter))
+		{
+			bson_iter_t gte_iter;
+
+			if (bson_iter_recurse (&iter, &gte_iter) && bson_iter_find (&gte_iter, "$gte") && BSON_ITER_HOLDS_DATE_TIME (&gte_iter))
+				{
+					s_since = bson_iter_date_time (&gte_iter);
+				}
+		}
+
+	++ s_num_finds;
+
+	return true;
+}
+
+
+/*
+ * Used instead of the Grassroots MongoDB function. It returns the
+ * test samples whatever the query was.
+ */
+int32 IterateOverMongoResults (MongoTool *tool_p, bool (*process_bson_fn) (const bson_t *document_p, void *data_p), void *data_p)
+{
+	int32 num_docs = 0;
+	uint32 i;
+
+	for (i = 0; i < NUM_DOCS; ++ i)
+		{
+			if (s_docs_p [i])
+				{
+					if (process_bson_fn (s_docs_p [i], data_p))
+						{
+							++ num_docs;
+						}
+					else
+						{
+							return -1;
+						}
+				}
+		}
+
+	return num_docs;
+}
+
+
+static void GetTestId (const uint32 i, bson_oid_t *id_p)
+{
+	uint8_t data [12];
+
+	memset (data, 0, sizeof (data));
+	data [10] = (uint8_t) (i >> 8);
+	data [11] = (uint8_t) i;
+
+	bson_oid_init_from_data (id_p, data);
+}
+
+
+static void GetTaxaRange (const uint32 first_taxon, const uint32 num_taxa, uint32 *taxa_p)
+{
+	uint32 i;
+
+	for (i = 0; i < num_taxa; ++ i)
+		{
+			* (taxa_p + i) = first_taxon + i;
+		}
+}
+
+
+/*
+ * The fraction of the sketch values that are the same
+ */
+static double64 GetSketchSimilarity (const uint32 *taxa_0_p, const size_t num_taxa_0, const uint32 *taxa_1_p, const size_t num_taxa_1)
+{
+	uint32 sketch_0 [S_NUM_HASHES];
+	uint32 sketch_1 [S_NUM_HASHES];
+	uint32 num_same = 0;
+	uint32 i;
+
+	GetSketch (taxa_0_p, num_taxa_0, sketch_0);
+	GetSketch (taxa_1_p, num_taxa_1, sketch_1);
+
+	for (i = 0; i < S_NUM_HASHES; ++ i)
+		{
+			if (sketch_0 [i] == sketch_1 [i])
+				{
+					++ num_same;
+				}
+		}
+
+	return ((double64) num_same) / ((double64) S_NUM_HASHES);
+}
+
+
+static void TestSketches (void)
+{
+	uint32 taxa_0 [NUM_TAXA];
+	uint32 taxa_1 [NUM_TAXA];
+	uint32 i;
+
+	/* The order of the taxa doesn't matter */
+	GetTaxaRange (1, NUM_TAXA, taxa_0);
+
+	for (i = 0; i < NUM_TAXA; ++ i)
+		{
+			taxa_1 [i] = taxa_0 [NUM_TAXA - 1 - i];
+		}
+
+	MARTI_TEST_CHECK (GetSketchSimilarity (taxa_0, NUM_TAXA, taxa_1, NUM_TAXA) == 1.0);
+
+	/* Nor do repeated taxa */
+	memcpy (taxa_1, taxa_0, sizeof (taxa_1));
+	memcpy (taxa_1 + (NUM_TAXA / 2), taxa_0, (NUM_TAXA / 2) * sizeof (uint32));
+	MARTI_TEST_CHECK (GetSketchSimilarity (taxa_0, NUM_TAXA / 2, taxa_1, NUM_TAXA) == 1.0);
+
+	/*
+	 * 1 - 400 and 101 - 500 share 300 of 500 taxa, a Jaccard similarity
+	 * of 0.6. With 64 hashes, the standard error of the estimate is about
+	 * 0.06 so allow for more than 3 of them.
+	 */
+	GetTaxaRange (101, NUM_TAXA, taxa_1);
+	MARTI_TEST_CHECK (fabs (GetSketchSimilarity (taxa_0, NUM_TAXA, taxa_1, NUM_TAXA) - 0.6) < 0.2);
+
+	/* 1 - 400 and 301 - 700 share 100 of 700 taxa, about 0.14 */
+	GetTaxaRange (301, NUM_TAXA, taxa_1);
+	MARTI_TEST_CHECK (fabs (GetSketchSimilarity (taxa_0, NUM_TAXA, taxa_1, NUM_TAXA) - (100.0 / 700.0)) < 0.15);
+
+	/*
+	 * Nearly every sample has the lowest taxonomy ids, such as 1 for the root
+	 * and 2 for bacteria, so they mustn't make up most of the sketch.
+	 */
+	GetTaxaRange (1, 64, taxa_0);
+	GetTaxaRange (1, 64, taxa_1);
+	GetTaxaRange (1001, NUM_TAXA - 64, taxa_0 + 64);
+	GetTaxaRange (5001, NUM_TAXA - 64, taxa_1 + 64);
+	MARTI_TEST_CHECK (GetSketchSimilarity (taxa_0, NUM_TAXA, taxa_1, NUM_TAXA) < 0.4);
+
+	/* Taxa that are all different only match by chance */
+	GetTaxaRange (1, NUM_TAXA, taxa_0);
+	GetTaxaRange (1001, NUM_TAXA, taxa_1);
+	MARTI_TEST_CHECK (GetSketchSimilarity (taxa_0, NUM_TAXA, taxa_1, NUM_TAXA) < 0.1);
+}
+
+
+static void TestFindSimilarSamples (void)
+{
+	uint32 taxa [NUM_TAXA];
+	bson_oid_t ids [4];
+	MartiSimilarMatch *matches_p;
+	size_t num_matches = 0;
+	size_t i;
+
+	for (i = 0; i < 4; ++ i)
+		{
+			GetTestId (i, ids + i);
+		}
+
+	/*
+	 * 0 and 1 have the same taxa, 2 shares 380 of 420 with them
+	 * and 3 has none in common. 1 is about 110 km north of 0.
+	 */
+	GetTaxaRange (1, NUM_TAXA, taxa);
+	MARTI_TEST_CHECK (UpdateMartiSimilarityIndex (ids, taxa, NUM_TAXA, 52.0, 1.0, NULL));
+	MARTI_TEST_CHECK (UpdateMartiSimilarityIndex (ids + 1, taxa, NUM_TAXA, 53.0, 1.0, NULL));
+
+	GetTaxaRange (21, NUM_TAXA, taxa);
+	MARTI_TEST_CHECK (UpdateMartiSimilarityIndex (ids + 2, taxa, NUM_TAXA, 52.0, 1.0, NULL));
+
+	GetTaxaRange (5001, NUM_TAXA, taxa);
+	MARTI_TEST_CHECK (UpdateMartiSimilarityIndex (ids + 3, taxa, NUM_TAXA, 52.0, 1.0, NULL));
+
+	MARTI_TEST_CHECK (IsInMartiSimilarityIndex (ids));
+	MARTI_TEST_CHECK (s_index_p -> msi_num_active_entries == 4);
+
+	/* The sample itself isn't a match and the closest match comes first */
+	matches_p = FindMartiSimilarSamples (ids, NULL, 0, 10, 52.0, 1.0, 0.0, NULL, NULL, &num_matches);
+	MARTI_TEST_CHECK (matches_p != NULL);
+	MARTI_TEST_CHECK (num_matches == 2);
+
+	if (matches_p)
+		{
+			MARTI_TEST_CHECK (bson_oid_equal (& (matches_p -> msm_id), ids + 1));
+			MARTI_TEST_CHECK (matches_p -> msm_similarity == 1.0);
+
+			if (num_matches == 2)
+				{
+					MARTI_TEST_CHECK (bson_oid_equal (& ((matches_p + 1) -> msm_id), ids + 2));
+					MARTI_TEST_CHECK ((matches_p + 1) -> msm_similarity < 1.0);
+					MARTI_TEST_CHECK ((matches_p + 1) -> msm_similarity > 0.7);
+				}
+
+			FreeMemory (matches_p);
+		}
+
+	/* Only the best one */
+	matches_p = FindMartiSimilarSamples (ids, NULL, 0, 1, 52.0, 1.0, 0.0, NULL, NULL, &num_matches);
+	MARTI_TEST_CHECK (num_matches == 1);
+
+	if (matches_p)
+		{
+			MARTI_TEST_CHECK (bson_oid_equal (& (matches_p -> msm_id), ids + 1));
+			FreeMemory (matches_p);
+		}
+
+	/* Sample 1 is too far away */
+	matches_p = FindMartiSimilarSamples (ids, NULL, 0, 10, 52.0, 1.0, 50000.0, NULL, NULL, &num_matches);
+	MARTI_TEST_CHECK (num_matches == 1);
+
+	if (matches_p)
+		{
+			MARTI_TEST_CHECK (bson_oid_equal (& (matches_p -> msm_id), ids + 2));
+			MARTI_TEST_CHECK (matches_p -> msm_distance < 1.0);
+			FreeMemory (matches_p);
+		}
+
+	/* Searching by taxa rather than by a sample includes all of the samples with those taxa */
+	GetTaxaRange (1, NUM_TAXA, taxa);
+	matches_p = FindMartiSimilarSamples (NULL, taxa, NUM_TAXA, 10, 52.0, 1.0, 0.0, NULL, NULL, &num_matches);
+	MARTI_TEST_CHECK (num_matches == 3);
+
+	if (matches_p)
+		{
+			FreeMemory (matches_p);
+		}
+
+	/* A sample that loses all of its taxa is taken out */
+	MARTI_TEST_CHECK (UpdateMartiSimilarityIndex (ids + 1, NULL, 0, 53.0, 1.0, NULL));
+	MARTI_TEST_CHECK (!IsInMartiSimilarityIndex (ids + 1));
+	MARTI_TEST_CHECK (s_index_p -> msi_num_active_entries == 3);
+
+	matches_p = FindMartiSimilarSamples (ids, NULL, 0, 10, 52.0, 1.0, 0.0, NULL, NULL, &num_matches);
+	MARTI_TEST_CHECK (num_matches == 1);
+
+	if (matches_p)
+		{
+			MARTI_TEST_CHECK (bson_oid_equal (& (matches_p -> msm_id), ids + 2));
+			FreeMemory (matches_p);
+		}
+
+	/* and put back when it gets some again */
+	GetTaxaRange (1, NUM_TAXA, taxa);
+	MARTI_TEST_CHECK (UpdateMartiSimilarityIndex (ids + 1, taxa, NUM_TAXA, 53.0, 1.0, NULL));
+	MARTI_TEST_CHECK (IsInMartiSimilarityIndex (ids + 1));
+
+	matches_p = FindMartiSimilarSamples (ids, NULL, 0, 10, 52.0, 1.0, 0.0, NULL, NULL, &num_matches);
+	MARTI_TEST_CHECK (num_matches == 2);
+
+	if (matches_p)
+		{
+			FreeMemory (matches_p);
+		}
+
+	/* Nothing is similar to a sample with no taxa in common with the others */
+	matches_p = FindMartiSimilarSamples (ids + 3, NULL, 0, 10, 52.0, 1.0, 0.0, NULL, NULL, &num_matches);
+	MARTI_TEST_CHECK (matches_p == NULL);
+	MARTI_TEST_CHECK (num_matches == 0);
+}
+
+
+/*
+ * Only dated samples can be in a date range.
+ */
+static void TestDateRange (void)
+{
+	uint32 taxa [NUM_TAXA];
+	bson_oid_t ids [3];
+	struct tm sample_time;
+	struct tm start;
+	struct tm end;
+	MartiSimilarMatch *matches_p;
+	size_t num_matches = 0;
+	size_t i;
+
+	for (i = 0; i < 3; ++ i)
+		{
+			GetTestId (i, ids + i);
+		}
+
+	memset (&sample_time, 0, sizeof (sample_time));
+	sample_time.tm_year = 124;
+	sample_time.tm_mon = 4;
+	sample_time.tm_mday = 1;
+
+	start = sample_time;
+	start.tm_mon = 0;
+
+	end = sample_time;
+	end.tm_mon = 11;
+
+	/* Sample 1 is dated 1 May 2024 and sample 2 has no date */
+	GetTaxaRange (1, NUM_TAXA, taxa);
+	MARTI_TEST_CHECK (UpdateMartiSimilarityIndex (ids + 1, taxa, NUM_TAXA, 53.0, 1.0, &sample_time));
+
+	matches_p = FindMartiSimilarSamples (ids, NULL, 0, 10, 52.0, 1.0, 0.0, &start, &end, &num_matches);
+	MARTI_TEST_CHECK (num_matches == 1);
+
+	if (matches_p)
+		{
+			MARTI_TEST_CHECK (bson_oid_equal (& (matches_p -> msm_id), ids + 1));
+			FreeMemory (matches_p);
+		}
+
+	/* The range includes both of its ends */
+	matches_p = FindMartiSimilarSamples (ids, NULL, 0, 10, 52.0, 1.0, 0.0, &sample_time, &sample_time, &num_matches);
+	MARTI_TEST_CHECK (num_matches == 1);
+
+	if (matches_p)
+		{
+			FreeMemory (matches_p);
+		}
+
+	/* Only a start or an end */
+	matches_p = FindMartiSimilarSamples (ids, NULL, 0, 10, 52.0, 1.0, 0.0, &end, NULL, &num_matches);
+	MARTI_TEST_CHECK (matches_p == NULL);
+	MARTI_TEST_CHECK (num_matches == 0);
+
+	matches_p = FindMartiSimilarSamples (ids, NULL, 0, 10, 52.0, 1.0, 0.0, NULL, &end, &num_matches);
+	MARTI_TEST_CHECK (num_matches == 1);
+
+	if (matches_p)
+		{
+			FreeMemory (matches_p);
+		}
+
+	/* Without a range, the undated sample matches too */
+	matches_p = FindMartiSimilarSamples (ids, NULL, 0, 10, 52.0, 1.0, 0.0, NULL, NULL, &num_matches);
+	MARTI_TEST_CHECK (num_matches == 2);
+
+	if (matches_p)
+		{
+			FreeMemory (matches_p);
+		}
+}
+
+
+/*
+ * Samples saved by other processes are picked up once the refresh interval
+ * has passed since the index was last loaded, including ones whose taxa
+ * have all been removed.
+ */
+static void TestRefresh (void)
+{
+	MongoTool tool;
+	MartiServiceData data;
+	bson_oid_t ids [2];
+	const time_t load_time = time (NULL) - S_REFRESH_INTERVAL;
+	const size_t num_active_entries = s_index_p -> msi_num_active_entries;
+	uint32 i;
+
+	memset (&tool, 0, sizeof (tool));
+	memset (&data, 0, sizeof (data));
+	data.msd_mongo_p = &tool;
+
+	/* Sample 2 loses all of its taxa and sample 10 is new */
+	GetTestId (2, ids);
+	s_docs_p [0] = BCON_NEW (MONGO_ID_S, BCON_OID (ids),
+													 ME_LOCATION_S, "{", ME_COORDINATES_S, "[", BCON_DOUBLE (1.0), BCON_DOUBLE (52.0), "]", "}",
+													 ME_TAXA_S, "[", "]");
+	MARTI_TEST_CHECK (s_docs_p [0] != NULL);
+
+	GetTestId (10, ids + 1);
+	s_docs_p [1] = BCON_NEW (MONGO_ID_S, BCON_OID (ids + 1),
+													 ME_LOCATION_S, "{", ME_COORDINATES_S, "[", BCON_DOUBLE (1.0), BCON_DOUBLE (52.0), "]", "}",
+													 ME_TAXA_S, "[", BCON_INT32 (1), BCON_INT32 (2), BCON_INT32 (3), "]");
+	MARTI_TEST_CHECK (s_docs_p [1] != NULL);
+
+	/* It's too soon */
+	s_num_finds = 0;
+	s_index_p -> msi_load_time = load_time + 10;
+	RefreshMartiSimilarityIndex (&data);
+	MARTI_TEST_CHECK (s_num_finds == 0);
+
+	s_index_p -> msi_load_time = load_time;
+	RefreshMartiSimilarityIndex (&data);
+	MARTI_TEST_CHECK (s_num_finds == 1);
+	MARTI_TEST_CHECK (s_since == ((int64) (load_time - S_REFRESH_OVERLAP)) * 1000);
+	MARTI_TEST_CHECK (s_index_p -> msi_load_time >= load_time + S_REFRESH_INTERVAL);
+
+	MARTI_TEST_CHECK (!IsInMartiSimilarityIndex (ids));
+	MARTI_TEST_CHECK (IsInMartiSimilarityIndex (ids + 1));
+	MARTI_TEST_CHECK (s_index_p -> msi_num_active_entries == num_active_entries);
+
+	for (i = 0; i < NUM_DOCS; ++ i)
+		{
+			if (s_docs_p [i])
+				{
+					bson_destroy (s_docs_p [i]);
+					s_docs_p [i] = NULL;
+				}
+		}
+}
@@ -0,0 +1,436 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * test_spatial_index.c
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#include "marti_spatial_index.c"
+
+#include "marti_test.h"
+
+
+/* Norwich */
+static const double64 S_LATITUDE = 52.62;
+
+static const double64 S_LONGITUDE = 1.29;
+
+
+/*
+ * The finds made by the fake database functions below, the times
+ * that they asked for the samples since and the sample that they return.
+ */
+#define MAX_NUM_FINDS (4)
+
+static uint32 s_num_finds = 0;
+
+static int64 s_since_times [MAX_NUM_FINDS];
+
+static bson_t *s_doc_p = NULL;
+
+
+static void GetTestId (const uint32 i, bson_oid_t *id_p);
+
+static bool AddTestSample (const uint32 i, const double64 latitude, const double64 longitude);
+
+static bool IsTestId (const MartiSpatialMatch *match_p, const uint32 i);
+
+static void TestRadiusSearch (void);
+
+static void TestUnlimitedRadiusSearch (void);
+
+static void TestCoLocatedSamples (void);
+
+static void TestBoxSearch (void);
+
+static void TestRefresh (void);
+
+static void TestInitialLoad (void);
+
+
+
+int main (int argc, char *argv [])
+{
+	/* The same set up as InitMartiSpatialIndex () but without loading any samples */
+	s_index_p = AllocateSpatialIndex (S_DEFAULT_CELL_SIZE);
+	MARTI_TEST_CHECK (s_index_p != NULL);
+
+	if (s_index_p)
+		{
+			/* 0 and 1 are close by, 2 is about 115km away and 3 is in Auckland */
+			MARTI_TEST_CHECK (AddTestSample (0, S_LATITUDE, S_LONGITUDE));
+			MARTI_TEST_CHECK (AddTestSample (1, S_LATITUDE + 0.01, S_LONGITUDE));
+			MARTI_TEST_CHECK (AddTestSample (2, S_LATITUDE - 1.0, S_LONGITUDE + 0.5));
+			MARTI_TEST_CHECK (AddTestSample (3, -36.85, 174.76));
+
+			TestRadiusSearch ();
+			TestUnlimitedRadiusSearch ();
+			TestBoxSearch ();
+
+			/* These are added after the others so they are all at the end */
+			TestCoLocatedSamples ();
+
+			/* This moves one of the samples */
+			TestRefresh ();
+
+			FreeSpatialIndex (s_index_p);
+			s_index_p = NULL;
+		}
+
+	TestInitialLoad ();
+
+	return MARTI_TEST_RESULT ();
+}
+
+
+/*
+ * Used instead of the Grassroots MongoDB function. It records the time that
+ * the samples were asked for since or -1 if they all were.
+ */
+bool FindMatchingMongoDocumentsByBSON (MongoTool *tool_p, const bson_t *query_p, const char **fields_ss, bson_t *opts_p)
+{
+	int64 since = -1;
+	bson_iter_t iter;
+
+	if (bson_iter_init_find (&iter, query_p, MONGO_TIMESTAMP_S) && BSON_ITER_HOLDS_DOCUMENT (&iter))
+		{
+			bson_iter_t gte_iter;
+
+			if (bson_iter_recurse (&iter, &gte_iter) && bson_iter_find (&gte_iter, "$gte") && BSON_ITER_HOLDS_DATE_TIME (&gte_iter))
+				{
+					since = bson_iter_date_time (&gte_iter);
+				}
+		}
+
+	if (s_num_finds < MAX_NUM_FINDS)
+		{
+			s_since_times [s_num_finds] = since;
+		}
+
+	++ s_num_finds;
+
+	return true;
+}
+
+
+/*
+ * Used instead of the Grassroots MongoDB function. It returns the test
+ * sample, if there is one, whatever the query was.
+ */
+int32 IterateOverMongoResults (MongoTool *tool_p, bool (*process_bson_fn) (const bson_t *document_p, void *data_p), void *data_p)
+{
+	int32 num_docs = 0;
+
+	if (s_doc_p)
+		{
+			if (process_bson_fn (s_doc_p, data_p))
+				{
+					++ num_docs;
+				}
+			else
+				{
+					num_docs = -1;
+				}
+		}
+
+	return num_docs;
+}
+
+
+static void GetTestId (const uint32 i, bson_oid_t *id_p)
+{
+	uint8_t data [12];
+
+	memset (data, 0, sizeof (data));
+	data [10] = (uint8_t) (i >> 8);
+	data [11] = (uint8_t) i;
+
+	bson_oid_init_from_data (id_p, data);
+}
+
+
+static bool AddTestSample (const uint32 i, const double64 latitude, const double64 longitude)
+{
+	bson_oid_t id;
+
+	GetTestId (i, &id);
+
+	return UpdateMartiSpatialIndex (&id, latitude, longitude, NULL);
+}
+
+
+static bool IsTestId (const MartiSpatialMatch *match_p, const uint32 i)
+{
+	bson_oid_t id;
+
+	GetTestId (i, &id);
+
+	return bson_oid_equal (& (match_p -> msm_id), &id);
+}
+
+
+static void TestRadiusSearch (void)
+{
+	size_t num_matches = 0;
+	MartiSpatialMatch *matches_p = FindMartiSpatialIndexMatches (S_LATITUDE, S_LONGITUDE, 0.0, NULL, 10000.0, NULL, NULL, &num_matches);
+
+	MARTI_TEST_CHECK (num_matches == 2);
+
+	if (matches_p)
+		{
+			if (num_matches == 2)
+				{
+					/* Nearest first */
+					MARTI_TEST_CHECK (IsTestId (matches_p, 0));
+					MARTI_TEST_CHECK (matches_p -> msm_distance == 0.0);
+					MARTI_TEST_CHECK (IsTestId (matches_p + 1, 1));
+					MARTI_TEST_CHECK (((matches_p + 1) -> msm_distance > 1000.0) && ((matches_p + 1) -> msm_distance < 1200.0));
+				}
+
+			FreeMemory (matches_p);
+		}
+
+	/* The matches after the first one */
+	matches_p = FindMartiSpatialIndexMatches (S_LATITUDE, S_LONGITUDE, 1.0, NULL, 200000.0, NULL, NULL, &num_matches);
+
+	MARTI_TEST_CHECK (num_matches == 2);
+
+	if (matches_p)
+		{
+			if (num_matches == 2)
+				{
+					MARTI_TEST_CHECK (IsTestId (matches_p, 1));
+					MARTI_TEST_CHECK (IsTestId (matches_p + 1, 2));
+				}
+
+			FreeMemory (matches_p);
+		}
+}
+
+
+/*
+ * A maximum distance of 0 means that there is no limit, as with $geoNear
+ */
+static void TestUnlimitedRadiusSearch (void)
+{
+	size_t num_matches = 0;
+	MartiSpatialMatch *matches_p = FindMartiSpatialIndexMatches (S_LATITUDE, S_LONGITUDE, 0.0, NULL, 0.0, NULL, NULL, &num_matches);
+
+	MARTI_TEST_CHECK (num_matches == 4);
+
+	if (matches_p)
+		{
+			if (num_matches == 4)
+				{
+					MARTI_TEST_CHECK (IsTestId (matches_p, 0));
+					MARTI_TEST_CHECK (IsTestId (matches_p + 3, 3));
+				}
+
+			FreeMemory (matches_p);
+		}
+
+	/* and this includes resuming after a sample */
+	matches_p = FindMartiSpatialIndexMatches (-36.85, 174.76, 1.0, NULL, 0.0, NULL, NULL, &num_matches);
+
+	MARTI_TEST_CHECK (num_matches == 3);
+
+	if (matches_p)
+		{
+			FreeMemory (matches_p);
+		}
+}
+
+
+/*
+ * Samples at the same place are ordered by id so that a search can be
+ * resumed after any of them.
+ */
+static void TestCoLocatedSamples (void)
+{
+	const double64 latitude = 10.5;
+	const double64 longitude = 20.5;
+	const uint32 first_id = 100;
+	const uint32 num_samples = 5;
+	size_t num_matches = 0;
+	MartiSpatialMatch *matches_p = NULL;
+	bson_oid_t last_id;
+	uint32 i;
+
+	/* Add them in reverse order so that they aren't sorted already */
+	for (i = num_samples; i > 0; -- i)
+		{
+			MARTI_TEST_CHECK (AddTestSample (first_id + i - 1, latitude, longitude));
+		}
+
+	GetTestId (first_id + 1, &last_id);
+
+	matches_p = FindMartiSpatialIndexMatches (latitude, longitude, 0.0, &last_id, 1000.0, NULL, NULL, &num_matches);
+
+	MARTI_TEST_CHECK (num_matches == num_samples - 2);
+
+	if (matches_p)
+		{
+			for (i = 0; i < num_matches; ++ i)
+				{
+					MARTI_TEST_CHECK (IsTestId (matches_p + i, first_id + 2 + i));
+				}
+
+			FreeMemory (matches_p);
+		}
+}
+
+
+static void TestBoxSearch (void)
+{
+	size_t num_matches = 0;
+	MartiSpatialMatch *matches_p = FindMartiSpatialIndexMatchesInBox (52.0, 1.0, 53.0, 2.0, NULL, NULL, &num_matches);
+
+	MARTI_TEST_CHECK (num_matches == 2);
+
+	if (matches_p)
+		{
+			FreeMemory (matches_p);
+		}
+
+	/* A box that crosses the antimeridian */
+	matches_p = FindMartiSpatialIndexMatchesInBox (-40.0, 170.0, -30.0, -170.0, NULL, NULL, &num_matches);
+
+	MARTI_TEST_CHECK (num_matches == 1);
+
+	if (matches_p)
+		{
+			if (num_matches == 1)
+				{
+					MARTI_TEST_CHECK (IsTestId (matches_p, 3));
+				}
+
+			FreeMemory (matches_p);
+		}
+}
+
+
+/*
+ * Samples saved by other processes are picked up once the refresh interval
+ * has passed since the index was last loaded.
+ */
+static void TestRefresh (void)
+{
+	MongoTool tool;
+	MartiServiceData data;
+	bson_oid_t id;
+	const time_t load_time = time (NULL) - S_REFRESH_INTERVAL;
+	size_t num_matches = 0;
+	MartiSpatialMatch *matches_p = NULL;
+
+	memset (&tool, 0, sizeof (tool));
+	memset (&data, 0, sizeof (data));
+	data.msd_mongo_p = &tool;
+
+	/* Another process moves sample 2 to just by sample 0 */
+	GetTestId (2, &id);
+	s_doc_p = BCON_NEW (MONGO_ID_S, BCON_OID (&id),
+											ME_LOCATION_S, "{", ME_COORDINATES_S, "[", BCON_DOUBLE (S_LONGITUDE), BCON_DOUBLE (S_LATITUDE + 0.02), "]", "}");
+	MARTI_TEST_CHECK (s_doc_p != NULL);
+
+	/* It's too soon */
+	s_num_finds = 0;
+	s_index_p -> msi_load_time = load_time + 10;
+	RefreshMartiSpatialIndex (&data);
+	MARTI_TEST_CHECK (s_num_finds == 0);
+
+	s_index_p -> msi_load_time = load_time;
+	RefreshMartiSpatialIndex (&data);
+	MARTI_TEST_CHECK (s_num_finds == 1);
+	MARTI_TEST_CHECK (s_since_times [0] == ((int64) (load_time - S_REFRESH_OVERLAP)) * 1000);
+	MARTI_TEST_CHECK (s_index_p -> msi_load_time >= load_time + S_REFRESH_INTERVAL);
+
+	matches_p = FindMartiSpatialIndexMatches (S_LATITUDE, S_LONGITUDE, 0.0, NULL, 10000.0, NULL, NULL, &num_matches);
+	MARTI_TEST_CHECK (num_matches == 3);
+
+	if (matches_p)
+		{
+			if (num_matches == 3)
+				{
+					MARTI_TEST_CHECK (IsTestId (matches_p + 2, 2));
+				}
+
+			FreeMemory (matches_p);
+		}
+
+	/* and it isn't refreshed again straight away */
+	RefreshMartiSpatialIndex (&data);
+	MARTI_TEST_CHECK (s_num_finds == 1);
+
+	if (s_doc_p)
+		{
+			bson_destroy (s_doc_p);
+			s_doc_p = NULL;
+		}
+}
+
+
+/*
+ * A sample saved whilst the index is loading might have been read before it
+ * was updated, so once the index is in use, those samples are read again.
+ */
+static void TestInitialLoad (void)
+{
+	MongoTool tool;
+	MartiServiceData data;
+	bson_oid_t id;
+	json_t *config_p = json_pack ("{s:{s:f}}", "spatial_index", "cell_size", 2.0);
+	time_t start_time;
+
+	memset (&tool, 0, sizeof (tool));
+	memset (&data, 0, sizeof (data));
+	data.msd_mongo_p = &tool;
+	data.msd_base_data.sd_config_p = config_p;
+
+	GetTestId (1, &id);
+	s_doc_p = BCON_NEW (MONGO_ID_S, BCON_OID (&id),
+											ME_LOCATION_S, "{", ME_COORDINATES_S, "[", BCON_DOUBLE (S_LONGITUDE), BCON_DOUBLE (S_LATITUDE), "]", "}");
+	MARTI_TEST_CHECK (s_doc_p != NULL);
+
+	s_num_finds = 0;
+	start_time = time (NULL);
+
+	MARTI_TEST_CHECK (InitMartiSpatialIndex (&data));
+	MARTI_TEST_CHECK (s_num_finds == 2);
+
+	/* All of the samples and then the ones saved since the load began */
+	MARTI_TEST_CHECK (s_since_times [0] == -1);
+	MARTI_TEST_CHECK (s_since_times [1] >= ((int64) (start_time - S_REFRESH_OVERLAP)) * 1000);
+	MARTI_TEST_CHECK (s_since_times [1] <= ((int64) (time (NULL) - S_REFRESH_OVERLAP)) * 1000);
+
+	if (s_index_p)
+		{
+			MARTI_TEST_CHECK (s_index_p -> msi_num_entries == 1);
+			MARTI_TEST_CHECK (s_index_p -> msi_load_time >= start_time);
+
+			FreeSpatialIndex (s_index_p);
+			s_index_p = NULL;
+		}
+
+	if (s_doc_p)
+		{
+			bson_destroy (s_doc_p);
+			s_doc_p = NULL;
+		}
+
+	json_decref (config_p);
+}
@@ -0,0 +1,323 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * test_taxa_index.c
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#include "marti_taxa_index.c"
+
+#include "marti_test.h"
+
+
+#define NUM_SAMPLES (4)
+
+
+/*
+ * The finds made by the fake database functions below, the time
+ * that they asked for the samples since and the samples that they return.
+ */
+#define NUM_DOCS (2)
+
+static uint32 s_num_finds = 0;
+
+static int64 s_since = -1;
+
+static bson_t *s_docs_p [NUM_DOCS];
+
+
+static void GetTestId (const uint32 i, bson_oid_t *id_p);
+
+static bool SetTestTaxa (const uint32 i, const uint32 *taxa_p, const size_t num_taxa);
+
+static uint32 GetMatchingSamples (const uint32 *taxa_p, const size_t num_taxa, const bool all_flag, const uint32 *excluded_p, const size_t num_excluded);
+
+static void TestFilters (void);
+
+static void TestUpdates (void);
+
+static void TestRefresh (void);
+
+
+
+int main (int argc, char *argv [])
+{
+	/* The same set up as InitMartiTaxaIndex () but without loading any samples */
+	s_index_p = AllocateTaxaIndex ();
+	MARTI_TEST_CHECK (s_index_p != NULL);
+
+	if (s_index_p)
+		{
+			const uint32 taxa_0 [] = { 10, 20 };
+			const uint32 taxa_1 [] = { 20, 30 };
+			const uint32 taxa_2 [] = { 30 };
+
+			MARTI_TEST_CHECK (SetTestTaxa (0, taxa_0, 2));
+			MARTI_TEST_CHECK (SetTestTaxa (1, taxa_1, 2));
+			MARTI_TEST_CHECK (SetTestTaxa (2, taxa_2, 1));
+
+			/* Sample 3 has no taxa so it isn't in the index */
+			MARTI_TEST_CHECK (SetTestTaxa (3, NULL, 0));
+			MARTI_TEST_CHECK (s_index_p -> mti_num_samples == 3);
+
+			TestFilters ();
+			TestUpdates ();
+			TestRefresh ();
+
+			FreeTaxaIndex (s_index_p);
+			s_index_p = NULL;
+		}
+
+	return MARTI_TEST_RESULT ();
+}
+
+
+/*
+ * Used instead of the Grassroots MongoDB function. It records the time that
+ * the samples were asked for since or -1 if they all were.
+ */
+bool FindMatchingMongoDocumentsByBSON (MongoTool *tool_p, const bson_t *query_p, const char **fields_ss, bson_t *opts_p)
+{
+	bson_iter_t iter;
+
+	s_since = -1;
+
+	if (bson_iter_init_find (&iter, query_p, MONGO_TIMESTAMP_S) && BSON_ITER_HOLDS_DOCUMENT (&iter))
+		{
+			bson_iter_t gte_iter;
+
+			if (bson_iter_recurse (&iter, &gte_iter) && bson_iter_find (&gte_iter, "$gte") && BSON_ITER_HOLDS_DATE_TIME (&gte_iter))
+				{
+					s_since = bson_iter_date_time (&gte_iter);
+				}
+		}
+
+	++ s_num_finds;
+
+	return true;
+}
+
+
+/*
+ * Used instead of the Grassroots MongoDB function. It returns the
+ * test samples whatever the query was.
+ */
+int32 IterateOverMongoResults (MongoTool *tool_p, bool (*process_bson_fn) (const bson_t *document_p, void *data_p), void *data_p)
+{
+	int32 num_docs = 0;
+	uint32 i;
+
+	for (i = 0; i < NUM_DOCS; ++ i)
+		{
+			if (s_docs_p [i])
+				{
+					if (process_bson_fn (s_docs_p [i], data_p))
+						{
+							++ num_docs;
+						}
+					else
+						{
+							return -1;
+						}
+				}
+		}
+
+	return num_docs;
+}
+
+
+static void GetTestId (const uint32 i, bson_oid_t *id_p)
+{
+	uint8_t data [12];
+
+	memset (data, 0, sizeof (data));
+	data [10] = (uint8_t) (i >> 8);
+	data [11] = (uint8_t) i;
+
+	bson_oid_init_from_data (id_p, data);
+}
+
+
+static bool SetTestTaxa (const uint32 i, const uint32 *taxa_p, const size_t num_taxa)
+{
+	bson_oid_t id;
+
+	GetTestId (i, &id);
+
+	return UpdateMartiTaxaIndex (&id, taxa_p, num_taxa);
+}
+
+
+/*
+ * Filter all of the test samples and get the ones that are
+ * left as a bit set with bit i set for sample i.
+ */
+static uint32 GetMatchingSamples (const uint32 *taxa_p, const size_t num_taxa, const bool all_flag, const uint32 *excluded_p, const size_t num_excluded)
+{
+	MartiSpatialMatch matches [NUM_SAMPLES];
+	size_t num_matches = NUM_SAMPLES;
+	uint32 samples = 0;
+	uint32 i;
+
+	memset (matches, 0, sizeof (matches));
+
+	for (i = 0; i < NUM_SAMPLES; ++ i)
+		{
+			GetTestId (i, & (matches [i].msm_id));
+		}
+
+	MARTI_TEST_CHECK (FilterMartiSpatialMatchesByTaxa (matches, &num_matches, taxa_p, num_taxa, all_flag, excluded_p, num_excluded));
+
+	for (i = 0; i < num_matches; ++ i)
+		{
+			uint32 j;
+
+			for (j = 0; j < NUM_SAMPLES; ++ j)
+				{
+					bson_oid_t id;
+
+					GetTestId (j, &id);
+
+					if (bson_oid_equal (& (matches [i].msm_id), &id))
+						{
+							samples |= (1 << j);
+						}
+				}
+		}
+
+	return samples;
+}
+
+
+static void TestFilters (void)
+{
+	const uint32 taxa_10_30 [] = { 10, 30 };
+	const uint32 taxa_20_30 [] = { 20, 30 };
+	const uint32 taxon_10 [] = { 10 };
+	const uint32 unknown_taxon [] = { 99 };
+
+	/* Any of the taxa */
+	MARTI_TEST_CHECK (GetMatchingSamples (taxa_10_30, 2, false, NULL, 0) == 0x7);
+
+	/* All of the taxa */
+	MARTI_TEST_CHECK (GetMatchingSamples (taxa_20_30, 2, true, NULL, 0) == 0x2);
+	MARTI_TEST_CHECK (GetMatchingSamples (taxa_10_30, 2, true, NULL, 0) == 0);
+
+	/* Taxa that no sample has */
+	MARTI_TEST_CHECK (GetMatchingSamples (unknown_taxon, 1, false, NULL, 0) == 0);
+
+	/* Samples without any taxa can only match if no taxa are required */
+	MARTI_TEST_CHECK (GetMatchingSamples (taxa_20_30, 2, false, taxon_10, 1) == 0x6);
+	MARTI_TEST_CHECK (GetMatchingSamples (NULL, 0, false, taxon_10, 1) == 0xE);
+	MARTI_TEST_CHECK (GetMatchingSamples (NULL, 0, false, unknown_taxon, 1) == 0xF);
+}
+
+
+/*
+ * An updated sample loses its old taxa and gets its new ones
+ * without the other samples being changed.
+ */
+static void TestUpdates (void)
+{
+	const uint32 taxon_10 [] = { 10 };
+	const uint32 taxon_20 [] = { 20 };
+	const uint32 taxon_30 [] = { 30 };
+	const uint32 taxon_40 [] = { 40 };
+	const uint32 new_taxa_0 [] = { 30, 40 };
+
+	MARTI_TEST_CHECK (SetTestTaxa (0, new_taxa_0, 2));
+	MARTI_TEST_CHECK (s_index_p -> mti_num_samples == 3);
+
+	MARTI_TEST_CHECK (GetMatchingSamples (taxon_10, 1, false, NULL, 0) == 0);
+	MARTI_TEST_CHECK (GetMatchingSamples (taxon_20, 1, false, NULL, 0) == 0x2);
+	MARTI_TEST_CHECK (GetMatchingSamples (taxon_30, 1, false, NULL, 0) == 0x7);
+	MARTI_TEST_CHECK (GetMatchingSamples (taxon_40, 1, false, NULL, 0) == 0x1);
+
+	/* Saving the same taxa again changes nothing */
+	MARTI_TEST_CHECK (SetTestTaxa (0, new_taxa_0, 2));
+	MARTI_TEST_CHECK (GetMatchingSamples (taxon_30, 1, false, NULL, 0) == 0x7);
+	MARTI_TEST_CHECK (GetMatchingSamples (taxon_40, 1, false, NULL, 0) == 0x1);
+
+	/* A sample whose taxa are all removed keeps its number but matches no taxa */
+	MARTI_TEST_CHECK (SetTestTaxa (1, NULL, 0));
+	MARTI_TEST_CHECK (s_index_p -> mti_num_samples == 3);
+	MARTI_TEST_CHECK ((s_index_p -> mti_samples_p + 1) -> st_num_taxa == 0);
+	MARTI_TEST_CHECK (GetMatchingSamples (taxon_20, 1, false, NULL, 0) == 0);
+	MARTI_TEST_CHECK (GetMatchingSamples (taxon_30, 1, false, NULL, 0) == 0x5);
+
+	/* and it can get some again */
+	MARTI_TEST_CHECK (SetTestTaxa (1, taxon_20, 1));
+	MARTI_TEST_CHECK (GetMatchingSamples (taxon_20, 1, false, NULL, 0) == 0x2);
+}
+
+
+/*
+ * Samples saved by other processes are picked up once the refresh interval
+ * has passed since the index was last loaded, including ones whose taxa
+ * have all been removed.
+ */
+static void TestRefresh (void)
+{
+	MongoTool tool;
+	MartiServiceData data;
+	bson_oid_t id;
+	const time_t load_time = time (NULL) - S_REFRESH_INTERVAL;
+	const uint32 taxon_20 [] = { 20 };
+	const uint32 taxon_30 [] = { 30 };
+	const uint32 taxon_50 [] = { 50 };
+	uint32 i;
+
+	memset (&tool, 0, sizeof (tool));
+	memset (&data, 0, sizeof (data));
+	data.msd_mongo_p = &tool;
+
+	/* Sample 3 gets some taxa and sample 1 loses all of its ones */
+	GetTestId (3, &id);
+	s_docs_p [0] = BCON_NEW (MONGO_ID_S, BCON_OID (&id), ME_TAXA_S, "[", BCON_INT32 (30), BCON_INT32 (50), "]");
+	MARTI_TEST_CHECK (s_docs_p [0] != NULL);
+
+	GetTestId (1, &id);
+	s_docs_p [1] = BCON_NEW (MONGO_ID_S, BCON_OID (&id), ME_TAXA_S, "[", "]");
+	MARTI_TEST_CHECK (s_docs_p [1] != NULL);
+
+	/* It's too soon */
+	s_num_finds = 0;
+	s_index_p -> mti_load_time = load_time + 10;
+	RefreshMartiTaxaIndex (&data);
+	MARTI_TEST_CHECK (s_num_finds == 0);
+
+	s_index_p -> mti_load_time = load_time;
+	RefreshMartiTaxaIndex (&data);
+	MARTI_TEST_CHECK (s_num_finds == 1);
+	MARTI_TEST_CHECK (s_since == ((int64) (load_time - S_REFRESH_OVERLAP)) * 1000);
+	MARTI_TEST_CHECK (s_index_p -> mti_load_time >= load_time + S_REFRESH_INTERVAL);
+
+	MARTI_TEST_CHECK (s_index_p -> mti_num_samples == 4);
+	MARTI_TEST_CHECK (GetMatchingSamples (taxon_20, 1, false, NULL, 0) == 0);
+	MARTI_TEST_CHECK (GetMatchingSamples (taxon_30, 1, false, NULL, 0) == 0xD);
+	MARTI_TEST_CHECK (GetMatchingSamples (taxon_50, 1, false, NULL, 0) == 0x8);
+
+	for (i = 0; i < NUM_DOCS; ++ i)
+		{
+			if (s_docs_p [i])
+				{
+					bson_destroy (s_docs_p [i]);
+					s_docs_p [i] = NULL;
+				}
+		}
+}
@@ -0,0 +1,249 @@
+/*
+** Copyright 2014-2018 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * test_taxonomy.c
+ *
+ *  Created on: 16 Oct 2026
+ *      Author: agent
+ */
+
+#include "marti_taxonomy.c"
+
+#include "marti_test.h"
+
+
+/*
+ * The test tree, as (taxon, parent) pairs:
+ *
+ *	1
+ *	+-- 2
+ *	|   +-- 4
+ *	|   +-- 5
+ *	+-- 3
+ *	    +-- 6
+ *
+ * along with 10, whose parent 99 is missing so it is a root of
+ * its own, and 20 and 21 which are each other's parents so
+ * they can't be reached from any root.
+ */
+#define NUM_NODES (9)
+
+static const uint32 S_NODES [NUM_NODES][2] =
+{
+	{ 6, 3 },
+	{ 1, 1 },
+	{ 3, 1 },
+	{ 5, 2 },
+	{ 2, 1 },
+	{ 4, 2 },
+	{ 10, 99 },
+	{ 20, 21 },
+	{ 21, 20 }
+};
+
+
+static MartiTaxonomy *BuildTestTaxonomy (const bool reverse_flag, const uint32 changed_parent);
+
+static bool HasInterval (const uint32 taxon, const uint32 expected_first, const uint32 expected_last);
+
+static void TestParseNodes (void);
+
+static void TestNumbering (void);
+
+static void TestVersions (void);
+
+
+
+int main (int argc, char *argv [])
+{
+	TestParseNodes ();
+	TestNumbering ();
+	TestVersions ();
+
+	return MARTI_TEST_RESULT ();
+}
+
+
+/*
+ * Build the test tree with its nodes in the order above or in reverse.
+ * If changed_parent isn't 0, it becomes the parent of taxon 6 instead of 3.
+ */
+static MartiTaxonomy *BuildTestTaxonomy (const bool reverse_flag, const uint32 changed_parent)
+{
+	MartiTaxonomy *taxonomy_p = NULL;
+	TaxonomyNodes nodes;
+	bool success_flag = true;
+	uint32 i;
+
+	memset (&nodes, 0, sizeof (TaxonomyNodes));
+
+	for (i = 0; (i < NUM_NODES) && success_flag; ++ i)
+		{
+			const uint32 *node_p = S_NODES [reverse_flag ? (NUM_NODES - 1 - i) : i];
+			uint32 parent = node_p [1];
+
+			if ((changed_parent > 0) && (node_p [0] == 6))
+				{
+					parent = changed_parent;
+				}
+
+			success_flag = AddTaxonomyNode (&nodes, node_p [0], parent);
+		}
+
+	MARTI_TEST_CHECK (success_flag);
+
+	if (success_flag)
+		{
+			taxonomy_p = BuildTaxonomy (&nodes);
+			MARTI_TEST_CHECK (taxonomy_p != NULL);
+		}
+
+	if (nodes.tn_taxa_p)
+		{
+			FreeMemory (nodes.tn_taxa_p);
+		}
+
+	if (nodes.tn_parents_p)
+		{
+			FreeMemory (nodes.tn_parents_p);
+		}
+
+	return taxonomy_p;
+}
+
+
+static bool HasInterval (const uint32 taxon, const uint32 expected_first, const uint32 expected_last)
+{
+	uint32 first = 0;
+	uint32 last = 0;
+
+	if (GetMartiTaxonInterval (taxon, &first, &last))
+		{
+			if ((first == expected_first) && (last == expected_last))
+				{
+					return true;
+				}
+
+			fprintf (stderr, "taxon " UINT32_FMT " is [" UINT32_FMT ", " UINT32_FMT "] rather than [" UINT32_FMT ", " UINT32_FMT "]\n", taxon, first, last, expected_first, expected_last);
+		}
+	else
+		{
+			fprintf (stderr, "taxon " UINT32_FMT " isn't in the tree\n", taxon);
+		}
+
+	return false;
+}
+
+
+static void TestParseNodes (void)
+{
+	uint32 taxon = 0;
+	uint32 parent = 0;
+
+	MARTI_TEST_CHECK (ParseTaxonomyNode ("9606\t|\t9605\t|\tspecies\t|\tHS\t|\n", &taxon, &parent));
+	MARTI_TEST_CHECK (taxon == 9606);
+	MARTI_TEST_CHECK (parent == 9605);
+
+	MARTI_TEST_CHECK (ParseTaxonomyNode ("1\t|\t1\t|\tno rank\t|\n", &taxon, &parent));
+	MARTI_TEST_CHECK ((taxon == 1) && (parent == 1));
+
+	/* The taxa are stored as 32-bit signed integers and 0 isn't an id */
+	MARTI_TEST_CHECK (!ParseTaxonomyNode ("2147483648\t|\t1\t|\n", &taxon, &parent));
+	MARTI_TEST_CHECK (!ParseTaxonomyNode ("5\t|\t0\t|\n", &taxon, &parent));
+	MARTI_TEST_CHECK (!ParseTaxonomyNode ("5\t|\t\t|\n", &taxon, &parent));
+	MARTI_TEST_CHECK (!ParseTaxonomyNode ("\n", &taxon, &parent));
+}
+
+
+/*
+ * Each taxon's descendants have the numbers straight after its own
+ */
+static void TestNumbering (void)
+{
+	MartiTaxonomy *taxonomy_p = BuildTestTaxonomy (false, 0);
+
+	MARTI_TEST_CHECK (!IsMartiTaxonomyLoaded ());
+	MARTI_TEST_CHECK (GetMartiTaxonomyVersion () == NULL);
+
+	if (taxonomy_p)
+		{
+			uint32 first;
+			uint32 last;
+
+			s_taxonomy_p = taxonomy_p;
+
+			MARTI_TEST_CHECK (IsMartiTaxonomyLoaded ());
+			MARTI_TEST_CHECK (taxonomy_p -> mt_num_taxa == 7);
+
+			/* The children are walked in the order of their ids */
+			MARTI_TEST_CHECK (HasInterval (1, 1, 6));
+			MARTI_TEST_CHECK (HasInterval (2, 2, 4));
+			MARTI_TEST_CHECK (HasInterval (4, 3, 3));
+			MARTI_TEST_CHECK (HasInterval (5, 4, 4));
+			MARTI_TEST_CHECK (HasInterval (3, 5, 6));
+			MARTI_TEST_CHECK (HasInterval (6, 6, 6));
+
+			/* A taxon whose parent is missing is a root */
+			MARTI_TEST_CHECK (HasInterval (10, 7, 7));
+
+			/* Taxa in a cycle, missing ones and ones beyond the largest id aren't numbered */
+			MARTI_TEST_CHECK (!GetMartiTaxonInterval (20, &first, &last));
+			MARTI_TEST_CHECK (!GetMartiTaxonInterval (21, &first, &last));
+			MARTI_TEST_CHECK (!GetMartiTaxonInterval (7, &first, &last));
+			MARTI_TEST_CHECK (!GetMartiTaxonInterval (99, &first, &last));
+			MARTI_TEST_CHECK (!GetMartiTaxonInterval (0, &first, &last));
+
+			MARTI_TEST_CHECK (GetMartiTaxonomyVersion () != NULL);
+			MARTI_TEST_CHECK (strlen (GetMartiTaxonomyVersion ()) == 16);
+
+			s_taxonomy_p = NULL;
+			FreeTaxonomy (taxonomy_p);
+		}
+}
+
+
+/*
+ * The version only changes when the numbers do
+ */
+static void TestVersions (void)
+{
+	MartiTaxonomy *taxonomy_p = BuildTestTaxonomy (false, 0);
+	MartiTaxonomy *reversed_p = BuildTestTaxonomy (true, 0);
+	MartiTaxonomy *changed_p = BuildTestTaxonomy (false, 2);
+
+	if (taxonomy_p && reversed_p && changed_p)
+		{
+			MARTI_TEST_CHECK (strcmp (taxonomy_p -> mt_version_s, reversed_p -> mt_version_s) == 0);
+
+			/* Moving 6 under 2 changes the numbers of 3 and 6 */
+			MARTI_TEST_CHECK (strcmp (taxonomy_p -> mt_version_s, changed_p -> mt_version_s) != 0);
+		}
+
+	if (taxonomy_p)
+		{
+			FreeTaxonomy (taxonomy_p);
+		}
+
+	if (reversed_p)
+		{
+			FreeTaxonomy (reversed_p);
+		}
+
+	if (changed_p)
+		{
+			FreeTaxonomy (changed_p);
+		}
+}